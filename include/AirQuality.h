@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include "TelemetrySchema.h"
+
+// Local air quality rules.
+// Keeps 1 minute and 8 hour rolling averages of CO, NO2 and VOC and compares them
+// with warning and alarm thresholds on every sample, without a cloud round trip.
+class AirQuality
+{
+public:
+    enum class Level : uint8_t
+    {
+        Normal,
+        Warning,
+        Alarm,
+    };
+
+    static constexpr unsigned long ShortWindowMillisecs = 60UL * 1000;
+    static constexpr unsigned long LongWindowMillisecs = 8UL * 60 * 60 * 1000;
+
+public:
+    static void Reset();
+
+    // Adds the gas readings of sample and fills in its rolling averages.
+    // Returns true when the level changed.
+    static bool Update(unsigned long now, TelemetrySample* sample);
+
+    static Level GetLevel() { return CurrentLevel; }
+    static const char* GetLevelName(Level level);
+    static const char* GetCause() { return Cause; }    // Rule that set the level, "" when normal
+
+private:
+    static Level CurrentLevel;
+    static const char* Cause;
+
+};
@@ -11,14 +11,15 @@ public:
     AzureDpsClient(const AzureDpsClient&) = delete;
     AzureDpsClient& operator=(const AzureDpsClient&) = delete;
 
-    std::string GetEndpoint() const { return Endpoint; }
-    void SetEndpoint(const std::string& endpoint) { Endpoint = endpoint; }
-    std::string GetIdScope() const { return IdScope; }
-    void SetIdScope(const std::string& idScope) { IdScope = idScope; }
-    std::string GetRegistrationId() const { return RegistrationId; }
-    void SetRegistrationId(const std::string& registrationId) { RegistrationId = registrationId; }
+    az_span GetEndpoint() const { return Endpoint; }
+    az_span GetIdScope() const { return IdScope; }
+    az_span GetRegistrationId() const { return RegistrationId; }
 
-    int Init(const std::string& endpoint, const std::string& idScope, const std::string& registrationId);
+    // The spans are referenced, not copied, and must outlive the client.
+    int Init(az_span endpoint, az_span idScope, az_span registrationId);
+
+    // Points the client at the same ids after they moved, the operation in progress is kept.
+    int Rebind(az_span idScope, az_span registrationId);
 
     std::vector<uint8_t> GetSignature(const uint64_t& expirationEpochTime);
 
@@ -30,17 +31,22 @@ public:
     std::string GetRegisterSubscribeTopic() const;
     int RegisterSubscribeWork(const std::string& topic, const std::vector<uint8_t>& payload);
     bool IsRegisterOperationCompleted();
+    az_iot_status GetStatus() const;
     int GetWaitBeforeQueryStatusSeconds() const;
+
+    // The operation id outlives error responses, so a status query can resume the operation after a reconnect.
+    bool HasOperationId() const { return !OperationId.empty(); }
+    const std::string& GetOperationId() const { return OperationId; }
     std::string GetQueryStatusPublishTopic();
 
     bool IsAssigned();
-    std::string GetHubHost();
-    std::string GetDeviceId();
+    az_span GetHubHost();
+    az_span GetDeviceId();
 
 private:
-    std::string Endpoint;
-    std::string IdScope;
-    std::string RegistrationId;
+    az_span Endpoint;
+    az_span IdScope;
+    az_span RegistrationId;
 
     az_iot_provisioning_client ProvClient;
 
@@ -48,6 +54,7 @@ private:
     std::string ResponseTopic;
     std::vector<uint8_t> ResponsePayload;
     az_iot_provisioning_client_register_response Response;
+    std::string OperationId;
 
 private:
     static az_iot_provisioning_client_operation_status GetOperationStatus(az_iot_provisioning_client_register_response& response);
@@ -1,3 +1,3 @@
 #pragma once
 
-extern const char* ROOT_CA_BALTIMORE;
\ No newline at end of file
+extern const char* ROOT_CA_BUNDLE;
@@ -1,3 +1,8 @@
 #pragma once
 
+// Incremental console, polled from loop() while the device keeps running.
+void CliInit();
+void CliDoWork();
+
+// Console only, never returns.
 void CliMode();
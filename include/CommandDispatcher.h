@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <az_span.h>
+#include "TelemetrySchema.h"
+
+// FNV-1a with the seed as offset basis. Must match command_hash() in scripts/generate_telemetry_schema.py.
+static inline uint32_t CommandHash(const uint8_t* name, size_t nameSize, uint32_t seed)
+{
+    uint32_t hash = seed;
+    for (size_t i = 0; i < nameSize; ++i)
+    {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Finds a DTDL command with one hash and one compare. Returns CommandId::Count if unknown.
+static inline CommandId LookupCommand(az_span name)
+{
+    const CommandTableEntry& entry = CommandTable[CommandHash(az_span_ptr(name), az_span_size(name), CommandHashSeed) >> CommandHashShift];
+    if (entry.Name == nullptr || entry.NameSize != az_span_size(name) || memcmp(entry.Name, az_span_ptr(name), entry.NameSize) != 0) return CommandId::Count;
+
+    return entry.Id;
+}
+
+// Command handler, indexed by CommandId.
+// Parse() runs in the MQTT callback. It validates the payload into a small argument block
+// and returns the status to respond with; the response is sent right away. On 2xx the
+// work is queued and Run() is called from loop() until it returns true, so long running
+// commands never stall the MQTT loop.
+struct CommandHandler
+{
+    static constexpr size_t ArgsSize = 16;
+
+    const char* Name;
+    uint16_t (*Parse)(az_span payload, uint8_t* args);
+    bool (*Run)(const uint8_t* args, bool start, unsigned long now);
+};
+
+class CommandDispatcher
+{
+public:
+    static constexpr uint16_t StatusOk = 200;
+    static constexpr uint16_t StatusAccepted = 202;
+    static constexpr uint16_t StatusBadRequest = 400;
+    static constexpr uint16_t StatusNotFound = 404;
+    static constexpr uint16_t StatusBusy = 503;
+
+    static constexpr size_t JobQueueSize = 4;
+
+public:
+    // handlers has one entry per CommandId, in CommandId order.
+    explicit CommandDispatcher(const CommandHandler (&handlers)[static_cast<size_t>(CommandId::Count)]);
+    CommandDispatcher(const CommandDispatcher&) = delete;
+    CommandDispatcher& operator=(const CommandDispatcher&) = delete;
+
+    // Validates and queues a command. Returns the status to respond with.
+    uint16_t Dispatch(az_span name, az_span payload);
+
+    // Runs the queued commands one after another.
+    void DoWork(unsigned long now);
+
+    bool IsBusy() const { return JobCount > 0; }
+
+private:
+    struct Job
+    {
+        const CommandHandler* Handler;
+        uint8_t Args[CommandHandler::ArgsSize];
+    };
+
+    const CommandHandler* const Handlers;
+
+    Job Jobs[JobQueueSize];
+    size_t JobHead;
+    size_t JobCount;
+    bool JobStarted;
+
+};
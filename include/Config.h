@@ -1,17 +1,21 @@
+#include "TelemetrySchema.h"
+
 #define USE_CLI
 //#define USE_DPS
 
 #if defined(USE_CLI)
 
 // Wi-Fi
-#define IOT_CONFIG_WIFI_SSID				Storage::WiFiSSID.c_str()
-#define IOT_CONFIG_WIFI_PASSWORD			Storage::WiFiPassword.c_str()
+#define IOT_CONFIG_WIFI_SSID				reinterpret_cast<const char*>(az_span_ptr(Storage::WiFiSSID))
+#define IOT_CONFIG_WIFI_PASSWORD			reinterpret_cast<const char*>(az_span_ptr(Storage::WiFiPassword))
 
 // Azure IoT Hub DPS
-#define IOT_CONFIG_GLOBAL_DEVICE_ENDPOINT	"global.azure-devices-provisioning.net"
+#define IOT_CONFIG_GLOBAL_DEVICE_ENDPOINT	AZ_SPAN_FROM_STR("global.azure-devices-provisioning.net")
 #define IOT_CONFIG_ID_SCOPE					Storage::IdScope
 #define IOT_CONFIG_REGISTRATION_ID			Storage::RegistrationId
 #define IOT_CONFIG_SYMMETRIC_KEY			Storage::SymmetricKey
+#define IOT_CONFIG_X509_CERTIFICATE			Storage::X509Certificate	// Set with set_az_x509
+#define IOT_CONFIG_X509_PRIVATE_KEY			Storage::X509PrivateKey
 
 #else // USE_CLI
 
@@ -21,36 +25,75 @@
 
 #if !defined(USE_DPS)
 // Azure IoT Hub
-#define IOT_CONFIG_IOTHUB					"[Azure IoT Hub host name].azure-devices.net"
-#define IOT_CONFIG_DEVICE_ID				"[device id]"
-#define IOT_CONFIG_SYMMETRIC_KEY			"[symmetric key]"
+#define IOT_CONFIG_IOTHUB					AZ_SPAN_FROM_STR("[Azure IoT Hub host name].azure-devices.net")
+#define IOT_CONFIG_DEVICE_ID				AZ_SPAN_FROM_STR("[device id]")
+#define IOT_CONFIG_SYMMETRIC_KEY			AZ_SPAN_FROM_STR("[symmetric key]")
 #else // USE_DPS
 // Azure IoT Hub DPS
-#define IOT_CONFIG_GLOBAL_DEVICE_ENDPOINT	"global.azure-devices-provisioning.net"
-#define IOT_CONFIG_ID_SCOPE					"[id scope]"
-#define IOT_CONFIG_REGISTRATION_ID			"[registration id]" // For Azure IoT Central, specify the device id.
-#define IOT_CONFIG_SYMMETRIC_KEY			"[symmetric key]"   // For Azure IoT Central, symmetric key for individual enrollment or ComputeDerivedSymmetricKey("[symmetric key]", "[device id]") for group enrollment.
+#define IOT_CONFIG_GLOBAL_DEVICE_ENDPOINT	AZ_SPAN_FROM_STR("global.azure-devices-provisioning.net")
+#define IOT_CONFIG_ID_SCOPE					AZ_SPAN_FROM_STR("[id scope]")
+#define IOT_CONFIG_REGISTRATION_ID			AZ_SPAN_FROM_STR("[registration id]") // For Azure IoT Central, specify the device id.
+#define IOT_CONFIG_SYMMETRIC_KEY			AZ_SPAN_FROM_STR("[symmetric key]")   // For Azure IoT Central, symmetric key for individual enrollment or the result of ComputeDerivedSymmetricKey("[symmetric key]", "[device id]") for group enrollment.
                                                                 // https://learn.microsoft.com/en-us/azure/iot-central/core/concepts-device-authentication#sas-enrollment-group
 #endif // USE_DPS
 
+// X.509 device certificate and private key in PEM. Leave empty for the symmetric key.
+#define IOT_CONFIG_X509_CERTIFICATE			AZ_SPAN_FROM_STR("")
+#define IOT_CONFIG_X509_PRIVATE_KEY			AZ_SPAN_FROM_STR("")
+
 #endif // USE_CLI
 
-#define IOT_CONFIG_MODEL_ID					"dtmi:local:wioterminal:wioterminal_aziot_example;5"
+#define IOT_CONFIG_USE_X509					(az_span_size(IOT_CONFIG_X509_CERTIFICATE) > 0 && az_span_size(IOT_CONFIG_X509_PRIVATE_KEY) > 0)
+
+// MQTT port of Azure IoT Hub and DPS.
+// Point the endpoints at a local broker emulating the IoT Hub/DPS topics to exercise the flows without Azure.
+#define IOT_CONFIG_MQTT_PORT				8883
+#define IOT_HUB_MESSAGES_PER_SECOND			5       // Device-to-cloud rate limit, well below the IoT Hub throttle
+#define IOT_HUB_MESSAGE_BURST				10
+
+#define IOT_CONFIG_MODEL_ID					TELEMETRY_SCHEMA_MODEL_ID    // Generated from the DTDL model
 
 #define TOKEN_LIFESPAN                      3600
 
 #define TELEMETRY_FREQUENCY_MILLISECS		10000
-#define TELEMETRY_ACCEL_X					"accelX"
-#define TELEMETRY_ACCEL_Y					"accelY"
-#define TELEMETRY_ACCEL_Z					"accelZ"
-#define TELEMETRY_LIGHT                     "light"
-#define TELEMETRY_RIGHT_BUTTON              "rightButton"
-#define TELEMETRY_CENTER_BUTTON             "centerButton"
-#define TELEMETRY_LEFT_BUTTON               "leftButton"
-#define COMMAND_RING_BUZZER					"ringBuzzer"
-#define TELEMETRY_HUMID                     "humidity"
-#define TELEMETRY_TEMP                      "temperature"
-#define TELEMETRY_CO                        "co"
-#define TELEMETRY_NO2                       "no2"
-#define TELEMETRY_VOC                       "voc"
-#define TELEMETRY_C2H5CH                    "c2h5ch"
\ No newline at end of file
+#define TELEMETRY_FREQUENCY_MIN_MILLISECS	2000
+#define TELEMETRY_FREQUENCY_MAX_MILLISECS	60000
+#define TELEMETRY_VOC_SLOPE_THRESHOLD		0.5     // [ppm/s]
+#define TELEMETRY_RSSI_THRESHOLD			-75     // [dBm]
+#define TELEMETRY_LATENCY_THRESHOLD_MILLISECS	1000
+
+#define SERIAL_STREAM_INTERVAL_MILLISECS		40      // Accelerometer output data rate is 25 Hz
+#define SERIAL_STREAM_INTERVAL_MIN_MILLISECS	10
+
+#define GAS_BASELINE_SAVE_MILLISECS			3600000
+
+#define AIR_QUALITY_SAMPLE_MILLISECS		1000
+#define AIR_QUALITY_DISPLAY_MILLISECS	2000    // Redraws the readings on screen
+#define AIR_QUALITY_WARNING_BUZZER_MILLISECS	200
+#define AIR_QUALITY_ALARM_BUZZER_MILLISECS	2000
+
+#define COMMAND_BUZZER_MAX_MILLISECS		10000
+
+#define POWER_LOW_POWER_MODE				false   // Default until set_low_power is used
+#define POWER_BACKLIGHT_TIMEOUT_MILLISECS	60000   // Low-power mode only
+#define POWER_IDLE_MAX_MILLISECS			10      // Below the button debounce and every schedule
+
+#define TIME_NTP_SERVER						"pool.ntp.org"
+#define TIME_SYNC_INTERVAL_MILLISECS		3600000
+
+#define WIFI_ROAM_RSSI_THRESHOLD			-75     // [dBm] Look for a better AP below this
+
+#define DNS_CACHE_TTL_MILLISECS				3600000 // The resolver does not report record TTLs
+
+#define GATEWAY_ENABLED						false   // Default until set_gateway is used
+#define GATEWAY_GROUP_KEY					AZ_SPAN_FROM_STR("")    // Group enrollment key to sign node readings, empty for unsigned
+#define GATEWAY_BAUD						115200  // Serial1 on the 40-pin header, POWER_IDLE_MAX_MILLISECS of input fits in its receive buffer
+#define GATEWAY_BATCH_MILLISECS				10000
+
+#define WATCHDOG_TIMEOUT_MILLISECS			16000   // Longest WDT period, covers a TLS connect
+#define WATCHDOG_NETWORK_DEADLINE_MILLISECS	(DPS_RETRY_MAX_MILLISECS + DPS_RETRY_MIN_MILLISECS + 30000)  // Checked in on progress, the longest wait between attempts plus a connect
+#define WATCHDOG_SENSORS_DEADLINE_MILLISECS	10000
+#define WATCHDOG_DISPLAY_DEADLINE_MILLISECS	(AIR_QUALITY_DISPLAY_MILLISECS * 5)
+#define DPS_REGISTER_TIMEOUT_MILLISECS		300000  // Whole registration, then it starts over after DPS_RETRY_MAX_MILLISECS
+#define DPS_RETRY_MIN_MILLISECS				2000    // Also the jitter that spreads devices powered on together
+#define DPS_RETRY_MAX_MILLISECS				60000
\ No newline at end of file
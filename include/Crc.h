@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3). Pass the previous result as crc to continue a running checksum.
+uint32_t Crc32(const void* data, size_t size, uint32_t crc = 0);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <IPAddress.h>
+
+// Host name resolution cache.
+// The RTL8720 resolver does not report record TTLs, so entries live for a fixed TTL.
+// Hosts marked persistent are also kept in Storage with a UTC expiry, so the first connect
+// after a reboot skips the lookup too.
+class DnsCache
+{
+public:
+    static constexpr const char* KeyPersistent = "dns.cache";
+
+    static constexpr size_t EntryMax = 4;
+
+public:
+    static void Begin(unsigned long ttlMillisecs);
+
+    // Keeps the entry of host in Storage. Only one host is persistent at a time.
+    static void SetPersistent(const char* host);
+
+    // Returns the cached address while it is fresh, otherwise resolves it.
+    static bool Resolve(const char* host, IPAddress* ip, bool* fromCache);
+
+    // Writes a fresh lookup of the persistent host to Storage. Resolve() only marks it,
+    // the write can compact the store and must not run in the middle of a connect.
+    static void SavePersistent();
+
+    // Forgets host, for example after connecting to its cached address failed.
+    static void Invalidate(const char* host);
+
+    static void Print();
+
+private:
+    struct Entry
+    {
+        uint32_t HostHash;          // 0: empty
+        uint32_t Ip;
+        unsigned long ResolvedTime;
+    };
+
+    struct PersistentEntry
+    {
+        uint32_t HostHash;
+        uint32_t Ip;
+        uint64_t ExpiryEpoch;       // [s]
+    };
+
+    static Entry* Find(uint32_t hostHash);
+    static void Store(uint32_t hostHash, uint32_t ip, unsigned long resolvedTime);
+
+    static Entry Entries[EntryMax];
+    static unsigned long TtlMillisecs;
+    static uint32_t PersistentHostHash;
+    static bool PersistentPending;
+
+    static uint32_t Hits;
+    static uint32_t Misses;
+
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <PubSubClient.h>
+#include "AzureDpsClient.h"
+
+// Registers the device with Azure IoT DPS as a state machine driven from loop().
+// Nothing waits in place: the connection, the response to a register or status query,
+// the retry-after interval of an assigning operation and the back-off after throttling
+// (429) or a server error are all deadlines checked by DoWork(). A lost connection is
+// reopened and the operation in progress is resumed by its operation id instead of
+// registering again. The whole registration is cancelled when the timeout expires.
+class DpsRegistration
+{
+public:
+    enum class State : uint8_t
+    {
+        Idle,
+        Connecting,         // Waiting to connect, after a back-off if any
+        WaitingForResponse, // Register or status query published
+        WaitingToQuery,     // Connected, waiting for retry-after
+        Assigned,
+        Failed,
+    };
+
+    static constexpr unsigned long ResponseTimeoutMillisecs = 30000;
+    static constexpr int16_t BackOffAttemptsMax = 16;
+
+public:
+    // connect opens the MQTT connection to DPS with fresh credentials and returns true on success.
+    DpsRegistration(PubSubClient& client, AzureDpsClient& dps, bool (*connect)());
+    DpsRegistration(const DpsRegistration&) = delete;
+    DpsRegistration& operator=(const DpsRegistration&) = delete;
+
+    // Exponential back-off between retryMinMillisecs and retryMaxMillisecs, plus up to retryMinMillisecs of jitter.
+    // A longer retry-after from DPS is cut to retryMaxMillisecs, so no wait outlasts the watchdog deadline.
+    void SetBackOff(int32_t retryMinMillisecs, int32_t retryMaxMillisecs);
+
+    // dps must be initialized. registerPayload is referenced, not copied.
+    void Start(unsigned long now, unsigned long timeoutMillisecs, const char* registerPayload);
+    void Cancel();
+    void DoWork(unsigned long now);
+
+    // Call from the MQTT callback while registering.
+    void OnMessage(const char* topic, const uint8_t* payload, size_t payloadSize, unsigned long now);
+
+    State GetState() const { return CurrentState; }
+    bool IsBusy() const { return CurrentState != State::Idle && CurrentState != State::Assigned && CurrentState != State::Failed; }
+    unsigned long GetStartTime() const { return StartTime; }
+    const char* GetLastError() const { return LastError; }
+
+    void Print();
+
+private:
+    void Publish(unsigned long now);
+    void BackOff(unsigned long now, uint32_t retryAfterSeconds, const char* reason);
+    void Fail(const char* reason);
+
+    static const char* GetStateName(State state);
+
+private:
+    PubSubClient& Client;
+    AzureDpsClient& Dps;
+    bool (*const Connect)();
+
+    int32_t RetryMinMillisecs;
+    int32_t RetryMaxMillisecs;
+
+    State CurrentState;
+    const char* RegisterPayload;
+    unsigned long StartTime;
+    unsigned long TimeoutMillisecs;
+    unsigned long NextActionTime;
+    unsigned long RequestTime;
+    int16_t BackOffAttempts;
+    const char* LastError;
+
+    unsigned long Connections;
+    unsigned long Requests;
+    unsigned long Throttled;
+
+};
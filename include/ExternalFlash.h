@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// QSPI flash, shared by Storage and the firmware update staging area.
+// The flash stays in memory mode, so reads go straight through the memory map;
+// erase and program leave memory mode for the duration of the command.
+class ExternalFlash
+{
+public:
+    static constexpr uintptr_t MapAddress = 0x04000000;
+    static constexpr uint32_t Size = 4 * 1024 * 1024;
+    static constexpr uint32_t SectorSize = 4096;
+    static constexpr uint32_t PageSize = 256;
+
+public:
+    static const uint8_t* Map(uint32_t address) { return reinterpret_cast<const uint8_t*>(MapAddress) + address; }
+
+    static void EraseSector(uint32_t address);
+    static void Program(uint32_t address, const uint8_t* data, size_t size);
+
+private:
+    static int Init;
+
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Firmware update over the air.
+// Request() takes the URL, size and SHA-256 of an application image (the .bin built for the
+// bootloader, linked at AppAddress). DoWork() streams it over HTTP or HTTPS into a staging
+// slot in the QSPI flash and hashes it as it arrives, so RAM use does not depend on the image
+// size. A dropped connection resumes with a Range request.
+// Once verified the device restarts. ApplyPending() then checks the staged image again,
+// backs up the running firmware to a second slot and copies the image into the internal
+// flash from RAM. The new firmware is on trial until Confirm(); after BootAttemptsMax
+// restarts without it, the backup is copied back.
+// Power loss while copying leaves the UF2 bootloader intact (double-tap reset).
+class FirmwareUpdate
+{
+public:
+    static constexpr const char* KeyState = "ota.state";
+
+    static constexpr uint32_t AppAddress = 0x4000;             // After the UF2 bootloader
+    static constexpr uint32_t AppMaxSize = 0x80000 - AppAddress;
+    static constexpr uint32_t StagingAddress = 0x100000;        // QSPI flash, clear of Storage
+    static constexpr uint32_t BackupAddress = 0x180000;
+
+    static constexpr size_t HostMaxSize = 64;
+    static constexpr size_t PathMaxSize = 192;
+    static constexpr size_t ChunkSize = 512;                    // Max bytes read per DoWork() call
+    static constexpr size_t Sha256Size = 32;
+    static constexpr int RetryMax = 3;
+    static constexpr unsigned long RetryDelayMillisecs = 2000;
+    static constexpr unsigned long TimeoutMillisecs = 10000;
+    static constexpr uint8_t BootAttemptsMax = 3;
+
+    enum class State : uint8_t
+    {
+        Idle,
+        Connecting,
+        Headers,
+        Body,
+        Verified,
+        Failed,
+    };
+
+public:
+    // Call first in setup(), right after Storage::Load(). Does not return when it installs an image.
+    static void ApplyPending();
+
+    // Ends the trial of a new firmware. Call once it has connected to IoT Hub.
+    static void Confirm();
+
+    // Starts a download. url is http://host[:port]/path or https://...
+    static bool Request(const char* url, uint32_t size, const uint8_t* sha256);
+
+    // Downloads in the background. Call from loop() while Wi-Fi is connected.
+    static void DoWork(unsigned long now);
+
+    static State GetState() { return DownloadState; }
+    static bool IsBusy() { return DownloadState >= State::Connecting && DownloadState <= State::Body; }
+    static bool IsVerified() { return DownloadState == State::Verified; }
+
+    // Restarts into ApplyPending().
+    static void Restart();
+
+    static void Print();
+
+private:
+    static bool ParseUrl(const char* url);
+    static void Connect(unsigned long now);
+    static void ReadHeaders(unsigned long now);
+    static void ParseHeader();
+    static void StartBody(unsigned long now);
+    static void ReadBody(unsigned long now);
+    static void Finish();
+    static void Retry(unsigned long now, const char* reason);
+    static void Fail(const char* reason);
+
+    static State DownloadState;
+    static char Host[HostMaxSize + 1];
+    static char Path[PathMaxSize + 1];
+    static uint16_t Port;
+    static bool Secure;
+    static uint32_t ImageSize;
+    static uint8_t ImageSha256[Sha256Size];
+
+    static uint32_t Offset;
+    static int Attempts;
+    static unsigned long NextAttemptTime;
+    static unsigned long LastReceiveTime;
+    static char Line[128];
+    static size_t LineSize;
+    static int HttpStatus;
+    static long RangeStart;
+    static long ContentLength;
+    static const char* LastError;
+
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Converts raw GM-series ADC counts to concentrations.
+//
+// The sensor resistance ratio Rs/R0 is computed from the count, compensated for
+// temperature and humidity and looked up in a per-sensor curve. Curves are kept in
+// Storage as a few (Rs/R0, ppm) points and expanded at Load() into a table indexed by
+// log2(Rs/R0), so Convert() only needs integer arithmetic. R0 (the clean air
+// resistance) is tracked automatically and saved with SaveBaselines().
+enum class GasSensor : uint8_t
+{
+    NO2,        // GM-102B
+    C2H5CH,     // GM-302B
+    VOC,        // GM-502B
+    CO,         // GM-702B
+    Count,
+};
+
+struct GasCurvePoint
+{
+    float Ratio;                // Rs/R0
+    float Ppm;
+};
+
+// Persisted as the value of GasCalibration::CurveKey(sensor).
+struct GasCurve
+{
+    static constexpr size_t PointMaxCount = 8;
+
+    uint8_t PointCount;
+    uint8_t Oxidizing;          // Rs rises with concentration, R0 is the minimum in clean air
+    uint8_t Reserved[2];
+    float TemperatureCoeff;     // Relative change of Rs per degC above 20 degC
+    float HumidityCoeff;        // Relative change of Rs per %RH above 65 %RH
+    GasCurvePoint Points[PointMaxCount];    // Ascending Ratio
+};
+
+class GasCalibration
+{
+public:
+    static constexpr uint32_t AdcMax = 1023;
+    static constexpr unsigned long BaselinePeriodMillisecs = 60000;
+
+public:
+    static void Load();
+    static void SaveBaselines();
+    static void ResetBaselines();
+
+    static const char* GetName(GasSensor sensor);
+    static const char* CurveKey(GasSensor sensor);
+    static const GasCurve& GetCurve(GasSensor sensor);
+    static bool SetCurve(GasSensor sensor, const GasCurve& curve);
+
+    // Compensation applies to the following Convert() calls. NaN disables it.
+    static void SetEnvironment(float temperature, float humidity);
+
+    // Returns the concentration in ppm (Q16.16) and tracks the baseline.
+    static uint32_t Convert(GasSensor sensor, uint32_t count, unsigned long now);
+    static float ToFloat(uint32_t q16) { return static_cast<float>(q16) / 65536.0f; }
+
+    static uint16_t GetLastCount(GasSensor sensor);
+    static uint32_t GetLastRatio(GasSensor sensor);     // Rs/R0 (Q16.16)
+    static uint32_t GetBaseline(GasSensor sensor);      // R0/RL (Q16.16)
+
+};
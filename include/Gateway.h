@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <az_span.h>
+
+class Stream;
+
+// Gateway for downstream sensor nodes.
+// Nodes send readings over a serial link in the SerialStream frame format, see
+// scripts/gateway_node_simulator.py. Readings are batched into one JSON array message:
+//   [{"deviceId":"node-1","time":"2024-01-01T00:00:00.000Z","signature":"...","telemetry":{...}}, ...]
+// IoT Hub accepts one identity per MQTT connection, so the batch is sent by the gateway.
+// With a group enrollment key, each entry is signed with the key derived for its node
+// (HMAC-SHA256 over deviceId '\n' time '\n' telemetry), which lets the cloud attribute it.
+// Derived keys are computed once per node and cached.
+class Gateway
+{
+public:
+    static constexpr const char* KeyEnabled = "gw.enabled";
+    static constexpr const char* KeyGroupKey = "gw.groupkey";
+
+    enum class FrameType : uint8_t
+    {
+        NodeTelemetry = 16,     // Node id '\0' JSON object
+    };
+
+    static constexpr size_t NodeMax = 8;
+    static constexpr size_t NodeIdMaxSize = 32;
+    static constexpr size_t PayloadMaxSize = 256;
+    static constexpr size_t FrameMaxSize = 2 + 1 + 2 + 4 + 4 + PayloadMaxSize + 4;
+    static constexpr size_t BatchMaxSize = 4096;
+    static constexpr size_t EntryMaxSize = 200 + PayloadMaxSize;    // Entry without its telemetry is below 200 bytes
+    static constexpr int InputBudget = 256;     // Max bytes read per DoWork() call
+
+public:
+    // enable and groupKey are defaults, overridden by the values saved in Storage.
+    // groupKey may be empty, entries are then sent unsigned.
+    static void Init(bool enable, az_span groupKey, unsigned long batchMillisecs);
+    static bool IsEnabled() { return Enabled; }
+    static void SetEnabled(bool enable);        // Takes effect after a restart
+    static bool SetGroupKey(const char* groupKey);  // Base64, empty to send unsigned
+
+    // Starts reading node frames from link, which is already open.
+    static void Begin(Stream& link);
+
+    // Reads node frames. Call from loop().
+    static void DoWork(unsigned long now);
+
+    // True when the batch is old or full enough to send.
+    static bool IsBatchDue(unsigned long now);
+    static const uint8_t* GetBatch(size_t* size);
+    static void ClearBatch();   // After the batch was queued
+    static size_t DropBatch();  // Discards the batch, its readings count as dropped. Returns their number.
+
+    static void Print();
+
+private:
+    struct Node
+    {
+        char Id[NodeIdMaxSize + 1];
+        char DerivedKey[48];        // Base64 of HMAC-SHA256, empty without a group key
+        unsigned long LastSeenTime;
+        uint32_t Readings;
+    };
+
+    static bool ParseFrame(unsigned long now);
+    static void HandleTelemetry(unsigned long now, const uint8_t* payload, size_t payloadSize);
+    static Node* FindNode(const char* id, unsigned long now);
+    static bool AppendEntry(unsigned long now, const Node& node, const char* telemetry, size_t telemetrySize);
+
+    static bool Enabled;
+    static Stream* Link;
+    static char GroupKey[64];
+    static unsigned long BatchMillisecs;
+
+    static Node Nodes[NodeMax];
+    static uint8_t Frame[FrameMaxSize];
+    static size_t FrameSize;
+
+    static uint8_t Batch[BatchMaxSize];
+    static size_t BatchSize;
+    static size_t BatchEntries;
+    static unsigned long BatchStartTime;
+
+    static uint32_t ReceivedFrames;
+    static uint32_t InvalidFrames;
+    static uint32_t DroppedReadings;
+
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdarg.h>
+#include <Arduino.h>
+
+// Diagnostic output on the USB serial port, for main and the modules alike.
+// Dropped while SerialStream owns the port, so the decoder sees frames only.
+void Log(const char* format, ...);
+
+String StringVFormat(const char* format, va_list arg);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// FIFO of MQTT messages in a caller-provided byte ring.
+// Records are [topicSize u16][payloadSize u16][topic][payload] and may wrap around the
+// end of the buffer. When the ring is full the oldest messages are dropped.
+//
+// A message is written like a payload writer:
+//   Begin(topic, payloadSize), Write(...) until payloadSize bytes, End().
+class MessageQueue
+{
+public:
+    static constexpr size_t TopicMaxSize = 255;
+
+public:
+    MessageQueue(uint8_t* buffer, size_t bufferSize);
+    MessageQueue(const MessageQueue&) = delete;
+    MessageQueue& operator=(const MessageQueue&) = delete;
+
+    bool Begin(const char* topic, size_t payloadSize);
+    bool Write(const uint8_t* data, size_t size);
+    bool End();
+
+    bool IsEmpty() const { return Count == 0; }
+    size_t GetCount() const { return Count; }
+    size_t GetUsedBytes() const { return Used; }
+    uint32_t GetDroppedCount() const { return Dropped; }
+
+    // Copies the topic of the oldest message into topic (at least TopicMaxSize + 1 bytes).
+    void GetFrontTopic(char* topic) const;
+    size_t GetFrontPayloadSize() const;
+    uint8_t& FrontAttempts() { return Attempts; }
+    void Pop();
+    void Drop();    // Pop() counted as dropped
+
+    // Passes the payload of the oldest message to writer in at most two pieces.
+    template<typename Writer>
+    bool ReadFrontPayload(Writer& writer) const
+    {
+        const size_t start = Wrap(Head + HeaderSize + GetFrontTopicSize());
+        const size_t payloadSize = GetFrontPayloadSize();
+        const size_t first = payloadSize < BufferSize - start ? payloadSize : BufferSize - start;
+
+        if (first > 0 && !writer.Write(&Buffer[start], first)) return false;
+        if (payloadSize > first && !writer.Write(&Buffer[0], payloadSize - first)) return false;
+
+        return true;
+    }
+
+private:
+    static constexpr size_t HeaderSize = 4;
+
+    size_t Wrap(size_t offset) const { return offset >= BufferSize ? offset - BufferSize : offset; }
+    void RawWrite(const uint8_t* data, size_t size);
+    void RawRead(size_t offset, uint8_t* data, size_t size) const;
+    size_t GetFrontTopicSize() const;
+
+    uint8_t* const Buffer;
+    const size_t BufferSize;
+    size_t Head;                // Offset of the oldest record
+    size_t Used;                // Committed bytes
+    size_t Count;
+    uint32_t Dropped;
+    uint8_t Attempts;           // Failed publishes of the oldest message
+
+    bool Open;
+    size_t PendingUsed;
+    size_t PendingRemaining;
+
+};
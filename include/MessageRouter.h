@@ -0,0 +1,16 @@
+#pragma once
+
+#include <az_span.h>
+
+// Class of a message received from IoT Hub.
+enum class TopicClass
+{
+    Method,
+    CloudToDevice,
+    TwinResponse,
+    TwinDesired,
+    Unknown,
+};
+
+// Classifies a received topic by its prefix so only the matching az_iot_hub_client parser runs.
+TopicClass ClassifyTopic(az_span topic);
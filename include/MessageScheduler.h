@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <PubSubClient.h>
+#include "MessageQueue.h"
+#include "TelemetrySerializer.h"
+
+// Outbound message classes in priority order.
+enum class MessagePriority : uint8_t
+{
+    CommandResponse,
+    Alarm,
+    Button,
+    Telemetry,
+    Diagnostics,
+    Count,
+};
+
+// Queues outbound MQTT messages per priority class and publishes them from loop(),
+// highest priority first, within a device-to-cloud rate limit.
+// Messages are kept while disconnected and drained after reconnecting, so a command
+// response never waits behind a telemetry backlog.
+class MessageScheduler
+{
+public:
+    static constexpr size_t CommandResponseQueueSize = 1024;
+    static constexpr size_t AlarmQueueSize = 1024;
+    static constexpr size_t ButtonQueueSize = 1024;
+    static constexpr size_t TelemetryQueueSize = 16384;
+    static constexpr size_t DiagnosticsQueueSize = 1024;
+
+    static constexpr uint8_t MaxAttempts = 3;
+    static constexpr int MaxPublishesPerCall = 4;
+
+public:
+    explicit MessageScheduler(PubSubClient& client);
+    MessageScheduler(const MessageScheduler&) = delete;
+    MessageScheduler& operator=(const MessageScheduler&) = delete;
+
+    // Command responses are not device-to-cloud messages and are exempt.
+    void SetRateLimit(uint32_t messagesPerSecond, uint32_t burst);
+
+    bool Enqueue(MessagePriority priority, const char* topic, const uint8_t* payload, size_t payloadSize);
+
+    // Serializes the payload produced by source (bool operator()(Writer&)) straight into the queue.
+    template<typename Source>
+    bool Enqueue(MessagePriority priority, const char* topic, const Source& source)
+    {
+        TelemetryCountingWriter counter;
+        if (!source(counter)) return false;
+
+        MessageQueue& queue = GetQueue(priority);
+        if (!queue.Begin(topic, counter.GetSize())) return false;
+        const bool serialized = source(queue);
+
+        return queue.End() && serialized;
+    }
+
+    // Publishes queued messages while connected. Returns the number of messages published.
+    int DoWork(unsigned long now);
+
+    size_t GetQueuedCount(MessagePriority priority) { return GetQueue(priority).GetCount(); }
+    uint32_t GetDroppedCount(MessagePriority priority) { return GetQueue(priority).GetDroppedCount(); }
+    // Outcome of the latest publish attempt of the class, so each class sees its own link quality.
+    bool IsLastPublishSucceeded(MessagePriority priority) const { return LastPublishSucceeded[static_cast<size_t>(priority)]; }
+    uint32_t GetLastPublishMillisecs(MessagePriority priority) const { return LastPublishMillisecs[static_cast<size_t>(priority)]; }
+    static const char* GetName(MessagePriority priority);
+    void Print();
+
+private:
+    MessageQueue& GetQueue(MessagePriority priority) { return Queues[static_cast<size_t>(priority)]; }
+    void Refill(unsigned long now);
+    bool Publish(MessagePriority priority);
+
+    PubSubClient& Client;
+
+    uint8_t CommandResponseBuffer[CommandResponseQueueSize];
+    uint8_t AlarmBuffer[AlarmQueueSize];
+    uint8_t ButtonBuffer[ButtonQueueSize];
+    uint8_t TelemetryBuffer[TelemetryQueueSize];
+    uint8_t DiagnosticsBuffer[DiagnosticsQueueSize];
+    MessageQueue Queues[static_cast<size_t>(MessagePriority::Count)];
+
+    uint32_t TokensPerSecond;
+    uint32_t TokenMax;          // [milli tokens]
+    uint32_t Tokens;            // [milli tokens]
+    unsigned long LastRefillTime;
+    bool LastPublishSucceeded[static_cast<size_t>(MessagePriority::Count)];
+    uint32_t LastPublishMillisecs[static_cast<size_t>(MessagePriority::Count)];
+
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <PubSubClient.h>
+#include "TelemetrySerializer.h"
+
+// Streams an MQTT PUBLISH payload to the network client in fixed-size chunks,
+// so the payload is neither copied into nor limited by the PubSubClient buffer.
+class MqttStreamWriter
+{
+public:
+    explicit MqttStreamWriter(PubSubClient& client);
+    MqttStreamWriter(const MqttStreamWriter&) = delete;
+    MqttStreamWriter& operator=(const MqttStreamWriter&) = delete;
+
+    bool Begin(const char* topic, size_t payloadSize);
+    bool Write(const uint8_t* data, size_t size);
+    bool End();
+
+private:
+    static constexpr size_t ChunkSize = 256;
+
+    bool Flush();
+
+    PubSubClient& Client;
+    uint8_t Chunk[ChunkSize];
+    size_t ChunkUsed;
+    size_t Remaining;
+    bool Failed;
+
+};
+
+// Publishes the payload produced by source (bool operator()(Writer&)) without an intermediate buffer.
+// The source is run twice: once to measure the payload and once to stream it.
+template<typename Source>
+bool MqttPublishStreamed(PubSubClient& client, const char* topic, const Source& source, size_t* payloadSize = nullptr)
+{
+    TelemetryCountingWriter counter;
+    if (!source(counter)) return false;
+    if (payloadSize != nullptr) *payloadSize = counter.GetSize();
+
+    MqttStreamWriter writer(client);
+    if (!writer.Begin(topic, counter.GetSize())) return false;
+    const bool serialized = source(writer);
+
+    return writer.End() && serialized;
+}
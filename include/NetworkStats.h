@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+class NetworkStats
+{
+public:
+    struct Latency
+    {
+        uint32_t Count;
+        uint32_t Min;
+        uint32_t Max;
+        uint32_t Last;
+        uint64_t Total;
+
+        void Add(uint32_t millisecs);
+        uint32_t Average() const { return Count > 0 ? static_cast<uint32_t>(Total / Count) : 0; }
+    };
+
+    static Latency WiFiAssociate;
+    static Latency WiFiDhcp;
+    static Latency DnsResolve;
+    static Latency DpsRegister;
+    static Latency HubConnect;
+    static Latency Publish;
+
+    static uint32_t HubConnectFailures;
+    static uint32_t PublishFailures;
+    static uint64_t PublishBytes;
+    static uint32_t ReceivedMessages;
+    static unsigned long HubConnectedTime;
+
+public:
+    static void OnHubConnected(unsigned long now);
+    static void Print();
+
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// Low-power mode for battery powered units.
+// Between loop() iterations the core sleeps until the next SysTick or peripheral interrupt,
+// the RTL8720 Wi-Fi co-processor uses its power-save mode, and the LCD backlight turns off
+// after a period without user activity. millis() keeps running, so every schedule holds.
+class PowerManager
+{
+public:
+    static constexpr const char* KeyLowPower = "power.low";
+
+public:
+    // Restores the mode from Storage, defaulting to lowPower.
+    static void Init(bool lowPower, unsigned long backlightTimeoutMillisecs);
+
+    static void SetLowPower(bool enable);   // Saved to Storage
+    static bool IsLowPower() { return LowPower; }
+
+    // Applies the Wi-Fi power-save mode. Call after every Wi-Fi (re)connection.
+    static void ApplyWiFiPowerSave();
+
+    // Button presses, alarms and the like turn the backlight on and restart its timeout.
+    static void NotifyActivity(unsigned long now);
+    static void SetBacklight(bool on);
+    static bool IsBacklightOn() { return BacklightOn; }
+    static void DoWork(unsigned long now);
+
+    // Sleeps for at most maxMillisecs, returning early on console input. Does nothing unless in low-power mode.
+    static void Idle(unsigned long maxMillisecs);
+
+    static uint32_t GetSleepMillisecs() { return SleepMillisecs; }
+    static void Print();
+
+private:
+    static bool LowPower;
+    static bool BacklightOn;
+    static unsigned long BacklightTimeoutMillisecs;
+    static unsigned long LastActivityTime;
+    static uint32_t SleepMillisecs;
+
+};
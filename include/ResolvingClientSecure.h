@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <rpcWiFiClientSecure.h>
+
+// WiFiClientSecure that resolves host names through DnsCache.
+// It connects to the address and still sends the host name for SNI and certificate
+// verification. If a cached address does not answer, the name is resolved again and the
+// connect retried once. A fresh address is saved to Storage once the connect succeeded.
+// The watchdog is fed before each blocking step.
+class ResolvingClientSecure : public WiFiClientSecure
+{
+public:
+    ResolvingClientSecure();
+
+    // Hide the WiFiClientSecure setters to keep the PEMs for connect().
+    // rootCA is referenced. The certificate and key are copied and released after the next
+    // connect(), so set them before each one. nullptr selects no client authentication.
+    void setCACert(const char* rootCA);
+    void setCertificate(const char* clientCertificate);
+    void setPrivateKey(const char* privateKey);
+
+    int connect(const char* host, uint16_t port) override;
+    using WiFiClientSecure::connect;
+
+private:
+    int ConnectResolved(const char* host, uint16_t port);
+
+    const char* RootCA;
+    std::string ClientCertificate;      // Empty: none
+    std::string PrivateKey;
+
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Average over a sliding time window, updated in O(1) per sample.
+// The window is split into BucketCount buckets that leave the window one at a time,
+// so the window length is exact to one bucket. Sums are integers and never drift.
+template<unsigned long WindowMillisecs, size_t BucketCount>
+class RollingAverage
+{
+public:
+    RollingAverage()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        for (size_t i = 0; i < BucketCount; ++i) Buckets[i] = Bucket{ 0, 0 };
+        Current = 0;
+        CurrentStartTime = 0;
+        Started = false;
+        Sum = 0;
+        Count = 0;
+    }
+
+    void Add(unsigned long now, int32_t value)
+    {
+        Advance(now);
+
+        Buckets[Current].Sum += value;
+        ++Buckets[Current].Count;
+        Sum += value;
+        ++Count;
+    }
+
+    // Drops the buckets that left the window.
+    void Advance(unsigned long now)
+    {
+        if (!Started)
+        {
+            CurrentStartTime = now;
+            Started = true;
+            return;
+        }
+
+        const unsigned long elapsed = (now - CurrentStartTime) / BucketMillisecs;
+        if (elapsed == 0) return;
+
+        // Bounded by BucketCount, so the cost stays constant when averaged over the samples
+        const size_t expired = elapsed < BucketCount ? elapsed : BucketCount;
+        for (size_t i = 0; i < expired; ++i)
+        {
+            Current = Current + 1 < BucketCount ? Current + 1 : 0;
+            Sum -= Buckets[Current].Sum;
+            Count -= Buckets[Current].Count;
+            Buckets[Current] = Bucket{ 0, 0 };
+        }
+        CurrentStartTime += elapsed * BucketMillisecs;
+    }
+
+    bool IsEmpty() const { return Count == 0; }
+    uint32_t GetCount() const { return Count; }
+    int32_t Get() const { return Count > 0 ? static_cast<int32_t>(Sum / static_cast<int64_t>(Count)) : 0; }
+
+private:
+    struct Bucket
+    {
+        int64_t Sum;
+        uint32_t Count;
+    };
+
+    static constexpr unsigned long BucketMillisecs = WindowMillisecs / BucketCount;
+    static_assert(BucketMillisecs > 0, "Window too short for the bucket count");
+
+    Bucket Buckets[BucketCount];
+    size_t Current;
+    unsigned long CurrentStartTime;
+    bool Started;
+    int64_t Sum;
+    uint32_t Count;
+
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "TelemetrySchema.h"
+
+// Binary sample stream over the USB serial port, decoded by scripts/serial_stream_decoder.py.
+//
+// Frame (little-endian):
+//   [0xaa 0x55][type u8][payloadSize u16][sequence u32][millis u32][payload][crc32 u32]
+// The CRC-32 covers type through payload. A receiver resynchronizes on the sync bytes,
+// so text written to the same port between frames is skipped.
+class SerialStream
+{
+public:
+    static constexpr uint8_t Sync0 = 0xaa;
+    static constexpr uint8_t Sync1 = 0x55;
+
+    enum class FrameType : uint8_t
+    {
+        TelemetrySample = 1,    // Packed TelemetrySample
+        GasRaw = 2,             // Per GasSensor: count u16, then Rs/R0 u32, then R0/RL u32 (Q16.16)
+    };
+
+public:
+    static void Enable(bool enable, unsigned long intervalMillisecs);
+    static bool IsEnabled() { return Enabled; }
+    static unsigned long GetIntervalMillisecs() { return IntervalMillisecs; }
+
+    // True once per interval while enabled.
+    static bool IsDue(unsigned long now);
+    static bool Send(unsigned long now, const TelemetrySample& sample);
+    static bool SendGas(unsigned long now);     // Latest GasCalibration inputs
+
+    static uint32_t GetSequence() { return Sequence; }
+    static uint32_t GetDroppedFrames() { return DroppedFrames; }
+
+private:
+    static bool SendFrame(FrameType type, unsigned long now, const void* payload, size_t payloadSize);
+
+    static bool Enabled;
+    static unsigned long IntervalMillisecs;
+    static unsigned long NextSendTime;
+    static uint32_t Sequence;
+    static uint32_t DroppedFrames;
+
+};
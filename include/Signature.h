@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <string>
+#include <az_span.h>
 
-std::string GenerateEncryptedSignature(const std::string& symmetricKey, const std::vector<uint8_t>& signature);
+std::string GenerateEncryptedSignature(az_span symmetricKey, const std::vector<uint8_t>& signature);
 std::string ComputeDerivedSymmetricKey(const std::string& masterKey, const std::string& registrationId);
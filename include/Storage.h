@@ -1,22 +1,51 @@
 #pragma once
 
-#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <az_span.h>
 
+// Configuration store.
+// Settings are kept as CRC-protected key-value records appended to a log that spans
+// several QSPI flash sectors. An in-RAM index built at Load() maps each key to its
+// latest record, which is read in place through the memory-mapped flash.
 class Storage
 {
 public:
-	static std::string WiFiSSID;
-	static std::string WiFiPassword;
-	static std::string IdScope;
-	static std::string RegistrationId;
-	static std::string SymmetricKey;
+	static constexpr const char* KeyWiFiSSID = "wifi.ssid";
+	static constexpr const char* KeyWiFiPassword = "wifi.pwd";
+	static constexpr const char* KeyIdScope = "az.idscope";
+	static constexpr const char* KeyRegistrationId = "az.regid";
+	static constexpr const char* KeySymmetricKey = "az.symkey";
+	static constexpr const char* KeyHubHost = "az.hubhost";	// Assigned by DPS
+	static constexpr const char* KeyDeviceId = "az.devid";		// Assigned by DPS
+	static constexpr const char* KeyX509Certificate = "az.x509cert";	// PEM, replaces the symmetric key when set
+	static constexpr const char* KeyX509PrivateKey = "az.x509key";		// PEM
+
+	// Views of the records in the memory-mapped flash, validated once at Load() and
+	// refreshed by Set(). A Set() of any key may compact the store and move them, so read
+	// them again after one instead of keeping the pointers. Each is followed by '\0' and
+	// can be used as a C string.
+	static az_span WiFiSSID;
+	static az_span WiFiPassword;
+	static az_span IdScope;
+	static az_span RegistrationId;
+	static az_span SymmetricKey;
+	static az_span HubHost;
+	static az_span DeviceId;
+	static az_span X509Certificate;
+	static az_span X509PrivateKey;
 
 public:
 	static void Load();
-	static void Save();
 	static void Erase();
 
-private:
-	static int Init;
+	static bool Get(const char* key, const uint8_t** value, size_t* valueSize);
+	static bool Set(const char* key, const void* value, size_t valueSize);
+	static bool Set(const char* key, const char* value) { return Set(key, value, strlen(value)); }
+	static bool Set(const char* key, az_span value) { return Set(key, az_span_ptr(value), az_span_size(value)); }
+
+	static size_t GetUsedBytes();
+	static size_t GetFreeBytes();
 
 };
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+class TelemetryRate
+{
+public:
+    TelemetryRate(unsigned long initialIntervalMillisecs, unsigned long minIntervalMillisecs, unsigned long maxIntervalMillisecs);
+    TelemetryRate(const TelemetryRate&) = delete;
+    TelemetryRate& operator=(const TelemetryRate&) = delete;
+
+    void SetVocSlopeThreshold(float threshold) { VocSlopeThreshold = threshold; }
+    void SetRssiThreshold(int threshold) { RssiThreshold = threshold; }
+    void SetPublishLatencyThreshold(unsigned long thresholdMillisecs) { PublishLatencyThreshold = thresholdMillisecs; }
+
+    void Update(unsigned long now, float voc, int rssi, unsigned long publishLatencyMillisecs, bool published);
+
+    unsigned long GetIntervalMillisecs() const { return IntervalMillisecs; }
+    float GetVocSlope() const { return VocSlope; }
+    bool IsLinkDegraded() const { return LinkDegraded; }
+
+private:
+    const unsigned long MinIntervalMillisecs;
+    const unsigned long MaxIntervalMillisecs;
+    const unsigned long BackOffStepMillisecs;
+
+    float VocSlopeThreshold;
+    int RssiThreshold;
+    unsigned long PublishLatencyThreshold;
+
+    unsigned long IntervalMillisecs;
+    bool HasLastSample;
+    unsigned long LastSampleTime;
+    float LastVoc;
+    float VocSlope;
+    bool LinkDegraded;
+
+};
@@ -0,0 +1,115 @@
+// Generated by scripts/generate_telemetry_schema.py from seeedkk-wioterminal-wioterminal_aziot_example.json. DO NOT EDIT.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_SCHEMA_MODEL_ID               "dtmi:local:wioterminal:wioterminal_aziot_example;8"
+
+#define TELEMETRY_C2H5CH                        "c2h5ch"
+#define TELEMETRY_CO                            "co"
+#define TELEMETRY_VOC                           "voc"
+#define TELEMETRY_NO2                           "no2"
+#define TELEMETRY_TEMPERATURE                   "temperature"
+#define TELEMETRY_HUMIDITY                      "humidity"
+#define TELEMETRY_ACCEL_X                       "accelX"
+#define TELEMETRY_ACCEL_Y                       "accelY"
+#define TELEMETRY_ACCEL_Z                       "accelZ"
+#define TELEMETRY_LIGHT                         "light"
+#define TELEMETRY_CO_AVERAGE1M                  "coAverage1m"
+#define TELEMETRY_CO_AVERAGE8H                  "coAverage8h"
+#define TELEMETRY_NO2_AVERAGE1M                 "no2Average1m"
+#define TELEMETRY_NO2_AVERAGE8H                 "no2Average8h"
+#define TELEMETRY_VOC_AVERAGE1M                 "vocAverage1m"
+#define TELEMETRY_VOC_AVERAGE8H                 "vocAverage8h"
+#define TELEMETRY_AIR_QUALITY_ALARM             "airQualityAlarm"
+#define TELEMETRY_AIR_QUALITY_ALARM_CAUSE       "airQualityAlarmCause"
+#define TELEMETRY_RIGHT_BUTTON                  "rightButton"
+#define TELEMETRY_CENTER_BUTTON                 "centerButton"
+#define TELEMETRY_LEFT_BUTTON                   "leftButton"
+#define COMMAND_RING_BUZZER                     "ringBuzzer"
+#define COMMAND_UPDATE_FIRMWARE                 "updateFirmware"
+
+struct __attribute__((packed)) TelemetrySample
+{
+    float c2h5ch;
+    float co;
+    float voc;
+    float no2;
+    float temperature;
+    float humidity;
+    float accelX;
+    float accelY;
+    float accelZ;
+    int32_t light;
+    float coAverage1m;
+    float coAverage8h;
+    float no2Average1m;
+    float no2Average8h;
+    float vocAverage1m;
+    float vocAverage8h;
+};
+
+enum class TelemetryFieldType : uint8_t
+{
+    Int32,
+    Float,
+};
+
+struct TelemetryField
+{
+    const char* Key;        // JSON key including the preceding '{' or ','
+    uint8_t KeySize;
+    TelemetryFieldType Type;
+    uint8_t Decimals;
+    uint16_t Offset;
+};
+
+static constexpr TelemetryField TelemetrySchema[] =
+{
+    { "{\"c2h5ch\":", 10, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, c2h5ch) },
+    { ",\"co\":", 6, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, co) },
+    { ",\"voc\":", 7, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, voc) },
+    { ",\"no2\":", 7, TelemetryFieldType::Float, 3, offsetof(TelemetrySample, no2) },
+    { ",\"temperature\":", 15, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, temperature) },
+    { ",\"humidity\":", 12, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, humidity) },
+    { ",\"accelX\":", 10, TelemetryFieldType::Float, 3, offsetof(TelemetrySample, accelX) },
+    { ",\"accelY\":", 10, TelemetryFieldType::Float, 3, offsetof(TelemetrySample, accelY) },
+    { ",\"accelZ\":", 10, TelemetryFieldType::Float, 3, offsetof(TelemetrySample, accelZ) },
+    { ",\"light\":", 9, TelemetryFieldType::Int32, 0, offsetof(TelemetrySample, light) },
+    { ",\"coAverage1m\":", 15, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, coAverage1m) },
+    { ",\"coAverage8h\":", 15, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, coAverage8h) },
+    { ",\"no2Average1m\":", 16, TelemetryFieldType::Float, 3, offsetof(TelemetrySample, no2Average1m) },
+    { ",\"no2Average8h\":", 16, TelemetryFieldType::Float, 3, offsetof(TelemetrySample, no2Average8h) },
+    { ",\"vocAverage1m\":", 16, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, vocAverage1m) },
+    { ",\"vocAverage8h\":", 16, TelemetryFieldType::Float, 2, offsetof(TelemetrySample, vocAverage8h) },
+};
+
+static constexpr size_t TelemetrySchemaSize = sizeof(TelemetrySchema) / sizeof(TelemetrySchema[0]);
+
+enum class CommandId : uint8_t
+{
+    RingBuzzer,
+    UpdateFirmware,
+    Count,
+};
+
+struct CommandTableEntry
+{
+    const char* Name;       // nullptr: empty slot
+    uint8_t NameSize;
+    CommandId Id;
+};
+
+// Perfect hash: the entry of a command is CommandTable[CommandHash(name, CommandHashSeed) >> CommandHashShift].
+static constexpr uint32_t CommandHashSeed = 0x811c9dc5u;
+static constexpr int CommandHashShift = 30;
+static constexpr size_t CommandTableSize = 4;
+static constexpr CommandTableEntry CommandTable[CommandTableSize] =
+{
+    { nullptr, 0, CommandId::Count },
+    { nullptr, 0, CommandId::Count },
+    { "ringBuzzer", 10, CommandId::RingBuzzer },
+    { "updateFirmware", 14, CommandId::UpdateFirmware },
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "TelemetrySchema.h"
+
+// Writer requirements:
+//   bool Write(const uint8_t* data, size_t size);
+
+class TelemetryBufferWriter
+{
+public:
+    TelemetryBufferWriter(uint8_t* buffer, size_t bufferSize) : Buffer{ buffer }, BufferSize{ bufferSize }, Size{ 0 } {}
+
+    bool Write(const uint8_t* data, size_t size)
+    {
+        if (BufferSize - Size < size) return false;
+        memcpy(&Buffer[Size], data, size);
+        Size += size;
+        return true;
+    }
+
+    const uint8_t* GetData() const { return Buffer; }
+    size_t GetSize() const { return Size; }
+
+private:
+    uint8_t* const Buffer;
+    const size_t BufferSize;
+    size_t Size;
+
+};
+
+class TelemetryCountingWriter
+{
+public:
+    TelemetryCountingWriter() : Size{ 0 } {}
+
+    bool Write(const uint8_t* /*data*/, size_t size)
+    {
+        Size += size;
+        return true;
+    }
+
+    size_t GetSize() const { return Size; }
+
+private:
+    size_t Size;
+
+};
+
+static constexpr size_t TelemetryNumberMaxSize = 24;
+
+// Writes value in decimal into buf (at least TelemetryNumberMaxSize bytes) and returns the length.
+static inline size_t TelemetryFormatInt32(char* buf, int32_t value)
+{
+    char digits[10];
+    size_t digitsSize = 0;
+    uint32_t magnitude = value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+    do
+    {
+        digits[digitsSize++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    }
+    while (magnitude > 0);
+
+    size_t len = 0;
+    if (value < 0) buf[len++] = '-';
+    while (digitsSize > 0) buf[len++] = digits[--digitsSize];
+
+    return len;
+}
+
+// Writes value with a fixed number of decimals into buf (at least TelemetryNumberMaxSize bytes) and returns the length.
+// Non-finite or out of range values are written as null.
+static inline size_t TelemetryFormatFixed(char* buf, float value, uint8_t decimals)
+{
+    static constexpr uint32_t Pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+    if (decimals >= sizeof(Pow10) / sizeof(Pow10[0])) decimals = sizeof(Pow10) / sizeof(Pow10[0]) - 1;
+
+    if (!isfinite(value) || fabsf(value) >= 2000000000.0f)
+    {
+        memcpy(buf, "null", 4);
+        return 4;
+    }
+
+    const bool negative = value < 0.0f;
+    const uint64_t scaled = static_cast<uint64_t>((negative ? -value : value) * Pow10[decimals] + 0.5f);
+    const uint32_t integerPart = static_cast<uint32_t>(scaled / Pow10[decimals]);
+    uint32_t fractionPart = static_cast<uint32_t>(scaled % Pow10[decimals]);
+
+    size_t len = 0;
+    if (negative && scaled > 0) buf[len++] = '-';
+    len += TelemetryFormatInt32(&buf[len], static_cast<int32_t>(integerPart));
+    if (decimals > 0)
+    {
+        buf[len++] = '.';
+        for (size_t i = len + decimals; i > len; fractionPart /= 10) buf[--i] = '0' + fractionPart % 10;
+        len += decimals;
+    }
+
+    return len;
+}
+
+// Encodes sample as a JSON object in a single pass over TelemetrySchema.
+template<typename Writer>
+bool TelemetrySerializeJson(const TelemetrySample& sample, Writer& writer)
+{
+    const uint8_t* const base = reinterpret_cast<const uint8_t*>(&sample);
+    char number[TelemetryNumberMaxSize];
+
+    for (size_t i = 0; i < TelemetrySchemaSize; ++i)
+    {
+        const TelemetryField& field = TelemetrySchema[i];
+        if (!writer.Write(reinterpret_cast<const uint8_t*>(field.Key), field.KeySize)) return false;
+
+        size_t len;
+        switch (field.Type)
+        {
+        case TelemetryFieldType::Int32:
+        {
+            int32_t value;
+            memcpy(&value, &base[field.Offset], sizeof(value));
+            len = TelemetryFormatInt32(number, value);
+            break;
+        }
+        case TelemetryFieldType::Float:
+        {
+            float value;
+            memcpy(&value, &base[field.Offset], sizeof(value));
+            len = TelemetryFormatFixed(number, value, field.Decimals);
+            break;
+        }
+        default:
+            return false;
+        }
+        if (!writer.Write(reinterpret_cast<const uint8_t*>(number), len)) return false;
+    }
+
+    return writer.Write(reinterpret_cast<const uint8_t*>("}"), 1);
+}
+
+// Encodes sample as the packed little-endian TelemetrySample layout.
+template<typename Writer>
+bool TelemetrySerializeBinary(const TelemetrySample& sample, Writer& writer)
+{
+    return writer.Write(reinterpret_cast<const uint8_t*>(&sample), sizeof(sample));
+}
+
+// Payload source for MqttPublishStreamed.
+struct TelemetryJsonSource
+{
+    const TelemetrySample& Sample;
+
+    template<typename Writer>
+    bool operator()(Writer& writer) const { return TelemetrySerializeJson(Sample, writer); }
+};
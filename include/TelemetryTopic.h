@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <az_iot_hub_client.h>
+
+static constexpr size_t Iso8601Size = 24;   // yyyy-mm-ddThh:mm:ss.sssZ
+
+// Writes epochMillisecs as yyyy-mm-ddThh:mm:ss.sssZ into buf (Iso8601Size bytes, no terminator).
+void FormatIso8601(char* buf, uint64_t epochMillisecs);
+
+class TelemetryTopic
+{
+public:
+    TelemetryTopic();
+    TelemetryTopic(const TelemetryTopic&) = delete;
+    TelemetryTopic& operator=(const TelemetryTopic&) = delete;
+
+    int Init(const az_iot_hub_client* client);
+    bool IsValid() const { return TimestampOffset != 0; }
+
+    const char* Get(uint64_t epochMillisecs);
+
+private:
+    static constexpr size_t TopicMaxSize = 128;
+
+    char Topic[TopicMaxSize];
+    size_t TimestampOffset;
+
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class UDP;
+
+// UTC time base.
+// SNTP runs in the background without blocking loop(). Each reply re-anchors a millis()
+// based clock and refines its measured drift, so timestamps stay accurate between syncs
+// and when the server is unreachable. Returned times never go backwards.
+class TimeService
+{
+public:
+    static constexpr unsigned long TimeoutMillisecs = 2000;
+    static constexpr unsigned long RetryMinMillisecs = 10000;  // Doubles up to the sync interval
+    static constexpr int32_t DriftMaxPpm = 500;
+
+public:
+    static void Begin(UDP& udp, const char* server, unsigned long syncIntervalMillisecs);
+
+    // Sends requests and reads replies. Call from loop().
+    static void DoWork(unsigned long now);
+
+    static bool IsSynchronized() { return Synchronized; }
+
+    // UTC [ms since 1970-01-01] at the millis() value now, which may be in the past.
+    static uint64_t GetEpochMillisecs(unsigned long now);
+    static uint64_t GetEpochMillisecs();
+    static uint64_t GetEpoch() { return GetEpochMillisecs() / 1000; }
+
+    static int32_t GetDriftPpm() { return DriftPpm; }
+    static void Print();
+
+private:
+    static void SendRequest(unsigned long now);
+    static bool ReadReply(unsigned long now);
+    static void Anchor(unsigned long now, uint64_t epochMillisecs);
+
+    static UDP* Udp;
+    static const char* Server;
+    static unsigned long SyncIntervalMillisecs;
+
+    static bool Synchronized;
+    static unsigned long AnchorMillis;
+    static uint64_t AnchorEpochMillisecs;
+    static int32_t DriftPpm;
+    static uint64_t LastEpochMillisecs;
+
+    static bool RequestPending;
+    static unsigned long RequestTime;
+    static unsigned long NextRequestTime;
+    static unsigned long RetryIntervalMillisecs;
+
+    static uint32_t SyncCount;
+    static uint32_t SyncFailures;
+    static int32_t LastCorrectionMillisecs;
+
+};
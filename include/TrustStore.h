@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Root CAs for the TLS connections to IoT Hub and DPS.
+// The PEM bundle is checked once at boot: every certificate must parse, and expired roots
+// are reported. The same bundle is then handed to the TLS client for all connections.
+class TrustStore
+{
+public:
+    // Returns the number of roots that parse and are valid at epochMillisecs.
+    static int Load(const char* pemBundle, uint64_t epochMillisecs);
+
+    static const char* GetPem() { return Pem; }
+    static int GetValidCount() { return ValidCount; }
+
+    static void Print();
+
+private:
+    static const char* Pem;
+    static int ValidCount;
+    static int ExpiredCount;
+    static int ParseErrors;
+
+};
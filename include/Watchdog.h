@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Logical tasks of loop() under supervision.
+enum class WatchdogTask : uint8_t
+{
+    Network,    // Wi-Fi, MQTT and the outbound queues
+    Sensors,    // Sensor sampling
+    Display,    // Telemetry display
+    Count,
+};
+
+// Hardware watchdog supervisor.
+// The SAMD51 WDT is fed from DoWork() only while every task has checked in within its
+// deadline, so the device resets when loop() wedges or when one task stops making progress.
+// A task is supervised from its first check-in. The early warning interrupt records the
+// late task in backup RAM, which survives the reset, and Begin() reports it on the next boot.
+class Watchdog
+{
+public:
+    static constexpr const char* KeyResetCount = "wdt.resets";
+
+public:
+    // timeoutMillisecs is rounded up to a WDT period, 16 s at most.
+    static void Begin(unsigned long timeoutMillisecs);
+    static void SetDeadline(WatchdogTask task, unsigned long deadlineMillisecs);
+
+    // Call when the task made progress, not on every pass, or the deadline can never fire.
+    static void CheckIn(WatchdogTask task, unsigned long now);
+
+    // Feeds the WDT unless a task missed its deadline. For waits in setup() and before a
+    // blocking network call, which then gets a whole WDT period.
+    static void Feed();
+
+    // Feeds the WDT while all tasks are on time. Call from loop().
+    static void DoWork(unsigned long now);
+
+    static void Print();
+
+    // Called from the early warning interrupt.
+    static void OnEarlyWarning();
+
+private:
+    static const char* GetName(WatchdogTask task);
+
+    static bool Armed;
+    static bool Running;
+    static bool Starving;
+    static unsigned long Deadlines[static_cast<size_t>(WatchdogTask::Count)];
+    static unsigned long LastCheckInTimes[static_cast<size_t>(WatchdogTask::Count)];
+    static bool CheckedIn[static_cast<size_t>(WatchdogTask::Count)];
+    static uint8_t LastTask;
+    static uint32_t ResetCount;
+
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Keeps the Wi-Fi link up.
+// Networks are configured as profiles in priority order. A full connect scans and picks
+// the visible AP with the best score: RSSI, less a penalty for lower priority, recent
+// failures and slow past connects. The BSSID, channel and IP configuration of the last
+// connection are cached in Storage, and a reconnect first associates directly to that AP
+// with the cached addresses, which skips the scan and DHCP. The link is checked from
+// loop() and restored in the background with back-off. Scans block, so an outage scans
+// once and the retries go to the AP it found. While the signal stays weak, a scan looks
+// for a clearly better AP and moves over to it.
+class WiFiManager
+{
+public:
+    static constexpr const char* KeyCache = "wifi.cache";
+    static constexpr const char* KeyProfiles[] = { "wifi.profile.1", "wifi.profile.2", "wifi.profile.3" };   // Profiles 1 to 3: ssid '\0' password
+
+    static constexpr size_t ProfileMax = 4;     // Profile 0 is Storage::WiFiSSID/WiFiPassword
+    static constexpr size_t SsidMaxSize = 32;
+    static constexpr size_t PasswordMaxSize = 64;
+
+    static constexpr unsigned long FastConnectTimeoutMillisecs = 3000;
+    static constexpr unsigned long ConnectTimeoutMillisecs = 15000;
+    static constexpr unsigned long DhcpTimeoutMillisecs = 10000;
+    static constexpr unsigned long RetryMinMillisecs = 1000;
+    static constexpr unsigned long RetryMaxMillisecs = 30000;
+    static constexpr unsigned long OutageScanMillisecs = 300000;    // Min time between scans during an outage
+
+    static constexpr unsigned long RoamCheckMillisecs = 10000;
+    static constexpr int RoamWeakChecks = 3;                    // Consecutive weak checks before a scan
+    static constexpr unsigned long RoamScanMillisecs = 300000;  // Min time between scans, they block
+    static constexpr int RoamHysteresis = 10;                   // [dB]
+
+    static constexpr int PriorityPenalty = 5;                   // [dB per profile index]
+    static constexpr int FailurePenalty = 10;                   // [dB per consecutive failure, up to 3]
+
+public:
+    // Adds a network in priority order. The credentials are copied.
+    static bool AddProfile(const char* ssid, const char* password);
+
+    // Adds the profiles kept in Storage under KeyProfiles.
+    static void LoadProfiles();
+
+    static void Begin(int roamRssiThreshold);
+
+    // Monitors the link and advances a reconnect. Call from loop().
+    static void DoWork(unsigned long now);
+
+    static bool IsConnected() { return CurrentState == State::Connected; }
+
+    // Connect attempts that succeeded or failed so far, the progress of an outage.
+    static uint32_t GetAttempts();
+
+    // The upstream server was unreachable. If the addresses came from the cache they may
+    // be stale, so reconnect with DHCP.
+    static void OnUpstreamFailure();
+
+    static void Print();
+
+private:
+    enum class State : uint8_t
+    {
+        Disconnected,
+        Associating,
+        WaitingForAddress,
+        Connected,
+    };
+
+    struct Profile
+    {
+        char Ssid[SsidMaxSize + 1];
+        char Password[PasswordMaxSize + 1];
+        uint32_t Connects;
+        uint32_t Failures;
+        uint8_t ConsecutiveFailures;
+        uint32_t ConnectMillisecs;      // Average of recent connects
+    };
+
+    struct Target
+    {
+        int ProfileIndex;
+        uint8_t Bssid[6];
+        uint8_t Channel;                // 0: unknown, let the co-processor scan
+        int Score;
+    };
+
+    struct Cache
+    {
+        uint32_t SsidHash;
+        uint8_t Bssid[6];
+        uint8_t Channel;
+        uint8_t Reserved;
+        uint32_t LocalIp;
+        uint32_t Gateway;
+        uint32_t Subnet;
+        uint32_t Dns;
+    };
+
+    static int Score(int profileIndex, int rssi);
+    static bool Scan(Target* best);
+    static void Connect(unsigned long now, const Target* target);
+    static void Fail(unsigned long now);
+    static void OnConnected(unsigned long now);
+    static void CheckRoam(unsigned long now);
+    static bool LoadCache(Cache* cache, int* profileIndex);
+    static void SaveCache();
+
+    static Profile Profiles[ProfileMax];
+    static size_t ProfileCount;
+    static int CurrentProfile;
+    static int NextProfile;             // Round robin when a scan finds nothing
+    static int RoamRssiThreshold;
+
+    static State CurrentState;
+    static bool FastConnect;
+    static bool CacheEnabled;
+    static unsigned long AttemptTime;
+    static unsigned long NextAttemptTime;
+    static unsigned long RetryIntervalMillisecs;
+
+    static Target OutageTarget;         // ProfileIndex -1: no profile was visible
+    static bool OutageScanned;
+    static unsigned long OutageScanTime;
+
+    static unsigned long NextRoamCheckTime;
+    static unsigned long LastRoamScanTime;
+    static int WeakChecks;
+
+    static uint32_t FastConnects;
+    static uint32_t FullConnects;
+    static uint32_t Disconnects;
+    static uint32_t Roams;
+
+};
@@ -0,0 +1,104 @@
+# Simulate downstream sensor nodes for the gateway mode started with "set_gateway on".
+#
+#   python scripts/gateway_node_simulator.py --port /dev/ttyUSB0 --nodes 4 --interval 2
+#   python scripts/gateway_node_simulator.py --output frames.bin --nodes 8 --count 100
+#
+# Each node sends a JSON reading in the frame format of include/SerialStream.h with the
+# frame type NodeTelemetry of include/Gateway.h. Connect a USB UART to Serial1 of the
+# 40-pin header. Writing a port requires pyserial.
+#
+# With --group-key the script prints the derived key of each node, the key a cloud side
+# verifier checks the "signature" of its batch entries with.
+
+import argparse
+import base64
+import binascii
+import hashlib
+import hmac
+import json
+import random
+import struct
+import sys
+import time
+
+SYNC = b"\xaa\x55"
+HEADER = struct.Struct("<BHII")     # type, payloadSize, sequence, millis
+TRAILER = struct.Struct("<I")       # crc32 of type through payload
+MAX_PAYLOAD_SIZE = 256              # Gateway::PayloadMaxSize
+
+FRAME_TYPE_NODE_TELEMETRY = 16
+
+
+def encode_frame(frame_type, sequence, millis, payload):
+    if len(payload) > MAX_PAYLOAD_SIZE:
+        raise ValueError("payload of %d bytes exceeds %d" % (len(payload), MAX_PAYLOAD_SIZE))
+    body = HEADER.pack(frame_type, len(payload), sequence, millis & 0xffffffff) + payload
+    return SYNC + body + TRAILER.pack(binascii.crc32(body) & 0xffffffff)
+
+
+def derive_key(group_key, device_id):
+    """Same as ComputeDerivedSymmetricKey() in src/Signature.cpp."""
+    digest = hmac.new(base64.b64decode(group_key), device_id.encode(), hashlib.sha256).digest()
+    return base64.b64encode(digest).decode()
+
+
+def reading(rng):
+    return {
+        "temperature": round(rng.uniform(18, 28), 1),
+        "humidity": round(rng.uniform(30, 70), 1),
+        "voc": round(rng.uniform(0, 3), 2),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate downstream nodes of the Wio Terminal gateway.")
+    sink = parser.add_mutually_exclusive_group(required=True)
+    sink.add_argument("--port", help="serial port connected to Serial1 of the Wio Terminal")
+    sink.add_argument("--output", help="write the frames to this file instead")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--nodes", type=int, default=4, help="number of simulated nodes")
+    parser.add_argument("--prefix", default="node-", help="node ids are the prefix and a number")
+    parser.add_argument("--interval", type=float, default=5.0, help="seconds between readings of a node")
+    parser.add_argument("--count", type=int, default=0, help="readings per node, 0 to run until interrupted")
+    parser.add_argument("--group-key", help="group enrollment key, prints derived keys")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    ids = ["%s%d" % (args.prefix, i + 1) for i in range(args.nodes)]
+    if args.group_key:
+        for device_id in ids:
+            print("%s: derived key %s" % (device_id, derive_key(args.group_key, device_id)), file=sys.stderr)
+
+    if args.port:
+        import serial
+        stream = serial.Serial(args.port, args.baud)
+    else:
+        stream = open(args.output, "wb")
+
+    rng = random.Random(args.seed)
+    sequences = {device_id: 0 for device_id in ids}
+    start = time.monotonic()
+    sent = 0
+    try:
+        n = 0
+        while args.count == 0 or n < args.count:
+            # Spread the nodes over the interval like independent devices
+            for i, device_id in enumerate(ids):
+                telemetry = json.dumps(reading(rng), separators=(",", ":")).encode()
+                millis = int((time.monotonic() - start) * 1000)
+                stream.write(encode_frame(FRAME_TYPE_NODE_TELEMETRY, sequences[device_id], millis, device_id.encode() + b"\0" + telemetry))
+                sequences[device_id] += 1
+                sent += 1
+                if args.port:
+                    stream.flush()
+                    time.sleep(args.interval / len(ids))
+            n += 1
+    except KeyboardInterrupt:
+        pass
+    finally:
+        stream.close()
+        print("%d frames sent from %d nodes" % (sent, len(ids)), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,172 @@
+# Generate include/TelemetrySchema.h (telemetry layout and command table) from the DTDL model.
+#
+# Runs as a PlatformIO pre-build script (see extra_scripts in platformio.ini)
+# or standalone: python scripts/generate_telemetry_schema.py
+
+import json
+import os
+import re
+
+MODEL_FILE = "seeedkk-wioterminal-wioterminal_aziot_example.json"
+OUTPUT_FILE = os.path.join("include", "TelemetrySchema.h")
+
+# DTDL primitive schema -> (C type, TelemetryFieldType)
+PRIMITIVE_SCHEMAS = {
+    "integer": ("int32_t", "Int32"),
+    "long": ("int32_t", "Int32"),
+    "float": ("float", "Float"),
+    "double": ("float", "Float"),
+}
+
+# Number of decimals in the JSON encoding of floating point fields
+DEFAULT_DECIMALS = 2
+DECIMALS = {
+    "no2": 3,
+    "no2Average1m": 3,
+    "no2Average8h": 3,
+    "accelX": 3,
+    "accelY": 3,
+    "accelZ": 3,
+}
+
+
+def macro_name(name):
+    return re.sub(r"(?<=[a-z0-9])([A-Z])", r"_\1", name).upper()
+
+
+def pascal_name(name):
+    return name[:1].upper() + name[1:]
+
+
+# Must match CommandHash() in include/CommandDispatcher.h (FNV-1a with the seed as offset basis)
+def command_hash(name, seed):
+    h = seed
+    for b in name.encode("utf-8"):
+        h ^= b
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def perfect_hash(names):
+    size = 4
+    while size < 2 * len(names):
+        size *= 2
+    while True:
+        for seed in range(2166136261, 2166136261 + 65536):
+            # Use the top bits, the low bits of FNV-1a barely depend on the seed
+            slots = [command_hash(n, seed) >> (32 - size.bit_length() + 1) for n in names]
+            if len(set(slots)) == len(slots):
+                return seed, size, slots
+        size *= 2
+
+
+def c_string(value):
+    return '"' + value.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+def generate(model):
+    telemetries = [c for c in model["contents"] if "Telemetry" in (c["@type"] if isinstance(c["@type"], list) else [c["@type"]])]
+    commands = [c for c in model["contents"] if "Command" in (c["@type"] if isinstance(c["@type"], list) else [c["@type"]])]
+    fields = [t for t in telemetries if isinstance(t["schema"], str) and t["schema"] in PRIMITIVE_SCHEMAS]
+
+    lines = []
+    lines.append("// Generated by scripts/generate_telemetry_schema.py from %s. DO NOT EDIT." % MODEL_FILE)
+    lines.append("")
+    lines.append("#pragma once")
+    lines.append("")
+    lines.append("#include <stddef.h>")
+    lines.append("#include <stdint.h>")
+    lines.append("")
+    lines.append("#define %-40s%s" % ("TELEMETRY_SCHEMA_MODEL_ID", c_string(model["@id"])))
+    lines.append("")
+    for t in telemetries:
+        lines.append("#define %-40s%s" % ("TELEMETRY_" + macro_name(t["name"]), c_string(t["name"])))
+    for c in commands:
+        lines.append("#define %-40s%s" % ("COMMAND_" + macro_name(c["name"]), c_string(c["name"])))
+    lines.append("")
+    lines.append("struct __attribute__((packed)) TelemetrySample")
+    lines.append("{")
+    for f in fields:
+        lines.append("    %s %s;" % (PRIMITIVE_SCHEMAS[f["schema"]][0], f["name"]))
+    lines.append("};")
+    lines.append("")
+    lines.append("enum class TelemetryFieldType : uint8_t")
+    lines.append("{")
+    lines.append("    Int32,")
+    lines.append("    Float,")
+    lines.append("};")
+    lines.append("")
+    lines.append("struct TelemetryField")
+    lines.append("{")
+    lines.append("    const char* Key;        // JSON key including the preceding '{' or ','")
+    lines.append("    uint8_t KeySize;")
+    lines.append("    TelemetryFieldType Type;")
+    lines.append("    uint8_t Decimals;")
+    lines.append("    uint16_t Offset;")
+    lines.append("};")
+    lines.append("")
+    lines.append("static constexpr TelemetryField TelemetrySchema[] =")
+    lines.append("{")
+    for i, f in enumerate(fields):
+        key = ("{" if i == 0 else ",") + '"%s":' % f["name"]
+        field_type = PRIMITIVE_SCHEMAS[f["schema"]][1]
+        decimals = DECIMALS.get(f["name"], DEFAULT_DECIMALS) if field_type == "Float" else 0
+        lines.append("    { %s, %d, TelemetryFieldType::%s, %d, offsetof(TelemetrySample, %s) }," % (c_string(key), len(key), field_type, decimals, f["name"]))
+    lines.append("};")
+    lines.append("")
+    lines.append("static constexpr size_t TelemetrySchemaSize = sizeof(TelemetrySchema) / sizeof(TelemetrySchema[0]);")
+    lines.append("")
+    lines.append("enum class CommandId : uint8_t")
+    lines.append("{")
+    for c in commands:
+        lines.append("    %s," % pascal_name(c["name"]))
+    lines.append("    Count,")
+    lines.append("};")
+    lines.append("")
+    lines.append("struct CommandTableEntry")
+    lines.append("{")
+    lines.append("    const char* Name;       // nullptr: empty slot")
+    lines.append("    uint8_t NameSize;")
+    lines.append("    CommandId Id;")
+    lines.append("};")
+    lines.append("")
+    seed, size, slots = perfect_hash([c["name"] for c in commands])
+    table = [None] * size
+    for c, slot in zip(commands, slots):
+        table[slot] = c
+    lines.append("// Perfect hash: the entry of a command is CommandTable[CommandHash(name, CommandHashSeed) >> CommandHashShift].")
+    lines.append("static constexpr uint32_t CommandHashSeed = 0x%08xu;" % seed)
+    lines.append("static constexpr int CommandHashShift = %d;" % (32 - size.bit_length() + 1))
+    lines.append("static constexpr size_t CommandTableSize = %d;" % size)
+    lines.append("static constexpr CommandTableEntry CommandTable[CommandTableSize] =")
+    lines.append("{")
+    for c in table:
+        if c is None:
+            lines.append("    { nullptr, 0, CommandId::Count },")
+        else:
+            lines.append("    { %s, %d, CommandId::%s }," % (c_string(c["name"]), len(c["name"].encode("utf-8")), pascal_name(c["name"])))
+    lines.append("};")
+
+    return "\n".join(lines) + "\n"
+
+
+def run(project_dir):
+    with open(os.path.join(project_dir, MODEL_FILE), encoding="utf-8") as f:
+        model = json.load(f)
+    content = generate(model)
+
+    output_path = os.path.join(project_dir, OUTPUT_FILE)
+    if os.path.exists(output_path):
+        with open(output_path, encoding="utf-8") as f:
+            if f.read() == content:
+                return
+    with open(output_path, "w", encoding="utf-8", newline="\n") as f:
+        f.write(content)
+    print("Generated %s" % OUTPUT_FILE)
+
+
+if __name__ == "__main__":
+    run(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+else:
+    Import("env")  # noqa: F821
+    run(env.subst("$PROJECT_DIR"))  # noqa: F821
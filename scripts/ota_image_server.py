@@ -0,0 +1,86 @@
+# Serve a firmware image for the updateFirmware command, as a local stand-in for the file server.
+#
+#   python scripts/ota_image_server.py .pio/build/seeed_wio_terminal/firmware.bin
+#   python scripts/ota_image_server.py firmware.bin --port 8000 --drop-after 100000
+#
+# Prints the command payload (url, size, sha256) to invoke on the device. Range requests
+# are honoured so that resumed downloads can be tested; --drop-after closes the first
+# connection after that many body bytes.
+
+import argparse
+import hashlib
+import http.server
+import json
+import os
+import re
+import socket
+import sys
+
+
+def local_address():
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        try:
+            s.connect(("192.0.2.1", 9))    # No packet is sent
+            return s.getsockname()[0]
+        except OSError:
+            return "127.0.0.1"
+
+
+def make_handler(image, name, drop_after):
+    state = {"drop_after": drop_after}
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_GET(self):
+            if self.path.lstrip("/") != name:
+                self.send_error(404)
+                return
+
+            start = 0
+            match = re.match(r"bytes=(\d+)-$", self.headers.get("Range", ""))
+            if match and int(match.group(1)) < len(image):
+                start = int(match.group(1))
+                self.send_response(206)
+                self.send_header("Content-Range", "bytes %d-%d/%d" % (start, len(image) - 1, len(image)))
+            else:
+                self.send_response(200)
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("Content-Length", str(len(image) - start))
+            self.end_headers()
+
+            body = image[start:]
+            if state["drop_after"] is not None:
+                body = body[:state["drop_after"]]
+                state["drop_after"] = None
+            self.wfile.write(body)
+
+    return Handler
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Serve a firmware image for an over-the-air update of the Wio Terminal.")
+    parser.add_argument("image", help="application image (.bin)")
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--drop-after", type=int, help="close the first connection after this many bytes")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    name = os.path.basename(args.image)
+
+    payload = {
+        "url": "http://%s:%d/%s" % (local_address(), args.port, name),
+        "size": len(image),
+        "sha256": hashlib.sha256(image).hexdigest(),
+    }
+    print(json.dumps(payload), file=sys.stderr)
+
+    server = http.server.HTTPServer((args.bind, args.port), make_handler(image, name, args.drop_after))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
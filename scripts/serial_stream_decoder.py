@@ -0,0 +1,146 @@
+# Decode the binary sensor stream started with the "stream on" console command.
+#
+#   python scripts/serial_stream_decoder.py --port COM3 --csv samples.csv
+#   python scripts/serial_stream_decoder.py --port /dev/ttyACM0 --record capture.bin
+#   python scripts/serial_stream_decoder.py --input capture.bin --csv samples.csv
+#
+# The sample layout is read from include/TelemetrySchema.h, so the decoder always
+# matches the firmware built from the same tree. Reading a port requires pyserial.
+
+import argparse
+import binascii
+import os
+import re
+import struct
+import sys
+
+SYNC = b"\xaa\x55"
+HEADER = struct.Struct("<BHII")     # type, payloadSize, sequence, millis
+TRAILER = struct.Struct("<I")       # crc32 of type through payload
+MAX_PAYLOAD_SIZE = 1024
+
+FRAME_TYPE_TELEMETRY_SAMPLE = 1
+FRAME_TYPE_GAS_RAW = 2
+
+# Order of GasSensor in include/GasCalibration.h
+GAS_SENSORS = ["no2", "c2h5ch", "voc", "co"]
+GAS_RAW = struct.Struct("<%dH%dI%dI" % ((len(GAS_SENSORS),) * 3))
+
+C_TYPES = {
+    "float": "f",
+    "int32_t": "i",
+}
+
+
+def load_sample_layout(project_dir):
+    with open(os.path.join(project_dir, "include", "TelemetrySchema.h"), encoding="utf-8") as f:
+        content = f.read()
+    body = re.search(r"struct __attribute__\(\(packed\)\) TelemetrySample\s*\{(.*?)\};", content, re.S)
+    if body is None:
+        raise RuntimeError("TelemetrySample not found in TelemetrySchema.h")
+    fields = re.findall(r"(\w+)\s+(\w+);", body.group(1))
+    return [name for _, name in fields], struct.Struct("<" + "".join(C_TYPES[c_type] for c_type, _ in fields))
+
+
+def frames(read):
+    """Yield (type, sequence, millis, payload) for each valid frame; read() returns None at the end."""
+    buf = b""
+    while True:
+        data = read()
+        if data is None:
+            return
+        buf += data
+
+        while True:
+            start = buf.find(SYNC)
+            if start < 0:
+                buf = buf[-1:]
+                break
+            buf = buf[start:]
+            if len(buf) < len(SYNC) + HEADER.size:
+                break
+            frame_type, payload_size, sequence, millis = HEADER.unpack_from(buf, len(SYNC))
+            if payload_size > MAX_PAYLOAD_SIZE:
+                buf = buf[1:]
+                continue
+            frame_size = len(SYNC) + HEADER.size + payload_size + TRAILER.size
+            if len(buf) < frame_size:
+                break
+            body = buf[len(SYNC):frame_size - TRAILER.size]
+            (crc,) = TRAILER.unpack_from(buf, frame_size - TRAILER.size)
+            if binascii.crc32(body) & 0xffffffff != crc:
+                buf = buf[1:]   # False sync in text or a corrupted frame
+                continue
+            yield frame_type, sequence, millis, body[HEADER.size:]
+            buf = buf[frame_size:]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the binary sensor stream of the Wio Terminal.")
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--port", help="serial port of the Wio Terminal")
+    source.add_argument("--input", help="previously recorded capture file")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--csv", help="write decoded samples to this file instead of stdout")
+    parser.add_argument("--record", help="also save the raw byte stream to this file")
+    args = parser.parse_args()
+
+    names, layout = load_sample_layout(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+    if args.port:
+        import serial
+        stream = serial.Serial(args.port, args.baud, timeout=1)
+        stream.write(b"stream on\r")
+        read = lambda: stream.read(4096)
+    else:
+        stream = open(args.input, "rb")
+        read = lambda: stream.read(4096) or None
+
+    record = open(args.record, "wb") if args.record else None
+    if record is not None:
+        inner_read = read
+        def read():
+            data = inner_read()
+            if data:
+                record.write(data)
+            return data
+
+    out = open(args.csv, "w", encoding="utf-8", newline="") if args.csv else sys.stdout
+    gas_names = ["%s_%s" % (name, column) for column in ("count", "ratio", "r0") for name in GAS_SENSORS]
+    out.write(",".join(["sequence", "millis"] + names + gas_names) + "\n")
+
+    received = 0
+    lost = 0
+    last_sequence = None
+    gas = None
+    try:
+        for frame_type, sequence, millis, payload in frames(read):
+            if last_sequence is not None and sequence > last_sequence + 1:
+                lost += sequence - last_sequence - 1
+            last_sequence = sequence
+            received += 1
+
+            # The gas frame precedes the sample it was read with
+            if frame_type == FRAME_TYPE_GAS_RAW and len(payload) == GAS_RAW.size:
+                values = GAS_RAW.unpack(payload)
+                n = len(GAS_SENSORS)
+                gas = (millis, [str(v) for v in values[:n]] + ["%.4f" % (v / 65536) for v in values[n:]])
+            elif frame_type == FRAME_TYPE_TELEMETRY_SAMPLE and len(payload) == layout.size:
+                values = ["%g" % v for v in layout.unpack(payload)]
+                gas_values = gas[1] if gas is not None and gas[0] == millis else [""] * len(gas_names)
+                out.write(",".join([str(sequence), str(millis)] + values + gas_values) + "\n")
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if args.port:
+            stream.write(b"stream off\r")
+        stream.close()
+        if record is not None:
+            record.close()
+        if out is not sys.stdout:
+            out.close()
+        print("%d frames received, %d lost" % (received, lost), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,165 @@
+#include "AirQuality.h"
+#include "RollingAverage.h"
+#include <math.h>
+
+AirQuality::Level AirQuality::CurrentLevel = AirQuality::Level::Normal;
+const char* AirQuality::Cause = "";
+
+static constexpr size_t ShortBucketCount = 30;     // 2 s
+static constexpr size_t LongBucketCount = 48;      // 10 min
+
+static constexpr float HysteresisRatio = 0.9f;     // A level clears below 90% of its threshold
+
+// Long window rules only apply once this much history exists
+static constexpr unsigned long LongWindowMinMillisecs = AirQuality::LongWindowMillisecs / 4;
+
+enum class Gas : uint8_t
+{
+    CO,
+    NO2,
+    VOC,
+    Count,
+};
+
+static constexpr size_t GasCount = static_cast<size_t>(Gas::Count);
+
+enum class Window : uint8_t
+{
+    Sample,             // Reacts within one sample to dangerous peaks
+    Short,
+    Long,
+};
+
+struct Rule
+{
+    const char* Name;
+    Gas Source;
+    Window Average;
+    float Warning;      // [ppm]
+    float Alarm;        // [ppm]
+};
+
+// CO and NO2 follow the US EPA ambient standards (CO 9 ppm over 8 h, NO2 100 ppb over 1 h)
+// and the NIOSH ceiling limits. VOC is a total reading of the GM-502B without a standard.
+static const Rule Rules[] =
+{
+    { "co"    , Gas::CO , Window::Sample, 100.0f, 200.0f },
+    { "co 1m" , Gas::CO , Window::Short , 35.0f , 100.0f },
+    { "co 8h" , Gas::CO , Window::Long  , 9.0f  , 35.0f  },
+    { "no2"   , Gas::NO2, Window::Sample, 1.0f  , 5.0f   },
+    { "no2 1m", Gas::NO2, Window::Short , 0.1f  , 1.0f   },
+    { "no2 8h", Gas::NO2, Window::Long  , 0.053f, 0.1f   },
+    { "voc"   , Gas::VOC, Window::Sample, 10.0f , 30.0f  },
+    { "voc 1m", Gas::VOC, Window::Short , 3.0f  , 10.0f  },
+    { "voc 8h", Gas::VOC, Window::Long  , 1.0f  , 3.0f   },
+};
+
+static constexpr size_t RuleCount = sizeof(Rules) / sizeof(Rules[0]);
+
+static RollingAverage<AirQuality::ShortWindowMillisecs, ShortBucketCount> ShortAverages[GasCount];
+static RollingAverage<AirQuality::LongWindowMillisecs, LongBucketCount> LongAverages[GasCount];
+static AirQuality::Level RuleLevels[RuleCount];
+static unsigned long StartTime;
+static bool Started = false;
+
+static int32_t ToFixed(float ppm)
+{
+    if (!isfinite(ppm) || ppm < 0.0f) return 0;
+    if (ppm > 32767.0f) return INT32_MAX;
+
+    return static_cast<int32_t>(ppm * 65536.0f + 0.5f);
+}
+
+static float ToFloat(int32_t q16)
+{
+    return static_cast<float>(q16) / 65536.0f;
+}
+
+static AirQuality::Level EvaluateRule(const Rule& rule, AirQuality::Level level, float value)
+{
+    if (value >= rule.Alarm) return AirQuality::Level::Alarm;
+    if (level == AirQuality::Level::Alarm && value >= rule.Alarm * HysteresisRatio) return AirQuality::Level::Alarm;
+    if (value >= rule.Warning) return AirQuality::Level::Warning;
+    if (level != AirQuality::Level::Normal && value >= rule.Warning * HysteresisRatio) return AirQuality::Level::Warning;
+
+    return AirQuality::Level::Normal;
+}
+
+void AirQuality::Reset()
+{
+    for (size_t i = 0; i < GasCount; ++i)
+    {
+        ShortAverages[i].Reset();
+        LongAverages[i].Reset();
+    }
+    for (size_t i = 0; i < RuleCount; ++i) RuleLevels[i] = Level::Normal;
+    CurrentLevel = Level::Normal;
+    Cause = "";
+    Started = false;
+}
+
+bool AirQuality::Update(unsigned long now, TelemetrySample* sample)
+{
+    if (!Started)
+    {
+        StartTime = now;
+        Started = true;
+    }
+
+    const float values[GasCount] = { sample->co, sample->no2, sample->voc };
+    float shortAverages[GasCount];
+    float longAverages[GasCount];
+    for (size_t i = 0; i < GasCount; ++i)
+    {
+        const int32_t value = ToFixed(values[i]);
+        ShortAverages[i].Add(now, value);
+        LongAverages[i].Add(now, value);
+        shortAverages[i] = ToFloat(ShortAverages[i].Get());
+        longAverages[i] = ToFloat(LongAverages[i].Get());
+    }
+
+    sample->coAverage1m = shortAverages[static_cast<size_t>(Gas::CO)];
+    sample->coAverage8h = longAverages[static_cast<size_t>(Gas::CO)];
+    sample->no2Average1m = shortAverages[static_cast<size_t>(Gas::NO2)];
+    sample->no2Average8h = longAverages[static_cast<size_t>(Gas::NO2)];
+    sample->vocAverage1m = shortAverages[static_cast<size_t>(Gas::VOC)];
+    sample->vocAverage8h = longAverages[static_cast<size_t>(Gas::VOC)];
+
+    Level level = Level::Normal;
+    const char* cause = "";
+    for (size_t i = 0; i < RuleCount; ++i)
+    {
+        const Rule& rule = Rules[i];
+        if (rule.Average == Window::Long && now - StartTime < LongWindowMinMillisecs) continue;
+
+        const size_t gas = static_cast<size_t>(rule.Source);
+        const float value = rule.Average == Window::Sample ? values[gas] : rule.Average == Window::Short ? shortAverages[gas] : longAverages[gas];
+        RuleLevels[i] = EvaluateRule(rule, RuleLevels[i], value);
+        if (RuleLevels[i] > level)
+        {
+            level = RuleLevels[i];
+            cause = rule.Name;
+        }
+    }
+
+    const bool changed = level != CurrentLevel;
+    CurrentLevel = level;
+    Cause = cause;
+
+    return changed;
+}
+
+const char* AirQuality::GetLevelName(Level level)
+{
+    switch (level)
+    {
+    case Level::Normal:
+        return "normal";
+    case Level::Warning:
+        return "warning";
+    case Level::Alarm:
+        return "alarm";
+    default:
+        return "";
+    }
+}
@@ -10,22 +10,33 @@ static constexpr size_t RegisterPublishTopicMaxSize = 128;
 static constexpr size_t QueryStatusPublishTopicMaxSize = 256;
 
 AzureDpsClient::AzureDpsClient() :
+    Endpoint{ AZ_SPAN_EMPTY },
+    IdScope{ AZ_SPAN_EMPTY },
+    RegistrationId{ AZ_SPAN_EMPTY },
     ResponseValid{ false }
 {
 }
 
-int AzureDpsClient::Init(const std::string& endpoint, const std::string& idScope, const std::string& registrationId)
+int AzureDpsClient::Init(az_span endpoint, az_span idScope, az_span registrationId)
 {
     ResponseValid = false;
+    OperationId.clear();
 
     Endpoint = endpoint;
     IdScope = idScope;
     RegistrationId = registrationId;
 
-    const az_span endpointSpan{ az_span_create((uint8_t*)&Endpoint[0], Endpoint.size()) };
-    const az_span idScopeSpan{ az_span_create((uint8_t*)&IdScope[0], IdScope.size()) };
-    const az_span registrationIdSpan{ az_span_create((uint8_t*)&RegistrationId[0], RegistrationId.size()) };
-    if (az_result_failed(az_iot_provisioning_client_init(&ProvClient, endpointSpan, idScopeSpan, registrationIdSpan, NULL))) return -1;
+    if (az_result_failed(az_iot_provisioning_client_init(&ProvClient, Endpoint, IdScope, RegistrationId, NULL))) return -1;
+
+    return 0;
+}
+
+int AzureDpsClient::Rebind(az_span idScope, az_span registrationId)
+{
+    IdScope = idScope;
+    RegistrationId = registrationId;
+
+    if (az_result_failed(az_iot_provisioning_client_init(&ProvClient, Endpoint, IdScope, RegistrationId, NULL))) return -1;
 
     return 0;
 }
@@ -88,6 +99,7 @@ int AzureDpsClient::RegisterSubscribeWork(const std::string& topic, const std::v
     if (az_result_failed(az_iot_provisioning_client_parse_received_topic_and_payload(&ProvClient, az_span_create((uint8_t*)&ResponseTopic[0], ResponseTopic.size()), az_span_create((uint8_t*)&ResponsePayload[0], ResponsePayload.size()), &Response))) return -1;
 
     ResponseValid = true;
+    if (az_span_size(Response.operation_id) > 0) OperationId.assign(reinterpret_cast<const char*>(az_span_ptr(Response.operation_id)), az_span_size(Response.operation_id));
 
     return 0;
 }
@@ -99,6 +111,13 @@ bool AzureDpsClient::IsRegisterOperationCompleted()
     return az_iot_provisioning_client_operation_complete(GetOperationStatus(Response));
 }
 
+az_iot_status AzureDpsClient::GetStatus() const
+{
+    if (!ResponseValid) return static_cast<az_iot_status>(0);
+
+    return Response.status;
+}
+
 int AzureDpsClient::GetWaitBeforeQueryStatusSeconds() const
 {
     if (!ResponseValid) return 0;
@@ -108,10 +127,11 @@ int AzureDpsClient::GetWaitBeforeQueryStatusSeconds() const
 
 std::string AzureDpsClient::GetQueryStatusPublishTopic()
 {
-    if (!ResponseValid) return std::string();
+    if (OperationId.empty()) return std::string();
 
     char queryStatusPublishTopic[QueryStatusPublishTopicMaxSize];
-    if (az_result_failed(az_iot_provisioning_client_query_status_get_publish_topic(&ProvClient, Response.operation_id, queryStatusPublishTopic, sizeof(queryStatusPublishTopic), NULL))) return std::string();
+    const az_span operationId = az_span_create(reinterpret_cast<uint8_t*>(&OperationId[0]), OperationId.size());
+    if (az_result_failed(az_iot_provisioning_client_query_status_get_publish_topic(&ProvClient, operationId, queryStatusPublishTopic, sizeof(queryStatusPublishTopic), NULL))) return std::string();
 
     return queryStatusPublishTopic;
 }
@@ -123,20 +143,18 @@ bool AzureDpsClient::IsAssigned()
     return GetOperationStatus(Response) == AZ_IOT_PROVISIONING_STATUS_ASSIGNED;
 }
 
-std::string AzureDpsClient::GetHubHost()
+az_span AzureDpsClient::GetHubHost()
 {
-    if (!IsAssigned()) return std::string();
+    if (!IsAssigned()) return AZ_SPAN_EMPTY;
 
-    const az_span& span{ Response.registration_state.assigned_hub_hostname };
-    return std::string(az_span_ptr(span), az_span_ptr(span) + az_span_size(span));
+    return Response.registration_state.assigned_hub_hostname;
 }
 
-std::string AzureDpsClient::GetDeviceId()
+az_span AzureDpsClient::GetDeviceId()
 {
-    if (!IsAssigned()) return std::string();
+    if (!IsAssigned()) return AZ_SPAN_EMPTY;
 
-    const az_span& span{ Response.registration_state.device_id };
-    return std::string(az_span_ptr(span), az_span_ptr(span) + az_span_size(span));
+    return Response.registration_state.device_id;
 }
 
 az_iot_provisioning_client_operation_status AzureDpsClient::GetOperationStatus(az_iot_provisioning_client_register_response& response)
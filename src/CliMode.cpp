@@ -2,6 +2,20 @@
 #include "CliMode.h"
 #include "Storage.h"
 #include "Signature.h"
+#include "NetworkStats.h"
+#include "SerialStream.h"
+#include "GasCalibration.h"
+#include "PowerManager.h"
+#include "TimeService.h"
+#include "WiFiManager.h"
+#include "DnsCache.h"
+#include "TrustStore.h"
+#include "Gateway.h"
+#include "FirmwareUpdate.h"
+#include "Watchdog.h"
+#include "Config.h"
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
 
 #define END_CHAR        ('\r')
 #define TAB_CHAR        ('\t')
@@ -15,6 +29,8 @@
 #define PROMPT          DLM "# "
 
 #define INBUF_SIZE      (1024)
+#define INPUT_BUDGET    (64)    // Max bytes consumed per CliDoWork() call
+#define PASTE_SIZE      (2048)  // Max PEM size, the Storage value limit
 
 struct console_command 
 {
@@ -29,11 +45,29 @@ static void reset_factory_settings_command(int argc, char** argv);
 static void display_settings_command(int argc, char** argv);
 static void wifissid_command(int argc, char** argv);
 static void wifipwd_command(int argc, char** argv);
+static void wifi_profile_command(int argc, char** argv);
+// The hub assignment belongs to the old DPS identity, the device registers again on the next start
+static void ForgetDpsAssignment()
+{
+    Storage::Set(Storage::KeyHubHost, "");
+    Storage::Set(Storage::KeyDeviceId, "");
+}
+
 static void az_idscope_command(int argc, char** argv);
 static void az_regid_command(int argc, char** argv);
 static void az_symkey_command(int argc, char** argv);
 static void az_iotc_command(int argc, char** argv);
 static void az_iotc_device_command(int argc, char** argv);
+static void az_x509_command(int argc, char** argv);
+static void display_memory_command(int argc, char** argv);
+static void display_stats_command(int argc, char** argv);
+static void stream_command(int argc, char** argv);
+static void display_gas_command(int argc, char** argv);
+static void gas_curve_command(int argc, char** argv);
+static void gas_comp_command(int argc, char** argv);
+static void reset_gas_baseline_command(int argc, char** argv);
+static void low_power_command(int argc, char** argv);
+static void gateway_command(int argc, char** argv);
 
 static const struct console_command cmds[] = 
 {
@@ -43,11 +77,22 @@ static const struct console_command cmds[] =
   {"show_settings"         , "Display settings"                                                     , display_settings_command       },
   {"set_wifissid"          , "Set Wi-Fi SSID"                                                       , wifissid_command               },
   {"set_wifipwd"           , "Set Wi-Fi password"                                                   , wifipwd_command                },
+  {"set_wifi_profile"      , "Set or clear an additional Wi-Fi network"                             , wifi_profile_command           },
   {"set_az_idscope"        , "Set id scope of Azure IoT DPS"                                        , az_idscope_command             },
   {"set_az_regid"          , "Set registration id of Azure IoT DPS"                                 , az_regid_command               },
   {"set_az_symkey"         , "Set symmetric key of Azure IoT DPS"                                   , az_symkey_command              },
   {"set_az_iotc"           , "Set group enrollment connection information of Azure IoT Central"     , az_iotc_command                },
-  {"set_az_iotc_dev"       , "Set individual enrollment connection information of Azure IoT Central", az_iotc_device_command         }
+  {"set_az_iotc_dev"       , "Set individual enrollment connection information of Azure IoT Central", az_iotc_device_command         },
+  {"set_az_x509"           , "Paste X.509 device certificate or private key, or clear both"         , az_x509_command                },
+  {"show_memory"           , "Display memory usage"                                                 , display_memory_command         },
+  {"show_stats"            , "Display network and timing statistics"                                , display_stats_command          },
+  {"stream"                , "Start or stop the binary sensor stream"                               , stream_command                 },
+  {"show_gas"              , "Display gas sensor calibration"                                       , display_gas_command            },
+  {"set_gas_curve"         , "Set gas sensor curve"                                                 , gas_curve_command              },
+  {"set_gas_comp"          , "Set gas sensor temperature and humidity compensation"                 , gas_comp_command               },
+  {"reset_gas_baseline"    , "Relearn clean air resistance of gas sensors"                          , reset_gas_baseline_command     },
+  {"set_low_power"         , "Set low-power mode for battery operation"                             , low_power_command              },
+  {"set_gateway"           , "Set gateway mode for downstream nodes on the header UART"             , gateway_command                }
 };
 
 static const int cmd_count = sizeof(cmds) / sizeof(cmds[0]);
@@ -127,11 +172,20 @@ static void reset_factory_settings_command(int argc, char** argv)
 
 static void display_settings_command(int argc, char** argv)
 {
-    Serial.print(String::format("Wi-Fi SSID = %s" DLM, Storage::WiFiSSID.c_str()));
-    Serial.print(String::format("Wi-Fi password = %s" DLM, Storage::WiFiPassword.c_str()));
-    Serial.print(String::format("Id scope of Azure IoT DPS = %s" DLM, Storage::IdScope.c_str()));
-    Serial.print(String::format("Registration id of Azure IoT DPS = %s" DLM, Storage::RegistrationId.c_str()));
-    Serial.print(String::format("Symmetric key of Azure IoT DPS = %s" DLM, Storage::SymmetricKey.c_str()));
+    Serial.print(String::format("Wi-Fi SSID = %s" DLM, reinterpret_cast<const char*>(az_span_ptr(Storage::WiFiSSID))));
+    Serial.print(String::format("Wi-Fi password = %s" DLM, reinterpret_cast<const char*>(az_span_ptr(Storage::WiFiPassword))));
+    for (size_t i = 0; i < WiFiManager::ProfileMax - 1; i++)
+    {
+        const uint8_t* value;
+        size_t valueSize;
+        if (!Storage::Get(WiFiManager::KeyProfiles[i], &value, &valueSize) || valueSize == 0) continue;
+        Serial.print(String::format("Wi-Fi profile %u = %s" DLM, i + 1, reinterpret_cast<const char*>(value)));
+    }
+    Serial.print(String::format("Id scope of Azure IoT DPS = %s" DLM, reinterpret_cast<const char*>(az_span_ptr(Storage::IdScope))));
+    Serial.print(String::format("Registration id of Azure IoT DPS = %s" DLM, reinterpret_cast<const char*>(az_span_ptr(Storage::RegistrationId))));
+    Serial.print(String::format("Symmetric key of Azure IoT DPS = %s" DLM, reinterpret_cast<const char*>(az_span_ptr(Storage::SymmetricKey))));
+    Serial.print(String::format("X.509 certificate = %d bytes" DLM, az_span_size(Storage::X509Certificate)));
+    Serial.print(String::format("X.509 private key = %d bytes" DLM, az_span_size(Storage::X509PrivateKey)));
 }
 
 static void wifissid_command(int argc, char** argv)
@@ -142,8 +196,7 @@ static void wifissid_command(int argc, char** argv)
         return;
     }
 
-    Storage::WiFiSSID = argv[1];
-    Storage::Save();
+    Storage::Set(Storage::KeyWiFiSSID, argv[1]);
 
     Serial.print("Set Wi-Fi SSID successfully." DLM);
 }
@@ -156,12 +209,45 @@ static void wifipwd_command(int argc, char** argv)
         return;
     }
 
-    Storage::WiFiPassword = argv[1];
-    Storage::Save();
+    Storage::Set(Storage::KeyWiFiPassword, argv[1]);
 
     Serial.print("Set Wi-Fi password successfully." DLM);
 }
 
+static void wifi_profile_command(int argc, char** argv)
+{
+    const int count = WiFiManager::ProfileMax - 1;
+    const int index = argc >= 2 ? atoi(argv[1]) : 0;
+    if (argc < 2 || argc > 4 || index < 1 || index > count)
+    {
+        Serial.print(String::format("ERROR: Usage: %s <1-%d> [SSID [Password]]. Lower numbers are preferred, omit the SSID to clear." DLM, argv[0], count));
+        return;
+    }
+
+    if (argc == 2)
+    {
+        Storage::Set(WiFiManager::KeyProfiles[index - 1], "", 0);
+        Serial.print(String::format("Cleared Wi-Fi profile %d." DLM, index));
+        return;
+    }
+
+    const char* password = argc == 4 ? argv[3] : "";
+    if (strlen(argv[2]) > WiFiManager::SsidMaxSize || strlen(password) > WiFiManager::PasswordMaxSize)
+    {
+        Serial.print("ERROR: SSID or password is too long." DLM);
+        return;
+    }
+
+    // ssid '\0' password
+    char value[WiFiManager::SsidMaxSize + 1 + WiFiManager::PasswordMaxSize];
+    const size_t ssidSize = strlen(argv[2]);
+    memcpy(value, argv[2], ssidSize + 1);
+    memcpy(&value[ssidSize + 1], password, strlen(password));
+    Storage::Set(WiFiManager::KeyProfiles[index - 1], value, ssidSize + 1 + strlen(password));
+
+    Serial.print(String::format("Set Wi-Fi profile %d successfully." DLM, index));
+}
+
 static void az_idscope_command(int argc, char** argv)
 {
     if (argc != 2) 
@@ -170,8 +256,8 @@ static void az_idscope_command(int argc, char** argv)
         return;
     }
 
-    Storage::IdScope = argv[1];
-    Storage::Save();
+    Storage::Set(Storage::KeyIdScope, argv[1]);
+    ForgetDpsAssignment();
 
     Serial.print("Set id scope successfully." DLM);
 }
@@ -184,8 +270,8 @@ static void az_regid_command(int argc, char** argv)
         return;
     }
 
-    Storage::RegistrationId = argv[1];
-    Storage::Save();
+    Storage::Set(Storage::KeyRegistrationId, argv[1]);
+    ForgetDpsAssignment();
 
     Serial.print("Set registration id successfully." DLM);
 }
@@ -198,8 +284,7 @@ static void az_symkey_command(int argc, char** argv)
         return;
     }
 
-    Storage::SymmetricKey = argv[1];
-    Storage::Save();
+    Storage::Set(Storage::KeySymmetricKey, argv[1]);
 
     Serial.print("Set symmetric key successfully." DLM);
 }
@@ -212,10 +297,10 @@ static void az_iotc_command(int argc, char** argv)
         return;
     }
 
-    Storage::IdScope = argv[1];
-    Storage::RegistrationId = argv[3];
-    Storage::SymmetricKey = ComputeDerivedSymmetricKey(argv[2], argv[3]);
-    Storage::Save();
+    Storage::Set(Storage::KeyIdScope, argv[1]);
+    Storage::Set(Storage::KeyRegistrationId, argv[3]);
+    Storage::Set(Storage::KeySymmetricKey, ComputeDerivedSymmetricKey(argv[2], argv[3]).c_str());
+    ForgetDpsAssignment();
 
     Serial.print("Set group enrollment connection information of Azure IoT Central successfully." DLM);
 }
@@ -228,26 +313,281 @@ static void az_iotc_device_command(int argc, char** argv)
         return;
     }
 
-    Storage::IdScope = argv[1];
-    Storage::RegistrationId = argv[2];
-    Storage::SymmetricKey = argv[3];
-    Storage::Save();
+    Storage::Set(Storage::KeyIdScope, argv[1]);
+    Storage::Set(Storage::KeyRegistrationId, argv[2]);
+    Storage::Set(Storage::KeySymmetricKey, argv[3]);
+    ForgetDpsAssignment();
 
     Serial.print("Set individual enrollment connection information of Azure IoT Central successfully." DLM);
 }
 
-static bool CliGetInput(char* inbuf, int* bp)
+// Paste mode collects PEM lines until the END line, then validates and stores them
+static const char* PasteKey = NULL;
+static char PasteBuffer[PASTE_SIZE];
+static size_t PasteSize = 0;
+
+static void az_x509_command(int argc, char** argv)
+{
+    if (argc != 2 || (strcmp(argv[1], "cert") != 0 && strcmp(argv[1], "key") != 0 && strcmp(argv[1], "clear") != 0))
+    {
+        Serial.print(String::format("ERROR: Usage: %s <cert|key|clear>. Paste the PEM after the command." DLM, argv[0]));
+        return;
+    }
+
+    if (strcmp(argv[1], "clear") == 0)
+    {
+        if (!Storage::Set(Storage::KeyX509Certificate, "") || !Storage::Set(Storage::KeyX509PrivateKey, ""))
+        {
+            Serial.print("ERROR: Failed to clear the X.509 certificate and private key." DLM);
+            return;
+        }
+        Serial.print("Cleared X.509 certificate and private key. The symmetric key is used." DLM);
+        return;
+    }
+
+    PasteKey = strcmp(argv[1], "cert") == 0 ? Storage::KeyX509Certificate : Storage::KeyX509PrivateKey;
+    PasteSize = 0;
+    Serial.print("Paste the PEM, ending with its -----END line." DLM);
+}
+
+static bool ValidatePem(const char* key, const char* pem, size_t pemSize)
+{
+    if (key == Storage::KeyX509Certificate)
+    {
+        mbedtls_x509_crt crt;
+        mbedtls_x509_crt_init(&crt);
+        const int result = mbedtls_x509_crt_parse(&crt, reinterpret_cast<const unsigned char*>(pem), pemSize);
+        mbedtls_x509_crt_free(&crt);
+        return result == 0;
+    }
+
+    mbedtls_pk_context pk;
+    mbedtls_pk_init(&pk);
+    const int result = mbedtls_pk_parse_key(&pk, reinterpret_cast<const unsigned char*>(pem), pemSize, NULL, 0);
+    mbedtls_pk_free(&pk);
+    return result == 0;
+}
+
+static void PasteLine(const char* line)
+{
+    const size_t lineSize = strlen(line);
+    if (lineSize == 0) return;
+    if (PasteSize + lineSize + 2 > sizeof(PasteBuffer))
+    {
+        Serial.print(DLM "ERROR: PEM is too large." DLM);
+        PasteKey = NULL;
+        return;
+    }
+
+    memcpy(&PasteBuffer[PasteSize], line, lineSize);
+    PasteSize += lineSize;
+    PasteBuffer[PasteSize++] = '\n';
+    Serial.print(DLM);
+    if (strncmp(line, "-----END ", 9) != 0) return;
+
+    // mbedtls wants the terminator counted for PEM
+    PasteBuffer[PasteSize] = '\0';
+    if (!ValidatePem(PasteKey, PasteBuffer, PasteSize + 1))
+    {
+        Serial.print("ERROR: Invalid PEM." DLM);
+    }
+    else if (!Storage::Set(PasteKey, PasteBuffer, PasteSize))
+    {
+        Serial.print("ERROR: Failed to save the PEM, the storage is full." DLM);
+    }
+    else
+    {
+        Serial.print(String::format("Set %s successfully." DLM, PasteKey == Storage::KeyX509Certificate ? "X.509 certificate" : "X.509 private key"));
+    }
+    PasteKey = NULL;
+}
+
+extern "C" char* sbrk(int incr);
+
+static void display_memory_command(int argc, char** argv)
+{
+    char stackTop;
+    const char* heapEnd = sbrk(0);
+
+    Serial.print(String::format("Free RAM = %d bytes" DLM, &stackTop - heapEnd));
+    Serial.print(String::format("Storage used = %u bytes" DLM, Storage::GetUsedBytes()));
+    Serial.print(String::format("Storage free = %u bytes" DLM, Storage::GetFreeBytes()));
+}
+
+static void display_stats_command(int argc, char** argv)
+{
+    Serial.print(String::format("Uptime = %lu s" DLM, millis() / 1000));
+    PowerManager::Print();
+    Watchdog::Print();
+    TimeService::Print();
+    WiFiManager::Print();
+    DnsCache::Print();
+    TrustStore::Print();
+    NetworkStats::Print();
+    if (Gateway::IsEnabled()) Gateway::Print();
+    FirmwareUpdate::Print();
+}
+
+static void stream_command(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3 || (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0))
+    {
+        Serial.print(String::format("ERROR: Usage: %s <on|off> [Interval ms]." DLM, argv[0]));
+        return;
+    }
+
+    if (strcmp(argv[1], "off") == 0)
+    {
+        SerialStream::Enable(false, 0);
+        Serial.print(String::format("Stopped the sensor stream after %lu frames (%lu dropped)." DLM, SerialStream::GetSequence(), SerialStream::GetDroppedFrames()));
+        return;
+    }
+
+    const long interval = argc == 3 ? atol(argv[2]) : SERIAL_STREAM_INTERVAL_MILLISECS;
+    if (interval < SERIAL_STREAM_INTERVAL_MIN_MILLISECS)
+    {
+        Serial.print(String::format("ERROR: Interval must be at least %d ms." DLM, SERIAL_STREAM_INTERVAL_MIN_MILLISECS));
+        return;
+    }
+
+    Serial.print(String::format("Started the sensor stream every %ld ms. Type \"%s off\" to stop." DLM, interval, argv[0]));
+    SerialStream::Enable(true, interval);
+}
+
+static bool ParseGasSensor(const char* name, GasSensor* sensor)
+{
+    for (int i = 0; i < static_cast<int>(GasSensor::Count); i++)
+    {
+        if (strcmp(name, GasCalibration::GetName(static_cast<GasSensor>(i))) == 0)
+        {
+            *sensor = static_cast<GasSensor>(i);
+            return true;
+        }
+    }
+
+    Serial.print(String::format("ERROR: Unknown gas sensor: %s. Use no2, c2h5ch, voc or co." DLM, name));
+    return false;
+}
+
+static void display_gas_command(int argc, char** argv)
+{
+    for (int i = 0; i < static_cast<int>(GasSensor::Count); i++)
+    {
+        const GasSensor sensor = static_cast<GasSensor>(i);
+        const GasCurve& curve = GasCalibration::GetCurve(sensor);
+
+        Serial.print(String::format("%s: count = %u, Rs/R0 = %.3f, R0/RL = %.3f" DLM, GasCalibration::GetName(sensor), GasCalibration::GetLastCount(sensor), GasCalibration::ToFloat(GasCalibration::GetLastRatio(sensor)), GasCalibration::ToFloat(GasCalibration::GetBaseline(sensor))));
+        Serial.print(String::format(" compensation = %g /degC, %g /%%RH" DLM " curve =", curve.TemperatureCoeff, curve.HumidityCoeff));
+        for (int j = 0; j < curve.PointCount; j++)
+        {
+            Serial.print(String::format(" %g:%g", curve.Points[j].Ratio, curve.Points[j].Ppm));
+        }
+        Serial.print(DLM);
+    }
+}
+
+static void gas_curve_command(int argc, char** argv)
+{
+    if (argc != 3) 
+    {
+        Serial.print(String::format("ERROR: Usage: %s <no2|c2h5ch|voc|co> <Rs/R0>:<ppm>,... Points in ascending Rs/R0." DLM, argv[0]));
+        return;
+    }
+
+    GasSensor sensor;
+    if (!ParseGasSensor(argv[1], &sensor)) return;
+
+    GasCurve curve = GasCalibration::GetCurve(sensor);
+    curve.PointCount = 0;
+    for (char* point = strtok(argv[2], ","); point != NULL; point = strtok(NULL, ","))
+    {
+        if (curve.PointCount >= GasCurve::PointMaxCount || sscanf(point, "%f:%f", &curve.Points[curve.PointCount].Ratio, &curve.Points[curve.PointCount].Ppm) != 2)
+        {
+            Serial.print(String::format("ERROR: Invalid curve. Up to %u points." DLM, GasCurve::PointMaxCount));
+            return;
+        }
+        curve.PointCount++;
+    }
+    if (!GasCalibration::SetCurve(sensor, curve))
+    {
+        Serial.print("ERROR: Invalid curve." DLM);
+        return;
+    }
+
+    Serial.print("Set gas sensor curve successfully." DLM);
+}
+
+static void gas_comp_command(int argc, char** argv)
+{
+    if (argc != 4) 
+    {
+        Serial.print(String::format("ERROR: Usage: %s <no2|c2h5ch|voc|co> <Per degC> <Per %%RH>." DLM, argv[0]));
+        return;
+    }
+
+    GasSensor sensor;
+    if (!ParseGasSensor(argv[1], &sensor)) return;
+
+    GasCurve curve = GasCalibration::GetCurve(sensor);
+    curve.TemperatureCoeff = atof(argv[2]);
+    curve.HumidityCoeff = atof(argv[3]);
+    if (!GasCalibration::SetCurve(sensor, curve))
+    {
+        Serial.print("ERROR: Invalid compensation." DLM);
+        return;
+    }
+
+    Serial.print("Set gas sensor compensation successfully." DLM);
+}
+
+static void reset_gas_baseline_command(int argc, char** argv)
+{
+    GasCalibration::ResetBaselines();
+
+    Serial.print("Reset gas sensor baselines. Keep the device in clean air." DLM);
+}
+
+static void low_power_command(int argc, char** argv)
+{
+    if (argc != 2 || (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0))
+    {
+        Serial.print(String::format("ERROR: Usage: %s <on|off>." DLM, argv[0]));
+        return;
+    }
+
+    PowerManager::SetLowPower(strcmp(argv[1], "on") == 0);
+    Serial.print(String::format("Low-power mode is %s." DLM, PowerManager::IsLowPower() ? "on" : "off"));
+}
+
+static void gateway_command(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3 || (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0))
+    {
+        Serial.print(String::format("ERROR: Usage: %s <on|off> [Group enrollment key]." DLM, argv[0]));
+        return;
+    }
+    if (argc == 3 && !Gateway::SetGroupKey(argv[2]))
+    {
+        Serial.print("ERROR: Invalid group enrollment key." DLM);
+        return;
+    }
+
+    Gateway::SetEnabled(strcmp(argv[1], "on") == 0);
+    Serial.print(String::format("Gateway mode is %s after a restart." DLM, Gateway::IsEnabled() ? "on" : "off"));
+}
+
+static bool CliGetInput(char* inbuf, int* bp, int budget)
 {
     if (inbuf == NULL) 
     {
         return false;
     }
     
-    while (Serial.available() >= 1) 
+    while (budget-- > 0 && Serial.available() >= 1) 
     {
         inbuf[*bp] = (char)Serial.read();
         
-        if (inbuf[*bp] == END_CHAR) 
+        if (inbuf[*bp] == END_CHAR || (PasteKey != NULL && inbuf[*bp] == '\n')) 
         {
             /* end of input line */
             inbuf[*bp] = '\0';
@@ -389,22 +729,42 @@ static bool CliHandleInput(char* inbuf)
     return true;
 }
 
-void CliMode()
+static char CliInbuf[INBUF_SIZE];
+static int CliBp = 0;
+
+void CliInit()
 {
+    CliBp = 0;
+
     print_help();
     Serial.print(PROMPT);
+}
 
-    char inbuf[INBUF_SIZE];
-    int bp = 0;
-    while (true) 
+void CliDoWork()
+{
+    if (!CliGetInput(CliInbuf, &CliBp, INPUT_BUDGET)) return;
+
+    if (PasteKey != NULL)
     {
-        if (!CliGetInput(inbuf, &bp)) continue;
+        PasteLine(CliInbuf);
+        if (PasteKey == NULL) Serial.print(PROMPT);
+        return;
+    }
 
-        if (!CliHandleInput(inbuf))
-        {
-            Serial.print("ERROR: Syntax error." DLM);
-        }
+    if (!CliHandleInput(CliInbuf))
+    {
+        Serial.print("ERROR: Syntax error." DLM);
+    }
+
+    if (PasteKey == NULL) Serial.print(PROMPT);
+}
 
-        Serial.print(PROMPT);
+void CliMode()
+{
+    CliInit();
+
+    while (true) 
+    {
+        CliDoWork();
     }
 }
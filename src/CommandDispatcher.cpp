@@ -0,0 +1,46 @@
+#include "CommandDispatcher.h"
+#include <string.h>
+
+CommandDispatcher::CommandDispatcher(const CommandHandler (&handlers)[static_cast<size_t>(CommandId::Count)]) :
+    Handlers{ handlers },
+    JobHead{ 0 },
+    JobCount{ 0 },
+    JobStarted{ false }
+{
+}
+
+uint16_t CommandDispatcher::Dispatch(az_span name, az_span payload)
+{
+    const CommandId id = LookupCommand(name);
+    if (id == CommandId::Count) return StatusNotFound;
+    const CommandHandler* handler = &Handlers[static_cast<size_t>(id)];
+    if (handler->Parse == nullptr) return StatusNotFound;
+
+    uint8_t args[CommandHandler::ArgsSize] = { 0 };
+    const uint16_t status = handler->Parse(payload, args);
+    if (status < 200 || status >= 300) return status;
+    if (handler->Run == nullptr) return status;
+
+    if (JobCount >= JobQueueSize) return StatusBusy;
+
+    Job& job = Jobs[(JobHead + JobCount) % JobQueueSize];
+    job.Handler = handler;
+    memcpy(job.Args, args, sizeof(job.Args));
+    ++JobCount;
+
+    return status;
+}
+
+void CommandDispatcher::DoWork(unsigned long now)
+{
+    if (JobCount == 0) return;
+
+    Job& job = Jobs[JobHead];
+    const bool start = !JobStarted;
+    JobStarted = true;
+    if (!job.Handler->Run(job.Args, start, now)) return;
+
+    JobStarted = false;
+    JobHead = (JobHead + 1) % JobQueueSize;
+    --JobCount;
+}
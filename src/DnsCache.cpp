@@ -0,0 +1,141 @@
+#include <Arduino.h>
+#include <rpcWiFi.h>
+#include "DnsCache.h"
+#include "Storage.h"
+#include "Crc.h"
+#include "NetworkStats.h"
+#include "TimeService.h"
+#include "Watchdog.h"
+
+#define DLM "\r\n"
+
+constexpr const char* DnsCache::KeyPersistent;
+
+DnsCache::Entry DnsCache::Entries[EntryMax];
+unsigned long DnsCache::TtlMillisecs = 0;
+uint32_t DnsCache::PersistentHostHash = 0;
+bool DnsCache::PersistentPending = false;
+
+uint32_t DnsCache::Hits = 0;
+uint32_t DnsCache::Misses = 0;
+
+static uint32_t HostHash(const char* host)
+{
+    // 0 marks an empty entry
+    const uint32_t hash = Crc32(host, strlen(host));
+    return hash != 0 ? hash : 1;
+}
+
+void DnsCache::Begin(unsigned long ttlMillisecs)
+{
+    TtlMillisecs = ttlMillisecs;
+    memset(Entries, 0, sizeof(Entries));
+    PersistentHostHash = 0;
+    PersistentPending = false;
+}
+
+void DnsCache::SetPersistent(const char* host)
+{
+    // Saved entries are loaded once per host, an invalidated one stays invalid
+    const uint32_t hash = HostHash(host);
+    if (hash == PersistentHostHash) return;
+    PersistentHostHash = hash;
+    PersistentPending = false;
+    if (Find(PersistentHostHash) != nullptr) return;
+
+    // Load the entry saved before the reboot, with whatever TTL it has left
+    const uint8_t* value;
+    size_t valueSize;
+    if (!Storage::Get(KeyPersistent, &value, &valueSize) || valueSize != sizeof(PersistentEntry)) return;
+    PersistentEntry saved;
+    memcpy(&saved, value, sizeof(saved));
+
+    const uint64_t now = TimeService::GetEpoch();
+    if (saved.HostHash != PersistentHostHash || saved.Ip == 0 || !TimeService::IsSynchronized() || now >= saved.ExpiryEpoch) return;
+
+    const uint64_t remainingMillisecs = (saved.ExpiryEpoch - now) * 1000;
+    if (remainingMillisecs >= TtlMillisecs) return;
+    Store(saved.HostHash, saved.Ip, millis() - (TtlMillisecs - static_cast<unsigned long>(remainingMillisecs)));
+}
+
+bool DnsCache::Resolve(const char* host, IPAddress* ip, bool* fromCache)
+{
+    const unsigned long now = millis();
+    const uint32_t hash = HostHash(host);
+
+    const Entry* entry = Find(hash);
+    if (entry != nullptr && now - entry->ResolvedTime < TtlMillisecs)
+    {
+        ++Hits;
+        *ip = IPAddress(entry->Ip);
+        *fromCache = true;
+        return true;
+    }
+
+    ++Misses;
+    *fromCache = false;
+    Watchdog::Feed();
+    if (WiFi.hostByName(host, *ip) != 1 || static_cast<uint32_t>(*ip) == 0) return false;
+    NetworkStats::DnsResolve.Add(millis() - now);
+
+    Store(hash, static_cast<uint32_t>(*ip), now);
+    if (hash == PersistentHostHash) PersistentPending = true;
+
+    return true;
+}
+
+void DnsCache::SavePersistent()
+{
+    if (!PersistentPending || !TimeService::IsSynchronized()) return;
+    PersistentPending = false;
+
+    const Entry* entry = Find(PersistentHostHash);
+    if (entry == nullptr) return;
+    const unsigned long ageMillisecs = millis() - entry->ResolvedTime;
+    if (ageMillisecs >= TtlMillisecs) return;
+
+    const PersistentEntry saved = { entry->HostHash, entry->Ip, TimeService::GetEpoch() + (TtlMillisecs - ageMillisecs) / 1000 };
+    Storage::Set(KeyPersistent, &saved, sizeof(saved));
+}
+
+void DnsCache::Invalidate(const char* host)
+{
+    const uint32_t hash = HostHash(host);
+    Entry* entry = Find(hash);
+    if (entry != nullptr) entry->HostHash = 0;
+    if (hash == PersistentHostHash) PersistentPending = false;
+}
+
+void DnsCache::Print()
+{
+    Serial.print(String::format("DNS cache: hits = %lu, misses = %lu" DLM, Hits, Misses));
+}
+
+DnsCache::Entry* DnsCache::Find(uint32_t hostHash)
+{
+    for (Entry& entry : Entries)
+    {
+        if (entry.HostHash == hostHash) return &entry;
+    }
+
+    return nullptr;
+}
+
+void DnsCache::Store(uint32_t hostHash, uint32_t ip, unsigned long resolvedTime)
+{
+    // Replace the same host, an empty entry, or else the oldest
+    Entry* slot = Find(hostHash);
+    if (slot == nullptr) slot = Find(0);
+    if (slot == nullptr)
+    {
+        slot = &Entries[0];
+        for (Entry& entry : Entries)
+        {
+            if (millis() - entry.ResolvedTime > millis() - slot->ResolvedTime) slot = &entry;
+        }
+    }
+
+    slot->HostHash = hostHash;
+    slot->Ip = ip;
+    slot->ResolvedTime = resolvedTime;
+}
@@ -0,0 +1,251 @@
+#include <Arduino.h>
+#include <az_iot_common.h>
+#include "DpsRegistration.h"
+#include "Log.h"
+
+#define DLM "\r\n"
+
+// Devices powered on together must not retry in step, so the jitter is seeded from the TRNG.
+static uint32_t ReadTrng()
+{
+    MCLK->APBCMASK.bit.TRNG_ = 1;
+    TRNG->CTRLA.bit.ENABLE = 1;
+    while (!TRNG->INTFLAG.bit.DATARDY) {}
+    const uint32_t value = TRNG->DATA.reg;
+    TRNG->CTRLA.bit.ENABLE = 0;
+
+    return value;
+}
+
+// Compared in seconds, a large retry-after would overflow in milliseconds
+static unsigned long RetryAfterMillisecs(uint32_t retryAfterSeconds, int32_t retryMaxMillisecs)
+{
+    return retryAfterSeconds < static_cast<uint32_t>(retryMaxMillisecs) / 1000 ? retryAfterSeconds * 1000UL : static_cast<unsigned long>(retryMaxMillisecs);
+}
+
+DpsRegistration::DpsRegistration(PubSubClient& client, AzureDpsClient& dps, bool (*connect)()) :
+    Client{ client },
+    Dps{ dps },
+    Connect{ connect },
+    RetryMinMillisecs{ 1000 },
+    RetryMaxMillisecs{ 60000 },
+    CurrentState{ State::Idle },
+    RegisterPayload{ "" },
+    StartTime{ 0 },
+    TimeoutMillisecs{ 0 },
+    NextActionTime{ 0 },
+    RequestTime{ 0 },
+    BackOffAttempts{ 0 },
+    LastError{ "" },
+    Connections{ 0 },
+    Requests{ 0 },
+    Throttled{ 0 }
+{
+}
+
+void DpsRegistration::SetBackOff(int32_t retryMinMillisecs, int32_t retryMaxMillisecs)
+{
+    RetryMinMillisecs = retryMinMillisecs;
+    RetryMaxMillisecs = retryMaxMillisecs;
+}
+
+void DpsRegistration::Start(unsigned long now, unsigned long timeoutMillisecs, const char* registerPayload)
+{
+    static bool seeded = false;
+    if (!seeded)
+    {
+        randomSeed(ReadTrng());
+        seeded = true;
+    }
+
+    RegisterPayload = registerPayload;
+    StartTime = now;
+    TimeoutMillisecs = timeoutMillisecs;
+    NextActionTime = now;
+    BackOffAttempts = 0;
+    LastError = "";
+    CurrentState = State::Connecting;
+}
+
+void DpsRegistration::Cancel()
+{
+    if (IsBusy() && Client.connected()) Client.disconnect();
+    CurrentState = State::Idle;
+}
+
+void DpsRegistration::DoWork(unsigned long now)
+{
+    if (!IsBusy()) return;
+
+    if (now - StartTime >= TimeoutMillisecs)
+    {
+        if (Client.connected()) Client.disconnect();
+        Fail("timeout");
+        return;
+    }
+
+    switch (CurrentState)
+    {
+    case State::Connecting:
+        if (static_cast<long>(now - NextActionTime) < 0) return;
+
+        if (!Connect())
+        {
+            BackOff(now, 0, "connect failed");
+            return;
+        }
+        ++Connections;
+        Log("DPS connected%s" DLM, Dps.HasOperationId() ? ", resuming the operation" : "");
+
+        Client.subscribe(Dps.GetRegisterSubscribeTopic().c_str());
+        Publish(now);
+        break;
+
+    case State::WaitingForResponse:
+    case State::WaitingToQuery:
+        if (!Client.loop())
+        {
+            // Reconnect and query again, the operation id survives the connection
+            if (CurrentState == State::WaitingForResponse)
+            {
+                BackOff(now, 0, "connection lost");
+                return;
+            }
+            LastError = "connection lost";
+            CurrentState = State::Connecting;
+            return;
+        }
+
+        // OnMessage() ran from loop(), disconnect here rather than from the callback
+        if (!IsBusy())
+        {
+            Client.disconnect();
+            return;
+        }
+
+        if (CurrentState == State::WaitingForResponse && now - RequestTime >= ResponseTimeoutMillisecs)
+        {
+            Client.disconnect();
+            BackOff(now, 0, "no response");
+            return;
+        }
+        if (CurrentState == State::WaitingToQuery && static_cast<long>(now - NextActionTime) >= 0) Publish(now);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void DpsRegistration::OnMessage(const char* topic, const uint8_t* payload, size_t payloadSize, unsigned long now)
+{
+    if (CurrentState != State::WaitingForResponse && CurrentState != State::WaitingToQuery) return;
+
+    if (Dps.RegisterSubscribeWork(topic, std::vector<uint8_t>(payload, payload + payloadSize)) != 0)
+    {
+        Log("DPS response could not be parsed" DLM);
+        return;
+    }
+
+    const az_iot_status status = Dps.GetStatus();
+    const uint32_t retryAfterSeconds = Dps.GetWaitBeforeQueryStatusSeconds();
+    if (az_iot_status_retriable(status))
+    {
+        if (status == AZ_IOT_STATUS_THROTTLED) ++Throttled;
+        BackOff(now, retryAfterSeconds, status == AZ_IOT_STATUS_THROTTLED ? "throttled" : "server error");
+        return;
+    }
+    if (status >= AZ_IOT_STATUS_BAD_REQUEST)
+    {
+        Fail("rejected");
+        return;
+    }
+
+    if (Dps.IsRegisterOperationCompleted())
+    {
+        if (!Dps.IsAssigned())
+        {
+            Fail("not assigned");
+            return;
+        }
+
+        CurrentState = State::Assigned;
+        return;
+    }
+
+    // Assigning, query the status when DPS asks to, but not later than the longest back-off
+    BackOffAttempts = 0;
+    const unsigned long waitMillisecs = retryAfterSeconds > 0 ? RetryAfterMillisecs(retryAfterSeconds, RetryMaxMillisecs) : RetryMinMillisecs;
+    Log("DPS assigning, querying after %lu ms" DLM, waitMillisecs);
+    NextActionTime = now + waitMillisecs;
+    CurrentState = State::WaitingToQuery;
+}
+
+void DpsRegistration::Print()
+{
+    Log("DPS registration:" DLM);
+    Log(" State = %s" DLM, GetStateName(CurrentState));
+    Log(" Operation id = %s" DLM, Dps.GetOperationId().c_str());
+    Log(" Connections = %lu, requests = %lu, throttled = %lu" DLM, Connections, Requests, Throttled);
+    Log(" Last error = %s" DLM, LastError);
+}
+
+void DpsRegistration::Publish(unsigned long now)
+{
+    // Resume the operation rather than registering again, which would restart it on DPS
+    const bool query = Dps.HasOperationId();
+    const bool published = query ? Client.publish(Dps.GetQueryStatusPublishTopic().c_str(), "") : Client.publish(Dps.GetRegisterPublishTopic().c_str(), RegisterPayload);
+    if (!published)
+    {
+        Client.disconnect();
+        BackOff(now, 0, "publish failed");
+        return;
+    }
+    ++Requests;
+
+    RequestTime = now;
+    CurrentState = State::WaitingForResponse;
+}
+
+void DpsRegistration::BackOff(unsigned long now, uint32_t retryAfterSeconds, const char* reason)
+{
+    if (BackOffAttempts < BackOffAttemptsMax) ++BackOffAttempts;
+    int32_t delayMillisecs = az_iot_calculate_retry_delay(0, BackOffAttempts, RetryMinMillisecs, RetryMaxMillisecs, random(RetryMinMillisecs));
+
+    // DPS knows best when it can take the request again, up to the longest back-off
+    const int32_t retryAfterMillisecs = static_cast<int32_t>(RetryAfterMillisecs(retryAfterSeconds, RetryMaxMillisecs));
+    if (retryAfterMillisecs > delayMillisecs) delayMillisecs = retryAfterMillisecs + random(RetryMinMillisecs);
+
+    Log("DPS %s, retrying in %ld ms" DLM, reason, static_cast<long>(delayMillisecs));
+    LastError = reason;
+    NextActionTime = now + delayMillisecs;
+    CurrentState = Client.connected() ? State::WaitingToQuery : State::Connecting;
+}
+
+void DpsRegistration::Fail(const char* reason)
+{
+    Log("DPS registration failed: %s" DLM, reason);
+    LastError = reason;
+    CurrentState = State::Failed;
+}
+
+const char* DpsRegistration::GetStateName(State state)
+{
+    switch (state)
+    {
+    case State::Idle:
+        return "Idle";
+    case State::Connecting:
+        return "Connecting";
+    case State::WaitingForResponse:
+        return "Waiting for response";
+    case State::WaitingToQuery:
+        return "Waiting to query";
+    case State::Assigned:
+        return "Assigned";
+    case State::Failed:
+        return "Failed";
+    default:
+        return "";
+    }
+}
@@ -0,0 +1,55 @@
+#include <Arduino.h>
+#include "ExternalFlash.h"
+#include <ExtFlashLoader.h>
+
+static ExtFlashLoader::QSPIFlash Flash;
+
+int ExternalFlash::Init = [] {
+    Flash.initialize();
+    Flash.reset();
+    Flash.enterToMemoryMode();
+
+    return 0;
+}();
+
+static void InvalidateCache()
+{
+    // Memory-mapped QSPI reads go through the cache controller
+    if (CMCC->SR.bit.CSTS)
+    {
+        CMCC->CTRL.bit.CEN = 0;
+        while (CMCC->SR.bit.CSTS) {}
+        CMCC->MAINT0.bit.INVALL = 1;
+        CMCC->CTRL.bit.CEN = 1;
+    }
+}
+
+void ExternalFlash::EraseSector(uint32_t address)
+{
+    Flash.exitFromMemoryMode();
+    Flash.writeEnable();
+    Flash.eraseSector(address);
+    Flash.waitProgram(0);
+    Flash.enterToMemoryMode();
+    InvalidateCache();
+}
+
+void ExternalFlash::Program(uint32_t address, const uint8_t* data, size_t size)
+{
+    Flash.exitFromMemoryMode();
+    while (size > 0)
+    {
+        // A page program must not cross a page boundary
+        const size_t pageRemaining = PageSize - address % PageSize;
+        const size_t writeSize = size < pageRemaining ? size : pageRemaining;
+        Flash.writeEnable();
+        Flash.writeMemory(address, data, writeSize);
+        Flash.waitProgram(0);
+
+        address += writeSize;
+        data += writeSize;
+        size -= writeSize;
+    }
+    Flash.enterToMemoryMode();
+    InvalidateCache();
+}
@@ -0,0 +1,516 @@
+#include <Arduino.h>
+#include <rpcWiFi.h>
+#include <rpcWiFiClientSecure.h>
+#include <mbedtls/md.h>
+#include "FirmwareUpdate.h"
+#include "ExternalFlash.h"
+#include "Storage.h"
+#include "TrustStore.h"
+
+#define DLM "\r\n"
+
+constexpr const char* FirmwareUpdate::KeyState;
+
+FirmwareUpdate::State FirmwareUpdate::DownloadState = FirmwareUpdate::State::Idle;
+char FirmwareUpdate::Host[HostMaxSize + 1];
+char FirmwareUpdate::Path[PathMaxSize + 1];
+uint16_t FirmwareUpdate::Port = 0;
+bool FirmwareUpdate::Secure = false;
+uint32_t FirmwareUpdate::ImageSize = 0;
+uint8_t FirmwareUpdate::ImageSha256[Sha256Size];
+
+uint32_t FirmwareUpdate::Offset = 0;
+int FirmwareUpdate::Attempts = 0;
+unsigned long FirmwareUpdate::NextAttemptTime = 0;
+unsigned long FirmwareUpdate::LastReceiveTime = 0;
+char FirmwareUpdate::Line[128];
+size_t FirmwareUpdate::LineSize = 0;
+int FirmwareUpdate::HttpStatus = 0;
+long FirmwareUpdate::RangeStart = -1;
+long FirmwareUpdate::ContentLength = -1;
+const char* FirmwareUpdate::LastError = nullptr;
+
+static WiFiClient PlainClient;
+static WiFiClientSecure SecureClient;
+static Client* Connection = nullptr;
+static mbedtls_md_context_t Sha256;
+
+static constexpr uint32_t InternalFlashBlockSize = 8192;   // Erase unit
+static constexpr uint32_t InternalFlashPageSize = 512;     // Write unit
+
+enum class BootStage : uint8_t
+{
+    None,
+    Staged,         // Verified image waiting in the staging slot
+    Trial,          // Installed, not confirmed yet
+};
+
+enum class BootResult : uint8_t
+{
+    None,
+    Installed,
+    RolledBack,
+};
+
+// Saved under KeyState
+struct BootRecord
+{
+    BootStage Stage;
+    BootResult Result;
+    uint8_t BootAttempts;
+    uint8_t Reserved;
+    uint32_t ImageSize;
+    uint8_t ImageSha256[FirmwareUpdate::Sha256Size];
+    uint32_t BackupSize;
+    uint8_t BackupSha256[FirmwareUpdate::Sha256Size];
+};
+
+static bool LoadRecord(BootRecord* record)
+{
+    const uint8_t* value;
+    size_t valueSize;
+    if (!Storage::Get(FirmwareUpdate::KeyState, &value, &valueSize) || valueSize != sizeof(BootRecord)) return false;
+
+    memcpy(record, value, sizeof(BootRecord));
+    return true;
+}
+
+static void SaveRecord(const BootRecord& record)
+{
+    Storage::Set(FirmwareUpdate::KeyState, &record, sizeof(record));
+}
+
+static void ComputeSha256(const uint8_t* data, size_t size, uint8_t* sha256)
+{
+    mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), data, size, sha256);
+}
+
+// An application image starts with its vector table: the initial stack pointer in RAM,
+// then the reset handler in the image.
+static bool IsApplicationImage(const uint8_t* image, uint32_t size)
+{
+    uint32_t vectors[2];
+    memcpy(vectors, image, sizeof(vectors));
+
+    return vectors[0] >= HMCRAMC0_ADDR && vectors[0] <= HMCRAMC0_ADDR + HMCRAMC0_SIZE &&
+           vectors[1] >= FirmwareUpdate::AppAddress && vectors[1] < FirmwareUpdate::AppAddress + size;
+}
+
+static bool IsSlotValid(uint32_t address, uint32_t size, const uint8_t* sha256)
+{
+    if (size < 8 || size > FirmwareUpdate::AppMaxSize) return false;
+
+    uint8_t actual[FirmwareUpdate::Sha256Size];
+    ComputeSha256(ExternalFlash::Map(address), size, actual);
+
+    return memcmp(actual, sha256, sizeof(actual)) == 0 && IsApplicationImage(ExternalFlash::Map(address), size);
+}
+
+// The running firmware ends at its last programmed word, the rest of the area is erased
+static uint32_t GetRunningSize()
+{
+    const uint32_t* app = reinterpret_cast<const uint32_t*>(FirmwareUpdate::AppAddress);
+    uint32_t words = FirmwareUpdate::AppMaxSize / 4;
+    while (words > 0 && app[words - 1] == 0xffffffff) --words;
+
+    return words * 4;
+}
+
+static void WriteSlot(uint32_t address, uint32_t offset, const uint8_t* data, size_t size)
+{
+    // Sectors are erased as writing reaches them
+    for (uint32_t sector = (offset + ExternalFlash::SectorSize - 1) / ExternalFlash::SectorSize * ExternalFlash::SectorSize; sector < offset + size; sector += ExternalFlash::SectorSize)
+    {
+        ExternalFlash::EraseSector(address + sector);
+    }
+    ExternalFlash::Program(address + offset, data, size);
+}
+
+// Runs from RAM because it overwrites the firmware it was called from. Reads the image
+// through the QSPI memory map, programs it over the application and resets.
+__attribute__((section(".ramfunc"), noinline, long_call, noreturn))
+static void InstallFromRam(const uint32_t* image, uint32_t size)
+{
+    __disable_irq();
+    NVMCTRL->CTRLA.bit.WMODE = NVMCTRL_CTRLA_WMODE_MAN;
+
+    for (uint32_t address = FirmwareUpdate::AppAddress; address < FirmwareUpdate::AppAddress + size; address += InternalFlashBlockSize)
+    {
+        while (!NVMCTRL->STATUS.bit.READY) {}
+        NVMCTRL->ADDR.reg = address;
+        NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | NVMCTRL_CTRLB_CMD_EB;
+    }
+
+    for (uint32_t offset = 0; offset < size; offset += InternalFlashPageSize)
+    {
+        while (!NVMCTRL->STATUS.bit.READY) {}
+        NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | NVMCTRL_CTRLB_CMD_PBC;
+        while (!NVMCTRL->STATUS.bit.READY) {}
+
+        // No memcpy(), it lives in the flash being written
+        volatile uint32_t* page = reinterpret_cast<volatile uint32_t*>(FirmwareUpdate::AppAddress + offset);
+        for (uint32_t i = 0; i < InternalFlashPageSize / 4; ++i) page[i] = image[offset / 4 + i];
+        NVMCTRL->ADDR.reg = FirmwareUpdate::AppAddress + offset;
+        NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | NVMCTRL_CTRLB_CMD_WP;
+    }
+    while (!NVMCTRL->STATUS.bit.READY) {}
+
+    __DSB();
+    SCB->AIRCR = (0x5fa << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+    __DSB();
+    for (;;) {}
+}
+
+__attribute__((noreturn))
+static void Install(uint32_t address, uint32_t size)
+{
+    InstallFromRam(reinterpret_cast<const uint32_t*>(ExternalFlash::Map(address)), size);
+}
+
+void FirmwareUpdate::ApplyPending()
+{
+    BootRecord record;
+    if (!LoadRecord(&record)) return;
+
+    switch (record.Stage)
+    {
+    case BootStage::Staged:
+    {
+        // The image was hashed as it arrived, check what actually landed in the flash
+        if (!IsSlotValid(StagingAddress, record.ImageSize, record.ImageSha256))
+        {
+            record.Stage = BootStage::None;
+            SaveRecord(record);
+            return;
+        }
+
+        record.BackupSize = GetRunningSize();
+        const uint8_t* running = reinterpret_cast<const uint8_t*>(AppAddress);
+        for (uint32_t offset = 0; offset < record.BackupSize; offset += ExternalFlash::SectorSize)
+        {
+            const uint32_t size = record.BackupSize - offset < ExternalFlash::SectorSize ? record.BackupSize - offset : ExternalFlash::SectorSize;
+            WriteSlot(BackupAddress, offset, &running[offset], size);
+        }
+        ComputeSha256(ExternalFlash::Map(BackupAddress), record.BackupSize, record.BackupSha256);
+
+        record.Stage = BootStage::Trial;
+        record.Result = BootResult::None;
+        record.BootAttempts = 0;
+        SaveRecord(record);
+        Install(StagingAddress, record.ImageSize);
+    }
+    case BootStage::Trial:
+    {
+        if (++record.BootAttempts <= BootAttemptsMax)
+        {
+            SaveRecord(record);
+            return;
+        }
+
+        // The new firmware never got as far as IoT Hub
+        record.Stage = BootStage::None;
+        if (!IsSlotValid(BackupAddress, record.BackupSize, record.BackupSha256))
+        {
+            SaveRecord(record);
+            return;
+        }
+        record.Result = BootResult::RolledBack;
+        SaveRecord(record);
+        Install(BackupAddress, record.BackupSize);
+    }
+    default:
+        break;
+    }
+}
+
+void FirmwareUpdate::Confirm()
+{
+    BootRecord record;
+    if (!LoadRecord(&record) || record.Stage != BootStage::Trial) return;
+
+    record.Stage = BootStage::None;
+    record.Result = BootResult::Installed;
+    SaveRecord(record);
+}
+
+bool FirmwareUpdate::Request(const char* url, uint32_t size, const uint8_t* sha256)
+{
+    if (IsBusy()) return false;
+    if (size < 8 || size > AppMaxSize || !ParseUrl(url)) return false;
+
+    ImageSize = size;
+    memcpy(ImageSha256, sha256, sizeof(ImageSha256));
+
+    static bool initialized = false;
+    if (!initialized)
+    {
+        mbedtls_md_init(&Sha256);
+        if (mbedtls_md_setup(&Sha256, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0) return false;
+        initialized = true;
+    }
+    mbedtls_md_starts(&Sha256);
+
+    Offset = 0;
+    Attempts = 0;
+    LastError = nullptr;
+    NextAttemptTime = millis();
+    DownloadState = State::Connecting;
+
+    return true;
+}
+
+bool FirmwareUpdate::ParseUrl(const char* url)
+{
+    if (strncmp(url, "https://", 8) == 0)
+    {
+        Secure = true;
+        Port = 443;
+        url += 8;
+    }
+    else if (strncmp(url, "http://", 7) == 0)
+    {
+        Secure = false;
+        Port = 80;
+        url += 7;
+    }
+    else
+    {
+        return false;
+    }
+
+    const char* path = strchr(url, '/');
+    if (path == nullptr) path = url + strlen(url);
+    const char* colon = static_cast<const char*>(memchr(url, ':', path - url));
+    const char* hostEnd = colon != nullptr ? colon : path;
+    if (hostEnd == url || static_cast<size_t>(hostEnd - url) > HostMaxSize) return false;
+    if (colon != nullptr)
+    {
+        const long port = strtol(colon + 1, nullptr, 10);
+        if (port <= 0 || port > 0xffff) return false;
+        Port = port;
+    }
+    if (strlen(path) > PathMaxSize) return false;
+
+    memcpy(Host, url, hostEnd - url);
+    Host[hostEnd - url] = '\0';
+    strcpy(Path, *path != '\0' ? path : "/");
+
+    return true;
+}
+
+void FirmwareUpdate::DoWork(unsigned long now)
+{
+    switch (DownloadState)
+    {
+    case State::Connecting:
+        if (static_cast<long>(now - NextAttemptTime) >= 0) Connect(now);
+        break;
+    case State::Headers:
+        ReadHeaders(now);
+        break;
+    case State::Body:
+        ReadBody(now);
+        break;
+    default:
+        break;
+    }
+}
+
+void FirmwareUpdate::Connect(unsigned long now)
+{
+    if (Secure) SecureClient.setCACert(TrustStore::GetPem());
+    Connection = Secure ? static_cast<Client*>(&SecureClient) : static_cast<Client*>(&PlainClient);
+    if (!Connection->connect(Host, Port))
+    {
+        Retry(now, "connect failed");
+        return;
+    }
+
+    // HTTP/1.0 keeps the body free of chunked encoding
+    Connection->print(String::format("GET %s HTTP/1.0" DLM "Host: %s" DLM, Path, Host));
+    if (Offset > 0) Connection->print(String::format("Range: bytes=%lu-" DLM, Offset));
+    Connection->print("Connection: close" DLM DLM);
+
+    LineSize = 0;
+    HttpStatus = 0;
+    RangeStart = -1;
+    ContentLength = -1;
+    LastReceiveTime = now;
+    DownloadState = State::Headers;
+}
+
+void FirmwareUpdate::ReadHeaders(unsigned long now)
+{
+    for (size_t budget = ChunkSize; budget > 0; --budget)
+    {
+        const int c = Connection->read();
+        if (c < 0) break;
+        LastReceiveTime = now;
+
+        if (c == '\r') continue;
+        if (c != '\n')
+        {
+            if (LineSize < sizeof(Line) - 1) Line[LineSize++] = c;
+            continue;
+        }
+
+        Line[LineSize] = '\0';
+        if (LineSize == 0)
+        {
+            StartBody(now);
+            return;
+        }
+        ParseHeader();
+        LineSize = 0;
+    }
+
+    if (now - LastReceiveTime >= TimeoutMillisecs) Retry(now, "response timeout");
+}
+
+void FirmwareUpdate::ParseHeader()
+{
+    if (HttpStatus == 0)
+    {
+        if (sscanf(Line, "HTTP/%*s %d", &HttpStatus) != 1) HttpStatus = -1;
+    }
+    else if (strncasecmp(Line, "Content-Length:", 15) == 0)
+    {
+        ContentLength = strtol(&Line[15], nullptr, 10);
+    }
+    else if (strncasecmp(Line, "Content-Range:", 14) == 0)
+    {
+        const char* bytes = strstr(&Line[14], "bytes ");
+        if (bytes != nullptr) RangeStart = strtol(&bytes[6], nullptr, 10);
+    }
+}
+
+void FirmwareUpdate::StartBody(unsigned long now)
+{
+    if (HttpStatus == 200 && Offset > 0)
+    {
+        // The server ignored the range, start over
+        Offset = 0;
+        mbedtls_md_starts(&Sha256);
+    }
+    else if (HttpStatus == 206)
+    {
+        if (RangeStart != static_cast<long>(Offset))
+        {
+            Fail("unexpected range");
+            return;
+        }
+    }
+    else if (HttpStatus != 200)
+    {
+        Fail(HttpStatus == 404 ? "not found" : "HTTP error");
+        return;
+    }
+
+    if (ContentLength >= 0 && static_cast<uint32_t>(ContentLength) != ImageSize - Offset)
+    {
+        Fail("size mismatch");
+        return;
+    }
+
+    LastReceiveTime = now;
+    DownloadState = State::Body;
+}
+
+void FirmwareUpdate::ReadBody(unsigned long now)
+{
+    uint8_t chunk[ChunkSize];
+    const size_t remaining = ImageSize - Offset;
+    const int size = Connection->read(chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+    if (size > 0)
+    {
+        WriteSlot(StagingAddress, Offset, chunk, size);
+        mbedtls_md_update(&Sha256, chunk, size);
+        Offset += size;
+        Attempts = 0;
+        LastReceiveTime = now;
+
+        if (Offset >= ImageSize) Finish();
+        return;
+    }
+
+    if (!Connection->connected() && Connection->available() <= 0)
+    {
+        Retry(now, "connection closed");
+    }
+    else if (now - LastReceiveTime >= TimeoutMillisecs)
+    {
+        Retry(now, "download timeout");
+    }
+}
+
+void FirmwareUpdate::Finish()
+{
+    Connection->stop();
+
+    uint8_t sha256[Sha256Size];
+    mbedtls_md_finish(&Sha256, sha256);
+    if (memcmp(sha256, ImageSha256, sizeof(sha256)) != 0)
+    {
+        Fail("SHA-256 mismatch");
+        return;
+    }
+    if (!IsApplicationImage(ExternalFlash::Map(StagingAddress), ImageSize))
+    {
+        Fail("not an application image");
+        return;
+    }
+
+    BootRecord record;
+    if (!LoadRecord(&record)) memset(&record, 0, sizeof(record));
+    record.Stage = BootStage::Staged;
+    record.ImageSize = ImageSize;
+    memcpy(record.ImageSha256, ImageSha256, sizeof(record.ImageSha256));
+    SaveRecord(record);
+
+    LastError = nullptr;
+    DownloadState = State::Verified;
+}
+
+void FirmwareUpdate::Retry(unsigned long now, const char* reason)
+{
+    Connection->stop();
+    LastError = reason;
+    if (++Attempts > RetryMax)
+    {
+        Fail(reason);
+        return;
+    }
+
+    NextAttemptTime = now + RetryDelayMillisecs;
+    DownloadState = State::Connecting;
+}
+
+void FirmwareUpdate::Fail(const char* reason)
+{
+    if (Connection != nullptr) Connection->stop();
+    LastError = reason;
+    DownloadState = State::Failed;
+}
+
+void FirmwareUpdate::Restart()
+{
+    Serial.flush();
+    NVIC_SystemReset();
+}
+
+void FirmwareUpdate::Print()
+{
+    static const char* const StateNames[] = { "idle", "connecting", "receiving headers", "downloading", "verified", "failed" };
+    static const char* const ResultNames[] = { "none", "installed", "rolled back" };
+
+    Serial.print(String::format("Firmware update: %s", StateNames[static_cast<size_t>(DownloadState)]));
+    if (DownloadState != State::Idle) Serial.print(String::format(", %lu/%lu bytes from %s://%s:%u%s", Offset, ImageSize, Secure ? "https" : "http", Host, Port, Path));
+    if (LastError != nullptr) Serial.print(String::format(", last error = %s", LastError));
+    Serial.print(DLM);
+
+    BootRecord record;
+    if (LoadRecord(&record))
+    {
+        Serial.print(String::format(" Last update: %s%s, backup = %lu bytes" DLM, ResultNames[static_cast<size_t>(record.Result)], record.Stage == BootStage::Trial ? " (on trial)" : "", record.BackupSize));
+    }
+}
@@ -0,0 +1,276 @@
+#include <Arduino.h>
+#include "GasCalibration.h"
+#include "Storage.h"
+#include <math.h>
+
+static constexpr size_t SensorCount = static_cast<size_t>(GasSensor::Count);
+static constexpr int LutSegments = 32;
+
+static constexpr const char* Names[SensorCount] = { "no2", "c2h5ch", "voc", "co" };
+static constexpr const char* CurveKeys[SensorCount] = { "gas.curve.no2", "gas.curve.c2h5ch", "gas.curve.voc", "gas.curve.co" };
+static constexpr const char* BaselineKeys[SensorCount] = { "gas.r0.no2", "gas.r0.c2h5ch", "gas.r0.voc", "gas.r0.co" };
+
+// Approximate sensitivity curves read from the GM-102B/302B/502B/702B datasheets.
+// Replace them with bench calibrated curves through the set_gas_curve command.
+static const GasCurve DefaultCurves[SensorCount] =
+{
+    { 5, 1, { 0, 0 }, -0.005f, -0.003f, { { 1.0f, 0.0f }, { 2.5f, 0.5f }, { 4.0f, 1.0f }, { 12.0f, 5.0f }, { 20.0f, 10.0f } } },
+    { 6, 0, { 0, 0 }, -0.01f, -0.005f, { { 0.08f, 500.0f }, { 0.18f, 100.0f }, { 0.25f, 50.0f }, { 0.5f, 10.0f }, { 0.8f, 1.0f }, { 1.0f, 0.0f } } },
+    { 6, 0, { 0, 0 }, -0.01f, -0.005f, { { 0.07f, 500.0f }, { 0.15f, 100.0f }, { 0.22f, 50.0f }, { 0.45f, 10.0f }, { 0.8f, 1.0f }, { 1.0f, 0.0f } } },
+    { 7, 0, { 0, 0 }, -0.01f, -0.005f, { { 0.07f, 1000.0f }, { 0.1f, 500.0f }, { 0.22f, 100.0f }, { 0.3f, 50.0f }, { 0.55f, 10.0f }, { 0.85f, 1.0f }, { 1.0f, 0.0f } } },
+};
+
+// log2(1 + i / 32) in Q16.16
+static constexpr int32_t Log2Lut[33] =
+{
+    0, 2909, 5732, 8473, 11136, 13727, 16248, 18704, 21098, 23433, 25711, 27936, 30109, 32234, 34312, 36346,
+    38336, 40286, 42196, 44068, 45904, 47705, 49472, 51207, 52911, 54584, 56229, 57845, 59434, 60997, 62534, 64047,
+    65536,
+};
+
+struct Channel
+{
+    GasCurve Curve;
+
+    // Curve expanded over log2(Rs/R0)
+    int32_t LogMinQ16;
+    int32_t ScaleQ16;                   // Table segments per unit of log2(Rs/R0)
+    uint32_t PpmQ16[LutSegments + 1];
+
+    int32_t TemperatureCoeffQ16;
+    int32_t HumidityCoeffQ16;
+
+    uint32_t BaselineQ16;               // R0/RL, 0: not yet known
+    uint32_t SavedBaselineQ16;
+    uint32_t PeriodExtremeQ16;
+    unsigned long PeriodStartTime;
+    bool PeriodStarted;
+
+    uint16_t LastCount;
+    uint32_t LastRatioQ16;
+};
+
+static Channel Channels[SensorCount];
+
+static bool EnvironmentValid = false;
+static int32_t EnvironmentTemperature;     // [degC] - 20
+static int32_t EnvironmentHumidity;        // [%RH] - 65
+
+static int32_t Log2Q16(uint32_t x)
+{
+    if (x == 0) x = 1;
+
+    const int msb = 31 - __builtin_clz(x);
+    const uint32_t mantissa = msb >= 16 ? x >> (msb - 16) : x << (16 - msb);  // [1, 2) in Q16.16
+    const uint32_t fraction = mantissa - 65536;
+    const uint32_t i = fraction >> 11;
+    const int32_t t = fraction & 0x7ff;
+
+    return ((msb - 16) << 16) + Log2Lut[i] + (((Log2Lut[i + 1] - Log2Lut[i]) * t) >> 11);
+}
+
+static bool IsValidCurve(const GasCurve& curve)
+{
+    if (curve.PointCount < 2 || curve.PointCount > GasCurve::PointMaxCount) return false;
+    if (!isfinite(curve.TemperatureCoeff) || !isfinite(curve.HumidityCoeff)) return false;
+    if (fabsf(curve.TemperatureCoeff) > 0.1f || fabsf(curve.HumidityCoeff) > 0.1f) return false;
+
+    for (size_t i = 0; i < curve.PointCount; ++i)
+    {
+        const GasCurvePoint& point = curve.Points[i];
+        if (!isfinite(point.Ratio) || !isfinite(point.Ppm)) return false;
+        if (point.Ratio <= 0.0f || point.Ppm < 0.0f || point.Ppm >= 65535.0f) return false;
+        if (i > 0 && point.Ratio <= curve.Points[i - 1].Ratio) return false;
+    }
+
+    return true;
+}
+
+static void BuildTable(Channel& channel)
+{
+    const GasCurve& curve = channel.Curve;
+    const float logMin = log2f(curve.Points[0].Ratio);
+    const float logMax = log2f(curve.Points[curve.PointCount - 1].Ratio);
+
+    channel.LogMinQ16 = lroundf(logMin * 65536.0f);
+    channel.ScaleQ16 = lroundf(LutSegments * 65536.0f / (logMax - logMin));
+    channel.TemperatureCoeffQ16 = lroundf(curve.TemperatureCoeff * 65536.0f);
+    channel.HumidityCoeffQ16 = lroundf(curve.HumidityCoeff * 65536.0f);
+
+    size_t segment = 0;
+    for (int i = 0; i <= LutSegments; ++i)
+    {
+        const float logRatio = logMin + (logMax - logMin) * i / LutSegments;
+        while (segment + 2 < curve.PointCount && logRatio > log2f(curve.Points[segment + 1].Ratio)) ++segment;
+
+        const GasCurvePoint& p0 = curve.Points[segment];
+        const GasCurvePoint& p1 = curve.Points[segment + 1];
+        const float log0 = log2f(p0.Ratio);
+        const float t = (logRatio - log0) / (log2f(p1.Ratio) - log0);
+
+        // Sensitivity curves are straight lines on log-log axes
+        const float ppm = p0.Ppm > 0.0f && p1.Ppm > 0.0f ? exp2f(log2f(p0.Ppm) + (log2f(p1.Ppm) - log2f(p0.Ppm)) * t) : p0.Ppm + (p1.Ppm - p0.Ppm) * t;
+        channel.PpmQ16[i] = static_cast<uint32_t>(lroundf(constrain(ppm, 0.0f, 65535.0f) * 65536.0f));
+    }
+}
+
+static void TrackBaseline(Channel& channel, uint32_t rsQ16, unsigned long now)
+{
+    const bool oxidizing = channel.Curve.Oxidizing != 0;
+
+    if (channel.BaselineQ16 == 0) channel.BaselineQ16 = rsQ16;
+
+    // Clean air is the highest resistance (lowest for oxidizing gas) seen in a period
+    if (!channel.PeriodStarted)
+    {
+        channel.PeriodExtremeQ16 = rsQ16;
+        channel.PeriodStartTime = now;
+        channel.PeriodStarted = true;
+    }
+    else if (oxidizing ? rsQ16 < channel.PeriodExtremeQ16 : rsQ16 > channel.PeriodExtremeQ16)
+    {
+        channel.PeriodExtremeQ16 = rsQ16;
+    }
+
+    if (now - channel.PeriodStartTime < GasCalibration::BaselinePeriodMillisecs) return;
+    channel.PeriodStarted = false;
+
+    // Follow cleaner air quickly, drift towards dirtier air over about a day
+    const int64_t delta = static_cast<int64_t>(channel.PeriodExtremeQ16) - channel.BaselineQ16;
+    const bool cleaner = oxidizing ? delta < 0 : delta > 0;
+    channel.BaselineQ16 += static_cast<int32_t>(cleaner ? delta / 4 : delta / 1024);
+    if (channel.BaselineQ16 == 0) channel.BaselineQ16 = 1;
+}
+
+void GasCalibration::Load()
+{
+    for (size_t i = 0; i < SensorCount; ++i)
+    {
+        Channel& channel = Channels[i];
+        memset(&channel, 0, sizeof(channel));
+
+        const uint8_t* value;
+        size_t valueSize;
+        if (Storage::Get(CurveKeys[i], &value, &valueSize) && valueSize == sizeof(GasCurve)) memcpy(&channel.Curve, value, sizeof(GasCurve));
+        if (!IsValidCurve(channel.Curve)) channel.Curve = DefaultCurves[i];
+        BuildTable(channel);
+
+        if (Storage::Get(BaselineKeys[i], &value, &valueSize) && valueSize == sizeof(uint32_t)) memcpy(&channel.BaselineQ16, value, sizeof(uint32_t));
+        channel.SavedBaselineQ16 = channel.BaselineQ16;
+    }
+}
+
+void GasCalibration::SaveBaselines()
+{
+    for (size_t i = 0; i < SensorCount; ++i)
+    {
+        Channel& channel = Channels[i];
+        if (channel.BaselineQ16 == 0) continue;
+
+        // Limit flash wear to changes of more than about 1.5%
+        const uint32_t delta = channel.BaselineQ16 > channel.SavedBaselineQ16 ? channel.BaselineQ16 - channel.SavedBaselineQ16 : channel.SavedBaselineQ16 - channel.BaselineQ16;
+        if (channel.SavedBaselineQ16 != 0 && delta < channel.SavedBaselineQ16 / 64) continue;
+
+        if (Storage::Set(BaselineKeys[i], &channel.BaselineQ16, sizeof(channel.BaselineQ16))) channel.SavedBaselineQ16 = channel.BaselineQ16;
+    }
+}
+
+void GasCalibration::ResetBaselines()
+{
+    for (size_t i = 0; i < SensorCount; ++i)
+    {
+        Channels[i].BaselineQ16 = 0;
+        Channels[i].PeriodStarted = false;
+    }
+}
+
+const char* GasCalibration::GetName(GasSensor sensor)
+{
+    return Names[static_cast<size_t>(sensor)];
+}
+
+const char* GasCalibration::CurveKey(GasSensor sensor)
+{
+    return CurveKeys[static_cast<size_t>(sensor)];
+}
+
+const GasCurve& GasCalibration::GetCurve(GasSensor sensor)
+{
+    return Channels[static_cast<size_t>(sensor)].Curve;
+}
+
+bool GasCalibration::SetCurve(GasSensor sensor, const GasCurve& curve)
+{
+    if (!IsValidCurve(curve)) return false;
+
+    GasCurve stored;
+    memset(&stored, 0, sizeof(stored));
+    memcpy(&stored, &curve, offsetof(GasCurve, Points) + curve.PointCount * sizeof(GasCurvePoint));
+    if (!Storage::Set(CurveKey(sensor), &stored, sizeof(stored))) return false;
+
+    Channel& channel = Channels[static_cast<size_t>(sensor)];
+    channel.Curve = stored;
+    BuildTable(channel);
+
+    return true;
+}
+
+void GasCalibration::SetEnvironment(float temperature, float humidity)
+{
+    EnvironmentValid = isfinite(temperature) && isfinite(humidity);
+    if (!EnvironmentValid) return;
+
+    EnvironmentTemperature = lroundf(temperature) - 20;
+    EnvironmentHumidity = lroundf(humidity) - 65;
+}
+
+uint32_t GasCalibration::Convert(GasSensor sensor, uint32_t count, unsigned long now)
+{
+    Channel& channel = Channels[static_cast<size_t>(sensor)];
+
+    if (count < 1) count = 1;
+    if (count > AdcMax - 1) count = AdcMax - 1;
+    channel.LastCount = count;
+
+    // Load resistor divider: Rs/RL = (Vc - Vout) / Vout
+    uint32_t rsQ16 = ((AdcMax - count) << 16) / count;
+
+    if (EnvironmentValid)
+    {
+        int32_t factorQ16 = 65536 + channel.TemperatureCoeffQ16 * EnvironmentTemperature + channel.HumidityCoeffQ16 * EnvironmentHumidity;
+        factorQ16 = constrain(factorQ16, 32768, 131072);
+        rsQ16 = static_cast<uint32_t>((static_cast<uint64_t>(rsQ16) << 16) / factorQ16);
+    }
+    if (rsQ16 == 0) rsQ16 = 1;
+
+    TrackBaseline(channel, rsQ16, now);
+
+    const uint32_t ratioQ16 = static_cast<uint32_t>((static_cast<uint64_t>(rsQ16) << 16) / channel.BaselineQ16);
+    channel.LastRatioQ16 = ratioQ16;
+
+    int64_t position = (static_cast<int64_t>(Log2Q16(ratioQ16) - channel.LogMinQ16) * channel.ScaleQ16) >> 16;
+    if (position <= 0) return channel.PpmQ16[0];
+    if (position >= static_cast<int64_t>(LutSegments) << 16) return channel.PpmQ16[LutSegments];
+
+    const uint32_t i = static_cast<uint32_t>(position >> 16);
+    const int64_t t = position & 0xffff;
+    const int64_t p0 = channel.PpmQ16[i];
+    const int64_t p1 = channel.PpmQ16[i + 1];
+
+    return static_cast<uint32_t>(p0 + (((p1 - p0) * t) >> 16));
+}
+
+uint16_t GasCalibration::GetLastCount(GasSensor sensor)
+{
+    return Channels[static_cast<size_t>(sensor)].LastCount;
+}
+
+uint32_t GasCalibration::GetLastRatio(GasSensor sensor)
+{
+    return Channels[static_cast<size_t>(sensor)].LastRatioQ16;
+}
+
+uint32_t GasCalibration::GetBaseline(GasSensor sensor)
+{
+    return Channels[static_cast<size_t>(sensor)].BaselineQ16;
+}
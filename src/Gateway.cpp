@@ -0,0 +1,311 @@
+#include <Arduino.h>
+#include <az_json.h>
+#include "Gateway.h"
+#include "Crc.h"
+#include "Signature.h"
+#include "Storage.h"
+#include "TelemetryTopic.h"
+#include "TimeService.h"
+
+#define DLM "\r\n"
+
+constexpr const char* Gateway::KeyEnabled;
+constexpr const char* Gateway::KeyGroupKey;
+
+bool Gateway::Enabled = false;
+Stream* Gateway::Link = nullptr;
+char Gateway::GroupKey[64] = "";
+unsigned long Gateway::BatchMillisecs = 0;
+
+Gateway::Node Gateway::Nodes[NodeMax];
+uint8_t Gateway::Frame[FrameMaxSize];
+size_t Gateway::FrameSize = 0;
+
+uint8_t Gateway::Batch[BatchMaxSize];
+size_t Gateway::BatchSize = 0;
+size_t Gateway::BatchEntries = 0;
+unsigned long Gateway::BatchStartTime = 0;
+
+uint32_t Gateway::ReceivedFrames = 0;
+uint32_t Gateway::InvalidFrames = 0;
+uint32_t Gateway::DroppedReadings = 0;
+
+static constexpr uint8_t Sync0 = 0xaa;
+static constexpr uint8_t Sync1 = 0x55;
+static constexpr size_t HeaderSize = 2 + 1 + 2 + 4 + 4;
+static constexpr size_t TrailerSize = 4;
+
+static uint32_t GetU32(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+// Same characters as an IoT Hub device id
+static bool IsValidNodeId(const char* id, size_t idSize)
+{
+    if (idSize == 0 || idSize > Gateway::NodeIdMaxSize) return false;
+    for (size_t i = 0; i < idSize; ++i)
+    {
+        const char c = id[i];
+        if (isalnum(c)) continue;
+        if (strchr("-.%_*?!(),:=@$'", c) == nullptr) return false;
+    }
+
+    return true;
+}
+
+static bool IsJsonObject(const uint8_t* json, size_t jsonSize)
+{
+    az_json_reader reader;
+    if (az_result_failed(az_json_reader_init(&reader, az_span_create(const_cast<uint8_t*>(json), jsonSize), nullptr))) return false;
+    if (az_result_failed(az_json_reader_next_token(&reader))) return false;
+    if (reader.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT) return false;
+    if (az_result_failed(az_json_reader_skip_children(&reader))) return false;
+
+    return az_json_reader_next_token(&reader) == AZ_ERROR_JSON_READER_DONE;
+}
+
+void Gateway::Init(bool enable, az_span groupKey, unsigned long batchMillisecs)
+{
+    const uint8_t* value;
+    size_t valueSize;
+    Enabled = Storage::Get(KeyEnabled, &value, &valueSize) && valueSize == 1 ? value[0] != 0 : enable;
+
+    if (Storage::Get(KeyGroupKey, &value, &valueSize) && valueSize < sizeof(GroupKey))
+    {
+        memcpy(GroupKey, value, valueSize);
+        GroupKey[valueSize] = '\0';
+    }
+    else if (static_cast<size_t>(az_span_size(groupKey)) < sizeof(GroupKey))
+    {
+        az_span_to_str(GroupKey, sizeof(GroupKey), groupKey);
+    }
+
+    BatchMillisecs = batchMillisecs;
+}
+
+void Gateway::SetEnabled(bool enable)
+{
+    const uint8_t value = enable ? 1 : 0;
+    Storage::Set(KeyEnabled, &value, sizeof(value));
+    Enabled = enable;
+}
+
+bool Gateway::SetGroupKey(const char* groupKey)
+{
+    const size_t groupKeySize = strlen(groupKey);
+    if (groupKeySize >= sizeof(GroupKey)) return false;
+    if (!Storage::Set(KeyGroupKey, groupKey, groupKeySize)) return false;
+
+    memcpy(GroupKey, groupKey, groupKeySize + 1);
+    for (Node& node : Nodes) node.Id[0] = '\0';     // Derive again with the new key
+
+    return true;
+}
+
+void Gateway::Begin(Stream& link)
+{
+    Link = &link;
+    FrameSize = 0;
+    for (Node& node : Nodes) node.Id[0] = '\0';
+    ClearBatch();
+}
+
+void Gateway::DoWork(unsigned long now)
+{
+    if (Link == nullptr) return;
+
+    for (int budget = InputBudget; budget > 0; --budget)
+    {
+        // Leave input in the UART buffer until the full batch is taken
+        if (BatchMaxSize - BatchSize < EntryMaxSize + 1) break;
+
+        const int c = Link->read();
+        if (c < 0) break;
+
+        if (FrameSize == 0 && c != Sync0) continue;
+        if (FrameSize == 1 && c != Sync1)
+        {
+            FrameSize = c == Sync0 ? 1 : 0;
+            continue;
+        }
+        Frame[FrameSize++] = c;
+
+        while (FrameSize > 0 && ParseFrame(now)) {}
+    }
+}
+
+// Consumes a complete or invalid frame at the start of Frame. Returns true if bytes were consumed.
+bool Gateway::ParseFrame(unsigned long now)
+{
+    if (FrameSize < HeaderSize) return false;
+
+    const size_t payloadSize = Frame[3] | Frame[4] << 8;
+    size_t consumed;
+    if (payloadSize > PayloadMaxSize)
+    {
+        consumed = 1;
+    }
+    else
+    {
+        const size_t frameSize = HeaderSize + payloadSize + TrailerSize;
+        if (FrameSize < frameSize) return false;
+
+        if (GetU32(&Frame[HeaderSize + payloadSize]) != Crc32(&Frame[2], HeaderSize - 2 + payloadSize))
+        {
+            consumed = 1;
+        }
+        else
+        {
+            ++ReceivedFrames;
+            if (static_cast<FrameType>(Frame[2]) == FrameType::NodeTelemetry) HandleTelemetry(now, &Frame[HeaderSize], payloadSize);
+            consumed = frameSize;
+        }
+    }
+    if (consumed == 1) ++InvalidFrames;
+
+    // Resynchronize on the next sync bytes
+    size_t next = consumed;
+    while (next < FrameSize && !(Frame[next] == Sync0 && (next + 1 >= FrameSize || Frame[next + 1] == Sync1))) ++next;
+    memmove(Frame, &Frame[next], FrameSize - next);
+    FrameSize -= next;
+
+    return true;
+}
+
+void Gateway::HandleTelemetry(unsigned long now, const uint8_t* payload, size_t payloadSize)
+{
+    const uint8_t* separator = static_cast<const uint8_t*>(memchr(payload, '\0', payloadSize));
+    if (separator == nullptr)
+    {
+        ++InvalidFrames;
+        return;
+    }
+
+    char id[NodeIdMaxSize + 1];
+    const size_t idSize = separator - payload;
+    const uint8_t* telemetry = separator + 1;
+    const size_t telemetrySize = payloadSize - idSize - 1;
+    if (!IsValidNodeId(reinterpret_cast<const char*>(payload), idSize) || !IsJsonObject(telemetry, telemetrySize))
+    {
+        ++InvalidFrames;
+        return;
+    }
+    memcpy(id, payload, idSize);
+    id[idSize] = '\0';
+
+    Node* node = FindNode(id, now);
+    ++node->Readings;
+    node->LastSeenTime = now;
+
+    if (!AppendEntry(now, *node, reinterpret_cast<const char*>(telemetry), telemetrySize)) ++DroppedReadings;
+}
+
+// Returns the node with id, replacing the least recently seen one if it is new.
+Gateway::Node* Gateway::FindNode(const char* id, unsigned long now)
+{
+    Node* oldest = &Nodes[0];
+    for (Node& node : Nodes)
+    {
+        if (strcmp(node.Id, id) == 0) return &node;
+        if (oldest->Id[0] == '\0') continue;
+        if (node.Id[0] == '\0' || now - node.LastSeenTime > now - oldest->LastSeenTime) oldest = &node;
+    }
+
+    Node& node = *oldest;
+    strcpy(node.Id, id);
+    node.Readings = 0;
+    node.LastSeenTime = now;
+    node.DerivedKey[0] = '\0';
+
+    // HMAC once per node instead of once per reading
+    if (GroupKey[0] != '\0')
+    {
+        const std::string derivedKey = ComputeDerivedSymmetricKey(GroupKey, id);
+        if (derivedKey.size() < sizeof(node.DerivedKey)) strcpy(node.DerivedKey, derivedKey.c_str());
+    }
+
+    return &node;
+}
+
+bool Gateway::AppendEntry(unsigned long now, const Node& node, const char* telemetry, size_t telemetrySize)
+{
+    if (BatchMaxSize - BatchSize < EntryMaxSize + 1) return false;
+
+    char time[Iso8601Size + 1];
+    FormatIso8601(time, TimeService::GetEpochMillisecs(now));
+    time[Iso8601Size] = '\0';
+
+    char signature[48] = "";
+    if (node.DerivedKey[0] != '\0')
+    {
+        std::vector<uint8_t> data;
+        data.reserve(strlen(node.Id) + 1 + Iso8601Size + 1 + telemetrySize);
+        data.insert(data.end(), node.Id, node.Id + strlen(node.Id));
+        data.push_back('\n');
+        data.insert(data.end(), time, time + Iso8601Size);
+        data.push_back('\n');
+        data.insert(data.end(), telemetry, telemetry + telemetrySize);
+        const std::string encryptedSignature = GenerateEncryptedSignature(az_span_create_from_str(const_cast<char*>(node.DerivedKey)), data);
+        if (encryptedSignature.size() < sizeof(signature)) strcpy(signature, encryptedSignature.c_str());
+    }
+
+    char* p = reinterpret_cast<char*>(&Batch[BatchSize]);
+    const size_t capacity = BatchMaxSize - BatchSize;
+    int size = snprintf(p, capacity, "%s{\"deviceId\":\"%s\",\"time\":\"%s\",", BatchEntries == 0 ? "[" : ",", node.Id, time);
+    if (signature[0] != '\0') size += snprintf(&p[size], capacity - size, "\"signature\":\"%s\",", signature);
+    size += snprintf(&p[size], capacity - size, "\"telemetry\":");
+    memcpy(&p[size], telemetry, telemetrySize);
+    size += telemetrySize;
+    p[size++] = '}';
+
+    if (BatchEntries == 0) BatchStartTime = now;
+    BatchSize += size;
+    ++BatchEntries;
+
+    return true;
+}
+
+bool Gateway::IsBatchDue(unsigned long now)
+{
+    if (BatchEntries == 0) return false;
+
+    return now - BatchStartTime >= BatchMillisecs || BatchMaxSize - BatchSize < EntryMaxSize + 1;
+}
+
+const uint8_t* Gateway::GetBatch(size_t* size)
+{
+    // The closing bracket fits, AppendEntry() keeps one byte free
+    Batch[BatchSize] = ']';
+    *size = BatchSize + 1;
+
+    return Batch;
+}
+
+void Gateway::ClearBatch()
+{
+    BatchSize = 0;
+    BatchEntries = 0;
+}
+
+size_t Gateway::DropBatch()
+{
+    const size_t entries = BatchEntries;
+    DroppedReadings += entries;
+    ClearBatch();
+
+    return entries;
+}
+
+void Gateway::Print()
+{
+    Serial.print(String::format("Gateway: %s, %s" DLM, Enabled ? "enabled" : "disabled", GroupKey[0] != '\0' ? "signed" : "unsigned"));
+    Serial.print(String::format(" Frames: received = %lu, invalid = %lu" DLM, ReceivedFrames, InvalidFrames));
+    Serial.print(String::format(" Batch: %u readings, %u bytes, dropped readings = %lu" DLM, BatchEntries, BatchSize, DroppedReadings));
+    const unsigned long now = millis();
+    for (const Node& node : Nodes)
+    {
+        if (node.Id[0] == '\0') continue;
+        Serial.print(String::format(" %s: readings = %lu, last seen %lu ms ago" DLM, node.Id, node.Readings, now - node.LastSeenTime));
+    }
+}
@@ -0,0 +1,28 @@
+#include "Log.h"
+#include "SerialStream.h"
+
+String StringVFormat(const char* format, va_list arg)
+{
+    // Sizing consumes the list, format from a copy
+    va_list sizeArg;
+    va_copy(sizeArg, arg);
+    const int len = vsnprintf(nullptr, 0, format, sizeArg);
+    va_end(sizeArg);
+    char str[len + 1];
+    vsnprintf(str, sizeof(str), format, arg);
+
+    return String{ str };
+}
+
+void Log(const char* format, ...)
+{
+    // Keep the port quiet for the decoder while streaming
+    if (SerialStream::IsEnabled()) return;
+
+    va_list arg;
+    va_start(arg, format);
+    String str{ StringVFormat(format, arg) };
+    va_end(arg);
+
+    Serial.print(str);
+}
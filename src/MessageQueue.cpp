@@ -0,0 +1,136 @@
+#include "MessageQueue.h"
+#include <string.h>
+
+MessageQueue::MessageQueue(uint8_t* buffer, size_t bufferSize) :
+    Buffer{ buffer },
+    BufferSize{ bufferSize },
+    Head{ 0 },
+    Used{ 0 },
+    Count{ 0 },
+    Dropped{ 0 },
+    Attempts{ 0 },
+    Open{ false },
+    PendingUsed{ 0 },
+    PendingRemaining{ 0 }
+{
+}
+
+bool MessageQueue::Begin(const char* topic, size_t payloadSize)
+{
+    Open = false;
+
+    const size_t topicSize = strlen(topic);
+    const size_t recordSize = HeaderSize + topicSize + payloadSize;
+    if (topicSize > TopicMaxSize || payloadSize > 0xffff || recordSize > BufferSize)
+    {
+        ++Dropped;
+        return false;
+    }
+
+    while (BufferSize - Used < recordSize) Drop();
+
+    const uint8_t header[HeaderSize] =
+    {
+        static_cast<uint8_t>(topicSize & 0xff),
+        static_cast<uint8_t>(topicSize >> 8),
+        static_cast<uint8_t>(payloadSize & 0xff),
+        static_cast<uint8_t>(payloadSize >> 8),
+    };
+    PendingUsed = 0;
+    RawWrite(header, sizeof(header));
+    RawWrite(reinterpret_cast<const uint8_t*>(topic), topicSize);
+    PendingRemaining = payloadSize;
+    Open = true;
+
+    return true;
+}
+
+bool MessageQueue::Write(const uint8_t* data, size_t size)
+{
+    if (!Open) return false;
+    if (size > PendingRemaining)
+    {
+        Open = false;
+        return false;
+    }
+
+    RawWrite(data, size);
+    PendingRemaining -= size;
+
+    return true;
+}
+
+bool MessageQueue::End()
+{
+    if (!Open) return false;
+    Open = false;
+
+    // Uncommitted bytes are simply overwritten by the next message
+    if (PendingRemaining != 0) return false;
+
+    if (Count == 0) Attempts = 0;
+    Used += PendingUsed;
+    ++Count;
+
+    return true;
+}
+
+void MessageQueue::GetFrontTopic(char* topic) const
+{
+    const size_t topicSize = GetFrontTopicSize();
+    RawRead(Wrap(Head + HeaderSize), reinterpret_cast<uint8_t*>(topic), topicSize);
+    topic[topicSize] = '\0';
+}
+
+size_t MessageQueue::GetFrontPayloadSize() const
+{
+    uint8_t header[HeaderSize];
+    RawRead(Head, header, sizeof(header));
+
+    return header[2] | header[3] << 8;
+}
+
+void MessageQueue::Pop()
+{
+    if (Count == 0) return;
+
+    const size_t recordSize = HeaderSize + GetFrontTopicSize() + GetFrontPayloadSize();
+    Head = Wrap(Head + recordSize);
+    Used -= recordSize;
+    --Count;
+    Attempts = 0;
+}
+
+void MessageQueue::Drop()
+{
+    if (Count == 0) return;
+
+    Pop();
+    ++Dropped;
+}
+
+void MessageQueue::RawWrite(const uint8_t* data, size_t size)
+{
+    const size_t offset = Wrap(Head + Used + PendingUsed);
+    const size_t first = size < BufferSize - offset ? size : BufferSize - offset;
+
+    memcpy(&Buffer[offset], data, first);
+    memcpy(&Buffer[0], &data[first], size - first);
+    PendingUsed += size;
+}
+
+void MessageQueue::RawRead(size_t offset, uint8_t* data, size_t size) const
+{
+    const size_t first = size < BufferSize - offset ? size : BufferSize - offset;
+
+    memcpy(data, &Buffer[offset], first);
+    memcpy(&data[first], &Buffer[0], size - first);
+}
+
+size_t MessageQueue::GetFrontTopicSize() const
+{
+    uint8_t header[HeaderSize];
+    RawRead(Head, header, sizeof(header));
+
+    return header[0] | header[1] << 8;
+}
@@ -0,0 +1,26 @@
+#include "MessageRouter.h"
+
+static bool StartsWith(az_span span, az_span prefix)
+{
+    return az_span_size(span) >= az_span_size(prefix) && az_span_is_content_equal(az_span_slice(span, 0, az_span_size(prefix)), prefix);
+}
+
+TopicClass ClassifyTopic(az_span topic)
+{
+    // $iothub/methods/POST/{name}/?$rid={id}
+    // $iothub/twin/res/{status}/?$rid={id}
+    // $iothub/twin/PATCH/properties/desired/?$version={version}
+    // devices/{id}/messages/devicebound/{properties}
+    if (StartsWith(topic, AZ_SPAN_FROM_STR("$iothub/")))
+    {
+        const az_span rest = az_span_slice_to_end(topic, 8);
+        if (StartsWith(rest, AZ_SPAN_FROM_STR("methods/POST/"))) return TopicClass::Method;
+        if (StartsWith(rest, AZ_SPAN_FROM_STR("twin/res/"))) return TopicClass::TwinResponse;
+        if (StartsWith(rest, AZ_SPAN_FROM_STR("twin/PATCH/properties/desired/"))) return TopicClass::TwinDesired;
+        return TopicClass::Unknown;
+    }
+
+    if (StartsWith(topic, AZ_SPAN_FROM_STR("devices/")) && az_span_find(topic, AZ_SPAN_FROM_STR("/messages/devicebound/")) > 0) return TopicClass::CloudToDevice;
+
+    return TopicClass::Unknown;
+}
@@ -0,0 +1,137 @@
+#include <Arduino.h>
+#include "MessageScheduler.h"
+#include "MqttStreamWriter.h"
+#include "NetworkStats.h"
+
+#define DLM "\r\n"
+
+MessageScheduler::MessageScheduler(PubSubClient& client) :
+    Client{ client },
+    Queues{
+        { CommandResponseBuffer, sizeof(CommandResponseBuffer) },
+        { AlarmBuffer, sizeof(AlarmBuffer) },
+        { ButtonBuffer, sizeof(ButtonBuffer) },
+        { TelemetryBuffer, sizeof(TelemetryBuffer) },
+        { DiagnosticsBuffer, sizeof(DiagnosticsBuffer) },
+    },
+    TokensPerSecond{ 0 },
+    TokenMax{ 0 },
+    Tokens{ 0 },
+    LastRefillTime{ 0 },
+    LastPublishMillisecs{}
+{
+    for (bool& succeeded : LastPublishSucceeded) succeeded = true;
+}
+
+void MessageScheduler::SetRateLimit(uint32_t messagesPerSecond, uint32_t burst)
+{
+    TokensPerSecond = messagesPerSecond;
+    TokenMax = burst * 1000;
+    Tokens = TokenMax;
+    LastRefillTime = millis();
+}
+
+bool MessageScheduler::Enqueue(MessagePriority priority, const char* topic, const uint8_t* payload, size_t payloadSize)
+{
+    MessageQueue& queue = GetQueue(priority);
+    if (!queue.Begin(topic, payloadSize)) return false;
+    queue.Write(payload, payloadSize);
+
+    return queue.End();
+}
+
+int MessageScheduler::DoWork(unsigned long now)
+{
+    Refill(now);
+
+    int published = 0;
+    while (published < MaxPublishesPerCall && Client.connected())
+    {
+        size_t i = 0;
+        while (i < static_cast<size_t>(MessagePriority::Count) && Queues[i].IsEmpty()) ++i;
+        if (i >= static_cast<size_t>(MessagePriority::Count)) break;
+
+        // Lower classes never overtake a higher one that is waiting for tokens
+        const bool limited = static_cast<MessagePriority>(i) != MessagePriority::CommandResponse;
+        if (limited && TokenMax > 0 && Tokens < 1000) break;
+
+        if (!Publish(static_cast<MessagePriority>(i))) break;
+        if (limited && TokenMax > 0) Tokens -= 1000;
+        ++published;
+    }
+
+    return published;
+}
+
+const char* MessageScheduler::GetName(MessagePriority priority)
+{
+    switch (priority)
+    {
+    case MessagePriority::CommandResponse:
+        return "Command response";
+    case MessagePriority::Alarm:
+        return "Alarm";
+    case MessagePriority::Button:
+        return "Button";
+    case MessagePriority::Telemetry:
+        return "Telemetry";
+    case MessagePriority::Diagnostics:
+        return "Diagnostics";
+    default:
+        return "";
+    }
+}
+
+void MessageScheduler::Print()
+{
+    Serial.print("Message queues:" DLM);
+    for (size_t i = 0; i < static_cast<size_t>(MessagePriority::Count); ++i)
+    {
+        const MessageQueue& queue = Queues[i];
+        Serial.print(String::format(" %s: queued = %u (%u bytes), dropped = %lu" DLM, GetName(static_cast<MessagePriority>(i)), queue.GetCount(), queue.GetUsedBytes(), queue.GetDroppedCount()));
+    }
+}
+
+void MessageScheduler::Refill(unsigned long now)
+{
+    const unsigned long elapsed = now - LastRefillTime;
+    LastRefillTime = now;
+    if (TokenMax == 0) return;
+
+    const uint64_t tokens = Tokens + static_cast<uint64_t>(elapsed) * TokensPerSecond;
+    Tokens = tokens < TokenMax ? static_cast<uint32_t>(tokens) : TokenMax;
+}
+
+bool MessageScheduler::Publish(MessagePriority priority)
+{
+    MessageQueue& queue = GetQueue(priority);
+    char topic[MessageQueue::TopicMaxSize + 1];
+    queue.GetFrontTopic(topic);
+    const size_t payloadSize = queue.GetFrontPayloadSize();
+
+    const unsigned long publishStartTime = millis();
+    MqttStreamWriter writer(Client);
+    bool published = writer.Begin(topic, payloadSize);
+    if (published)
+    {
+        const bool read = queue.ReadFrontPayload(writer);
+        published = writer.End() && read;
+    }
+    LastPublishSucceeded[static_cast<size_t>(priority)] = published;
+    LastPublishMillisecs[static_cast<size_t>(priority)] = millis() - publishStartTime;
+
+    if (!published)
+    {
+        ++NetworkStats::PublishFailures;
+
+        // Give up on a message that keeps failing instead of blocking its class
+        if (++queue.FrontAttempts() >= MaxAttempts) queue.Drop();
+        return false;
+    }
+
+    NetworkStats::Publish.Add(LastPublishMillisecs[static_cast<size_t>(priority)]);
+    NetworkStats::PublishBytes += payloadSize;
+    queue.Pop();
+
+    return true;
+}
@@ -0,0 +1,68 @@
+#include "MqttStreamWriter.h"
+#include <string.h>
+
+MqttStreamWriter::MqttStreamWriter(PubSubClient& client) :
+    Client{ client },
+    ChunkUsed{ 0 },
+    Remaining{ 0 },
+    Failed{ true }
+{
+}
+
+bool MqttStreamWriter::Begin(const char* topic, size_t payloadSize)
+{
+    ChunkUsed = 0;
+    Remaining = payloadSize;
+    Failed = !Client.beginPublish(topic, payloadSize, false);
+
+    return !Failed;
+}
+
+bool MqttStreamWriter::Write(const uint8_t* data, size_t size)
+{
+    if (Failed) return false;
+    if (size > Remaining)
+    {
+        Failed = true;
+        return false;
+    }
+    Remaining -= size;
+
+    while (size > 0)
+    {
+        const size_t copySize = ChunkSize - ChunkUsed < size ? ChunkSize - ChunkUsed : size;
+        memcpy(&Chunk[ChunkUsed], data, copySize);
+        ChunkUsed += copySize;
+        data += copySize;
+        size -= copySize;
+
+        if (ChunkUsed >= ChunkSize && !Flush()) return false;
+    }
+
+    return true;
+}
+
+bool MqttStreamWriter::End()
+{
+    if (!Failed && Remaining != 0) Failed = true;   // Declared length was not written
+    if (!Failed) Flush();
+
+    // A partially written PUBLISH leaves the session out of sync
+    if (Failed)
+    {
+        Client.disconnect();
+        return false;
+    }
+
+    return Client.endPublish() != 0;
+}
+
+bool MqttStreamWriter::Flush()
+{
+    if (ChunkUsed == 0) return true;
+
+    if (Client.write(Chunk, ChunkUsed) != ChunkUsed) Failed = true;
+    ChunkUsed = 0;
+
+    return !Failed;
+}
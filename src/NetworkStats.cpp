@@ -0,0 +1,53 @@
+#include <Arduino.h>
+#include "NetworkStats.h"
+
+#define DLM "\r\n"
+
+NetworkStats::Latency NetworkStats::WiFiAssociate;
+NetworkStats::Latency NetworkStats::WiFiDhcp;
+NetworkStats::Latency NetworkStats::DnsResolve;
+NetworkStats::Latency NetworkStats::DpsRegister;
+NetworkStats::Latency NetworkStats::HubConnect;
+NetworkStats::Latency NetworkStats::Publish;
+
+uint32_t NetworkStats::HubConnectFailures = 0;
+uint32_t NetworkStats::PublishFailures = 0;
+uint64_t NetworkStats::PublishBytes = 0;
+uint32_t NetworkStats::ReceivedMessages = 0;
+unsigned long NetworkStats::HubConnectedTime = 0;
+
+void NetworkStats::Latency::Add(uint32_t millisecs)
+{
+    if (Count == 0 || millisecs < Min) Min = millisecs;
+    if (Count == 0 || millisecs > Max) Max = millisecs;
+    Last = millisecs;
+    Total += millisecs;
+    ++Count;
+}
+
+void NetworkStats::OnHubConnected(unsigned long now)
+{
+    HubConnectedTime = now;
+}
+
+static void PrintLatency(const char* name, const NetworkStats::Latency& latency)
+{
+    Serial.print(String::format(" %s: count = %lu, last = %lu ms, min = %lu ms, avg = %lu ms, max = %lu ms" DLM, name, latency.Count, latency.Last, latency.Min, latency.Average(), latency.Max));
+}
+
+void NetworkStats::Print()
+{
+    const unsigned long connectedSecs = (millis() - HubConnectedTime) / 1000;
+
+    Serial.print("Network stats:" DLM);
+    PrintLatency("Wi-Fi associate", WiFiAssociate);
+    PrintLatency("Wi-Fi DHCP", WiFiDhcp);
+    PrintLatency("DNS resolve", DnsResolve);
+    PrintLatency("DPS register", DpsRegister);
+    PrintLatency("Hub connect", HubConnect);
+    PrintLatency("Publish", Publish);
+    Serial.print(String::format(" Hub connect failures = %lu" DLM, HubConnectFailures));
+    Serial.print(String::format(" Publish failures = %lu" DLM, PublishFailures));
+    Serial.print(String::format(" Publish bytes = %lu (%lu B/s over %lu s connected)" DLM, static_cast<unsigned long>(PublishBytes), connectedSecs > 0 ? static_cast<unsigned long>(PublishBytes / connectedSecs) : 0, connectedSecs));
+    Serial.print(String::format(" Received messages = %lu" DLM, ReceivedMessages));
+}
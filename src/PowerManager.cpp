@@ -0,0 +1,87 @@
+#include <Arduino.h>
+#include <rpcWiFi.h>
+#include "PowerManager.h"
+#include "Storage.h"
+
+#define DLM "\r\n"
+
+constexpr const char* PowerManager::KeyLowPower;
+
+bool PowerManager::LowPower = false;
+bool PowerManager::BacklightOn = true;
+unsigned long PowerManager::BacklightTimeoutMillisecs = 0;
+unsigned long PowerManager::LastActivityTime = 0;
+uint32_t PowerManager::SleepMillisecs = 0;
+
+void PowerManager::Init(bool lowPower, unsigned long backlightTimeoutMillisecs)
+{
+    const uint8_t* value;
+    size_t valueSize;
+    LowPower = Storage::Get(KeyLowPower, &value, &valueSize) && valueSize == 1 ? value[0] != 0 : lowPower;
+    BacklightTimeoutMillisecs = backlightTimeoutMillisecs;
+    NotifyActivity(millis());
+}
+
+void PowerManager::SetLowPower(bool enable)
+{
+    const uint8_t value = enable ? 1 : 0;
+    Storage::Set(KeyLowPower, &value, sizeof(value));
+    LowPower = enable;
+
+    ApplyWiFiPowerSave();
+    NotifyActivity(millis());
+}
+
+void PowerManager::ApplyWiFiPowerSave()
+{
+    // The RTL8720 sleeps between DTIM beacons and wakes for buffered frames
+    if (WiFi.status() == WL_CONNECTED) WiFi.setSleep(LowPower);
+}
+
+void PowerManager::NotifyActivity(unsigned long now)
+{
+    LastActivityTime = now;
+    SetBacklight(true);
+}
+
+void PowerManager::SetBacklight(bool on)
+{
+    if (BacklightOn == on) return;
+
+    digitalWrite(LCD_BACKLIGHT, on ? HIGH : LOW);
+    BacklightOn = on;
+}
+
+void PowerManager::DoWork(unsigned long now)
+{
+    if (!LowPower || !BacklightOn || BacklightTimeoutMillisecs == 0) return;
+
+    if (now - LastActivityTime >= BacklightTimeoutMillisecs) SetBacklight(false);
+}
+
+void PowerManager::Idle(unsigned long maxMillisecs)
+{
+    if (!LowPower) return;
+
+    // Idle sleep stops the CPU clock only. Standby would also stop the USB and the UART
+    // to the RTL8720, losing console input and MQTT traffic.
+    PM->SLEEPCFG.reg = PM_SLEEPCFG_SLEEPMODE_IDLE;
+    while (PM->SLEEPCFG.bit.SLEEPMODE != PM_SLEEPCFG_SLEEPMODE_IDLE_Val);
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+
+    // SysTick wakes the core every millisecond, go back to sleep until something else happens
+    const unsigned long start = millis();
+    while (millis() - start < maxMillisecs && !Serial.available())
+    {
+        __DSB();
+        __WFI();
+    }
+    SleepMillisecs += millis() - start;
+}
+
+void PowerManager::Print()
+{
+    Serial.print(String::format("Low-power mode = %s" DLM, LowPower ? "on" : "off"));
+    Serial.print(String::format("Backlight = %s" DLM, BacklightOn ? "on" : "off"));
+    Serial.print(String::format("Sleep time = %lu s" DLM, SleepMillisecs / 1000));
+}
@@ -0,0 +1,67 @@
+#include "ResolvingClientSecure.h"
+#include "DnsCache.h"
+#include "Watchdog.h"
+
+ResolvingClientSecure::ResolvingClientSecure() :
+    RootCA{ nullptr }
+{
+}
+
+static const char* GetPem(const std::string& pem)
+{
+    return pem.empty() ? nullptr : pem.c_str();
+}
+
+void ResolvingClientSecure::setCACert(const char* rootCA)
+{
+    RootCA = rootCA;
+    WiFiClientSecure::setCACert(rootCA);
+}
+
+void ResolvingClientSecure::setCertificate(const char* clientCertificate)
+{
+    ClientCertificate = clientCertificate != nullptr ? clientCertificate : "";
+}
+
+void ResolvingClientSecure::setPrivateKey(const char* privateKey)
+{
+    PrivateKey = privateKey != nullptr ? privateKey : "";
+}
+
+int ResolvingClientSecure::connect(const char* host, uint16_t port)
+{
+    const int connected = ConnectResolved(host, port);
+
+    // The handshake has parsed the PEMs, free the copies
+    std::string().swap(ClientCertificate);
+    std::string().swap(PrivateKey);
+    if (!connected) return 0;
+
+    // Only now, the write may compact the store and erase flash
+    DnsCache::SavePersistent();
+
+    // The MQTT CONNACK wait comes next
+    Watchdog::Feed();
+
+    return 1;
+}
+
+int ResolvingClientSecure::ConnectResolved(const char* host, uint16_t port)
+{
+    IPAddress ip;
+    bool fromCache;
+    if (!DnsCache::Resolve(host, &ip, &fromCache)) return 0;
+
+    // Each blocking step gets a whole WDT period, the handshake takes seconds
+    Watchdog::Feed();
+    if (WiFiClientSecure::connect(ip, port, host, RootCA, GetPem(ClientCertificate), GetPem(PrivateKey))) return 1;
+    if (!fromCache) return 0;
+
+    // The host may have moved, look it up again
+    DnsCache::Invalidate(host);
+    IPAddress freshIp;
+    if (!DnsCache::Resolve(host, &freshIp, &fromCache) || freshIp == ip) return 0;
+
+    Watchdog::Feed();
+    return WiFiClientSecure::connect(freshIp, port, host, RootCA, GetPem(ClientCertificate), GetPem(PrivateKey));
+}
@@ -0,0 +1,102 @@
+#include <Arduino.h>
+#include "SerialStream.h"
+#include "Crc.h"
+#include "GasCalibration.h"
+
+bool SerialStream::Enabled = false;
+unsigned long SerialStream::IntervalMillisecs = 0;
+unsigned long SerialStream::NextSendTime = 0;
+uint32_t SerialStream::Sequence = 0;
+uint32_t SerialStream::DroppedFrames = 0;
+
+static constexpr size_t HeaderSize = 2 + 1 + 2 + 4 + 4;
+static constexpr size_t TrailerSize = 4;
+static constexpr size_t PayloadMaxSize = 128;
+static constexpr size_t GasSensorCount = static_cast<size_t>(GasSensor::Count);
+
+static void PutU16(uint8_t* p, uint16_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static void PutU32(uint8_t* p, uint32_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = value >> 24;
+}
+
+void SerialStream::Enable(bool enable, unsigned long intervalMillisecs)
+{
+    if (enable && !Enabled)
+    {
+        Sequence = 0;
+        DroppedFrames = 0;
+        NextSendTime = millis();
+    }
+    Enabled = enable;
+    IntervalMillisecs = intervalMillisecs;
+}
+
+bool SerialStream::IsDue(unsigned long now)
+{
+    if (!Enabled) return false;
+    if (static_cast<long>(now - NextSendTime) < 0) return false;
+
+    // Skip missed slots instead of bursting to catch up
+    NextSendTime += IntervalMillisecs;
+    if (static_cast<long>(now - NextSendTime) >= 0) NextSendTime = now + IntervalMillisecs;
+
+    return true;
+}
+
+bool SerialStream::Send(unsigned long now, const TelemetrySample& sample)
+{
+    return SendFrame(FrameType::TelemetrySample, now, &sample, sizeof(sample));
+}
+
+bool SerialStream::SendGas(unsigned long now)
+{
+    uint8_t payload[GasSensorCount * (2 + 4 + 4)];
+    static_assert(sizeof(payload) <= PayloadMaxSize, "Gas payload too large");
+
+    for (size_t i = 0; i < GasSensorCount; ++i)
+    {
+        const GasSensor sensor = static_cast<GasSensor>(i);
+        PutU16(&payload[i * 2], GasCalibration::GetLastCount(sensor));
+        PutU32(&payload[GasSensorCount * 2 + i * 4], GasCalibration::GetLastRatio(sensor));
+        PutU32(&payload[GasSensorCount * 6 + i * 4], GasCalibration::GetBaseline(sensor));
+    }
+
+    return SendFrame(FrameType::GasRaw, now, payload, sizeof(payload));
+}
+
+bool SerialStream::SendFrame(FrameType type, unsigned long now, const void* payload, size_t payloadSize)
+{
+    static_assert(sizeof(TelemetrySample) <= PayloadMaxSize, "TelemetrySample too large");
+    uint8_t frame[HeaderSize + PayloadMaxSize + TrailerSize];
+    if (payloadSize > PayloadMaxSize) return false;
+
+    const uint32_t sequence = Sequence++;
+
+    // Don't block the main loop when no host has the port open; the gap shows up in the sequence number
+    const size_t frameSize = HeaderSize + payloadSize + TrailerSize;
+    if (!Serial)
+    {
+        ++DroppedFrames;
+        return false;
+    }
+
+    frame[0] = Sync0;
+    frame[1] = Sync1;
+    frame[2] = static_cast<uint8_t>(type);
+    PutU16(&frame[3], static_cast<uint16_t>(payloadSize));
+    PutU32(&frame[5], sequence);
+    PutU32(&frame[9], static_cast<uint32_t>(now));
+    memcpy(&frame[HeaderSize], payload, payloadSize);
+    PutU32(&frame[HeaderSize + payloadSize], Crc32(&frame[2], HeaderSize - 2 + payloadSize));
+
+    return Serial.write(frame, frameSize) == frameSize;
+}
@@ -4,15 +4,15 @@
 #include <mbedtls/md.h>
 #include <mbedtls/sha256.h>
 
-std::string GenerateEncryptedSignature(const std::string& symmetricKey, const std::vector<uint8_t>& signature)
+std::string GenerateEncryptedSignature(az_span symmetricKey, const std::vector<uint8_t>& signature)
 {
-    unsigned char base64DecodedSymmetricKey[symmetricKey.size() + 1];
+    unsigned char base64DecodedSymmetricKey[az_span_size(symmetricKey) + 1];
 
     // Base64-decode device key
     // <-- symmetricKey
     // --> base64DecodedSymmetricKey
     size_t base64DecodedSymmetricKeyLength;
-    if (mbedtls_base64_decode(base64DecodedSymmetricKey, sizeof(base64DecodedSymmetricKey), &base64DecodedSymmetricKeyLength, (unsigned char*)&symmetricKey[0], symmetricKey.size()) != 0) abort();
+    if (mbedtls_base64_decode(base64DecodedSymmetricKey, sizeof(base64DecodedSymmetricKey), &base64DecodedSymmetricKeyLength, az_span_ptr(symmetricKey), az_span_size(symmetricKey)) != 0) abort();
     if (base64DecodedSymmetricKeyLength == 0) abort();
 
     // SHA-256 encrypt
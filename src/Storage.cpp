@@ -1,84 +1,413 @@
 #include <Arduino.h>
 #include "Storage.h"
+#include "Crc.h"
+#include "ExternalFlash.h"
+#include <vector>
 #include <MsgPack.h>
-#include <ExtFlashLoader.h>
 
-static auto FlashStartAddress = reinterpret_cast<const uint8_t* const>(0x04000000);
+static auto FlashStartAddress = ExternalFlash::Map(0);
 
-static ExtFlashLoader::QSPIFlash Flash;
+static constexpr uint32_t FlashSectorSize = ExternalFlash::SectorSize;
 
-std::string Storage::WiFiSSID;
-std::string Storage::WiFiPassword;
-std::string Storage::IdScope;
-std::string Storage::RegistrationId;
-std::string Storage::SymmetricKey;
+static constexpr uint32_t LegacyAddress = 0;                // "AZ01" record written by previous firmware
+static constexpr uint32_t StoreAddress = 1 * FlashSectorSize;
+static constexpr int StoreSectorNumber = 4;
 
-int Storage::Init = [] {
-	Flash.initialize();    
-	Flash.reset();
-	Flash.enterToMemoryMode();
+static constexpr char SectorMagic[4] = { 'K', 'V', 'S', '1' };
+static constexpr uint32_t SectorHeaderSize = 8;             // magic, sequence number
 
-	WiFiSSID.clear();
-	WiFiPassword.clear();
-	IdScope.clear();
-	RegistrationId.clear();
-	SymmetricKey.clear();
-	
-	return 0;
-}();
+static constexpr uint8_t RecordEnd = 0xff;                  // KeySize of erased flash
+static constexpr size_t RecordHeaderSize = 8;               // key size, reserved, value size, CRC
+static constexpr size_t KeyMaxSize = 32;
+static constexpr size_t ValueMaxSize = 2048;
 
-void Storage::Load()
+static constexpr size_t IndexSize = 128;                    // Power of 2
+
+struct IndexEntry
+{
+	uint32_t Hash;
+	uint32_t Address;	// 0: empty
+};
+
+static IndexEntry Index[IndexSize];
+static uint32_t SectorSequence[StoreSectorNumber];		// 0: not in use
+static int HeadSector = -1;
+static uint32_t HeadOffset = 0;
+
+constexpr const char* Storage::KeyWiFiSSID;
+constexpr const char* Storage::KeyWiFiPassword;
+constexpr const char* Storage::KeyIdScope;
+constexpr const char* Storage::KeyRegistrationId;
+constexpr const char* Storage::KeySymmetricKey;
+constexpr const char* Storage::KeyHubHost;
+constexpr const char* Storage::KeyDeviceId;
+constexpr const char* Storage::KeyX509Certificate;
+constexpr const char* Storage::KeyX509PrivateKey;
+
+az_span Storage::WiFiSSID = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::WiFiPassword = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::IdScope = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::RegistrationId = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::SymmetricKey = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::HubHost = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::DeviceId = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::X509Certificate = AZ_SPAN_LITERAL_FROM_STR("");
+az_span Storage::X509PrivateKey = AZ_SPAN_LITERAL_FROM_STR("");
+
+////////////////////////////////////////////////////////////////////////////////
+// Record
+
+static inline uint32_t SectorAddress(int sector)
+{
+	return StoreAddress + sector * FlashSectorSize;
+}
+
+static inline size_t RecordSize(size_t keySize, size_t valueSize)
+{
+	return (RecordHeaderSize + keySize + valueSize + 1 + 3) & ~static_cast<size_t>(3);	// Value is followed by '\0'
+}
+
+static uint32_t RecordCrc(const uint8_t* header, const uint8_t* key, size_t keySize, const uint8_t* value, size_t valueSize)
+{
+	uint32_t crc = Crc32(header, 4);
+	crc = Crc32(key, keySize, crc);
+	return Crc32(value, valueSize, crc);
+}
+
+// Returns the record size, or 0 at the end of the log or on a corrupted record.
+static size_t ValidateRecord(uint32_t address, uint32_t limit)
+{
+	const uint8_t* record = &FlashStartAddress[address];
+	const size_t keySize = record[0];
+	if (keySize == RecordEnd || keySize == 0 || keySize > KeyMaxSize) return 0;
+	const size_t valueSize = record[2] | record[3] << 8;
+	if (valueSize > ValueMaxSize) return 0;
+	const size_t size = RecordSize(keySize, valueSize);
+	if (address + size > limit) return 0;
+
+	uint32_t crc;
+	memcpy(&crc, &record[4], sizeof(crc));
+	if (crc != RecordCrc(record, &record[RecordHeaderSize], keySize, &record[RecordHeaderSize + keySize], valueSize)) return 0;
+
+	return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Index
+
+static uint32_t HashKey(const char* key, size_t keySize)
+{
+	uint32_t hash = 2166136261u;	// FNV-1a
+	for (size_t i = 0; i < keySize; ++i) hash = (hash ^ static_cast<uint8_t>(key[i])) * 16777619u;
+
+	return hash;
+}
+
+static bool IsRecordKey(uint32_t address, const char* key, size_t keySize)
+{
+	const uint8_t* record = &FlashStartAddress[address];
+
+	return record[0] == keySize && memcmp(&record[RecordHeaderSize], key, keySize) == 0;
+}
+
+static IndexEntry* FindIndexEntry(const char* key, size_t keySize, bool forInsert)
 {
-	if (memcmp(&FlashStartAddress[0], "AZ01", 4) != 0)
+	const uint32_t hash = HashKey(key, keySize);
+	for (size_t i = 0; i < IndexSize; ++i)
 	{
-		Storage::WiFiSSID.clear();
-		Storage::WiFiPassword.clear();
-		Storage::IdScope.clear();
-		Storage::RegistrationId.clear();
-		Storage::SymmetricKey.clear();
+		IndexEntry* entry = &Index[(hash + i) & (IndexSize - 1)];
+		if (entry->Address == 0) return forInsert ? entry : nullptr;
+		if (entry->Hash == hash && IsRecordKey(entry->Address, key, keySize)) return entry;
 	}
-	else
+
+	return nullptr;
+}
+
+static bool IndexRecord(uint32_t address)
+{
+	const uint8_t* record = &FlashStartAddress[address];
+	const char* key = reinterpret_cast<const char*>(&record[RecordHeaderSize]);
+	const size_t keySize = record[0];
+
+	IndexEntry* entry = FindIndexEntry(key, keySize, true);
+	if (entry == nullptr) return false;
+	entry->Hash = HashKey(key, keySize);
+	entry->Address = address;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Log
+
+static bool IsSectorInUse(int sector)
+{
+	return memcmp(&FlashStartAddress[SectorAddress(sector)], SectorMagic, sizeof(SectorMagic)) == 0;
+}
+
+static void FormatSector(int sector, uint32_t sequence)
+{
+	const uint32_t address = SectorAddress(sector);
+	if (*reinterpret_cast<const uint32_t*>(&FlashStartAddress[address]) != 0xffffffff) ExternalFlash::EraseSector(address);
+
+	uint8_t header[SectorHeaderSize];
+	memcpy(&header[0], SectorMagic, sizeof(SectorMagic));
+	memcpy(&header[4], &sequence, sizeof(sequence));
+	ExternalFlash::Program(address, header, sizeof(header));
+
+	SectorSequence[sector] = sequence;
+}
+
+static bool AppendRaw(const uint8_t* record, size_t size)
+{
+	if (HeadOffset + size > FlashSectorSize) return false;
+
+	const uint32_t address = SectorAddress(HeadSector) + HeadOffset;
+	ExternalFlash::Program(address, record, size);
+	HeadOffset += size;
+
+	return IndexRecord(address);
+}
+
+// Moves the live records of the oldest sector to the head and erases it,
+// so that the sector after the head is always free.
+// The sector is left as it is when the head has no room for all of its live records.
+static bool CollectSector(int sector)
+{
+	if (IsSectorInUse(sector))
+	{
+		const uint32_t begin = SectorAddress(sector);
+		const uint32_t end = begin + FlashSectorSize;
+
+		size_t liveSize = 0;
+		for (size_t i = 0; i < IndexSize; ++i)
+		{
+			const uint32_t address = Index[i].Address;
+			if (address < begin || end <= address) continue;
+			const uint8_t* record = &FlashStartAddress[address];
+			liveSize += RecordSize(record[0], record[2] | record[3] << 8);
+		}
+		if (HeadOffset + liveSize > FlashSectorSize)
+		{
+			Serial.print("Storage: Out of space while compacting\r\n");
+			return false;
+		}
+
+		for (size_t i = 0; i < IndexSize; ++i)
+		{
+			const uint32_t address = Index[i].Address;
+			if (address < begin || end <= address) continue;
+
+			const uint8_t* record = &FlashStartAddress[address];
+			const size_t size = RecordSize(record[0], record[2] | record[3] << 8);
+			std::vector<uint8_t> buf(record, record + size);	// Copy out before the flash leaves memory mode
+			if (!AppendRaw(&buf[0], buf.size())) return false;
+		}
+	}
+
+	ExternalFlash::EraseSector(SectorAddress(sector));
+	SectorSequence[sector] = 0;
+
+	return true;
+}
+
+// Returns false if the sector after the head could not be freed, the store is full.
+static bool AdvanceHead()
+{
+	// Compaction that was cut short by a power loss is finished first
+	const int newHead = (HeadSector + 1) % StoreSectorNumber;
+	if (SectorSequence[newHead] != 0 && !CollectSector(newHead)) return false;
+
+	const uint32_t sequence = HeadSector >= 0 ? SectorSequence[HeadSector] + 1 : 1;
+	FormatSector(newHead, sequence);
+	HeadSector = newHead;
+	HeadOffset = SectorHeaderSize;
+
+	return CollectSector((HeadSector + 1) % StoreSectorNumber);
+}
+
+static void Replay()
+{
+	memset(Index, 0, sizeof(Index));
+	HeadSector = -1;
+	HeadOffset = 0;
+
+	// Oldest sector first, so that newer records override older ones
+	for (int sector = 0; sector < StoreSectorNumber; ++sector)
+	{
+		SectorSequence[sector] = 0;
+		if (IsSectorInUse(sector)) memcpy(&SectorSequence[sector], &FlashStartAddress[SectorAddress(sector) + 4], sizeof(uint32_t));
+	}
+
+	uint32_t lastSequence = 0;
+	while (true)
+	{
+		int sector = -1;
+		for (int i = 0; i < StoreSectorNumber; ++i)
+		{
+			if (SectorSequence[i] > lastSequence && (sector < 0 || SectorSequence[i] < SectorSequence[sector])) sector = i;
+		}
+		if (sector < 0) break;
+		lastSequence = SectorSequence[sector];
+
+		const uint32_t begin = SectorAddress(sector);
+		const uint32_t end = begin + FlashSectorSize;
+		uint32_t address = begin + SectorHeaderSize;
+		while (address + RecordHeaderSize <= end)
+		{
+			const size_t size = ValidateRecord(address, end);
+			if (size == 0) break;
+			if (!IndexRecord(address)) Serial.print("Storage: Index is full\r\n");
+			address += size;
+		}
+
+		HeadSector = sector;
+		HeadOffset = address - begin;
+
+		// A torn record leaves the rest of the sector unusable
+		if (address + RecordHeaderSize <= end && FlashStartAddress[address] != RecordEnd) HeadOffset = FlashSectorSize;
+	}
+
+	if (HeadSector < 0)
+	{
+		AdvanceHead();
+	}
+	else if (SectorSequence[(HeadSector + 1) % StoreSectorNumber] != 0)
+	{
+		// Power was lost during compaction
+		CollectSector((HeadSector + 1) % StoreSectorNumber);
+	}
+}
+
+static az_span View(const char* key)
+{
+	const uint8_t* data;
+	size_t size;
+	if (!Storage::Get(key, &data, &size)) return AZ_SPAN_FROM_STR("");
+
+	return az_span_create(const_cast<uint8_t*>(data), size);
+}
+
+// Records may move during compaction, so the views are refreshed after every change.
+static void UpdateViews()
+{
+	Storage::WiFiSSID = View(Storage::KeyWiFiSSID);
+	Storage::WiFiPassword = View(Storage::KeyWiFiPassword);
+	Storage::IdScope = View(Storage::KeyIdScope);
+	Storage::RegistrationId = View(Storage::KeyRegistrationId);
+	Storage::SymmetricKey = View(Storage::KeySymmetricKey);
+	Storage::HubHost = View(Storage::KeyHubHost);
+	Storage::DeviceId = View(Storage::KeyDeviceId);
+	Storage::X509Certificate = View(Storage::KeyX509Certificate);
+	Storage::X509PrivateKey = View(Storage::KeyX509PrivateKey);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Storage
+
+void Storage::Load()
+{
+	Replay();
+
+	if (memcmp(&FlashStartAddress[LegacyAddress], "AZ01", 4) == 0)
 	{
 		MsgPack::Unpacker unpacker;
-		unpacker.feed(&FlashStartAddress[8], *(const uint32_t*)&FlashStartAddress[4]);
+		unpacker.feed(&FlashStartAddress[LegacyAddress + 8], *(const uint32_t*)&FlashStartAddress[LegacyAddress + 4]);
 
 		MsgPack::str_t str[5];
 		unpacker.deserialize(str[0], str[1], str[2], str[3], str[4]);
 
-		Storage::WiFiSSID = str[0].c_str();
-		Storage::WiFiPassword = str[1].c_str();
-		Storage::IdScope = str[2].c_str();
-		Storage::RegistrationId = str[3].c_str();
-		Storage::SymmetricKey = str[4].c_str();
+		// Migrate to the key-value store
+		Set(KeyWiFiSSID, str[0].c_str());
+		Set(KeyWiFiPassword, str[1].c_str());
+		Set(KeyIdScope, str[2].c_str());
+		Set(KeyRegistrationId, str[3].c_str());
+		Set(KeySymmetricKey, str[4].c_str());
+		ExternalFlash::EraseSector(LegacyAddress);
 	}
+
+	UpdateViews();
 }
 
-void Storage::Save()
+void Storage::Erase()
 {
-    MsgPack::Packer packer;
+	for (int sector = 0; sector < StoreSectorNumber; ++sector)
 	{
-		MsgPack::str_t str[5];
-		str[0] = Storage::WiFiSSID.c_str();
-		str[1] = Storage::WiFiPassword.c_str();
-		str[2] = Storage::IdScope.c_str();
-		str[3] = Storage::RegistrationId.c_str();
-		str[4] = Storage::SymmetricKey.c_str();
-		packer.serialize(str[0], str[1], str[2], str[3], str[4]);
+		if (*reinterpret_cast<const uint32_t*>(&FlashStartAddress[SectorAddress(sector)]) != 0xffffffff) ExternalFlash::EraseSector(SectorAddress(sector));
 	}
+	if (*reinterpret_cast<const uint32_t*>(&FlashStartAddress[LegacyAddress]) != 0xffffffff) ExternalFlash::EraseSector(LegacyAddress);
 
-	std::vector<uint8_t> buf(4 + 4 + packer.size());
-	memcpy(&buf[0], "AZ01", 4);
-	*(uint32_t*)&buf[4] = packer.size();
-	memcpy(&buf[8], packer.data(), packer.size());
+	Replay();
+	UpdateViews();
+}
+
+bool Storage::Get(const char* key, const uint8_t** value, size_t* valueSize)
+{
+	const size_t keySize = strlen(key);
+	const IndexEntry* entry = FindIndexEntry(key, keySize, false);
+	if (entry == nullptr) return false;
+
+	const uint8_t* record = &FlashStartAddress[entry->Address];
+	*value = &record[RecordHeaderSize + keySize];
+	*valueSize = record[2] | record[3] << 8;
 
-	ExtFlashLoader::writeExternalFlash(Flash, 0, &buf[0], buf.size(), [](std::size_t bytes_processed, std::size_t bytes_total, bool verifying) { return true; });
+	return true;
 }
 
-void Storage::Erase()
+bool Storage::Set(const char* key, const void* value, size_t valueSize)
+{
+	const size_t keySize = strlen(key);
+	if (keySize == 0 || keySize > KeyMaxSize || valueSize > ValueMaxSize) return false;
+	if (HeadSector < 0) Replay();
+
+	const uint8_t* current;
+	size_t currentSize;
+	if (Get(key, &current, &currentSize) && currentSize == valueSize && memcmp(current, value, valueSize) == 0) return true;
+
+	std::vector<uint8_t> record(RecordSize(keySize, valueSize), 0);
+	record[0] = keySize;
+	record[1] = 0xff;
+	record[2] = valueSize & 0xff;
+	record[3] = valueSize >> 8;
+	memcpy(&record[RecordHeaderSize], key, keySize);
+	memcpy(&record[RecordHeaderSize + keySize], value, valueSize);
+	const uint32_t crc = RecordCrc(&record[0], &record[RecordHeaderSize], keySize, &record[RecordHeaderSize + keySize], valueSize);
+	memcpy(&record[4], &crc, sizeof(crc));
+
+	// Each advance reclaims the space of the overwritten records in one sector
+	for (int attempt = 0; HeadOffset + record.size() > FlashSectorSize; ++attempt)
+	{
+		if (attempt >= StoreSectorNumber || !AdvanceHead())
+		{
+			UpdateViews();
+			return false;
+		}
+	}
+
+	const bool appended = AppendRaw(&record[0], record.size());
+	UpdateViews();
+
+	return appended;
+}
+
+size_t Storage::GetUsedBytes()
 {
-	Flash.exitFromMemoryMode();
-	Flash.writeEnable();
-	Flash.eraseSector(0);
-	Flash.waitProgram(0);
-	Flash.enterToMemoryMode();
+	size_t used = 0;
+	for (size_t i = 0; i < IndexSize; ++i)
+	{
+		if (Index[i].Address == 0) continue;
+		const uint8_t* record = &FlashStartAddress[Index[i].Address];
+		used += RecordSize(record[0], record[2] | record[3] << 8);
+	}
+
+	return used;
+}
+
+size_t Storage::GetFreeBytes()
+{
+	// One sector is always kept free for compaction
+	const size_t capacity = (StoreSectorNumber - 1) * (FlashSectorSize - SectorHeaderSize);
+	const size_t used = GetUsedBytes();
+
+	return used < capacity ? capacity - used : 0;
 }
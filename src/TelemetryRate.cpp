@@ -0,0 +1,56 @@
+#include "TelemetryRate.h"
+#include <math.h>
+
+static constexpr unsigned int BackOffSteps = 8;     // Number of steps from min to max interval during stable periods
+static constexpr float VocSlopeSmoothing = 0.5f;    // Weight of the newest slope in the moving average
+
+TelemetryRate::TelemetryRate(unsigned long initialIntervalMillisecs, unsigned long minIntervalMillisecs, unsigned long maxIntervalMillisecs) :
+    MinIntervalMillisecs{ minIntervalMillisecs },
+    MaxIntervalMillisecs{ maxIntervalMillisecs },
+    BackOffStepMillisecs{ (maxIntervalMillisecs - minIntervalMillisecs) / BackOffSteps },
+    VocSlopeThreshold{ 0.0f },
+    RssiThreshold{ -128 },
+    PublishLatencyThreshold{ 0 },
+    IntervalMillisecs{ initialIntervalMillisecs },
+    HasLastSample{ false },
+    LastSampleTime{ 0 },
+    LastVoc{ 0.0f },
+    VocSlope{ 0.0f },
+    LinkDegraded{ false }
+{
+    if (IntervalMillisecs < MinIntervalMillisecs) IntervalMillisecs = MinIntervalMillisecs;
+    if (IntervalMillisecs > MaxIntervalMillisecs) IntervalMillisecs = MaxIntervalMillisecs;
+}
+
+void TelemetryRate::Update(unsigned long now, float voc, int rssi, unsigned long publishLatencyMillisecs, bool published)
+{
+    // VOC slope [/s]
+    if (HasLastSample && now != LastSampleTime)
+    {
+        const float slope = fabsf(voc - LastVoc) * 1000.0f / (now - LastSampleTime);
+        VocSlope = VocSlope * (1.0f - VocSlopeSmoothing) + slope * VocSlopeSmoothing;
+    }
+    HasLastSample = true;
+    LastSampleTime = now;
+    LastVoc = voc;
+
+    // Link quality
+    LinkDegraded = !published || rssi < RssiThreshold || (PublishLatencyThreshold > 0 && publishLatencyMillisecs > PublishLatencyThreshold);
+
+    // Next interval
+    if (LinkDegraded)
+    {
+        // Back off quickly to avoid retries on a poor link
+        IntervalMillisecs = IntervalMillisecs * 2 < MaxIntervalMillisecs ? IntervalMillisecs * 2 : MaxIntervalMillisecs;
+    }
+    else if (VocSlopeThreshold > 0.0f && VocSlope > VocSlopeThreshold)
+    {
+        // Speed up while the concentration is changing
+        IntervalMillisecs = IntervalMillisecs / 2 > MinIntervalMillisecs ? IntervalMillisecs / 2 : MinIntervalMillisecs;
+    }
+    else
+    {
+        // Back off slowly during stable periods
+        IntervalMillisecs = IntervalMillisecs + BackOffStepMillisecs < MaxIntervalMillisecs ? IntervalMillisecs + BackOffStepMillisecs : MaxIntervalMillisecs;
+    }
+}
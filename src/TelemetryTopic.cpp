@@ -0,0 +1,85 @@
+#include "TelemetryTopic.h"
+#include <string.h>
+#include <az_result.h>
+#include <az_span.h>
+
+static constexpr char CreationTimePropertyName[] = "iothub-creation-time-utc";
+static constexpr char CreationTimePlaceholder[] = "0000-00-00T00:00:00.000Z";
+static_assert(sizeof(CreationTimePlaceholder) - 1 == Iso8601Size, "Placeholder must match the formatted width");
+
+static inline void FormatDigits2(char* buf, unsigned value)
+{
+    buf[0] = '0' + value / 10;
+    buf[1] = '0' + value % 10;
+}
+
+void FormatIso8601(char* buf, uint64_t epochMillisecs)
+{
+    const uint64_t epochTime = epochMillisecs / 1000;
+    const uint32_t millisecs = static_cast<uint32_t>(epochMillisecs % 1000);
+    const uint32_t days = static_cast<uint32_t>(epochTime / 86400);
+    const uint32_t secs = static_cast<uint32_t>(epochTime % 86400);
+
+    // Civil date from days since 1970-01-01
+    // http://howardhinnant.github.io/date_algorithms.html#civil_from_days
+    const uint32_t z = days + 719468;
+    const uint32_t era = z / 146097;
+    const uint32_t doe = z - era * 146097;
+    const uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const uint32_t mp = (5 * doy + 2) / 153;
+    const uint32_t day = doy - (153 * mp + 2) / 5 + 1;
+    const uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+    const uint32_t year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+
+    FormatDigits2(&buf[0], year / 100 % 100);
+    FormatDigits2(&buf[2], year % 100);
+    buf[4] = '-';
+    FormatDigits2(&buf[5], month);
+    buf[7] = '-';
+    FormatDigits2(&buf[8], day);
+    buf[10] = 'T';
+    FormatDigits2(&buf[11], secs / 3600);
+    buf[13] = ':';
+    FormatDigits2(&buf[14], secs / 60 % 60);
+    buf[16] = ':';
+    FormatDigits2(&buf[17], secs % 60);
+    buf[19] = '.';
+    buf[20] = '0' + millisecs / 100;
+    FormatDigits2(&buf[21], millisecs % 100);
+    buf[23] = 'Z';
+}
+
+TelemetryTopic::TelemetryTopic() :
+    TimestampOffset{ 0 }
+{
+    Topic[0] = '\0';
+}
+
+int TelemetryTopic::Init(const az_iot_hub_client* client)
+{
+    TimestampOffset = 0;
+
+    az_iot_message_properties props;
+    uint8_t propsBuffer[64];
+    if (az_result_failed(az_iot_message_properties_init(&props, az_span_create(propsBuffer, sizeof(propsBuffer)), 0))) return -1;
+    if (az_result_failed(az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR(CreationTimePropertyName), AZ_SPAN_FROM_STR(CreationTimePlaceholder)))) return -2;
+
+    size_t topicLength;
+    if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(client, &props, Topic, sizeof(Topic), &topicLength))) return -3;
+
+    // The property value is the tail of the topic
+    if (topicLength < Iso8601Size || memcmp(&Topic[topicLength - Iso8601Size], CreationTimePlaceholder, Iso8601Size) != 0) return -4;
+    TimestampOffset = topicLength - Iso8601Size;
+
+    return 0;
+}
+
+const char* TelemetryTopic::Get(uint64_t epochMillisecs)
+{
+    if (!IsValid()) return nullptr;
+
+    FormatIso8601(&Topic[TimestampOffset], epochMillisecs);
+
+    return Topic;
+}
@@ -0,0 +1,180 @@
+#include <Arduino.h>
+#include <Udp.h>
+#include "TimeService.h"
+
+#define DLM "\r\n"
+
+static constexpr uint16_t NtpPort = 123;
+static constexpr uint16_t LocalPort = 2390;
+static constexpr size_t NtpPacketSize = 48;
+static constexpr uint32_t NtpToUnixSeconds = 2208988800UL;     // 1900-01-01 to 1970-01-01
+static constexpr unsigned long RebaseMillisecs = 86400000UL;    // Well within the millis() wrap
+static constexpr unsigned long DriftMinElapsedMillisecs = 600000UL;
+static constexpr int32_t DriftMaxCorrectionMillisecs = 5000;    // Larger errors are steps, not drift
+
+UDP* TimeService::Udp = nullptr;
+const char* TimeService::Server = nullptr;
+unsigned long TimeService::SyncIntervalMillisecs = 0;
+
+bool TimeService::Synchronized = false;
+unsigned long TimeService::AnchorMillis = 0;
+uint64_t TimeService::AnchorEpochMillisecs = 0;
+int32_t TimeService::DriftPpm = 0;
+uint64_t TimeService::LastEpochMillisecs = 0;
+
+bool TimeService::RequestPending = false;
+unsigned long TimeService::RequestTime = 0;
+unsigned long TimeService::NextRequestTime = 0;
+unsigned long TimeService::RetryIntervalMillisecs = TimeService::RetryMinMillisecs;
+
+uint32_t TimeService::SyncCount = 0;
+uint32_t TimeService::SyncFailures = 0;
+int32_t TimeService::LastCorrectionMillisecs = 0;
+
+static uint32_t GetU32(const uint8_t* p)
+{
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 | static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+static void PutU32(uint8_t* p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+}
+
+void TimeService::Begin(UDP& udp, const char* server, unsigned long syncIntervalMillisecs)
+{
+    Udp = &udp;
+    Server = server;
+    SyncIntervalMillisecs = syncIntervalMillisecs;
+    RequestPending = false;
+    NextRequestTime = millis();
+    RetryIntervalMillisecs = RetryMinMillisecs;
+
+    Udp->begin(LocalPort);
+}
+
+void TimeService::DoWork(unsigned long now)
+{
+    if (Udp == nullptr) return;
+
+    // Keep the elapsed time since the anchor small so that the millis() wrap never matters
+    if (Synchronized && now - AnchorMillis >= RebaseMillisecs)
+    {
+        AnchorEpochMillisecs = GetEpochMillisecs(now);
+        AnchorMillis = now;
+    }
+
+    if (RequestPending)
+    {
+        if (ReadReply(now))
+        {
+            RequestPending = false;
+            ++SyncCount;
+            RetryIntervalMillisecs = RetryMinMillisecs;
+            NextRequestTime = now + SyncIntervalMillisecs;
+        }
+        else if (now - RequestTime >= TimeoutMillisecs)
+        {
+            // The clock keeps running on the measured drift until a server answers
+            RequestPending = false;
+            ++SyncFailures;
+            NextRequestTime = now + RetryIntervalMillisecs;
+            RetryIntervalMillisecs = RetryIntervalMillisecs * 2 < SyncIntervalMillisecs ? RetryIntervalMillisecs * 2 : SyncIntervalMillisecs;
+        }
+        return;
+    }
+
+    if (static_cast<long>(now - NextRequestTime) >= 0) SendRequest(now);
+}
+
+uint64_t TimeService::GetEpochMillisecs(unsigned long now)
+{
+    if (!Synchronized) return 0;
+
+    const int64_t elapsed = static_cast<long>(now - AnchorMillis);
+    return AnchorEpochMillisecs + elapsed + elapsed * DriftPpm / 1000000;
+}
+
+uint64_t TimeService::GetEpochMillisecs()
+{
+    // A backward correction holds the clock still instead of repeating timestamps
+    const uint64_t epochMillisecs = GetEpochMillisecs(millis());
+    if (epochMillisecs > LastEpochMillisecs) LastEpochMillisecs = epochMillisecs;
+
+    return LastEpochMillisecs;
+}
+
+void TimeService::Print()
+{
+    Serial.print(String::format("Time: synchronized = %s, syncs = %lu, failures = %lu" DLM, Synchronized ? "yes" : "no", SyncCount, SyncFailures));
+    Serial.print(String::format(" Drift = %ld ppm, last correction = %ld ms" DLM, DriftPpm, LastCorrectionMillisecs));
+}
+
+void TimeService::SendRequest(unsigned long now)
+{
+    // SNTPv4 client request. The transmit timestamp is a nonce echoed back as the originate timestamp.
+    uint8_t packet[NtpPacketSize] = { 0 };
+    packet[0] = 0x23;   // LI = 0, VN = 4, Mode = 3 (client)
+    PutU32(&packet[40], now);
+    PutU32(&packet[44], SyncCount + SyncFailures);
+
+    RequestTime = now;
+    RequestPending = true;
+
+    if (Udp->beginPacket(Server, NtpPort) != 1) return;
+    Udp->write(packet, sizeof(packet));
+    Udp->endPacket();
+}
+
+bool TimeService::ReadReply(unsigned long now)
+{
+    const int size = Udp->parsePacket();
+    if (size <= 0) return false;
+
+    uint8_t packet[NtpPacketSize];
+    if (size < static_cast<int>(sizeof(packet)) || Udp->read(packet, sizeof(packet)) != static_cast<int>(sizeof(packet)))
+    {
+        Udp->flush();
+        return false;
+    }
+    Udp->flush();
+
+    // Server mode, not a kiss-o'-death, and an answer to the outstanding request
+    if ((packet[0] & 0x07) != 4 || packet[1] == 0) return false;
+    if (GetU32(&packet[24]) != RequestTime || GetU32(&packet[28]) != SyncCount + SyncFailures) return false;
+
+    const uint32_t seconds = GetU32(&packet[40]);
+    const uint32_t fraction = GetU32(&packet[44]);
+    const uint64_t transmitEpochMillisecs = static_cast<uint64_t>(seconds - NtpToUnixSeconds) * 1000 + (static_cast<uint64_t>(fraction) * 1000 >> 32);
+
+    // Assume a symmetric path, the reply left the server half a round trip ago
+    Anchor(now, transmitEpochMillisecs + (now - RequestTime) / 2);
+
+    return true;
+}
+
+void TimeService::Anchor(unsigned long now, uint64_t epochMillisecs)
+{
+    if (Synchronized)
+    {
+        const int64_t error = static_cast<int64_t>(epochMillisecs - GetEpochMillisecs(now));
+        const unsigned long elapsed = now - AnchorMillis;
+        LastCorrectionMillisecs = static_cast<int32_t>(error);
+
+        // Move the drift estimate halfway towards what this interval measured
+        if (elapsed >= DriftMinElapsedMillisecs && error > -DriftMaxCorrectionMillisecs && error < DriftMaxCorrectionMillisecs)
+        {
+            int32_t drift = DriftPpm + static_cast<int32_t>(error * 1000000 / static_cast<int64_t>(elapsed)) / 2;
+            if (drift > DriftMaxPpm) drift = DriftMaxPpm;
+            if (drift < -DriftMaxPpm) drift = -DriftMaxPpm;
+            DriftPpm = drift;
+        }
+    }
+
+    AnchorMillis = now;
+    AnchorEpochMillisecs = epochMillisecs;
+    Synchronized = true;
+}
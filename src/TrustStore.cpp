@@ -0,0 +1,58 @@
+#include <Arduino.h>
+#include "TrustStore.h"
+#include "TelemetryTopic.h"
+#include <mbedtls/x509_crt.h>
+
+#define DLM "\r\n"
+
+const char* TrustStore::Pem = nullptr;
+int TrustStore::ValidCount = 0;
+int TrustStore::ExpiredCount = 0;
+int TrustStore::ParseErrors = 0;
+
+// Formats an X.509 time like FormatIso8601() so that the two compare as strings
+static void FormatX509Time(char* buf, size_t bufSize, const mbedtls_x509_time& time)
+{
+    snprintf(buf, bufSize, "%04d-%02d-%02dT%02d:%02d:%02d.000Z", time.year, time.mon, time.day, time.hour, time.min, time.sec);
+}
+
+int TrustStore::Load(const char* pemBundle, uint64_t epochMillisecs)
+{
+    Pem = pemBundle;
+    ValidCount = 0;
+    ExpiredCount = 0;
+
+    char now[Iso8601Size + 1];
+    FormatIso8601(now, epochMillisecs);
+    now[Iso8601Size] = '\0';
+
+    mbedtls_x509_crt chain;
+    mbedtls_x509_crt_init(&chain);
+
+    // A positive result is the number of certificates that failed to parse
+    const int result = mbedtls_x509_crt_parse(&chain, reinterpret_cast<const unsigned char*>(pemBundle), strlen(pemBundle) + 1);
+    ParseErrors = result < 0 ? 1 : result;
+
+    if (result >= 0)
+    {
+        for (const mbedtls_x509_crt* crt = &chain; crt != nullptr && crt->raw.len > 0; crt = crt->next)
+        {
+            char validFrom[Iso8601Size + 1];
+            char validTo[Iso8601Size + 1];
+            FormatX509Time(validFrom, sizeof(validFrom), crt->valid_from);
+            FormatX509Time(validTo, sizeof(validTo), crt->valid_to);
+
+            if (strcmp(validFrom, now) <= 0 && strcmp(now, validTo) < 0) ++ValidCount;
+            else ++ExpiredCount;
+        }
+    }
+
+    mbedtls_x509_crt_free(&chain);
+
+    return ValidCount;
+}
+
+void TrustStore::Print()
+{
+    Serial.print(String::format("Trust store: valid roots = %d, expired = %d, parse errors = %d" DLM, ValidCount, ExpiredCount, ParseErrors));
+}
@@ -0,0 +1,177 @@
+#include <Arduino.h>
+#include "Watchdog.h"
+#include "Storage.h"
+#include "Log.h"
+
+#define DLM "\r\n"
+
+constexpr const char* Watchdog::KeyResetCount;
+
+bool Watchdog::Armed = false;
+bool Watchdog::Running = false;
+bool Watchdog::Starving = false;
+unsigned long Watchdog::Deadlines[static_cast<size_t>(WatchdogTask::Count)];
+unsigned long Watchdog::LastCheckInTimes[static_cast<size_t>(WatchdogTask::Count)];
+bool Watchdog::CheckedIn[static_cast<size_t>(WatchdogTask::Count)];
+uint8_t Watchdog::LastTask = static_cast<uint8_t>(WatchdogTask::Count);
+uint32_t Watchdog::ResetCount = 0;
+
+static constexpr uint8_t PeriodMax = 0xb;               // WDT_CONFIG_PER_CYC16384
+static constexpr uint32_t ClockHz = 1024;                // CLK_WDT_OSC
+
+// Written by the early warning interrupt, read after the reset. Backup RAM is not cleared by a reset.
+struct ResetRecord
+{
+    static constexpr uint32_t MagicValue = 0x57445431;  // "WDT1"
+
+    uint32_t Magic;
+    uint8_t LateTask;       // Most overdue task, WatchdogTask::Count if none was late
+    uint8_t LastTask;       // Task that checked in last, loop() stalled after it
+    uint8_t Reserved[2];
+    uint32_t LateMillisecs;
+};
+static ResetRecord* const Record = reinterpret_cast<ResetRecord*>(BKUPRAM_ADDR);
+
+extern "C" void WDT_Handler()
+{
+    Watchdog::OnEarlyWarning();
+}
+
+void Watchdog::Begin(unsigned long timeoutMillisecs)
+{
+    const uint8_t* value;
+    size_t valueSize;
+    if (Storage::Get(KeyResetCount, &value, &valueSize) && valueSize == sizeof(ResetCount)) memcpy(&ResetCount, value, sizeof(ResetCount));
+
+    if (RSTC->RCAUSE.bit.WDT)
+    {
+        ++ResetCount;
+        Storage::Set(KeyResetCount, &ResetCount, sizeof(ResetCount));
+
+        if (Record->Magic == ResetRecord::MagicValue)
+        {
+            if (Record->LateTask < static_cast<uint8_t>(WatchdogTask::Count))
+            {
+                Serial.print(String::format("Watchdog reset: %s missed its deadline by %lu ms" DLM, GetName(static_cast<WatchdogTask>(Record->LateTask)), Record->LateMillisecs));
+            }
+            else
+            {
+                Serial.print(String::format("Watchdog reset: loop() stalled after %s" DLM, GetName(static_cast<WatchdogTask>(Record->LastTask))));
+            }
+        }
+        else
+        {
+            Serial.print("Watchdog reset" DLM);
+        }
+    }
+    Record->Magic = 0;
+
+    // Smallest period of 8 << n cycles covering the timeout
+    const uint32_t cycles = timeoutMillisecs * ClockHz / 1000;
+    uint8_t period = 1;     // The early warning needs a shorter period below it
+    while (period < PeriodMax && (8UL << period) < cycles) ++period;
+
+    WDT->CTRLA.reg = 0;
+    while (WDT->SYNCBUSY.reg) {}
+    WDT->CONFIG.reg = WDT_CONFIG_PER(period);
+    WDT->EWCTRL.reg = WDT_EWCTRL_EWOFFSET(period - 1);     // Halfway, time left to record the culprit
+    WDT->INTFLAG.reg = WDT_INTFLAG_EW;
+    WDT->INTENSET.reg = WDT_INTENSET_EW;
+    NVIC_EnableIRQ(WDT_IRQn);
+    WDT->CTRLA.reg = WDT_CTRLA_ENABLE;
+    while (WDT->SYNCBUSY.reg) {}
+
+    Armed = true;
+    Starving = false;
+}
+
+void Watchdog::SetDeadline(WatchdogTask task, unsigned long deadlineMillisecs)
+{
+    Deadlines[static_cast<size_t>(task)] = deadlineMillisecs;
+}
+
+void Watchdog::CheckIn(WatchdogTask task, unsigned long now)
+{
+    LastCheckInTimes[static_cast<size_t>(task)] = now;
+    CheckedIn[static_cast<size_t>(task)] = true;
+    LastTask = static_cast<uint8_t>(task);
+}
+
+void Watchdog::Feed()
+{
+    // A write while the previous clear is synchronizing would stall the bus
+    if (Armed && !Starving && !WDT->SYNCBUSY.bit.CLEAR) WDT->CLEAR.reg = WDT_CLEAR_CLEAR_KEY;
+}
+
+void Watchdog::DoWork(unsigned long now)
+{
+    if (!Armed || Starving) return;
+
+    // Deadlines start with loop(), the waits in setup() do not count
+    if (!Running)
+    {
+        for (unsigned long& time : LastCheckInTimes) time = now;
+        Running = true;
+    }
+
+    for (size_t i = 0; i < static_cast<size_t>(WatchdogTask::Count); ++i)
+    {
+        if (!CheckedIn[i] || Deadlines[i] == 0) continue;
+        if (now - LastCheckInTimes[i] <= Deadlines[i]) continue;
+
+        // Stop feeding, the WDT resets the device within its period
+        Log("Watchdog: %s missed its deadline, restarting" DLM, GetName(static_cast<WatchdogTask>(i)));
+        Starving = true;
+        return;
+    }
+
+    Feed();
+}
+
+void Watchdog::OnEarlyWarning()
+{
+    WDT->INTFLAG.reg = WDT_INTFLAG_EW;
+
+    const unsigned long now = millis();
+    Record->LateTask = static_cast<uint8_t>(WatchdogTask::Count);
+    Record->LastTask = LastTask;
+    Record->LateMillisecs = 0;
+    for (size_t i = 0; i < static_cast<size_t>(WatchdogTask::Count); ++i)
+    {
+        if (!CheckedIn[i] || Deadlines[i] == 0) continue;
+
+        const unsigned long elapsed = now - LastCheckInTimes[i];
+        if (elapsed > Deadlines[i] && elapsed - Deadlines[i] > Record->LateMillisecs)
+        {
+            Record->LateTask = i;
+            Record->LateMillisecs = elapsed - Deadlines[i];
+        }
+    }
+    Record->Magic = ResetRecord::MagicValue;
+}
+
+const char* Watchdog::GetName(WatchdogTask task)
+{
+    switch (task)
+    {
+    case WatchdogTask::Network:
+        return "Network";
+    case WatchdogTask::Sensors:
+        return "Sensors";
+    case WatchdogTask::Display:
+        return "Display";
+    default:
+        return "setup";
+    }
+}
+
+void Watchdog::Print()
+{
+    Serial.print(String::format("Watchdog: %s, resets = %lu" DLM, Armed ? "armed" : "off", ResetCount));
+    const unsigned long now = millis();
+    for (size_t i = 0; i < static_cast<size_t>(WatchdogTask::Count); ++i)
+    {
+        if (!CheckedIn[i]) continue;
+        Serial.print(String::format(" %s: checked in %lu ms ago, deadline = %lu ms" DLM, GetName(static_cast<WatchdogTask>(i)), now - LastCheckInTimes[i], Deadlines[i]));
+    }
+}
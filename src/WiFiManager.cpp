@@ -0,0 +1,358 @@
+#include <Arduino.h>
+#include <rpcWiFi.h>
+#include "WiFiManager.h"
+#include "Storage.h"
+#include "Crc.h"
+#include "NetworkStats.h"
+#include "PowerManager.h"
+#include "Watchdog.h"
+
+#define DLM "\r\n"
+
+constexpr const char* WiFiManager::KeyCache;
+constexpr const char* WiFiManager::KeyProfiles[];
+static_assert(sizeof(WiFiManager::KeyProfiles) / sizeof(WiFiManager::KeyProfiles[0]) == WiFiManager::ProfileMax - 1, "Profile 0 has its own keys");
+
+WiFiManager::Profile WiFiManager::Profiles[ProfileMax];
+size_t WiFiManager::ProfileCount = 0;
+int WiFiManager::CurrentProfile = 0;
+int WiFiManager::NextProfile = 0;
+int WiFiManager::RoamRssiThreshold = -75;
+
+WiFiManager::State WiFiManager::CurrentState = WiFiManager::State::Disconnected;
+bool WiFiManager::FastConnect = false;
+bool WiFiManager::CacheEnabled = true;
+unsigned long WiFiManager::AttemptTime = 0;
+unsigned long WiFiManager::NextAttemptTime = 0;
+unsigned long WiFiManager::RetryIntervalMillisecs = WiFiManager::RetryMinMillisecs;
+
+WiFiManager::Target WiFiManager::OutageTarget;
+bool WiFiManager::OutageScanned = false;
+unsigned long WiFiManager::OutageScanTime = 0;
+
+unsigned long WiFiManager::NextRoamCheckTime = 0;
+unsigned long WiFiManager::LastRoamScanTime = 0;
+int WiFiManager::WeakChecks = 0;
+
+uint32_t WiFiManager::FastConnects = 0;
+uint32_t WiFiManager::FullConnects = 0;
+uint32_t WiFiManager::Disconnects = 0;
+uint32_t WiFiManager::Roams = 0;
+
+bool WiFiManager::AddProfile(const char* ssid, const char* password)
+{
+    if (ProfileCount >= ProfileMax || ssid[0] == '\0' || strlen(ssid) > SsidMaxSize || strlen(password) > PasswordMaxSize) return false;
+
+    Profile& profile = Profiles[ProfileCount++];
+    memset(&profile, 0, sizeof(profile));
+    strcpy(profile.Ssid, ssid);
+    strcpy(profile.Password, password);
+
+    return true;
+}
+
+void WiFiManager::LoadProfiles()
+{
+    for (const char* key : KeyProfiles)
+    {
+        const uint8_t* value;
+        size_t valueSize;
+        if (!Storage::Get(key, &value, &valueSize) || valueSize == 0) continue;
+
+        // ssid '\0' password, the record is followed by '\0'
+        const char* ssid = reinterpret_cast<const char*>(value);
+        const size_t ssidSize = strnlen(ssid, valueSize);
+        AddProfile(ssid, ssidSize < valueSize ? &ssid[ssidSize + 1] : "");
+    }
+}
+
+void WiFiManager::Begin(int roamRssiThreshold)
+{
+    RoamRssiThreshold = roamRssiThreshold;
+    CurrentState = State::Disconnected;
+    CacheEnabled = true;
+    NextAttemptTime = millis();
+    RetryIntervalMillisecs = RetryMinMillisecs;
+    OutageScanned = false;
+}
+
+void WiFiManager::DoWork(unsigned long now)
+{
+    if (ProfileCount == 0) return;
+
+    switch (CurrentState)
+    {
+    case State::Disconnected:
+        if (static_cast<long>(now - NextAttemptTime) >= 0) Connect(now, nullptr);
+        break;
+
+    case State::Associating:
+        if (WiFi.status() == WL_CONNECTED)
+        {
+            NetworkStats::WiFiAssociate.Add(now - AttemptTime);
+            CurrentState = State::WaitingForAddress;
+        }
+        else if (now - AttemptTime >= (FastConnect ? FastConnectTimeoutMillisecs : ConnectTimeoutMillisecs))
+        {
+            Fail(now);
+        }
+        break;
+
+    case State::WaitingForAddress:
+        if (WiFi.status() != WL_CONNECTED || (!FastConnect && now - AttemptTime >= ConnectTimeoutMillisecs + DhcpTimeoutMillisecs))
+        {
+            Fail(now);
+        }
+        else if (static_cast<uint32_t>(WiFi.localIP()) != 0)
+        {
+            OnConnected(now);
+        }
+        break;
+
+    case State::Connected:
+        if (WiFi.status() != WL_CONNECTED)
+        {
+            ++Disconnects;
+            CurrentState = State::Disconnected;
+            NextAttemptTime = now;
+            break;
+        }
+        CheckRoam(now);
+        break;
+    }
+}
+
+void WiFiManager::OnUpstreamFailure()
+{
+    if (!FastConnect || CurrentState != State::Connected) return;
+
+    CacheEnabled = false;
+    WiFi.disconnect();
+    CurrentState = State::Disconnected;
+    NextAttemptTime = millis();
+}
+
+uint32_t WiFiManager::GetAttempts()
+{
+    uint32_t attempts = 0;
+    for (size_t i = 0; i < ProfileCount; ++i) attempts += Profiles[i].Connects + Profiles[i].Failures;
+
+    return attempts;
+}
+
+void WiFiManager::Print()
+{
+    Serial.print(String::format("Wi-Fi: %s, SSID = %s, RSSI = %d dBm" DLM, IsConnected() ? "connected" : "disconnected", IsConnected() ? Profiles[CurrentProfile].Ssid : "", IsConnected() ? WiFi.RSSI() : 0));
+    Serial.print(String::format(" Fast connects = %lu, full connects = %lu, disconnects = %lu, roams = %lu" DLM, FastConnects, FullConnects, Disconnects, Roams));
+    for (size_t i = 0; i < ProfileCount; ++i)
+    {
+        const Profile& profile = Profiles[i];
+        Serial.print(String::format(" Profile %u: SSID = %s, connects = %lu, failures = %lu, connect time = %lu ms" DLM, i, profile.Ssid, profile.Connects, profile.Failures, profile.ConnectMillisecs));
+    }
+}
+
+int WiFiManager::Score(int profileIndex, int rssi)
+{
+    const Profile& profile = Profiles[profileIndex];
+    const int failures = profile.ConsecutiveFailures < 3 ? profile.ConsecutiveFailures : 3;
+
+    // A second of connect time costs as much as a dB
+    return rssi - PriorityPenalty * profileIndex - FailurePenalty * failures - static_cast<int>(profile.ConnectMillisecs / 1000);
+}
+
+bool WiFiManager::Scan(Target* best)
+{
+    Watchdog::Feed();
+    const int16_t count = WiFi.scanNetworks();
+    best->ProfileIndex = -1;
+    for (int16_t i = 0; i < count; ++i)
+    {
+        const String ssid = WiFi.SSID(i);
+        for (size_t j = 0; j < ProfileCount; ++j)
+        {
+            if (strcmp(ssid.c_str(), Profiles[j].Ssid) != 0) continue;
+
+            const int score = Score(j, WiFi.RSSI(i));
+            if (best->ProfileIndex < 0 || score > best->Score)
+            {
+                best->ProfileIndex = j;
+                best->Score = score;
+                best->Channel = static_cast<uint8_t>(WiFi.channel(i));
+                memcpy(best->Bssid, WiFi.BSSID(i), sizeof(best->Bssid));
+            }
+            break;
+        }
+    }
+    WiFi.scanDelete();
+
+    return best->ProfileIndex >= 0;
+}
+
+void WiFiManager::Connect(unsigned long now, const Target* target)
+{
+    AttemptTime = now;
+    CurrentState = State::Associating;
+
+    Cache cache;
+    int cacheProfile;
+    FastConnect = target == nullptr && CacheEnabled && LoadCache(&cache, &cacheProfile);
+    if (FastConnect)
+    {
+        CurrentProfile = cacheProfile;
+        const Profile& profile = Profiles[CurrentProfile];
+        WiFi.config(IPAddress(cache.LocalIp), IPAddress(cache.Gateway), IPAddress(cache.Subnet), IPAddress(cache.Dns));
+        WiFi.begin(profile.Ssid, profile.Password, cache.Channel, cache.Bssid);
+        return;
+    }
+
+    // The AP found at the start of the outage is retried until the scan is due again
+    if (target == nullptr)
+    {
+        if (!OutageScanned || now - OutageScanTime >= OutageScanMillisecs)
+        {
+            Scan(&OutageTarget);
+            OutageScanned = true;
+            OutageScanTime = now;
+            AttemptTime = millis();
+        }
+        if (OutageTarget.ProfileIndex >= 0) target = &OutageTarget;
+    }
+
+    // Without a visible profile, try them in priority order
+    Target next;
+    if (target == nullptr)
+    {
+        next.ProfileIndex = NextProfile;
+        next.Channel = 0;
+        target = &next;
+        NextProfile = (NextProfile + 1) % ProfileCount;
+    }
+    CurrentProfile = target->ProfileIndex;
+
+    // All zero addresses select DHCP
+    const Profile& profile = Profiles[CurrentProfile];
+    WiFi.config(IPAddress(static_cast<uint32_t>(0)), IPAddress(static_cast<uint32_t>(0)), IPAddress(static_cast<uint32_t>(0)));
+    if (target->Channel != 0)
+    {
+        WiFi.begin(profile.Ssid, profile.Password, target->Channel, target->Bssid);
+    }
+    else
+    {
+        WiFi.begin(profile.Ssid, profile.Password);
+    }
+}
+
+void WiFiManager::Fail(unsigned long now)
+{
+    WiFi.disconnect();
+    CurrentState = State::Disconnected;
+
+    Profile& profile = Profiles[CurrentProfile];
+    ++profile.Failures;
+    if (profile.ConsecutiveFailures < UINT8_MAX) ++profile.ConsecutiveFailures;
+
+    // A failed fast connect falls straight back to a full one
+    if (FastConnect)
+    {
+        CacheEnabled = false;
+        NextAttemptTime = now;
+        return;
+    }
+
+    NextAttemptTime = now + RetryIntervalMillisecs;
+    RetryIntervalMillisecs = RetryIntervalMillisecs * 2 < RetryMaxMillisecs ? RetryIntervalMillisecs * 2 : RetryMaxMillisecs;
+}
+
+void WiFiManager::OnConnected(unsigned long now)
+{
+    CurrentState = State::Connected;
+    RetryIntervalMillisecs = RetryMinMillisecs;
+    OutageScanned = false;
+    NextRoamCheckTime = now + RoamCheckMillisecs;
+    WeakChecks = 0;
+
+    // Cached addresses are configured statically, only a DHCP lease takes time
+    const unsigned long connectMillisecs = now - AttemptTime;
+    if (!FastConnect) NetworkStats::WiFiDhcp.Add(connectMillisecs - NetworkStats::WiFiAssociate.Last);
+
+    Profile& profile = Profiles[CurrentProfile];
+    ++profile.Connects;
+    profile.ConsecutiveFailures = 0;
+    profile.ConnectMillisecs = profile.Connects == 1 ? connectMillisecs : (profile.ConnectMillisecs * 3 + connectMillisecs) / 4;
+
+    if (FastConnect)
+    {
+        ++FastConnects;
+    }
+    else
+    {
+        ++FullConnects;
+        SaveCache();
+        CacheEnabled = true;
+    }
+
+    PowerManager::ApplyWiFiPowerSave();
+}
+
+void WiFiManager::CheckRoam(unsigned long now)
+{
+    if (static_cast<long>(now - NextRoamCheckTime) < 0) return;
+    NextRoamCheckTime = now + RoamCheckMillisecs;
+
+    const int rssi = WiFi.RSSI();
+    WeakChecks = rssi < RoamRssiThreshold ? WeakChecks + 1 : 0;
+    if (WeakChecks < RoamWeakChecks) return;
+    if (LastRoamScanTime != 0 && now - LastRoamScanTime < RoamScanMillisecs) return;
+    LastRoamScanTime = now;
+    WeakChecks = 0;
+
+    Target best;
+    if (!Scan(&best)) return;
+    if (best.Score < Score(CurrentProfile, rssi) + RoamHysteresis) return;
+    if (best.ProfileIndex == CurrentProfile && memcmp(best.Bssid, WiFi.BSSID(), sizeof(best.Bssid)) == 0) return;
+
+    ++Roams;
+    WiFi.disconnect();
+    Connect(millis(), &best);
+}
+
+bool WiFiManager::LoadCache(Cache* cache, int* profileIndex)
+{
+    const uint8_t* value;
+    size_t valueSize;
+    if (!Storage::Get(KeyCache, &value, &valueSize) || valueSize != sizeof(Cache)) return false;
+    memcpy(cache, value, sizeof(Cache));
+    if (cache->Channel == 0 || cache->LocalIp == 0) return false;
+
+    for (size_t i = 0; i < ProfileCount; ++i)
+    {
+        if (cache->SsidHash == Crc32(Profiles[i].Ssid, strlen(Profiles[i].Ssid)))
+        {
+            *profileIndex = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WiFiManager::SaveCache()
+{
+    const Profile& profile = Profiles[CurrentProfile];
+
+    Cache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.SsidHash = Crc32(profile.Ssid, strlen(profile.Ssid));
+    memcpy(cache.Bssid, WiFi.BSSID(), sizeof(cache.Bssid));
+    cache.Channel = static_cast<uint8_t>(WiFi.channel());
+    cache.LocalIp = static_cast<uint32_t>(WiFi.localIP());
+    cache.Gateway = static_cast<uint32_t>(WiFi.gatewayIP());
+    cache.Subnet = static_cast<uint32_t>(WiFi.subnetMask());
+    cache.Dns = static_cast<uint32_t>(WiFi.dnsIP());
+
+    // Rewrite only on change to spare the flash
+    Cache saved;
+    int savedProfile;
+    if (LoadCache(&saved, &savedProfile) && memcmp(&saved, &cache, sizeof(cache)) == 0) return;
+    Storage::Set(KeyCache, &cache, sizeof(cache));
+}
@@ -3,18 +3,37 @@
 #include "Storage.h"
 #include "Signature.h"
 #include "AzureDpsClient.h"
+#include "DpsRegistration.h"
 #include "CliMode.h"
 #include "DHT.h"
 #include "Bitmap.h"
 #include "Cert.h"
+#include "TrustStore.h"
+#include "TelemetryRate.h"
+#include "TelemetrySerializer.h"
+#include "TelemetryTopic.h"
+#include "NetworkStats.h"
+#include "SerialStream.h"
+#include "GasCalibration.h"
+#include "AirQuality.h"
+#include "MessageScheduler.h"
+#include "CommandDispatcher.h"
+#include "MessageRouter.h"
+#include "PowerManager.h"
+#include "TimeService.h"
+#include "WiFiManager.h"
+#include "DnsCache.h"
+#include "ResolvingClientSecure.h"
+#include "Gateway.h"
+#include "FirmwareUpdate.h"
+#include "Watchdog.h"
+#include "Log.h"
 #include "Multichannel_Gas_GMXXX.h"
 #include <TFT_eSPI.h>
 #include <Wire.h>
 #include <LIS3DHTR.h>
-#include <rpcWiFiClientSecure.h>
 #include <PubSubClient.h>
 #include <WiFiUdp.h>
-#include <NTP.h>
 #include <az_json.h>
 #include <az_result.h>
 #include <az_span.h>
@@ -31,13 +50,15 @@ DHT dht(DHTPIN, DHTTYPE);
 TFT_eSPI tft;
 TFT_eSprite spr = TFT_eSprite(&tft);  //sprite
 
-WiFiClientSecure wifi_client;
+ResolvingClientSecure wifi_client;    // Resolves the hub and DPS hosts through DnsCache
 PubSubClient mqtt_client(wifi_client);
+static MessageScheduler OutboundMessages(mqtt_client);
 WiFiUDP wifi_udp;
-NTP ntp(wifi_udp);
 
-std::string HubHost;
-std::string DeviceId;
+az_span HubHost = AZ_SPAN_LITERAL_FROM_STR("");     // '\0' terminated
+az_span DeviceId = AZ_SPAN_LITERAL_FROM_STR("");
+
+static TelemetryRate TelemetryRateController(TELEMETRY_FREQUENCY_MILLISECS, TELEMETRY_FREQUENCY_MIN_MILLISECS, TELEMETRY_FREQUENCY_MAX_MILLISECS);
 
 #define AZ_RETURN_IF_FAILED(exp) \
   do \
@@ -54,15 +75,6 @@ std::string DeviceId;
 
 #define DLM "\r\n"
 
-static String StringVFormat(const char* format, va_list arg)
-{
-    const int len = vsnprintf(nullptr, 0, format, arg);
-    char str[len + 1];
-    vsnprintf(str, sizeof(str), format, arg);
-
-    return String{ str };
-}
-
 static void Abort(const char* format, ...)
 {
     va_list arg;
@@ -72,19 +84,10 @@ static void Abort(const char* format, ...)
 
     Serial.print(String::format("ABORT: %s" DLM, str.c_str()));
 
+    // The watchdog restarts the device
     while (true) {}
 }
 
-static void Log(const char* format, ...)
-{
-    va_list arg;
-    va_start(arg, format);
-    String str{ StringVFormat(format, arg) };
-    va_end(arg);
-
-    Serial.print(str);
-}
-
 ////////////////////////////////////////////////////////////////////////////////
 // Display
 
@@ -120,6 +123,8 @@ static void ButtonEventHandler(AceButton* button, uint8_t eventType, uint8_t but
     const uint8_t id = button->getId();
     if (ButtonNumber <= id) return;
 
+    if (eventType == AceButton::kEventPressed) PowerManager::NotifyActivity(millis());
+
     switch (eventType)
     {
     case AceButton::kEventClicked:
@@ -129,11 +134,11 @@ static void ButtonEventHandler(AceButton* button, uint8_t eventType, uint8_t but
             DisplayPrintf("Right button was clicked");
             break;
         case ButtonId::CENTER:
-            digitalWrite(LCD_BACKLIGHT, HIGH);
+            PowerManager::SetBacklight(true);
             DisplayPrintf("Center button was clicked");
             break;
         case ButtonId::LEFT:
-            digitalWrite(LCD_BACKLIGHT, LOW);
+            PowerManager::SetBacklight(false);
             DisplayPrintf("Left button was clicked");
             break;
         }
@@ -163,112 +168,172 @@ static void ButtonDoWork()
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Authentication
+
+// With a device certificate, TLS authenticates the device and the MQTT password is left out.
+static void SetClientCertificate()
+{
+    // The client copies the PEMs for the next connect, the flash views move when the store compacts
+    if (IOT_CONFIG_USE_X509)
+    {
+        wifi_client.setCertificate(reinterpret_cast<const char*>(az_span_ptr(IOT_CONFIG_X509_CERTIFICATE)));
+        wifi_client.setPrivateKey(reinterpret_cast<const char*>(az_span_ptr(IOT_CONFIG_X509_PRIVATE_KEY)));
+    }
+    else
+    {
+        wifi_client.setCertificate(nullptr);
+        wifi_client.setPrivateKey(nullptr);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Azure IoT DPS
 
 static AzureDpsClient DpsClient;
-static unsigned long DpsPublishTimeOfQueryStatus = 0;
+static bool ConnectToDps();
+static DpsRegistration Provisioning(mqtt_client, DpsClient, ConnectToDps);
+static az_span DpsEndpoint = AZ_SPAN_LITERAL_FROM_STR("");     // '\0' terminated
+static bool Provisioned = false;
+static bool StoredAssignment = false;   // Provisioned from the last registration, not connected to yet
+static unsigned long ProvisioningRestartTime = 0;
 
 static void MqttSubscribeCallbackDPS(char* topic, byte* payload, unsigned int length);
 
-static int RegisterDeviceToDPS(const std::string& endpoint, const std::string& idScope, const std::string& registrationId, const std::string& symmetricKey, const uint64_t& expirationEpochTime, std::string* hubHost, std::string* deviceId)
+// idScope and registrationId are referenced by DpsClient, not copied. They may be views into
+// the flash, so ConnectToDps() points the client at them again.
+static int StartProvisioning(az_span endpoint, az_span idScope, az_span registrationId, unsigned long now)
 {
-    std::string endpointAndPort{ endpoint };
-    endpointAndPort += ":";
-    endpointAndPort += std::to_string(8883);
+    static char endpointAndPort[128];
+    const int endpointAndPortLength = snprintf(endpointAndPort, sizeof(endpointAndPort), "%.*s:%d", az_span_size(endpoint), az_span_ptr(endpoint), IOT_CONFIG_MQTT_PORT);
+    if (endpointAndPortLength < 0 || static_cast<size_t>(endpointAndPortLength) >= sizeof(endpointAndPort)) return -1;
 
-    if (DpsClient.Init(endpointAndPort, idScope, registrationId) != 0) return -1;
+    DpsEndpoint = endpoint;
+    if (DpsClient.Init(az_span_create(reinterpret_cast<uint8_t*>(endpointAndPort), endpointAndPortLength), idScope, registrationId) != 0) return -1;
 
-    const std::string mqttClientId = DpsClient.GetMqttClientId();
-    const std::string mqttUsername = DpsClient.GetMqttUsername();
+    Log("DPS:" DLM);
+    Log(" Endpoint = %.*s" DLM, az_span_size(endpoint), az_span_ptr(endpoint));
+    Log(" Id scope = %.*s" DLM, az_span_size(idScope), az_span_ptr(idScope));
+    Log(" Registration id = %.*s" DLM, az_span_size(registrationId), az_span_ptr(registrationId));
+    Log(" Authentication = %s" DLM, IOT_CONFIG_USE_X509 ? "X.509" : "SAS");
+    Log(" MQTT client id = %s" DLM, DpsClient.GetMqttClientId().c_str());
+    Log(" MQTT username = %s" DLM, DpsClient.GetMqttUsername().c_str());
 
-    const std::vector<uint8_t> signature = DpsClient.GetSignature(expirationEpochTime);
-    const std::string encryptedSignature = GenerateEncryptedSignature(symmetricKey, signature);
-    const std::string mqttPassword = DpsClient.GetMqttPassword(encryptedSignature, expirationEpochTime);
+    Provisioning.SetBackOff(DPS_RETRY_MIN_MILLISECS, DPS_RETRY_MAX_MILLISECS);
+    Provisioning.Start(now, DPS_REGISTER_TIMEOUT_MILLISECS, "{payload:{\"modelId\":\"" IOT_CONFIG_MODEL_ID "\"}}");
 
-    const std::string registerPublishTopic = DpsClient.GetRegisterPublishTopic();
-    const std::string registerSubscribeTopic = DpsClient.GetRegisterSubscribeTopic();
+    return 0;
+}
 
-    Log("DPS:" DLM);
-    Log(" Endpoint = %s" DLM, endpoint.c_str());
-    Log(" Id scope = %s" DLM, idScope.c_str());
-    Log(" Registration id = %s" DLM, registrationId.c_str());
-    Log(" MQTT client id = %s" DLM, mqttClientId.c_str());
-    Log(" MQTT username = %s" DLM, mqttUsername.c_str());
+// Called by Provisioning for every connection. Registration may outlast a token, so each one gets a fresh token.
+static bool ConnectToDps()
+{
+    if (DpsClient.Rebind(IOT_CONFIG_ID_SCOPE, IOT_CONFIG_REGISTRATION_ID) != 0) return false;
+
+    const std::string mqttClientId = DpsClient.GetMqttClientId();
+    const std::string mqttUsername = DpsClient.GetMqttUsername();
+
+    std::string mqttPassword;
+    if (!IOT_CONFIG_USE_X509)
+    {
+        const uint64_t expirationEpochTime = TimeService::GetEpoch() + TOKEN_LIFESPAN;
+        const std::vector<uint8_t> signature = DpsClient.GetSignature(expirationEpochTime);
+        const std::string encryptedSignature = GenerateEncryptedSignature(IOT_CONFIG_SYMMETRIC_KEY, signature);
+        mqttPassword = DpsClient.GetMqttPassword(encryptedSignature, expirationEpochTime);
+    }
     //Log(" MQTT password = %s" DLM, mqttPassword.c_str());
 
-    wifi_client.setCACert(ROOT_CA_BALTIMORE);
     mqtt_client.setBufferSize(MQTT_PACKET_SIZE);
-    mqtt_client.setServer(endpoint.c_str(), 8883);
+    mqtt_client.setServer(reinterpret_cast<const char*>(az_span_ptr(DpsEndpoint)), IOT_CONFIG_MQTT_PORT);
     mqtt_client.setCallback(MqttSubscribeCallbackDPS);
-    DisplayPrintf("Connecting to Azure IoT Hub DPS...");
-    if (!mqtt_client.connect(mqttClientId.c_str(), mqttUsername.c_str(), mqttPassword.c_str())) return -2;
+    SetClientCertificate();
+    Log("Connecting to Azure IoT Hub DPS..." DLM);
 
-    mqtt_client.subscribe(registerSubscribeTopic.c_str());
-    mqtt_client.publish(registerPublishTopic.c_str(), "{payload:{\"modelId\":\"" IOT_CONFIG_MODEL_ID "\"}}");
+    const bool connected = mqtt_client.connect(mqttClientId.c_str(), mqttUsername.c_str(), IOT_CONFIG_USE_X509 ? nullptr : mqttPassword.c_str());
+    Watchdog::CheckIn(WatchdogTask::Network, millis());
 
-    while (!DpsClient.IsRegisterOperationCompleted())
+    return connected;
+}
+
+// Drives the registration from loop(). Returns true once the hub host and device id are known.
+// A failed or timed out registration starts over after the longest back-off.
+static bool ProvisioningDoWork(unsigned long now)
+{
+    if (Provisioned) return true;
+
+    // Every connection signs a token with the current time
+    if (!TimeService::IsSynchronized()) return false;
+
+    if (Provisioning.GetState() == DpsRegistration::State::Idle)
     {
-        mqtt_client.loop();
-        if (DpsPublishTimeOfQueryStatus > 0 && millis() >= DpsPublishTimeOfQueryStatus)
+        if (static_cast<long>(now - ProvisioningRestartTime) < 0) return false;
+        if (StartProvisioning(IOT_CONFIG_GLOBAL_DEVICE_ENDPOINT, IOT_CONFIG_ID_SCOPE, IOT_CONFIG_REGISTRATION_ID, now) != 0)
         {
-            mqtt_client.publish(DpsClient.GetQueryStatusPublishTopic().c_str(), "");
-            Log("Client sent operation query message" DLM);
-            DpsPublishTimeOfQueryStatus = 0;
+            Log("DPS configuration is invalid" DLM);
+            Watchdog::CheckIn(WatchdogTask::Network, now);
+            ProvisioningRestartTime = now + DPS_RETRY_MAX_MILLISECS;
+            return false;
         }
     }
 
-    if (!DpsClient.IsAssigned()) return -3;
+    Provisioning.DoWork(now);
+    if (mqtt_client.connected()) Watchdog::CheckIn(WatchdogTask::Network, millis());
 
-    mqtt_client.disconnect();
+    switch (Provisioning.GetState())
+    {
+    case DpsRegistration::State::Assigned:
+        // Keep the assignment, setup() connects to it directly after a reboot
+        if (!Storage::Set(Storage::KeyHubHost, DpsClient.GetHubHost()) || !Storage::Set(Storage::KeyDeviceId, DpsClient.GetDeviceId()))
+        {
+            Log("Failed to store the DPS assignment" DLM);
+            break;
+        }
+        NetworkStats::DpsRegister.Add(now - Provisioning.GetStartTime());
+        Provisioned = true;
 
-    *hubHost = DpsClient.GetHubHost();
-    *deviceId = DpsClient.GetDeviceId();
+        Log("Device provisioned:" DLM);
+        Log(" Hub host = %.*s" DLM, az_span_size(Storage::HubHost), az_span_ptr(Storage::HubHost));
+        Log(" Device id = %.*s" DLM, az_span_size(Storage::DeviceId), az_span_ptr(Storage::DeviceId));
+        Provisioning.Cancel();
+        return true;
 
-    Log("Device provisioned:" DLM);
-    Log(" Hub host = %s" DLM, hubHost->c_str());
-    Log(" Device id = %s" DLM, deviceId->c_str());
+    case DpsRegistration::State::Failed:
+        break;
 
-    return 0;
+    default:
+        return false;
+    }
+
+    Provisioning.Print();
+    Provisioning.Cancel();
+    ProvisioningRestartTime = now + DPS_RETRY_MAX_MILLISECS;
+
+    return false;
 }
 
 static void MqttSubscribeCallbackDPS(char* topic, byte* payload, unsigned int length)
 {
     Log("Subscribe:" DLM " %s" DLM " %.*s" DLM, topic, length, (const char*)payload);
 
-    if (DpsClient.RegisterSubscribeWork(topic, std::vector<uint8_t>(payload, payload + length)) != 0)
-    {
-        Log("Failed to parse topic and/or payload" DLM);
-        return;
-    }
-
-    if (!DpsClient.IsRegisterOperationCompleted())
-    {
-        const int waitSeconds = DpsClient.GetWaitBeforeQueryStatusSeconds();
-        Log("Querying after %u  seconds..." DLM, waitSeconds);
-
-        DpsPublishTimeOfQueryStatus = millis() + waitSeconds * 1000;
-    }
+    Provisioning.OnMessage(topic, payload, length, millis());
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Azure IoT Hub
 
 static az_iot_hub_client HubClient;
+static TelemetryTopic TelemetryTopicCache;
 
 static int SendCommandResponse(az_iot_hub_client_method_request* request, uint16_t status, az_span response);
 static void MqttSubscribeCallbackHub(char* topic, byte* payload, unsigned int length);
 
-static int ConnectToHub(az_iot_hub_client* iot_hub_client, const std::string& host, const std::string& deviceId, const std::string& symmetricKey, const uint64_t& expirationEpochTime)
+// host and deviceId are referenced by the client, not copied. host must be '\0' terminated.
+static int ConnectToHub(az_iot_hub_client* iot_hub_client, az_span host, az_span deviceId, az_span symmetricKey, const uint64_t& expirationEpochTime)
 {
-    static std::string deviceIdCache;
-    deviceIdCache = deviceId;
-
-    const az_span hostSpan{ az_span_create((uint8_t*)&host[0], host.size()) };
-    const az_span deviceIdSpan{ az_span_create((uint8_t*)&deviceIdCache[0], deviceIdCache.size()) };
     az_iot_hub_client_options options = az_iot_hub_client_options_default();
     options.model_id = AZ_SPAN_LITERAL_FROM_STR(IOT_CONFIG_MODEL_ID);
-    if (az_result_failed(az_iot_hub_client_init(iot_hub_client, hostSpan, deviceIdSpan, &options))) return -1;
+    if (az_result_failed(az_iot_hub_client_init(iot_hub_client, host, deviceId, &options))) return -1;
+    if (TelemetryTopicCache.Init(iot_hub_client) != 0) return -7;
 
     char mqttClientId[128];
     size_t client_id_length;
@@ -278,28 +343,42 @@ static int ConnectToHub(az_iot_hub_client* iot_hub_client, const std::string& ho
     if (az_result_failed(az_iot_hub_client_get_user_name(iot_hub_client, mqttUsername, sizeof(mqttUsername), NULL))) return -5;
 
     char mqttPassword[300];
-    uint8_t signatureBuf[256];
-    az_span signatureSpan = az_span_create(signatureBuf, sizeof(signatureBuf));
-    az_span signatureValidSpan;
-    if (az_result_failed(az_iot_hub_client_sas_get_signature(iot_hub_client, expirationEpochTime, signatureSpan, &signatureValidSpan))) return -2;
-    const std::vector<uint8_t> signature(az_span_ptr(signatureValidSpan), az_span_ptr(signatureValidSpan) + az_span_size(signatureValidSpan));
-    const std::string encryptedSignature = GenerateEncryptedSignature(symmetricKey, signature);
-    az_span encryptedSignatureSpan = az_span_create((uint8_t*)&encryptedSignature[0], encryptedSignature.size());
-    if (az_result_failed(az_iot_hub_client_sas_get_password(iot_hub_client, expirationEpochTime, encryptedSignatureSpan, AZ_SPAN_EMPTY, mqttPassword, sizeof(mqttPassword), NULL))) return -3;
+    if (!IOT_CONFIG_USE_X509)
+    {
+        uint8_t signatureBuf[256];
+        az_span signatureSpan = az_span_create(signatureBuf, sizeof(signatureBuf));
+        az_span signatureValidSpan;
+        if (az_result_failed(az_iot_hub_client_sas_get_signature(iot_hub_client, expirationEpochTime, signatureSpan, &signatureValidSpan))) return -2;
+        const std::vector<uint8_t> signature(az_span_ptr(signatureValidSpan), az_span_ptr(signatureValidSpan) + az_span_size(signatureValidSpan));
+        const std::string encryptedSignature = GenerateEncryptedSignature(symmetricKey, signature);
+        az_span encryptedSignatureSpan = az_span_create((uint8_t*)&encryptedSignature[0], encryptedSignature.size());
+        if (az_result_failed(az_iot_hub_client_sas_get_password(iot_hub_client, expirationEpochTime, encryptedSignatureSpan, AZ_SPAN_EMPTY, mqttPassword, sizeof(mqttPassword), NULL))) return -3;
+    }
 
     Log("Hub:" DLM);
-    Log(" Host = %s" DLM, host.c_str());
-    Log(" Device id = %s" DLM, deviceIdCache.c_str());
+    Log(" Host = %.*s" DLM, az_span_size(host), az_span_ptr(host));
+    Log(" Device id = %.*s" DLM, az_span_size(deviceId), az_span_ptr(deviceId));
+    Log(" Authentication = %s" DLM, IOT_CONFIG_USE_X509 ? "X.509" : "SAS");
     Log(" MQTT client id = %s" DLM, mqttClientId);
     Log(" MQTT username = %s" DLM, mqttUsername);
     //Log(" MQTT password = %s" DLM, mqttPassword);
 
-    wifi_client.setCACert(ROOT_CA_BALTIMORE);
     mqtt_client.setBufferSize(MQTT_PACKET_SIZE);
-    mqtt_client.setServer(host.c_str(), 8883);
+    mqtt_client.setServer(reinterpret_cast<const char*>(az_span_ptr(host)), IOT_CONFIG_MQTT_PORT);
     mqtt_client.setCallback(MqttSubscribeCallbackHub);
+    DnsCache::SetPersistent(reinterpret_cast<const char*>(az_span_ptr(host)));
 
-    if (!mqtt_client.connect(mqttClientId, mqttUsername, mqttPassword)) return -6;
+    const unsigned long connectStartTime = millis();
+    SetClientCertificate();
+    if (!mqtt_client.connect(mqttClientId, mqttUsername, IOT_CONFIG_USE_X509 ? nullptr : mqttPassword))
+    {
+        // Resolve again on the next attempt in case the hub moved
+        DnsCache::Invalidate(reinterpret_cast<const char*>(az_span_ptr(host)));
+        ++NetworkStats::HubConnectFailures;
+        return -6;
+    }
+    NetworkStats::HubConnect.Add(millis() - connectStartTime);
+    NetworkStats::OnHubConnected(millis());
 
     mqtt_client.subscribe(AZ_IOT_HUB_CLIENT_METHODS_SUBSCRIBE_TOPIC);
     mqtt_client.subscribe(AZ_IOT_HUB_CLIENT_C2D_SUBSCRIBE_TOPIC);
@@ -362,159 +441,103 @@ static void DisplayTelemetry(float voc, float co, float no2, float c2h5ch, float
     spr.pushSprite(((tft.width() / 2) + (tft.width() / 2) / 2), (tft.height() / 2) + 67);
     spr.deleteSprite();
 
+    Watchdog::CheckIn(WatchdogTask::Display, millis());
 }
 
-static az_result SendTelemetry()
+static void ReadTelemetrySample(TelemetrySample* sample)
 {
     float accelX, accelY, accelZ;
     AccelSensor.getAcceleration(&accelX, &accelY, &accelZ);
-    float humidity;
-    uint32_t val = 0;
-    float no2, c2h5ch, voc, co;
-    int light;
-    float temperature;
-    
-    light = analogRead(WIO_LIGHT) * 100 / 1023;
-
-    // get multichannel gas sensor data
+    sample->accelX = accelX;
+    sample->accelY = accelY;
+    sample->accelZ = accelZ;
 
-    // VOC
-    val = gas.getGM502B();
-    if (val > 999) val = 999;
-    voc = gas.calcVol(val);    
+    sample->light = analogRead(WIO_LIGHT) * 100 / 1023;
 
-    // CO
-    val = gas.getGM702B();
-    if (val > 999) val = 999;
-    co = gas.calcVol(val);
+    // Temperature and humidity first, they compensate the gas readings
+    sample->temperature = dht.readTemperature();
+    sample->humidity = dht.readHumidity();
+    if (sample->humidity > 99.9) sample->humidity = 99.9;
+    GasCalibration::SetEnvironment(sample->temperature, sample->humidity);
 
-    // Temperature
-    temperature = dht.readTemperature();
-
-    // NO2
-    val = gas.getGM102B();
-    if (val > 999) val = 999;
-    no2 = gas.calcVol(val);
+    // get multichannel gas sensor data
+    const unsigned long now = millis();
+    sample->voc = GasCalibration::ToFloat(GasCalibration::Convert(GasSensor::VOC, gas.getGM502B(), now));
+    sample->co = GasCalibration::ToFloat(GasCalibration::Convert(GasSensor::CO, gas.getGM702B(), now));
+    sample->no2 = GasCalibration::ToFloat(GasCalibration::Convert(GasSensor::NO2, gas.getGM102B(), now));
+    sample->c2h5ch = GasCalibration::ToFloat(GasCalibration::Convert(GasSensor::C2H5CH, gas.getGM302B(), now));
+}
 
-    // Humidity
-    humidity = dht.readHumidity();
-    if (humidity > 99.9) humidity = 99.9;
+static TelemetrySample LatestSample;
+static unsigned long LatestSampleTime;
+static bool AirQualityAlarmPending = false;
 
-    // Ethyl
-    val = gas.getGM302B();
-    if (val > 999) val = 999;
-    c2h5ch = gas.calcVol(val);
+static void DisplayAirQualityLevel(AirQuality::Level level);
+static void BuzzerStart(unsigned long durationMillisecs);
+static bool BuzzerIsOn();
 
+static void SampleSensors(unsigned long now)
+{
+    ReadTelemetrySample(&LatestSample);
+    LatestSampleTime = now;
 
-    char creationTime[20 + 1];  // yyyy-mm-ddThh:mm:ss.sssZ
+    if (AirQuality::Update(now, &LatestSample))
     {
-        const time_t t = ntp.epoch();
-        struct tm tm;
-        gmtime_r(&t, &tm);
-        const int len = snprintf(creationTime, sizeof(creationTime), "%d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-        if (len != sizeof(creationTime) - 1)
-        {
-            Log("Failed snprintf" DLM);
-            return AZ_ERROR_NOT_SUPPORTED;
-        }
+        const AirQuality::Level level = AirQuality::GetLevel();
+        Log("Air quality %s %s" DLM, AirQuality::GetLevelName(level), AirQuality::GetCause());
+
+        DisplayAirQualityLevel(level);
+        PowerManager::NotifyActivity(now);
+        if (level == AirQuality::Level::Alarm) BuzzerStart(AIR_QUALITY_ALARM_BUZZER_MILLISECS);
+        else if (level == AirQuality::Level::Warning) BuzzerStart(AIR_QUALITY_WARNING_BUZZER_MILLISECS);
+        AirQualityAlarmPending = true;
     }
 
-    az_iot_message_properties props;
-    uint8_t propsBuffer[128];
-    if (az_result_failed(az_iot_message_properties_init(&props, az_span_create(propsBuffer, sizeof(propsBuffer)), 0)))
-    {
-        Log("Failed az_iot_message_properties_init" DLM);
-        return AZ_ERROR_NOT_SUPPORTED;
-    }
-    if (az_result_failed(az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR("iothub-creation-time-utc"), az_span_create(reinterpret_cast<uint8_t*>(creationTime), strlen(creationTime)))))
-    {
-        Log("Failed az_iot_message_properties_append" DLM);
-        return AZ_ERROR_NOT_SUPPORTED;
-    }
+    Watchdog::CheckIn(WatchdogTask::Sensors, now);
+}
+
+static az_result SendTelemetry()
+{
+    const TelemetrySample& sample = LatestSample;
 
-    char telemetry_topic[128];
-    if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&HubClient, &props, telemetry_topic, sizeof(telemetry_topic), NULL)))
+    // Stamped with the time the sample was read, not when it is queued
+    const char* telemetry_topic = TelemetryTopicCache.Get(TimeService::GetEpochMillisecs(LatestSampleTime));
+    if (telemetry_topic == nullptr)
     {
-        Log("Failed az_iot_hub_client_telemetry_get_publish_topic" DLM);
+        Log("Failed TelemetryTopic::Get" DLM);
         return AZ_ERROR_NOT_SUPPORTED;
     }
 
-    az_json_writer json_builder;
-    char telemetry_payload[200];
-    AZ_RETURN_IF_FAILED(az_json_writer_init(&json_builder, AZ_SPAN_FROM_BUFFER(telemetry_payload), NULL));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_begin_object(&json_builder));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_ACCEL_X)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, accelX, 3));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_ACCEL_Y)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, accelY, 3));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_ACCEL_Z)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, accelZ, 3));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_LIGHT)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_int32(&json_builder, light));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_TEMP)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, temperature, 2));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_HUMID)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, humidity, 2));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_CO)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, co, 2));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_VOC)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, voc, 2));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_NO2)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, no2, 2));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_C2H5CH)));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_double(&json_builder, c2h5ch, 2));
-    AZ_RETURN_IF_FAILED(az_json_writer_append_end_object(&json_builder));
-    const az_span out_payload{ az_json_writer_get_bytes_used_in_destination(&json_builder) };
-
     static int sendCount = 0;
-    if (!mqtt_client.publish(telemetry_topic, az_span_ptr(out_payload), az_span_size(out_payload), false))
+    if (!OutboundMessages.Enqueue(MessagePriority::Telemetry, telemetry_topic, TelemetryJsonSource{ sample }))
     {
-        DisplayPrintf("ERROR: Send telemetry %d", sendCount);
+        DisplayPrintf("ERROR: Queue telemetry %d", sendCount);
     }
     else
     {
         ++sendCount;
-        DisplayPrintf("Sent telemetry %d", sendCount);
+        DisplayPrintf("Queued telemetry %d", sendCount);
+    }
+
+    // The link quality comes from the most recent telemetry publish, other classes may have gone out since
+    const unsigned long now = millis();
+    const bool published = mqtt_client.connected() && OutboundMessages.IsLastPublishSucceeded(MessagePriority::Telemetry);
+    const unsigned long lastInterval = TelemetryRateController.GetIntervalMillisecs();
+    TelemetryRateController.Update(now, sample.voc, WiFi.RSSI(), OutboundMessages.GetLastPublishMillisecs(MessagePriority::Telemetry), published);
+    if (TelemetryRateController.GetIntervalMillisecs() != lastInterval)
+    {
+        Log("Telemetry interval = %lu ms (VOC slope = %.3f, link %s)" DLM, TelemetryRateController.GetIntervalMillisecs(), TelemetryRateController.GetVocSlope(), TelemetryRateController.IsLinkDegraded() ? "degraded" : "good");
     }
 
-    DisplayTelemetry(voc, co, no2, c2h5ch, temperature, humidity); // display values
     return AZ_OK;
 }
 
-
-
 static az_result SendButtonTelemetry(ButtonId id)
 {
-    char creationTime[20 + 1];  // yyyy-mm-ddThh:mm:ss.sssZ
-    {
-        const time_t t = ntp.epoch();
-        struct tm tm;
-        gmtime_r(&t, &tm);
-        const int len = snprintf(creationTime, sizeof(creationTime), "%d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-        if (len != sizeof(creationTime) - 1)
-        {
-            Log("Failed snprintf" DLM);
-            return AZ_ERROR_NOT_SUPPORTED;
-        }
-    }
-
-    az_iot_message_properties props;
-    uint8_t propsBuffer[128];
-    if (az_result_failed(az_iot_message_properties_init(&props, az_span_create(propsBuffer, sizeof(propsBuffer)), 0)))
-    {
-        Log("Failed az_iot_message_properties_init" DLM);
-        return AZ_ERROR_NOT_SUPPORTED;
-    }
-    if (az_result_failed(az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR("iothub-creation-time-utc"), az_span_create(reinterpret_cast<uint8_t*>(creationTime), strlen(creationTime)))))
+    const char* telemetry_topic = TelemetryTopicCache.Get(TimeService::GetEpochMillisecs());
+    if (telemetry_topic == nullptr)
     {
-        Log("Failed az_iot_message_properties_append" DLM);
-        return AZ_ERROR_NOT_SUPPORTED;
-    }
-
-    char telemetry_topic[128];
-    if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&HubClient, &props, telemetry_topic, sizeof(telemetry_topic), NULL)))
-    {
-        Log("Failed az_iot_hub_client_telemetry_get_publish_topic" DLM);
+        Log("Failed TelemetryTopic::Get" DLM);
         return AZ_ERROR_NOT_SUPPORTED;
     }
 
@@ -542,70 +565,190 @@ static az_result SendButtonTelemetry(ButtonId id)
     AZ_RETURN_IF_FAILED(az_json_writer_append_end_object(&json_builder));
     const az_span out_payload{ az_json_writer_get_bytes_used_in_destination(&json_builder) };
 
-    if (!mqtt_client.publish(telemetry_topic, az_span_ptr(out_payload), az_span_size(out_payload), false))
+    if (!OutboundMessages.Enqueue(MessagePriority::Button, telemetry_topic, az_span_ptr(out_payload), az_span_size(out_payload)))
     {
-        DisplayPrintf("ERROR: Send button telemetry");
+        DisplayPrintf("ERROR: Queue button telemetry");
+        return AZ_ERROR_NOT_ENOUGH_SPACE;
     }
-    else
+    DisplayPrintf("Queued button telemetry");
+
+    return AZ_OK;
+}
+
+static az_result SendAirQualityTelemetry()
+{
+    const char* telemetry_topic = TelemetryTopicCache.Get(TimeService::GetEpochMillisecs(LatestSampleTime));
+    if (telemetry_topic == nullptr)
     {
-        DisplayPrintf("Sent button telemetry");
+        Log("Failed TelemetryTopic::Get" DLM);
+        return AZ_ERROR_NOT_SUPPORTED;
     }
 
+    const char* level = AirQuality::GetLevelName(AirQuality::GetLevel());
+    const char* cause = AirQuality::GetCause();
+
+    az_json_writer json_builder;
+    char telemetry_payload[200];
+    AZ_RETURN_IF_FAILED(az_json_writer_init(&json_builder, AZ_SPAN_FROM_BUFFER(telemetry_payload), NULL));
+    AZ_RETURN_IF_FAILED(az_json_writer_append_begin_object(&json_builder));
+    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_AIR_QUALITY_ALARM)));
+    AZ_RETURN_IF_FAILED(az_json_writer_append_string(&json_builder, az_span_create((uint8_t*)level, strlen(level))));
+    AZ_RETURN_IF_FAILED(az_json_writer_append_property_name(&json_builder, AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_AIR_QUALITY_ALARM_CAUSE)));
+    AZ_RETURN_IF_FAILED(az_json_writer_append_string(&json_builder, az_span_create((uint8_t*)cause, strlen(cause))));
+    AZ_RETURN_IF_FAILED(az_json_writer_append_end_object(&json_builder));
+    const az_span out_payload{ az_json_writer_get_bytes_used_in_destination(&json_builder) };
+
+    if (!OutboundMessages.Enqueue(MessagePriority::Alarm, telemetry_topic, az_span_ptr(out_payload), az_span_size(out_payload)))
+    {
+        DisplayPrintf("ERROR: Queue air quality telemetry");
+        return AZ_ERROR_NOT_ENOUGH_SPACE;
+    }
+    DisplayPrintf("Queued air quality telemetry");
+
     return AZ_OK;
 }
 
-static void HandleCommandMessage(az_span payload, az_iot_hub_client_method_request* command_request)
+static az_result SendGatewayBatch()
 {
-    int command_res_code = 200;
-    az_result rc = AZ_OK;
+    const char* telemetry_topic = TelemetryTopicCache.Get(TimeService::GetEpochMillisecs());
+    if (telemetry_topic == nullptr)
+    {
+        Log("Failed TelemetryTopic::Get" DLM);
+        return AZ_ERROR_NOT_SUPPORTED;
+    }
 
-    if (az_span_is_content_equal(AZ_SPAN_LITERAL_FROM_STR(COMMAND_RING_BUZZER), command_request->name))
+    // Readings of the downstream nodes, each entry carries its own device id and time.
+    // The queue makes room by dropping older messages, so a batch it refuses never fits and is given up.
+    size_t batchSize;
+    const uint8_t* batch = Gateway::GetBatch(&batchSize);
+    if (!OutboundMessages.Enqueue(MessagePriority::Telemetry, telemetry_topic, batch, batchSize))
     {
-        // Parse the command payload (it contains a 'duration' field)
-        Log("Processing command 'ringBuzzer'" DLM);
-        char buffer[32];
-        az_span_to_str(buffer, 32, payload);
-        Log("Raw command payload: %s" DLM, buffer);
+        Log("ERROR: Queue gateway telemetry, dropped %u readings" DLM, Gateway::DropBatch());
+        return AZ_ERROR_NOT_ENOUGH_SPACE;
+    }
+    Gateway::ClearBatch();
+
+    return AZ_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Commands
 
-        az_json_reader json_reader;
+static uint16_t ParseRingBuzzer(az_span payload, uint8_t* args)
+{
+    // The payload is the duration in milliseconds
+    az_json_reader json_reader;
+    uint32_t duration;
+    if (az_result_failed(az_json_reader_init(&json_reader, payload, NULL))) return CommandDispatcher::StatusBadRequest;
+    if (az_result_failed(az_json_reader_next_token(&json_reader))) return CommandDispatcher::StatusBadRequest;
+    if (az_result_failed(az_json_token_get_uint32(&json_reader.token, &duration))) return CommandDispatcher::StatusBadRequest;
+    if (duration < 1 || duration > COMMAND_BUZZER_MAX_MILLISECS) return CommandDispatcher::StatusBadRequest;
+
+    memcpy(args, &duration, sizeof(duration));
+    return CommandDispatcher::StatusOk;
+}
+
+static bool RunRingBuzzer(const uint8_t* args, bool start, unsigned long /*now*/)
+{
+    if (start)
+    {
         uint32_t duration;
-        if (az_json_reader_init(&json_reader, payload, NULL) == AZ_OK)
-        {
-            if (az_json_reader_next_token(&json_reader) == AZ_OK)
-            {
-                if (az_result_failed(rc = az_json_token_get_uint32(&json_reader.token, &duration)))
-                {
-                    Log("Couldn't parse JSON token res=%d" DLM, rc);
-                }
-                else
-                {
-                    Log("Duration: %dms" DLM, duration);
-                }
-            }
+        memcpy(&duration, args, sizeof(duration));
+        Log("Duration: %lums" DLM, duration);
+        BuzzerStart(duration);
+    }
 
-            // Invoke command
-            analogWrite(WIO_BUZZER, 128);
-            delay(duration);
-            analogWrite(WIO_BUZZER, 0);
+    return !BuzzerIsOn();
+}
 
-            int rc;
-            if (az_result_failed(rc = SendCommandResponse(command_request, command_res_code, AZ_SPAN_LITERAL_FROM_STR("{}"))))
-            {
-                Log("Unable to send %d response, status 0x%08x" DLM, command_res_code, rc);
-            }
-        }
+static bool ParseHex(az_span hex, uint8_t* data, size_t dataSize)
+{
+    if (static_cast<size_t>(az_span_size(hex)) != dataSize * 2) return false;
+
+    for (size_t i = 0; i < dataSize * 2; ++i)
+    {
+        const char c = tolower(az_span_ptr(hex)[i]);
+        const int nibble = isdigit(c) ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (nibble < 0) return false;
+        data[i / 2] = i % 2 == 0 ? nibble << 4 : data[i / 2] | nibble;
     }
-    else
+
+    return true;
+}
+
+static uint16_t ParseUpdateFirmware(az_span payload, uint8_t* /*args*/)
+{
+    // {"url":"https://...","size":123456,"sha256":"<64 hex digits>"}
+    // The request is handed over right away, FirmwareUpdate::DoWork() downloads in the background
+    if (FirmwareUpdate::IsBusy()) return CommandDispatcher::StatusBusy;
+
+    char url[FirmwareUpdate::HostMaxSize + FirmwareUpdate::PathMaxSize + 16] = "";
+    uint32_t size = 0;
+    uint8_t sha256[FirmwareUpdate::Sha256Size];
+    bool shaFound = false;
+
+    az_json_reader json_reader;
+    if (az_result_failed(az_json_reader_init(&json_reader, payload, NULL))) return CommandDispatcher::StatusBadRequest;
+    if (az_result_failed(az_json_reader_next_token(&json_reader)) || json_reader.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT) return CommandDispatcher::StatusBadRequest;
+    while (az_result_succeeded(az_json_reader_next_token(&json_reader)) && json_reader.token.kind == AZ_JSON_TOKEN_PROPERTY_NAME)
     {
-        // Unsupported command
-        Log("Unsupported command received: %.*s." DLM, az_span_size(command_request->name), az_span_ptr(command_request->name));
+        const az_json_token name = json_reader.token;
+        if (az_result_failed(az_json_reader_next_token(&json_reader))) return CommandDispatcher::StatusBadRequest;
 
-        int rc;
-        if (az_result_failed(rc = SendCommandResponse(command_request, 404, AZ_SPAN_LITERAL_FROM_STR("{}"))))
+        if (az_json_token_is_text_equal(&name, AZ_SPAN_LITERAL_FROM_STR("url")))
+        {
+            if (az_result_failed(az_json_token_get_string(&json_reader.token, url, sizeof(url), NULL))) return CommandDispatcher::StatusBadRequest;
+        }
+        else if (az_json_token_is_text_equal(&name, AZ_SPAN_LITERAL_FROM_STR("size")))
+        {
+            if (az_result_failed(az_json_token_get_uint32(&json_reader.token, &size))) return CommandDispatcher::StatusBadRequest;
+        }
+        else if (az_json_token_is_text_equal(&name, AZ_SPAN_LITERAL_FROM_STR("sha256")))
+        {
+            if (json_reader.token.kind != AZ_JSON_TOKEN_STRING || !ParseHex(json_reader.token.slice, sha256, sizeof(sha256))) return CommandDispatcher::StatusBadRequest;
+            shaFound = true;
+        }
+        else if (az_result_failed(az_json_reader_skip_children(&json_reader)))
         {
-            printf("Unable to send %d response, status 0x%08x\n", 404, rc);
+            return CommandDispatcher::StatusBadRequest;
         }
     }
+    if (!shaFound || !FirmwareUpdate::Request(url, size, sha256)) return CommandDispatcher::StatusBadRequest;
+
+    Log("Firmware update from %s, %lu bytes" DLM, url, size);
+    return CommandDispatcher::StatusAccepted;
+}
+
+// In CommandId order, the names are looked up through the generated CommandTable
+static const CommandHandler CommandHandlers[] =
+{
+    { COMMAND_RING_BUZZER, ParseRingBuzzer, RunRingBuzzer },    // CommandId::RingBuzzer
+    { COMMAND_UPDATE_FIRMWARE, ParseUpdateFirmware, nullptr },  // CommandId::UpdateFirmware
+};
+static_assert(sizeof(CommandHandlers) / sizeof(CommandHandlers[0]) == static_cast<size_t>(CommandId::Count), "CommandHandlers must cover every DTDL command");
+
+static CommandDispatcher Commands(CommandHandlers);
+
+static void HandleCommandMessage(az_span payload, az_iot_hub_client_method_request* command_request)
+{
+    Log("Processing command '%.*s'" DLM, az_span_size(command_request->name), az_span_ptr(command_request->name));
+
+    // Validates and queues the work, the response goes out before the command runs
+    const uint16_t status = Commands.Dispatch(command_request->name, payload);
+    if (status == CommandDispatcher::StatusNotFound)
+    {
+        Log("Unsupported command received: %.*s." DLM, az_span_size(command_request->name), az_span_ptr(command_request->name));
+    }
+    else if (status < 200 || status >= 300)
+    {
+        Log("Rejected command with status %u, payload '%.*s'" DLM, status, az_span_size(payload), az_span_ptr(payload));
+    }
+
+    int rc;
+    if (az_result_failed(rc = SendCommandResponse(command_request, status, AZ_SPAN_LITERAL_FROM_STR("{}"))))
+    {
+        Log("Unable to send %d response, status 0x%08x" DLM, status, rc);
+    }
 }
 
 static int SendCommandResponse(az_iot_hub_client_method_request* request, uint16_t status, az_span response)
@@ -619,41 +762,118 @@ static int SendCommandResponse(az_iot_hub_client_method_request* request, uint16
         return rc;
     }
 
-    Log("Status: %u\tPayload: '", status);
-    char* payload_char = (char*)az_span_ptr(response);
-    if (payload_char != NULL)
+    Log("Status: %u\tPayload: '%.*s'" DLM, status, az_span_size(response), az_span_ptr(response));
+
+    // Queue the commands response ahead of any other message. The queue counts a response it cannot take as dropped.
+    if (!OutboundMessages.Enqueue(MessagePriority::CommandResponse, commands_response_topic, az_span_ptr(response), az_span_size(response)))
     {
-        for (int32_t i = 0; i < az_span_size(response); i++)
-        {
-            Log("%c", *(payload_char + i));
-        }
+        Log("Dropped response, %lu dropped so far" DLM, OutboundMessages.GetDroppedCount(MessagePriority::CommandResponse));
+        return AZ_ERROR_NOT_ENOUGH_SPACE;
     }
-    Log("'" DLM);
+    Log("Queued response" DLM);
+
+    return rc;
+}
 
-    // Send the commands response
-    if (mqtt_client.publish(commands_response_topic, az_span_ptr(response), az_span_size(response), false))
+static void HandleCloudToDeviceMessage(az_span payload, az_iot_hub_client_c2d_request* c2d_request)
+{
+    // A "command" property runs the command like a direct method, there is nobody to respond to
+    az_span name;
+    if (az_result_failed(az_iot_message_properties_find(&c2d_request->properties, AZ_SPAN_LITERAL_FROM_STR("command"), &name)))
     {
-        Log("Sent response" DLM);
+        Log("Cloud-to-device message, %d bytes" DLM, az_span_size(payload));
+        return;
     }
 
-    return rc;
+    Log("Processing cloud-to-device command '%.*s'" DLM, az_span_size(name), az_span_ptr(name));
+    const uint16_t status = Commands.Dispatch(name, payload);
+    if (status < 200 || status >= 300)
+    {
+        Log("Rejected cloud-to-device command with status %u" DLM, status);
+    }
 }
 
 static void MqttSubscribeCallbackHub(char* topic, byte* payload, unsigned int length)
 {
-    az_span topic_span = az_span_create((uint8_t *)topic, strlen(topic));
-    az_iot_hub_client_method_request command_request;
+    ++NetworkStats::ReceivedMessages;
 
-    if (az_result_succeeded(az_iot_hub_client_methods_parse_received_topic(&HubClient, topic_span, &command_request)))
+    // The payload stays in the PubSubClient buffer, handlers get a span over it
+    const az_span topic_span = az_span_create((uint8_t *)topic, strlen(topic));
+    const az_span payload_span = az_span_create(payload, length);
+
+    switch (ClassifyTopic(topic_span))
+    {
+    case TopicClass::Method:
     {
+        az_iot_hub_client_method_request command_request;
+        if (az_result_failed(az_iot_hub_client_methods_parse_received_topic(&HubClient, topic_span, &command_request))) break;
+
         DisplayPrintf("Command arrived!");
         // Determine if the command is supported and take appropriate actions
-        HandleCommandMessage(az_span_create(payload, length), &command_request);
+        HandleCommandMessage(payload_span, &command_request);
+        break;
+    }
+    case TopicClass::CloudToDevice:
+    {
+        az_iot_hub_client_c2d_request c2d_request;
+        if (az_result_failed(az_iot_hub_client_c2d_parse_received_topic(&HubClient, topic_span, &c2d_request))) break;
+
+        DisplayPrintf("Message arrived!");
+        HandleCloudToDeviceMessage(payload_span, &c2d_request);
+        break;
+    }
+    case TopicClass::TwinResponse:
+    case TopicClass::TwinDesired:
+        Log("Ignored twin message" DLM);
+        break;
+    default:
+        Log("Unexpected topic: %s" DLM, topic);
+        break;
     }
 
     Log(DLM);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Buzzer
+
+static bool BuzzerOn = false;
+static unsigned long BuzzerStopTime;
+
+static void BuzzerStart(unsigned long durationMillisecs)
+{
+    analogWrite(WIO_BUZZER, 128);
+    BuzzerOn = true;
+    BuzzerStopTime = millis() + durationMillisecs;
+}
+
+static bool BuzzerIsOn()
+{
+    return BuzzerOn;
+}
+
+static void BuzzerDoWork()
+{
+    if (BuzzerOn && static_cast<long>(millis() - BuzzerStopTime) >= 0)
+    {
+        analogWrite(WIO_BUZZER, 0);
+        BuzzerOn = false;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Display layout
+
+static void DisplayAirQualityLevel(AirQuality::Level level)
+{
+    const uint16_t color = level == AirQuality::Level::Alarm ? TFT_RED : level == AirQuality::Level::Warning ? TFT_YELLOW : TFT_GREEN;
+
+    for (int8_t line_index = 0; line_index < 5 ; line_index++)
+    {
+        tft.drawLine(0, 50 + line_index, tft.width(), 50 + line_index, color);
+    }
+}
+
 void setup_display() {
 
     //Head
@@ -730,6 +950,8 @@ void setup()
     // Load storage
 
     Storage::Load();
+    FirmwareUpdate::ApplyPending();
+    GasCalibration::Load();
 
     ////////////////////
     // Init I/O
@@ -737,6 +959,7 @@ void setup()
     Serial.begin(115200);
 
     pinMode(WIO_BUZZER, OUTPUT);
+    PowerManager::Init(POWER_LOW_POWER_MODE, POWER_BACKLIGHT_TIMEOUT_MILLISECS);
 
     ////////////////////
     // Display Logo
@@ -765,6 +988,14 @@ void setup()
         CliMode();
     }
 
+    ////////////////////
+    // Arm watchdog
+
+    Watchdog::Begin(WATCHDOG_TIMEOUT_MILLISECS);
+    Watchdog::SetDeadline(WatchdogTask::Network, WATCHDOG_NETWORK_DEADLINE_MILLISECS);
+    Watchdog::SetDeadline(WatchdogTask::Sensors, WATCHDOG_SENSORS_DEADLINE_MILLISECS);
+    Watchdog::SetDeadline(WatchdogTask::Display, WATCHDOG_DISPLAY_DEADLINE_MILLISECS);
+
     ////////////////////
     // Init sensor
 
@@ -777,32 +1008,61 @@ void setup()
     
     ButtonInit();
 
+    Gateway::Init(GATEWAY_ENABLED, GATEWAY_GROUP_KEY, GATEWAY_BATCH_MILLISECS);
+    if (Gateway::IsEnabled())
+    {
+        Serial1.begin(GATEWAY_BAUD);
+        Gateway::Begin(Serial1);
+    }
+
+    TelemetryRateController.SetVocSlopeThreshold(TELEMETRY_VOC_SLOPE_THRESHOLD);
+    TelemetryRateController.SetRssiThreshold(TELEMETRY_RSSI_THRESHOLD);
+    TelemetryRateController.SetPublishLatencyThreshold(TELEMETRY_LATENCY_THRESHOLD_MILLISECS);
+    OutboundMessages.SetRateLimit(IOT_HUB_MESSAGES_PER_SECOND, IOT_HUB_MESSAGE_BURST);
+
+    SampleSensors(millis());
+
     ////////////////////
     // Connect Wi-Fi
 
-    DisplayPrintf("Connecting to SSID: %s", IOT_CONFIG_WIFI_SSID);
-    do
-    {
-        Log(".");
-        WiFi.begin(IOT_CONFIG_WIFI_SSID, IOT_CONFIG_WIFI_PASSWORD);
-        delay(500);
-    }
-    while (WiFi.status() != WL_CONNECTED);
-    DisplayPrintf("Connected");
+    WiFiManager::AddProfile(IOT_CONFIG_WIFI_SSID, IOT_CONFIG_WIFI_PASSWORD);
+    #if defined(USE_CLI)
+        WiFiManager::LoadProfiles();
+    #endif // USE_CLI
+    // Connects from loop(), so that a missing network never holds up the boot
+    WiFiManager::Begin(WIFI_ROAM_RSSI_THRESHOLD);
+    DisplayPrintf("Connecting to Wi-Fi...");
 
     ////////////////////
     // Sync time server
     
-    ntp.begin();
+    // The first sync also runs from loop(), connections wait for it
+    TimeService::Begin(wifi_udp, TIME_NTP_SERVER, TIME_SYNC_INTERVAL_MILLISECS);
+    DnsCache::Begin(DNS_CACHE_TTL_MILLISECS);
 
     ////////////////////
     // Provisioning
 
     #if defined(USE_CLI) || defined(USE_DPS)
 
-        if (RegisterDeviceToDPS(IOT_CONFIG_GLOBAL_DEVICE_ENDPOINT, IOT_CONFIG_ID_SCOPE, IOT_CONFIG_REGISTRATION_ID, IOT_CONFIG_SYMMETRIC_KEY, ntp.epoch() + TOKEN_LIFESPAN, &HubHost, &DeviceId) != 0)
+        // A device registered before goes straight to its hub, so devices powered on together
+        // do not all register at once. DPS is asked again when that hub refuses the connection.
+        if (az_span_size(Storage::HubHost) > 0 && az_span_size(Storage::DeviceId) > 0)
+        {
+            Log("Using the last DPS assignment:" DLM);
+            Log(" Hub host = %.*s" DLM, az_span_size(Storage::HubHost), az_span_ptr(Storage::HubHost));
+            Log(" Device id = %.*s" DLM, az_span_size(Storage::DeviceId), az_span_ptr(Storage::DeviceId));
+            Provisioned = true;
+            StoredAssignment = true;
+        }
+        // Registration runs from loop() so that sensors, display and console keep working meanwhile
+        else
         {
-            Abort("RegisterDeviceToDPS()");
+            DisplayPrintf("Connecting to Azure IoT Hub DPS...");
+            if (StartProvisioning(IOT_CONFIG_GLOBAL_DEVICE_ENDPOINT, IOT_CONFIG_ID_SCOPE, IOT_CONFIG_REGISTRATION_ID, millis()) != 0)
+            {
+                Abort("StartProvisioning()");
+            }
         }
 
     #else
@@ -811,45 +1071,110 @@ void setup()
         DeviceId = IOT_CONFIG_DEVICE_ID;
 
     #endif // USE_CLI || USE_DPS
+
+    ////////////////////
+    // Start console
+
+    CliInit();
 }
 
-void loop()
+static void MainDoWork()
 {
     ButtonDoWork();
+    CliDoWork();
 
-    static uint64_t reconnectTime;
-    if (!mqtt_client.connected())
+    // Sensors are sampled faster than telemetry is sent so that local alarms react quickly
+    const unsigned long sampleTime = millis();
+    if (SerialStream::IsDue(sampleTime))
     {
-        Log("Connecting to Azure IoT Hub...");
-        const uint64_t now = ntp.epoch();
-        if (ConnectToHub(&HubClient, HubHost, DeviceId, IOT_CONFIG_SYMMETRIC_KEY, now + TOKEN_LIFESPAN) != 0)
-        {
-            //DisplayPrintf("> ERROR.");
-            Log("> ERROR. Status code =%d. Try again in 5 seconds." DLM, mqtt_client.state());
-            delay(5000);
-            return;
-        }
+        SampleSensors(sampleTime);
+        SerialStream::SendGas(sampleTime);
+        SerialStream::Send(sampleTime, LatestSample);
+    }
+    else if (sampleTime - LatestSampleTime >= AIR_QUALITY_SAMPLE_MILLISECS)
+    {
+        SampleSensors(sampleTime);
+    }
+    BuzzerDoWork();
 
-        Log("> SUCCESS.");
-        reconnectTime = now + TOKEN_LIFESPAN * 0.85;
+    // The screen follows the samples, also while telemetry cannot be sent
+    static unsigned long nextDisplayTime = 0;
+    if (static_cast<long>(millis() - nextDisplayTime) >= 0)
+    {
+        DisplayTelemetry(LatestSample.voc, LatestSample.co, LatestSample.no2, LatestSample.c2h5ch, LatestSample.temperature, LatestSample.humidity);
+        nextDisplayTime = millis() + AIR_QUALITY_DISPLAY_MILLISECS;
     }
-    else
+    Gateway::DoWork(millis());
+    Commands.DoWork(millis());
+    PowerManager::DoWork(millis());
+
+    // Reconnects in the background, messages keep queueing meanwhile
+    static bool wifiConnected = false;
+    WiFiManager::DoWork(millis());
+    if (WiFiManager::IsConnected() != wifiConnected)
+    {
+        wifiConnected = WiFiManager::IsConnected();
+        Log(wifiConnected ? "Wi-Fi connected" DLM : "Wi-Fi disconnected" DLM);
+    }
+
+    // The network task checks in on progress only. During an outage that is a finished Wi-Fi attempt.
+    static uint32_t wifiAttempts = 0;
+    if (WiFiManager::GetAttempts() != wifiAttempts)
+    {
+        wifiAttempts = WiFiManager::GetAttempts();
+        Watchdog::CheckIn(WatchdogTask::Network, millis());
+    }
+    if (wifiConnected) TimeService::DoWork(millis());
+
+    // Checked once against the time of the first sync, then used by every connection
+    static bool trustStoreLoaded = false;
+    if (!trustStoreLoaded && TimeService::IsSynchronized())
+    {
+        if (TrustStore::Load(ROOT_CA_BUNDLE, TimeService::GetEpochMillisecs()) == 0) Log("No valid root CA, TLS connections will fail" DLM);
+        wifi_client.setCACert(TrustStore::GetPem());
+        trustStoreLoaded = true;
+    }
+
+    if (wifiConnected) FirmwareUpdate::DoWork(millis());
+
+    static FirmwareUpdate::State updateState = FirmwareUpdate::State::Idle;
+    if (FirmwareUpdate::GetState() != updateState)
     {
-        if ((uint64_t)ntp.epoch() >= reconnectTime)
+        updateState = FirmwareUpdate::GetState();
+        if (updateState == FirmwareUpdate::State::Failed) FirmwareUpdate::Print();
+        if (updateState == FirmwareUpdate::State::Verified)
         {
-            Log("Disconnect");
-            mqtt_client.disconnect();
-            return;
+            DisplayPrintf("Restarting to update firmware");
+            if (mqtt_client.connected()) mqtt_client.disconnect();
+            FirmwareUpdate::Restart();
         }
+    }
 
-        mqtt_client.loop();
+    static unsigned long nextBaselineSaveTime = GAS_BASELINE_SAVE_MILLISECS;
+    if (static_cast<long>(millis() - nextBaselineSaveTime) >= 0)
+    {
+        GasCalibration::SaveBaselines();
+        nextBaselineSaveTime = millis() + GAS_BASELINE_SAVE_MILLISECS;
+    }
+
+    #if defined(USE_CLI) || defined(USE_DPS)
+
+        // The MQTT client belongs to DPS until the device is assigned to a hub
+        if (!ProvisioningDoWork(millis())) return;
+
+    #endif // USE_CLI || USE_DPS
+
+    // Messages are queued while disconnected once the topic is known, and sent in priority order
+    if (TelemetryTopicCache.IsValid())
+    {
+        if (AirQualityAlarmPending && SendAirQualityTelemetry() == AZ_OK) AirQualityAlarmPending = false;
 
         static unsigned long nextTelemetrySendTime = 0;
         if (millis() > nextTelemetrySendTime)
         {
-            Log("Sending Telemetry...");
+            Log("Queueing Telemetry...");
             SendTelemetry();
-            nextTelemetrySendTime = millis() + TELEMETRY_FREQUENCY_MILLISECS;
+            nextTelemetrySendTime = millis() + TelemetryRateController.GetIntervalMillisecs();
         }
 
         for (int i = 0; i < ButtonNumber; ++i)
@@ -860,5 +1185,77 @@ void loop()
                 ButtonsClicked[i] = false;
             }
         }
+
+        if (Gateway::IsBatchDue(millis())) SendGatewayBatch();
     }
+
+    // Token renewal runs on millis() so that time corrections never move it.
+    // A device certificate does not expire with the connection, so there is nothing to renew.
+    static bool tokenRenewal;
+    static unsigned long reconnectTime;
+    static unsigned long nextConnectTime = 0;
+    if (!mqtt_client.connected())
+    {
+        // Wait without blocking so that the console stays responsive. Tokens need the time.
+        if (!wifiConnected || !TimeService::IsSynchronized() || static_cast<long>(millis() - nextConnectTime) < 0) return;
+
+        #if defined(USE_CLI) || defined(USE_DPS)
+            // Views into the flash, which move when the store compacts
+            HubHost = Storage::HubHost;
+            DeviceId = Storage::DeviceId;
+        #endif // USE_CLI || USE_DPS
+
+        Log("Connecting to Azure IoT Hub...");
+        const uint64_t now = TimeService::GetEpoch();
+        const int result = ConnectToHub(&HubClient, HubHost, DeviceId, IOT_CONFIG_SYMMETRIC_KEY, now + TOKEN_LIFESPAN);
+        Watchdog::CheckIn(WatchdogTask::Network, millis());
+        if (result != 0)
+        {
+            //DisplayPrintf("> ERROR.");
+            Log("> ERROR. Status code =%d. Try again in 5 seconds." DLM, mqtt_client.state());
+            nextConnectTime = millis() + 5000;
+            WiFiManager::OnUpstreamFailure();
+
+            #if defined(USE_CLI) || defined(USE_DPS)
+                // The device may have been moved to another hub or deleted since it registered
+                if (StoredAssignment)
+                {
+                    Log("Registering with DPS again" DLM);
+                    StoredAssignment = false;
+                    Provisioned = false;
+                    ProvisioningRestartTime = millis();
+                }
+            #endif // USE_CLI || USE_DPS
+            return;
+        }
+        StoredAssignment = false;
+
+        Log("> SUCCESS." DLM);
+        FirmwareUpdate::Confirm();
+        NetworkStats::Print();
+        OutboundMessages.Print();
+        tokenRenewal = !IOT_CONFIG_USE_X509;
+        reconnectTime = millis() + TOKEN_LIFESPAN * 850UL;
+    }
+    else
+    {
+        if (tokenRenewal && static_cast<long>(millis() - reconnectTime) >= 0)
+        {
+            Log("Disconnect");
+            mqtt_client.disconnect();
+            return;
+        }
+
+        if (mqtt_client.loop()) Watchdog::CheckIn(WatchdogTask::Network, millis());
+        OutboundMessages.DoWork(millis());
+    }
+}
+
+void loop()
+{
+    MainDoWork();
+    Watchdog::DoWork(millis());
+
+    // Sleep between iterations unless something needs tight timing
+    if (!BuzzerIsOn() && !Commands.IsBusy() && !SerialStream::IsEnabled() && !FirmwareUpdate::IsBusy()) PowerManager::Idle(POWER_IDLE_MAX_MILLISECS);
 }
@@ -0,0 +1,356 @@
+# Local stand-in for Azure IoT Hub and DPS, for the host tests.
+#
+#   python test/host/iot_hub_standin.py --port 1883
+#   python test/host/iot_hub_standin.py --port 0 --throttle 2 --assigning 1 --drop-after-accept
+#
+# A plain TCP MQTT 3.1.1 server that plays DPS for connections whose username is
+# "{id scope}/registrations/{registration id}/..." and IoT Hub for "{hub host}/{device id}/...".
+# It answers register and operation status requests with the DPS topic conventions,
+# including 202 "assigning" retries and 429 throttling with retry-after, counts telemetry
+# and times direct method round trips. Prints "LISTENING <port>" once ready and
+# "STATS <json>" on exit, which is when stdin closes.
+#
+# A connected device controls it in-band:
+#   $standin/invoke/{method}    Sends the direct method with the payload to the device.
+#   $standin/stats              Replies on $standin/stats/res with the statistics so far.
+
+import argparse
+import asyncio
+import json
+import re
+import struct
+import sys
+import threading
+import time
+
+CONNECT, CONNACK, PUBLISH, PUBACK, SUBSCRIBE, SUBACK, UNSUBSCRIBE, UNSUBACK, PINGREQ, PINGRESP, DISCONNECT = 1, 2, 3, 4, 8, 9, 10, 11, 12, 13, 14
+
+CONNACK_ACCEPTED = 0
+CONNACK_BAD_CREDENTIALS = 4
+CONNACK_NOT_AUTHORIZED = 5
+
+CREATION_TIME = re.compile(r"iothub-creation-time-utc=\d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z$")
+
+
+def encode_length(length):
+    encoded = bytearray()
+    while True:
+        byte = length % 128
+        length //= 128
+        encoded.append(byte | 0x80 if length > 0 else byte)
+        if length == 0:
+            return bytes(encoded)
+
+
+def encode_string(value):
+    data = value.encode()
+    return struct.pack("!H", len(data)) + data
+
+
+def packet(packet_type, flags, body):
+    return bytes([packet_type << 4 | flags]) + encode_length(len(body)) + body
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def u8(self):
+        self.offset += 1
+        return self.data[self.offset - 1]
+
+    def u16(self):
+        self.offset += 2
+        return struct.unpack_from("!H", self.data, self.offset - 2)[0]
+
+    def binary(self):
+        size = self.u16()
+        self.offset += size
+        return self.data[self.offset - size:self.offset]
+
+    def string(self):
+        return self.binary().decode()
+
+    def rest(self):
+        return self.data[self.offset:]
+
+
+class Stats:
+    def __init__(self):
+        self.counts = {
+            "dps_connections": 0,
+            "hub_connections": 0,
+            "rejected_connections": 0,
+            "registers": 0,
+            "throttled": 0,
+            "queries": 0,
+            "assigned": 0,
+            "telemetry": 0,
+            "telemetry_bytes": 0,
+            "telemetry_bad_topic": 0,
+            "method_requests": 0,
+            "method_responses": 0,
+        }
+        self.method_statuses = {}
+        self.method_latencies = []
+
+    def add(self, name, value=1):
+        self.counts[name] += value
+
+    def to_json(self):
+        result = dict(self.counts)
+        result["method_statuses"] = self.method_statuses
+        latencies = self.method_latencies
+        result["method_latency_ms"] = {
+            "min": min(latencies) if latencies else 0,
+            "avg": sum(latencies) / len(latencies) if latencies else 0,
+            "max": max(latencies) if latencies else 0,
+        }
+        return json.dumps(result, sort_keys=True)
+
+
+class StandIn:
+    def __init__(self, args):
+        self.args = args
+        self.stats = Stats()
+        self.throttle_remaining = args.throttle
+        self.operations = {}            # operation id -> queries left before assigned
+        self.next_operation = 1
+        self.dropped = False
+        self.next_rid = 1
+
+    async def handle(self, reader, writer):
+        session = Session(self, reader, writer)
+        try:
+            await session.run()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            writer.close()
+
+    # DPS
+
+    def on_register(self, session, rid):
+        self.stats.add("registers")
+        if self.throttle_remaining > 0:
+            self.throttle_remaining -= 1
+            self.stats.add("throttled")
+            body = {"errorCode": 429001, "trackingId": "standin", "message": "Operations are being throttled for this tenant."}
+            session.publish("$dps/registrations/res/429/?$rid=%s&retry-after=%d" % (rid, self.args.retry_after), body)
+            return
+
+        operation_id = "4.standin.%d" % self.next_operation
+        self.next_operation += 1
+        self.operations[operation_id] = self.args.assigning
+        session.publish("$dps/registrations/res/202/?$rid=%s&retry-after=%d" % (rid, self.args.retry_after), {"operationId": operation_id, "status": "assigning"})
+
+        # The device has to resume this operation on a new connection
+        if self.args.drop_after_accept and not self.dropped:
+            self.dropped = True
+            session.close()
+
+    def on_query(self, session, rid, operation_id):
+        self.stats.add("queries")
+        if operation_id not in self.operations:
+            session.publish("$dps/registrations/res/404/?$rid=%s" % rid, {"errorCode": 404002, "message": "Operation not found."})
+            return
+
+        if self.operations[operation_id] > 0:
+            self.operations[operation_id] -= 1
+            session.publish("$dps/registrations/res/202/?$rid=%s&retry-after=%d" % (rid, self.args.retry_after), {"operationId": operation_id, "status": "assigning"})
+            return
+
+        self.stats.add("assigned")
+        session.publish("$dps/registrations/res/200/?$rid=%s" % rid, {
+            "operationId": operation_id,
+            "status": "assigned",
+            "registrationState": {
+                "registrationId": self.args.registration_id,
+                "assignedHub": self.args.hub_host,
+                "deviceId": self.args.device_id,
+                "status": "assigned",
+                "substatus": "initialAssignment",
+            },
+        })
+
+    # IoT Hub
+
+    def invoke(self, session, name, payload):
+        rid = "%x" % self.next_rid
+        self.next_rid += 1
+        session.pending_methods[rid] = time.monotonic()
+        self.stats.add("method_requests")
+        session.publish("$iothub/methods/POST/%s/?$rid=%s" % (name, rid), payload)
+
+    def on_method_response(self, session, status, rid):
+        sent = session.pending_methods.pop(rid, None)
+        if sent is None:
+            return
+        self.stats.add("method_responses")
+        self.stats.method_statuses[status] = self.stats.method_statuses.get(status, 0) + 1
+        self.stats.method_latencies.append((time.monotonic() - sent) * 1000)
+
+
+class Session:
+    def __init__(self, standin, reader, writer):
+        self.standin = standin
+        self.reader = reader
+        self.writer = writer
+        self.role = None
+        self.pending_methods = {}
+
+    async def run(self):
+        while True:
+            header = await self.reader.readexactly(1)
+            length, multiplier = 0, 1
+            while True:
+                byte = (await self.reader.readexactly(1))[0]
+                length += (byte & 0x7f) * multiplier
+                multiplier *= 128
+                if byte & 0x80 == 0:
+                    break
+            body = await self.reader.readexactly(length)
+            packet_type, flags = header[0] >> 4, header[0] & 0x0f
+
+            if self.role is None and packet_type != CONNECT:
+                return
+            if packet_type == CONNECT:
+                if not self.on_connect(Reader(body)):
+                    await self.writer.drain()
+                    return
+            elif packet_type == PUBLISH:
+                self.on_publish(flags, Reader(body))
+            elif packet_type == SUBSCRIBE:
+                message = Reader(body)
+                packet_id = message.u16()
+                granted = bytearray()
+                while message.offset < len(body):
+                    message.string()
+                    granted.append(min(message.u8(), 1))
+                self.writer.write(packet(SUBACK, 0, struct.pack("!H", packet_id) + bytes(granted)))
+            elif packet_type == UNSUBSCRIBE:
+                self.writer.write(packet(UNSUBACK, 0, body[:2]))
+            elif packet_type == PINGREQ:
+                self.writer.write(packet(PINGRESP, 0, b""))
+            elif packet_type == DISCONNECT:
+                return
+            if self.writer.is_closing():
+                return
+            await self.writer.drain()
+
+    def on_connect(self, message):
+        args = self.standin.args
+        if message.string() != "MQTT" or message.u8() != 4:
+            return False
+        flags = message.u8()
+        message.u16()   # Keep alive
+        client_id = message.string()
+        if flags & 0x04:
+            message.string()
+            message.binary()
+        username = message.string() if flags & 0x80 else ""
+        password = message.string() if flags & 0x40 else ""
+
+        if username.startswith("%s/registrations/%s/" % (args.id_scope, args.registration_id)) and client_id == args.registration_id:
+            self.role = "dps"
+        elif username.startswith("%s/%s/?api-version=" % (args.hub_host, args.device_id)) and client_id == args.device_id:
+            self.role = "hub"
+        else:
+            self.standin.stats.add("rejected_connections")
+            self.writer.write(packet(CONNACK, 0, bytes([0, CONNACK_BAD_CREDENTIALS])))
+            return False
+
+        if not password.startswith("SharedAccessSignature sr="):
+            self.standin.stats.add("rejected_connections")
+            self.writer.write(packet(CONNACK, 0, bytes([0, CONNACK_NOT_AUTHORIZED])))
+            return False
+
+        self.standin.stats.add(self.role + "_connections")
+        self.writer.write(packet(CONNACK, 0, bytes([0, CONNACK_ACCEPTED])))
+        return True
+
+    def on_publish(self, flags, message):
+        topic = message.string()
+        qos = flags >> 1 & 0x03
+        if qos > 0:
+            self.writer.write(packet(PUBACK, 0, struct.pack("!H", message.u16())))
+        payload = message.rest()
+
+        if self.role == "dps":
+            self.on_dps_publish(topic)
+        else:
+            self.on_hub_publish(topic, payload)
+
+    def on_dps_publish(self, topic):
+        rid = re.search(r"\$rid=([^&]+)", topic)
+        rid = rid.group(1) if rid else ""
+        if topic.startswith("$dps/registrations/PUT/iotdps-register/"):
+            self.standin.on_register(self, rid)
+            return
+
+        operation_id = re.search(r"operationId=([^&]+)", topic)
+        if topic.startswith("$dps/registrations/GET/iotdps-get-operationstatus/") and operation_id:
+            self.standin.on_query(self, rid, operation_id.group(1))
+
+    def on_hub_publish(self, topic, payload):
+        args = self.standin.args
+        stats = self.standin.stats
+        if topic.startswith("devices/%s/messages/events/" % args.device_id):
+            stats.add("telemetry")
+            stats.add("telemetry_bytes", len(payload))
+            if not CREATION_TIME.search(topic):
+                stats.add("telemetry_bad_topic")
+            return
+
+        match = re.match(r"\$iothub/methods/res/(\d+)/\?\$rid=(.+)$", topic)
+        if match:
+            self.standin.on_method_response(self, match.group(1), match.group(2))
+            return
+
+        if topic.startswith("$standin/invoke/"):
+            self.standin.invoke(self, topic[len("$standin/invoke/"):], payload)
+        elif topic == "$standin/stats":
+            self.publish("$standin/stats/res", stats.to_json().encode())
+
+    def publish(self, topic, payload):
+        if isinstance(payload, dict):
+            payload = json.dumps(payload, separators=(",", ":")).encode()
+        self.writer.write(packet(PUBLISH, 0, encode_string(topic) + payload))
+
+    def close(self):
+        self.writer.close()
+
+
+async def serve(args):
+    standin = StandIn(args)
+    server = await asyncio.start_server(standin.handle, args.bind, args.port)
+    print("LISTENING %d" % server.sockets[0].getsockname()[1], flush=True)
+
+    # Run until the parent closes stdin
+    loop = asyncio.get_running_loop()
+    stdin_closed = asyncio.Event()
+    threading.Thread(target=lambda: (sys.stdin.read(), loop.call_soon_threadsafe(stdin_closed.set)), daemon=True).start()
+    await stdin_closed.wait()
+
+    server.close()
+    print("STATS %s" % standin.stats.to_json(), flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in for Azure IoT Hub and DPS.")
+    parser.add_argument("--bind", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=1883, help="0 picks a free port")
+    parser.add_argument("--id-scope", default="0ne00000000")
+    parser.add_argument("--registration-id", default="wio-terminal")
+    parser.add_argument("--hub-host", default="standin-hub.azure-devices.net")
+    parser.add_argument("--device-id", default="wio-terminal")
+    parser.add_argument("--throttle", type=int, default=0, help="answer this many register requests with 429")
+    parser.add_argument("--assigning", type=int, default=0, help="answer this many status queries with 202 assigning")
+    parser.add_argument("--retry-after", type=int, default=1, help="retry-after seconds of 202 and 429 responses")
+    parser.add_argument("--drop-after-accept", action="store_true", help="close the connection after the first accepted register request")
+    asyncio.run(serve(parser.parse_args()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,74 @@
+#include "Arduino.h"
+#include <stdarg.h>
+#include <chrono>
+#include <random>
+#include <thread>
+
+HostSerial Serial;
+
+static HostMclk Mclk;
+static HostTrng Trng = [] {
+    HostTrng trng{};
+    trng.INTFLAG.bit.DATARDY = 1;
+    trng.DATA.reg = std::random_device{}();
+
+    return trng;
+}();
+HostMclk* const MCLK = &Mclk;
+HostTrng* const TRNG = &Trng;
+
+static const std::chrono::steady_clock::time_point StartTime = std::chrono::steady_clock::now();
+static std::minstd_rand Random;
+
+unsigned long millis()
+{
+    return static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - StartTime).count());
+}
+
+unsigned long micros()
+{
+    return static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - StartTime).count());
+}
+
+void delay(unsigned long millisecs)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(millisecs));
+}
+
+long random(long max)
+{
+    return max > 0 ? static_cast<long>(Random() % static_cast<unsigned long>(max)) : 0;
+}
+
+long random(long min, long max)
+{
+    return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+    Random.seed(static_cast<std::minstd_rand::result_type>(seed));
+}
+
+String String::format(const char* format, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    return String(buf);
+}
+
+size_t HostSerial::print(const char* value)
+{
+    if (Muted) return 0;
+
+    return fputs(value, stdout) < 0 ? 0 : strlen(value);
+}
+
+void HostSerial::flush()
+{
+    fflush(stdout);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Host stand-in for the parts of the Arduino core that the modules under test use.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+template<typename T, typename L, typename H>
+T constrain(T value, L low, H high) { return value < low ? low : value > high ? high : value; }
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long millisecs);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class String : public std::string
+{
+public:
+    String() {}
+    String(const char* value) : std::string(value) {}
+    String(const std::string& value) : std::string(value) {}
+
+    static String format(const char* format, ...);
+};
+
+class HostSerial
+{
+public:
+    size_t print(const char* value);
+    size_t print(const String& value) { return print(value.c_str()); }
+    void flush();
+
+    // Output is dropped while muted, for benchmarks and noisy flows.
+    void SetMuted(bool muted) { Muted = muted; }
+
+private:
+    bool Muted = false;
+
+};
+
+extern HostSerial Serial;
+
+// SAMD51 TRNG, seeds the retry jitter.
+struct HostMclk
+{
+    struct { struct { uint32_t TRNG_; } bit; } APBCMASK;
+};
+
+struct HostTrng
+{
+    struct { struct { uint8_t ENABLE; } bit; } CTRLA;
+    struct { struct { uint8_t DATARDY; } bit; } INTFLAG;
+    struct { uint32_t reg; } DATA;
+};
+
+extern HostMclk* const MCLK;
+extern HostTrng* const TRNG;
@@ -0,0 +1,34 @@
+// Host stand-in for the QSPI flash: anonymous memory at the same address as the
+// memory map, with NOR semantics (program only clears bits, erase sets a sector to 0xff).
+
+#include "ExternalFlash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+uint32_t HostFlashEraseCount = 0;
+
+int ExternalFlash::Init = [] {
+    void* map = mmap(reinterpret_cast<void*>(MapAddress), Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (map != reinterpret_cast<void*>(MapAddress))
+    {
+        fprintf(stderr, "Cannot map the flash at 0x%08lx\n", static_cast<unsigned long>(MapAddress));
+        abort();
+    }
+    memset(map, 0xff, Size);
+
+    return 0;
+}();
+
+void ExternalFlash::EraseSector(uint32_t address)
+{
+    memset(const_cast<uint8_t*>(Map(address - address % SectorSize)), 0xff, SectorSize);
+    ++HostFlashEraseCount;
+}
+
+void ExternalFlash::Program(uint32_t address, const uint8_t* data, size_t size)
+{
+    uint8_t* flash = const_cast<uint8_t*>(Map(address));
+    for (size_t i = 0; i < size; ++i) flash[i] &= data[i];
+}
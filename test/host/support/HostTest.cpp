@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include "HostTest.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int HostTestFailures = 0;
+
+int HostTestMain(int argc, char* argv[], const HostTestCase* cases, size_t caseCount)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    int run = 0;
+    for (size_t i = 0; i < caseCount; ++i)
+    {
+        bool selected = argc <= 1;
+        for (int j = 1; j < argc; ++j) selected = selected || strcmp(argv[j], cases[i].Name) == 0;
+        if (!selected) continue;
+
+        const int failures = HostTestFailures;
+        printf("[ RUN  ] %s\n", cases[i].Name);
+        fflush(stdout);
+        cases[i].Run();
+        printf("[ %s ] %s\n", HostTestFailures == failures ? " OK " : "FAIL", cases[i].Name);
+        fflush(stdout);
+        ++run;
+    }
+
+    printf("%d cases, %d failed checks\n", run, HostTestFailures);
+
+    return run > 0 && HostTestFailures == 0 ? 0 : 1;
+}
+
+StandInProcess::StandInProcess(const std::string& args) :
+    Pid{ -1 },
+    StdinFd{ -1 },
+    Stdout{ nullptr },
+    Port{ 0 }
+{
+    int stdinPipe[2];
+    int stdoutPipe[2];
+    if (pipe(stdinPipe) != 0 || pipe(stdoutPipe) != 0) return;
+
+    const std::string command = "exec '" HOST_TEST_PYTHON "' '" HOST_TEST_STANDIN "' --port 0 " + args;
+    Pid = fork();
+    if (Pid == 0)
+    {
+        dup2(stdinPipe[0], STDIN_FILENO);
+        dup2(stdoutPipe[1], STDOUT_FILENO);
+        close(stdinPipe[1]);
+        close(stdoutPipe[0]);
+        execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    close(stdinPipe[0]);
+    close(stdoutPipe[1]);
+    StdinFd = stdinPipe[1];
+    Stdout = fdopen(stdoutPipe[0], "r");
+
+    char line[128];
+    unsigned port;
+    if (fgets(line, sizeof(line), Stdout) != nullptr && sscanf(line, "LISTENING %u", &port) == 1) Port = port;
+    CHECK(Port != 0);
+}
+
+StandInProcess::~StandInProcess()
+{
+    Stop();
+}
+
+long StandInProcess::GetFinalStat(const char* name)
+{
+    Stop();
+
+    return HostTestJsonNumber(FinalStats, name);
+}
+
+void StandInProcess::Stop()
+{
+    if (Pid <= 0) return;
+
+    close(StdinFd);
+    char line[4096];
+    while (fgets(line, sizeof(line), Stdout) != nullptr)
+    {
+        if (strncmp(line, "STATS ", 6) == 0) FinalStats = &line[6];
+    }
+    fclose(Stdout);
+    waitpid(Pid, nullptr, 0);
+    Pid = -1;
+}
+
+long HostTestJsonNumber(const std::string& json, const char* name)
+{
+    const std::string key = std::string("\"") + name + "\":";
+    const size_t offset = json.find(key);
+    if (offset == std::string::npos) return -1;
+
+    return strtol(&json[offset + key.size()], nullptr, 10);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+// Minimal test runner for the host tests: CHECK() records a failure and the test goes on.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+
+extern int HostTestFailures;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++HostTestFailures; \
+        } \
+    } \
+    while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+    do \
+    { \
+        const auto expectedValue = (expected); \
+        const auto actualValue = (actual); \
+        if (!(expectedValue == actualValue)) \
+        { \
+            printf("%s:%d: CHECK_EQUAL(%s, %s) failed: %s != %s\n", __FILE__, __LINE__, #expected, #actual, HostTestToString(expectedValue).c_str(), HostTestToString(actualValue).c_str()); \
+            ++HostTestFailures; \
+        } \
+    } \
+    while (0)
+
+template<typename T>
+std::string HostTestToString(const T& value) { return std::to_string(value); }
+inline std::string HostTestToString(const std::string& value) { return '"' + value + '"'; }
+inline std::string HostTestToString(const char* value) { return '"' + std::string(value) + '"'; }
+
+// Runs body iterations times and returns the average time of one call in nanoseconds.
+// body returns a value that is folded into a sink so the compiler cannot drop the work.
+template<typename Body>
+double HostTestBenchmark(const char* name, long iterations, Body body)
+{
+    static volatile uint64_t sink;
+    uint64_t folded = 0;
+    const auto startTime = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; ++i) folded += body(i);
+    const auto elapsed = std::chrono::steady_clock::now() - startTime;
+    sink = folded;
+
+    const double nanosecs = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-32s %8.1f ns/call (%ld calls)\n", name, nanosecs, iterations);
+
+    return nanosecs;
+}
+
+struct HostTestCase
+{
+    const char* Name;
+    void (*Run)();
+};
+
+// Runs the cases given on the command line, or all of them. Returns the exit code.
+int HostTestMain(int argc, char* argv[], const HostTestCase* cases, size_t caseCount);
+
+template<size_t N>
+int HostTestMain(int argc, char* argv[], const HostTestCase (&cases)[N]) { return HostTestMain(argc, argv, cases, N); }
+
+// Runs iot_hub_standin.py with the given arguments for the lifetime of the object.
+class StandInProcess
+{
+public:
+    explicit StandInProcess(const std::string& args);
+    ~StandInProcess();
+    StandInProcess(const StandInProcess&) = delete;
+    StandInProcess& operator=(const StandInProcess&) = delete;
+
+    uint16_t GetPort() const { return Port; }
+
+    // Stops the stand-in and returns the final value of a counter in its statistics, -1 if missing.
+    long GetFinalStat(const char* name);
+
+private:
+    void Stop();
+
+    int Pid;
+    int StdinFd;
+    FILE* Stdout;
+    uint16_t Port;
+    std::string FinalStats;
+
+};
+
+// Value of a numeric member in a flat JSON object, -1 if missing.
+long HostTestJsonNumber(const std::string& json, const char* name);
@@ -0,0 +1,25 @@
+#include "Log.h"
+
+// There is no SerialStream on the host, everything goes to the Serial stand-in.
+
+String StringVFormat(const char* format, va_list arg)
+{
+    va_list sizeArg;
+    va_copy(sizeArg, arg);
+    const int len = vsnprintf(nullptr, 0, format, sizeArg);
+    va_end(sizeArg);
+    std::string str(len, '\0');
+    vsnprintf(&str[0], len + 1, format, arg);
+
+    return String{ str };
+}
+
+void Log(const char* format, ...)
+{
+    va_list arg;
+    va_start(arg, format);
+    String str{ StringVFormat(format, arg) };
+    va_end(arg);
+
+    Serial.print(str);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+// Host stand-in for the part of hideakitai/MsgPack that Storage uses to read the
+// legacy settings record: a sequence of strings.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <initializer_list>
+#include <string>
+
+namespace MsgPack
+{
+    using str_t = std::string;
+
+    class Unpacker
+    {
+    public:
+        void feed(const uint8_t* data, size_t size) { Data = data; Size = size; Offset = 0; }
+
+        template<typename... Args>
+        bool deserialize(Args&... args)
+        {
+            bool ok = true;
+            (void)std::initializer_list<int>{ (ok = ok && ReadString(args), 0)... };
+            return ok;
+        }
+
+    private:
+        bool ReadString(str_t& value)
+        {
+            if (Offset >= Size) return false;
+            const uint8_t header = Data[Offset++];
+            size_t length;
+            if ((header & 0xe0) == 0xa0) length = header & 0x1f;
+            else if (header == 0xd9 && Offset + 1 <= Size) length = Data[Offset++];
+            else if (header == 0xda && Offset + 2 <= Size) { length = Data[Offset] << 8 | Data[Offset + 1]; Offset += 2; }
+            else return false;
+            if (Offset + length > Size) return false;
+
+            value.assign(reinterpret_cast<const char*>(&Data[Offset]), length);
+            Offset += length;
+            return true;
+        }
+
+        const uint8_t* Data = nullptr;
+        size_t Size = 0;
+        size_t Offset = 0;
+
+    };
+}
@@ -0,0 +1,322 @@
+#include "PubSubClient.h"
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static constexpr uint8_t Connect = 1 << 4;
+static constexpr uint8_t ConnAck = 2 << 4;
+static constexpr uint8_t Publish = 3 << 4;
+static constexpr uint8_t Subscribe = 8 << 4 | 0x02;
+static constexpr uint8_t PingReq = 12 << 4;
+static constexpr uint8_t PingResp = 13 << 4;
+static constexpr uint8_t Disconnect = 14 << 4;
+
+PubSubClient::PubSubClient() :
+    Domain{ nullptr },
+    Port{ 0 },
+    Callback{ nullptr },
+    BufferSize{ 256 },
+    Socket{ -1 },
+    State{ MQTT_DISCONNECTED },
+    NextPacketId{ 1 },
+    LastOutActivity{ 0 },
+    LastInActivity{ 0 },
+    PingOutstanding{ false }
+{
+}
+
+PubSubClient::~PubSubClient()
+{
+    if (Socket >= 0) close(Socket);
+}
+
+PubSubClient& PubSubClient::setServer(const char* domain, uint16_t port)
+{
+    Domain = domain;
+    Port = port;
+
+    return *this;
+}
+
+PubSubClient& PubSubClient::setCallback(void (*callback)(char*, uint8_t*, unsigned int))
+{
+    Callback = callback;
+
+    return *this;
+}
+
+boolean PubSubClient::setBufferSize(uint16_t size)
+{
+    if (size == 0) return false;
+    BufferSize = size;
+
+    return true;
+}
+
+boolean PubSubClient::connect(const char* id, const char* user, const char* pass)
+{
+    if (connected()) return true;
+    if (Domain == nullptr) return false;
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses;
+    char port[8];
+    snprintf(port, sizeof(port), "%u", Port);
+    if (getaddrinfo(Domain, port, &hints, &addresses) != 0)
+    {
+        State = MQTT_CONNECT_FAILED;
+        return false;
+    }
+
+    for (addrinfo* address = addresses; address != nullptr && Socket < 0; address = address->ai_next)
+    {
+        Socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (Socket < 0) continue;
+        if (::connect(Socket, address->ai_addr, address->ai_addrlen) == 0) break;
+        close(Socket);
+        Socket = -1;
+    }
+    freeaddrinfo(addresses);
+    if (Socket < 0)
+    {
+        State = MQTT_CONNECT_FAILED;
+        return false;
+    }
+    const int noDelay = 1;
+    setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    std::vector<uint8_t> body;
+    AppendString(&body, "MQTT");
+    body.push_back(4);
+    body.push_back(0x02 | (user != nullptr ? 0x80 : 0) | (user != nullptr && pass != nullptr ? 0x40 : 0));
+    body.push_back(MQTT_KEEPALIVE >> 8);
+    body.push_back(MQTT_KEEPALIVE & 0xff);
+    AppendString(&body, id);
+    if (user != nullptr) AppendString(&body, user);
+    if (user != nullptr && pass != nullptr) AppendString(&body, pass);
+    if (!SendPacket(Connect, body))
+    {
+        Close(MQTT_CONNECT_FAILED);
+        return false;
+    }
+
+    uint8_t header;
+    std::vector<uint8_t> response;
+    if (!ReadPacket(&header, &response, MQTT_SOCKET_TIMEOUT * 1000))
+    {
+        Close(MQTT_CONNECTION_TIMEOUT);
+        return false;
+    }
+    if (header != ConnAck || response.size() != 2 || response[1] != 0)
+    {
+        Close(response.size() == 2 ? response[1] : MQTT_CONNECT_FAILED);
+        return false;
+    }
+
+    LastInActivity = LastOutActivity = millis();
+    PingOutstanding = false;
+    State = MQTT_CONNECTED;
+
+    return true;
+}
+
+void PubSubClient::disconnect()
+{
+    if (Socket >= 0) SendPacket(Disconnect, {});
+    Close(MQTT_DISCONNECTED);
+}
+
+boolean PubSubClient::publish(const char* topic, const char* payload)
+{
+    return publish(topic, reinterpret_cast<const uint8_t*>(payload), payload != nullptr ? strlen(payload) : 0);
+}
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength)
+{
+    // Like the library, the whole packet has to fit the buffer
+    if (strlen(topic) + plength + 7 > BufferSize) return false;
+
+    return beginPublish(topic, plength, false) && write(payload, plength) == plength && endPublish() != 0;
+}
+
+boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained)
+{
+    if (!connected()) return false;
+
+    std::vector<uint8_t> header;
+    header.push_back(Publish | (retained ? 1 : 0));
+    const size_t topicLength = strlen(topic);
+    AppendLength(&header, 2 + topicLength + plength);
+    AppendString(&header, topic);
+
+    return SendAll(header.data(), header.size());
+}
+
+int PubSubClient::endPublish()
+{
+    return connected() ? 1 : 0;
+}
+
+size_t PubSubClient::write(const uint8_t* buffer, size_t size)
+{
+    return SendAll(buffer, size) ? size : 0;
+}
+
+boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
+{
+    if (!connected()) return false;
+
+    std::vector<uint8_t> body;
+    const uint16_t packetId = NextPacketId++;
+    body.push_back(packetId >> 8);
+    body.push_back(packetId & 0xff);
+    AppendString(&body, topic);
+    body.push_back(qos);
+
+    return SendPacket(Subscribe, body);
+}
+
+boolean PubSubClient::loop()
+{
+    if (!connected()) return false;
+
+    const unsigned long now = millis();
+    if (now - LastInActivity > MQTT_KEEPALIVE * 1000UL || now - LastOutActivity > MQTT_KEEPALIVE * 1000UL)
+    {
+        if (PingOutstanding)
+        {
+            Close(MQTT_CONNECTION_TIMEOUT);
+            return false;
+        }
+        if (!SendPacket(PingReq, {})) return false;
+        PingOutstanding = true;
+    }
+
+    uint8_t header;
+    std::vector<uint8_t> body;
+    while (connected() && ReadPacket(&header, &body, 0))
+    {
+        LastInActivity = millis();
+        if (header == PingResp) PingOutstanding = false;
+        if ((header & 0xf0) != Publish || body.size() < 2) continue;
+
+        const size_t topicLength = body[0] << 8 | body[1];
+        if (body.size() < 2 + topicLength) continue;
+        size_t payloadOffset = 2 + topicLength;
+        if ((header & 0x06) != 0) payloadOffset += 2;   // Packet id of QoS 1 and 2
+        if (payloadOffset > body.size() || body.size() + 1 > BufferSize) continue;
+
+        // The library hands out its buffer with the topic terminated in place
+        std::vector<uint8_t> message(body.size() + 1);
+        memcpy(message.data(), &body[2], topicLength);
+        message[topicLength] = '\0';
+        const size_t payloadSize = body.size() - payloadOffset;
+        memcpy(&message[topicLength + 1], &body[payloadOffset], payloadSize);
+        if (Callback != nullptr) Callback(reinterpret_cast<char*>(message.data()), &message[topicLength + 1], payloadSize);
+    }
+
+    return connected();
+}
+
+boolean PubSubClient::connected()
+{
+    return Socket >= 0 && State == MQTT_CONNECTED;
+}
+
+bool PubSubClient::SendAll(const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t sent = send(Socket, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0)
+        {
+            Close(MQTT_CONNECTION_LOST);
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    LastOutActivity = millis();
+
+    return true;
+}
+
+bool PubSubClient::SendPacket(uint8_t header, const std::vector<uint8_t>& body)
+{
+    std::vector<uint8_t> packet;
+    packet.push_back(header);
+    AppendLength(&packet, body.size());
+    packet.insert(packet.end(), body.begin(), body.end());
+
+    return SendAll(packet.data(), packet.size());
+}
+
+bool PubSubClient::ReadPacket(uint8_t* header, std::vector<uint8_t>* body, int timeoutMillisecs)
+{
+    pollfd fd{ Socket, POLLIN, 0 };
+    if (poll(&fd, 1, timeoutMillisecs) <= 0) return false;
+
+    // Once a packet has started, the rest follows without waiting for loop()
+    auto readExactly = [this](uint8_t* data, size_t size) {
+        while (size > 0)
+        {
+            const ssize_t received = recv(Socket, data, size, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0)
+            {
+                Close(MQTT_CONNECTION_LOST);
+                return false;
+            }
+            data += received;
+            size -= received;
+        }
+        return true;
+    };
+
+    if (!readExactly(header, 1)) return false;
+    size_t length = 0;
+    for (int shift = 0; shift < 28; shift += 7)
+    {
+        uint8_t byte;
+        if (!readExactly(&byte, 1)) return false;
+        length |= static_cast<size_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) break;
+    }
+    body->resize(length);
+
+    return length == 0 || readExactly(body->data(), length);
+}
+
+void PubSubClient::Close(int state)
+{
+    if (Socket >= 0) close(Socket);
+    Socket = -1;
+    State = state;
+}
+
+void PubSubClient::AppendString(std::vector<uint8_t>* body, const char* value)
+{
+    const size_t length = strlen(value);
+    body->push_back(length >> 8);
+    body->push_back(length & 0xff);
+    body->insert(body->end(), value, value + length);
+}
+
+void PubSubClient::AppendLength(std::vector<uint8_t>* body, size_t length)
+{
+    do
+    {
+        uint8_t byte = length % 128;
+        length /= 128;
+        if (length > 0) byte |= 0x80;
+        body->push_back(byte);
+    }
+    while (length > 0);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+// Host stand-in for knolleary/PubSubClient over a POSIX socket.
+// Same interface as the members the firmware uses, plain TCP and QoS 0 only.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "Arduino.h"
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+#define MQTT_CONNECT_BAD_PROTOCOL    1
+#define MQTT_CONNECT_BAD_CLIENT_ID   2
+#define MQTT_CONNECT_UNAVAILABLE     3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED    5
+
+#define MQTT_KEEPALIVE 15
+#define MQTT_SOCKET_TIMEOUT 15
+
+#define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+
+class PubSubClient
+{
+public:
+    PubSubClient();
+    ~PubSubClient();
+    PubSubClient(const PubSubClient&) = delete;
+    PubSubClient& operator=(const PubSubClient&) = delete;
+
+    PubSubClient& setServer(const char* domain, uint16_t port);
+    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+    boolean setBufferSize(uint16_t size);
+
+    boolean connect(const char* id) { return connect(id, nullptr, nullptr); }
+    boolean connect(const char* id, const char* user, const char* pass);
+    void disconnect();
+
+    boolean publish(const char* topic, const char* payload);
+    boolean publish(const char* topic, const uint8_t* payload, unsigned int plength);
+    boolean beginPublish(const char* topic, unsigned int plength, boolean retained);
+    int endPublish();
+    size_t write(uint8_t data) { return write(&data, 1); }
+    size_t write(const uint8_t* buffer, size_t size);
+
+    boolean subscribe(const char* topic) { return subscribe(topic, 0); }
+    boolean subscribe(const char* topic, uint8_t qos);
+
+    boolean loop();
+    boolean connected();
+    int state() const { return State; }
+
+private:
+    bool SendAll(const uint8_t* data, size_t size);
+    bool SendPacket(uint8_t header, const std::vector<uint8_t>& body);
+    bool ReadPacket(uint8_t* header, std::vector<uint8_t>* body, int timeoutMillisecs);
+    void Close(int state);
+
+    static void AppendString(std::vector<uint8_t>* body, const char* value);
+    static void AppendLength(std::vector<uint8_t>* body, size_t length);
+
+    const char* Domain;
+    uint16_t Port;
+    void (*Callback)(char*, uint8_t*, unsigned int);
+    size_t BufferSize;
+
+    int Socket;
+    int State;
+    uint16_t NextPacketId;
+    unsigned long LastOutActivity;
+    unsigned long LastInActivity;
+    bool PingOutstanding;
+
+};
@@ -0,0 +1,153 @@
+// GasCalibration::Convert (Q16.16 tables) checked against a floating point evaluation
+// of the same curves over the whole ADC range, and timed against it.
+
+#include <Arduino.h>
+#include <math.h>
+#include <string>
+#include "GasCalibration.h"
+#include "Storage.h"
+#include "HostTest.h"
+
+static constexpr GasSensor Sensors[] = { GasSensor::NO2, GasSensor::C2H5CH, GasSensor::VOC, GasSensor::CO };
+
+// Accuracy the table lookup has to reach over the floating point curve. The 32 table
+// segments do not fall on the curve points, which costs up to about 2.5% next to a point.
+static constexpr double RelativeTolerance = 0.03;
+static constexpr double AbsoluteTolerance = 0.02;   // [ppm]
+
+static uint32_t RsQ16(uint32_t count)
+{
+    return ((GasCalibration::AdcMax - count) << 16) / count;
+}
+
+static void SetBaseline(GasSensor sensor, uint32_t baselineQ16)
+{
+    const std::string key = std::string("gas.r0.") + GasCalibration::GetName(sensor);
+    CHECK(Storage::Set(key.c_str(), &baselineQ16, sizeof(baselineQ16)));
+}
+
+// The curve straight from its points, in floating point
+static float ReferencePpm(const GasCurve& curve, float ratio)
+{
+    const GasCurvePoint* points = curve.Points;
+    if (ratio <= points[0].Ratio) return points[0].Ppm;
+    if (ratio >= points[curve.PointCount - 1].Ratio) return points[curve.PointCount - 1].Ppm;
+
+    size_t i = 0;
+    while (ratio > points[i + 1].Ratio) ++i;
+    const GasCurvePoint& p0 = points[i];
+    const GasCurvePoint& p1 = points[i + 1];
+    const float t = (log2f(ratio) - log2f(p0.Ratio)) / (log2f(p1.Ratio) - log2f(p0.Ratio));
+
+    return p0.Ppm > 0.0f && p1.Ppm > 0.0f ? exp2f(log2f(p0.Ppm) + (log2f(p1.Ppm) - log2f(p0.Ppm)) * t) : p0.Ppm + (p1.Ppm - p0.Ppm) * t;
+}
+
+static float ReferenceConvert(const GasCurve& curve, uint32_t count, float baseline, float temperature, float humidity)
+{
+    float rs = static_cast<float>(GasCalibration::AdcMax - count) / count;
+    if (isfinite(temperature) && isfinite(humidity))
+    {
+        const float factor = 1.0f + curve.TemperatureCoeff * (lroundf(temperature) - 20) + curve.HumidityCoeff * (lroundf(humidity) - 65);
+        rs /= constrain(factor, 0.5f, 2.0f);
+    }
+
+    return ReferencePpm(curve, rs / baseline);
+}
+
+static void CheckAgainstReference(float temperature, float humidity)
+{
+    for (GasSensor sensor : Sensors)
+    {
+        for (uint32_t baselineCount : { 150u, 400u, 700u })
+        {
+            Storage::Erase();
+            SetBaseline(sensor, RsQ16(baselineCount));
+            GasCalibration::Load();
+            GasCalibration::SetEnvironment(temperature, humidity);
+            const GasCurve& curve = GasCalibration::GetCurve(sensor);
+            const float baseline = GasCalibration::GetBaseline(sensor) / 65536.0f;
+
+            double maxError = 0;
+            long failures = 0;
+            for (uint32_t count = 1; count < GasCalibration::AdcMax; ++count)
+            {
+                // A fixed time never completes a baseline period, so R0 stays put
+                const float ppm = GasCalibration::ToFloat(GasCalibration::Convert(sensor, count, 0));
+                const float reference = ReferenceConvert(curve, count, baseline, temperature, humidity);
+                const double error = fabs(ppm - reference);
+                if (error > maxError) maxError = error;
+                if (error <= reference * RelativeTolerance + AbsoluteTolerance) continue;
+                if (++failures <= 3) printf("%s, R0 count %u, count %u: %.4f ppm, reference %.4f ppm\n", GasCalibration::GetName(sensor), baselineCount, count, ppm, reference);
+            }
+            CHECK_EQUAL(0L, failures);
+            CHECK_EQUAL(RsQ16(baselineCount), GasCalibration::GetBaseline(sensor));
+            printf("%-7s R0 count %3u: max error %.4f ppm\n", GasCalibration::GetName(sensor), baselineCount, maxError);
+        }
+    }
+}
+
+static void TestConvertUncompensated()
+{
+    CheckAgainstReference(NAN, NAN);
+}
+
+static void TestConvertCompensated()
+{
+    CheckAgainstReference(31.6f, 22.0f);
+    CheckAgainstReference(4.0f, 90.0f);
+}
+
+static void TestCurveRoundTrip()
+{
+    Storage::Erase();
+    GasCalibration::Load();
+
+    GasCurve curve{};
+    curve.PointCount = 3;
+    curve.TemperatureCoeff = -0.02f;
+    curve.HumidityCoeff = 0.01f;
+    curve.Points[0] = { 0.1f, 200.0f };
+    curve.Points[1] = { 0.5f, 20.0f };
+    curve.Points[2] = { 1.0f, 0.0f };
+    CHECK(GasCalibration::SetCurve(GasSensor::CO, curve));
+
+    // Reloaded from the store
+    GasCalibration::Load();
+    const GasCurve& loaded = GasCalibration::GetCurve(GasSensor::CO);
+    CHECK_EQUAL(3, static_cast<int>(loaded.PointCount));
+    CHECK(loaded.Points[1].Ratio == 0.5f && loaded.Points[1].Ppm == 20.0f);
+
+    // Not ascending
+    curve.Points[2].Ratio = 0.4f;
+    CHECK(!GasCalibration::SetCurve(GasSensor::CO, curve));
+}
+
+static void BenchmarkConvert()
+{
+    static constexpr long Iterations = 10000000;
+
+    Storage::Erase();
+    SetBaseline(GasSensor::CO, RsQ16(400));
+    GasCalibration::Load();
+    GasCalibration::SetEnvironment(25.0f, 50.0f);
+    static GasCurve curve;
+    curve = GasCalibration::GetCurve(GasSensor::CO);
+    static float baseline;
+    baseline = GasCalibration::GetBaseline(GasSensor::CO) / 65536.0f;
+
+    HostTestBenchmark("Float reference", Iterations, [](long i) { return static_cast<uint64_t>(ReferenceConvert(curve, 1 + i % 1022, baseline, 25.0f, 50.0f) * 65536.0f); });
+    HostTestBenchmark("GasCalibration::Convert", Iterations, [](long i) { return static_cast<uint64_t>(GasCalibration::Convert(GasSensor::CO, 1 + i % 1022, 0)); });
+}
+
+int main(int argc, char* argv[])
+{
+    static const HostTestCase cases[] =
+    {
+        { "convert_uncompensated", TestConvertUncompensated },
+        { "convert_compensated", TestConvertCompensated },
+        { "curve_round_trip", TestCurveRoundTrip },
+        { "convert_benchmark", BenchmarkConvert },
+    };
+
+    return HostTestMain(argc, argv, cases);
+}
@@ -0,0 +1,394 @@
+// Provisioning, connection, command and telemetry flows against iot_hub_standin.py.
+// The firmware modules run unchanged over the host PubSubClient; what main.cpp does around
+// them (ConnectToHub, the MQTT callbacks) is repeated here in the same order.
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <string>
+#include <az_iot_hub_client.h>
+#include "AzureDpsClient.h"
+#include "CommandDispatcher.h"
+#include "DpsRegistration.h"
+#include "MessageRouter.h"
+#include "MessageScheduler.h"
+#include "NetworkStats.h"
+#include "TelemetrySerializer.h"
+#include "TelemetryTopic.h"
+#include "HostTest.h"
+
+static constexpr char IdScope[] = "0ne00000000";
+static constexpr char RegistrationId[] = "wio-terminal";
+static constexpr char HubHost[] = "standin-hub.azure-devices.net";
+static constexpr char DeviceId[] = "wio-terminal";
+static constexpr char Signature[] = "c3RhbmRpbg==";      // The stand-in checks the SAS format, not the signature
+static constexpr uint64_t TokenExpiration = 4102444800; // 2100-01-01
+
+static constexpr uint16_t MqttPacketSize = 1024; // MQTT_PACKET_SIZE
+
+static PubSubClient Mqtt;
+static uint16_t StandInPort;
+
+////////////////////////////////////////////////////////////////////////////////
+// DPS
+
+static AzureDpsClient DpsClient;
+static bool ConnectToDps();
+static DpsRegistration Provisioning(Mqtt, DpsClient, ConnectToDps);
+
+static bool ConnectToDps()
+{
+    const std::string mqttPassword = DpsClient.GetMqttPassword(Signature, TokenExpiration);
+
+    Mqtt.setBufferSize(MqttPacketSize);
+    Mqtt.setServer("127.0.0.1", StandInPort);
+    Mqtt.setCallback([](char* topic, uint8_t* payload, unsigned int length) { Provisioning.OnMessage(topic, payload, length, millis()); });
+
+    return Mqtt.connect(DpsClient.GetMqttClientId().c_str(), DpsClient.GetMqttUsername().c_str(), mqttPassword.c_str());
+}
+
+static DpsRegistration::State Register(const char* registrationId, unsigned long timeoutMillisecs)
+{
+    CHECK_EQUAL(0, DpsClient.Init(AZ_SPAN_FROM_STR("127.0.0.1"), AZ_SPAN_FROM_STR(IdScope), az_span_create(reinterpret_cast<uint8_t*>(const_cast<char*>(registrationId)), strlen(registrationId))));
+
+    // loop() with its idle sleep
+    Provisioning.SetBackOff(200, 2000);
+    Provisioning.Start(millis(), timeoutMillisecs, "{payload:{\"modelId\":\"" TELEMETRY_SCHEMA_MODEL_ID "\"}}");
+    while (Provisioning.IsBusy())
+    {
+        Provisioning.DoWork(millis());
+        delay(1);
+    }
+    const DpsRegistration::State state = Provisioning.GetState();
+    Provisioning.Cancel();
+
+    return state;
+}
+
+static std::string ToString(az_span span)
+{
+    return std::string(reinterpret_cast<const char*>(az_span_ptr(span)), az_span_size(span));
+}
+
+static void TestProvisioningAssigning()
+{
+    StandInProcess standIn("--assigning 2 --retry-after 1");
+    StandInPort = standIn.GetPort();
+
+    const unsigned long startTime = millis();
+    CHECK(Register(RegistrationId, 30000) == DpsRegistration::State::Assigned);
+    printf("Provisioned in %lu ms\n", millis() - startTime);
+    CHECK_EQUAL(std::string(HubHost), ToString(DpsClient.GetHubHost()));
+    CHECK_EQUAL(std::string(DeviceId), ToString(DpsClient.GetDeviceId()));
+    CHECK(!Mqtt.connected());
+
+    CHECK_EQUAL(1, standIn.GetFinalStat("registers"));
+    CHECK_EQUAL(3, standIn.GetFinalStat("queries"));
+    CHECK_EQUAL(1, standIn.GetFinalStat("assigned"));
+    CHECK_EQUAL(1, standIn.GetFinalStat("dps_connections"));
+}
+
+static void TestProvisioningThrottled()
+{
+    StandInProcess standIn("--throttle 2 --retry-after 1");
+    StandInPort = standIn.GetPort();
+
+    // Each retry waits for retry-after, not just the back-off
+    const unsigned long startTime = millis();
+    CHECK(Register(RegistrationId, 30000) == DpsRegistration::State::Assigned);
+    const unsigned long elapsed = millis() - startTime;
+    printf("Provisioned through 2 throttled responses in %lu ms\n", elapsed);
+    CHECK(elapsed >= 2000);
+
+    CHECK_EQUAL(2, standIn.GetFinalStat("throttled"));
+    CHECK_EQUAL(3, standIn.GetFinalStat("registers"));
+    CHECK_EQUAL(1, standIn.GetFinalStat("assigned"));
+}
+
+static void TestProvisioningRetryAfterCapped()
+{
+    StandInProcess standIn("--throttle 1 --assigning 1 --retry-after 30");
+    StandInPort = standIn.GetPort();
+
+    // The 30 s retry-after is cut to the 2 s back-off maximum, for the throttled register and the assigning query
+    const unsigned long startTime = millis();
+    CHECK(Register(RegistrationId, 30000) == DpsRegistration::State::Assigned);
+    const unsigned long elapsed = millis() - startTime;
+    printf("Provisioned through a 30 s retry-after in %lu ms\n", elapsed);
+    CHECK(elapsed >= 2000 && elapsed < 10000);
+
+    CHECK_EQUAL(1, standIn.GetFinalStat("throttled"));
+    CHECK_EQUAL(1, standIn.GetFinalStat("assigned"));
+}
+
+static void TestProvisioningResumesAfterReconnect()
+{
+    StandInProcess standIn("--drop-after-accept --assigning 1 --retry-after 1");
+    StandInPort = standIn.GetPort();
+
+    CHECK(Register(RegistrationId, 30000) == DpsRegistration::State::Assigned);
+    CHECK(DpsClient.HasOperationId());
+
+    // The operation is queried on the new connection, not registered again
+    CHECK_EQUAL(1, standIn.GetFinalStat("registers"));
+    CHECK_EQUAL(2, standIn.GetFinalStat("dps_connections"));
+    CHECK_EQUAL(2, standIn.GetFinalStat("queries"));
+}
+
+static void TestProvisioningTimeout()
+{
+    StandInProcess standIn("--throttle 100 --retry-after 1");
+    StandInPort = standIn.GetPort();
+
+    const unsigned long startTime = millis();
+    CHECK(Register(RegistrationId, 2500) == DpsRegistration::State::Failed);
+    const unsigned long elapsed = millis() - startTime;
+    CHECK(elapsed >= 2500 && elapsed < 3500);
+    CHECK_EQUAL(std::string("timeout"), std::string(Provisioning.GetLastError()));
+    CHECK_EQUAL(0, standIn.GetFinalStat("assigned"));
+}
+
+static void TestProvisioningRejectedCredentials()
+{
+    StandInProcess standIn("");
+    StandInPort = standIn.GetPort();
+
+    // Refused connections back off until the timeout
+    CHECK(Register("unknown-device", 1500) == DpsRegistration::State::Failed);
+    CHECK(standIn.GetFinalStat("rejected_connections") >= 2);
+    CHECK_EQUAL(0, standIn.GetFinalStat("dps_connections"));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// IoT Hub
+
+static az_iot_hub_client HubClient;
+static TelemetryTopic TelemetryTopicCache;
+static MessageScheduler OutboundMessages(Mqtt);
+
+static std::string StandInStats;
+static int RingBuzzerRuns;
+
+static uint16_t ParseRingBuzzer(az_span payload, uint8_t* args)
+{
+    // Duration in milliseconds, as a JSON number
+    uint32_t duration = 0;
+    if (az_span_size(payload) == 0 || az_span_size(payload) > 5) return CommandDispatcher::StatusBadRequest;
+    for (int32_t i = 0; i < az_span_size(payload); ++i)
+    {
+        const uint8_t c = az_span_ptr(payload)[i];
+        if (c < '0' || c > '9') return CommandDispatcher::StatusBadRequest;
+        duration = duration * 10 + (c - '0');
+    }
+    memcpy(args, &duration, sizeof(duration));
+
+    return CommandDispatcher::StatusOk;
+}
+
+static bool RunRingBuzzer(const uint8_t* /*args*/, bool /*start*/, unsigned long /*now*/)
+{
+    ++RingBuzzerRuns;
+    return true;
+}
+
+static const CommandHandler CommandHandlers[] =
+{
+    { COMMAND_RING_BUZZER, ParseRingBuzzer, RunRingBuzzer },
+    { COMMAND_UPDATE_FIRMWARE, nullptr, nullptr },
+};
+static CommandDispatcher Commands(CommandHandlers);
+
+static void MqttSubscribeCallbackHub(char* topic, uint8_t* payload, unsigned int length)
+{
+    ++NetworkStats::ReceivedMessages;
+    const az_span topicSpan = az_span_create(reinterpret_cast<uint8_t*>(topic), strlen(topic));
+    if (strcmp(topic, "$standin/stats/res") == 0)
+    {
+        StandInStats.assign(reinterpret_cast<const char*>(payload), length);
+        return;
+    }
+
+    if (ClassifyTopic(topicSpan) != TopicClass::Method) return;
+
+    az_iot_hub_client_method_request request;
+    if (az_result_failed(az_iot_hub_client_methods_parse_received_topic(&HubClient, topicSpan, &request))) return;
+    const uint16_t status = Commands.Dispatch(request.name, az_span_create(payload, length));
+
+    char responseTopic[128];
+    if (az_result_failed(az_iot_hub_client_methods_response_get_publish_topic(&HubClient, request.request_id, status, responseTopic, sizeof(responseTopic), nullptr))) return;
+    OutboundMessages.Enqueue(MessagePriority::CommandResponse, responseTopic, reinterpret_cast<const uint8_t*>("{}"), 2);
+}
+
+static int ConnectToHub(const char* deviceId)
+{
+    az_iot_hub_client_options options = az_iot_hub_client_options_default();
+    options.model_id = AZ_SPAN_LITERAL_FROM_STR(TELEMETRY_SCHEMA_MODEL_ID);
+    if (az_result_failed(az_iot_hub_client_init(&HubClient, AZ_SPAN_FROM_STR(HubHost), az_span_create(reinterpret_cast<uint8_t*>(const_cast<char*>(deviceId)), strlen(deviceId)), &options))) return -1;
+    if (TelemetryTopicCache.Init(&HubClient) != 0) return -7;
+
+    char mqttClientId[128];
+    if (az_result_failed(az_iot_hub_client_get_client_id(&HubClient, mqttClientId, sizeof(mqttClientId), nullptr))) return -4;
+    char mqttUsername[256];
+    if (az_result_failed(az_iot_hub_client_get_user_name(&HubClient, mqttUsername, sizeof(mqttUsername), nullptr))) return -5;
+    char mqttPassword[300];
+    if (az_result_failed(az_iot_hub_client_sas_get_password(&HubClient, TokenExpiration, AZ_SPAN_FROM_STR(Signature), AZ_SPAN_EMPTY, mqttPassword, sizeof(mqttPassword), nullptr))) return -3;
+
+    Mqtt.setBufferSize(MqttPacketSize);
+    Mqtt.setServer("127.0.0.1", StandInPort);
+    Mqtt.setCallback(MqttSubscribeCallbackHub);
+    const unsigned long connectStartTime = millis();
+    if (!Mqtt.connect(mqttClientId, mqttUsername, mqttPassword))
+    {
+        ++NetworkStats::HubConnectFailures;
+        return -6;
+    }
+    NetworkStats::HubConnect.Add(millis() - connectStartTime);
+    NetworkStats::OnHubConnected(millis());
+
+    Mqtt.subscribe(AZ_IOT_HUB_CLIENT_METHODS_SUBSCRIBE_TOPIC);
+    Mqtt.subscribe(AZ_IOT_HUB_CLIENT_C2D_SUBSCRIBE_TOPIC);
+
+    return 0;
+}
+
+// Runs loop() until a message arrived from the stand-in and everything it caused was sent.
+static bool ServiceUntilIdle(uint32_t receivedMessages)
+{
+    const unsigned long startTime = millis();
+    while (Mqtt.connected() && millis() - startTime < 5000)
+    {
+        Mqtt.loop();
+        Commands.DoWork(millis());
+        OutboundMessages.DoWork(millis());
+        if (NetworkStats::ReceivedMessages >= receivedMessages && !Commands.IsBusy() && OutboundMessages.GetQueuedCount(MessagePriority::CommandResponse) == 0) return true;
+    }
+
+    return false;
+}
+
+// Fetches the stand-in statistics in-band, so they cover everything published before.
+static std::string FetchStandInStats()
+{
+    StandInStats.clear();
+    Mqtt.publish("$standin/stats", "");
+    ServiceUntilIdle(NetworkStats::ReceivedMessages + 1);
+
+    return StandInStats;
+}
+
+// Has the stand-in invoke a direct method and waits for the response to go out.
+static bool Invoke(const char* name, const char* payload)
+{
+    const std::string topic = std::string("$standin/invoke/") + name;
+    if (!Mqtt.publish(topic.c_str(), payload)) return false;
+
+    return ServiceUntilIdle(NetworkStats::ReceivedMessages + 1);
+}
+
+static void TestHubConnection()
+{
+    StandInProcess standIn("");
+    StandInPort = standIn.GetPort();
+
+    CHECK_EQUAL(0, ConnectToHub(DeviceId));
+    CHECK(Mqtt.connected());
+    CHECK(TelemetryTopicCache.IsValid());
+    Mqtt.disconnect();
+
+    // The stand-in only accepts the configured device, like a hub with one registered device
+    CHECK_EQUAL(-6, ConnectToHub("unknown-device"));
+    CHECK_EQUAL(MQTT_CONNECT_BAD_CREDENTIALS, Mqtt.state());
+
+    CHECK_EQUAL(1, standIn.GetFinalStat("hub_connections"));
+    CHECK_EQUAL(1, standIn.GetFinalStat("rejected_connections"));
+}
+
+static void TestCommands()
+{
+    StandInProcess standIn("");
+    StandInPort = standIn.GetPort();
+    CHECK_EQUAL(0, ConnectToHub(DeviceId));
+
+    static constexpr int Invocations = 50;
+    RingBuzzerRuns = 0;
+    for (int i = 0; i < Invocations; ++i) CHECK(Invoke(COMMAND_RING_BUZZER, "500"));
+    CHECK(Invoke(COMMAND_RING_BUZZER, "\"loud\""));
+    CHECK(Invoke(COMMAND_UPDATE_FIRMWARE, "{}"));
+    CHECK(Invoke("unknownCommand", "{}"));
+
+    const std::string stats = FetchStandInStats();
+    printf("Stand-in: %s\n", stats.c_str());
+    CHECK_EQUAL(Invocations + 3L, HostTestJsonNumber(stats, "method_responses"));
+    CHECK_EQUAL(static_cast<long>(Invocations), HostTestJsonNumber(stats, "200"));
+    CHECK_EQUAL(1L, HostTestJsonNumber(stats, "400"));
+    CHECK_EQUAL(2L, HostTestJsonNumber(stats, "404"));
+    CHECK_EQUAL(Invocations, RingBuzzerRuns);
+    Mqtt.disconnect();
+}
+
+static void TestTelemetryThroughput()
+{
+    StandInProcess standIn("");
+    StandInPort = standIn.GetPort();
+    CHECK_EQUAL(0, ConnectToHub(DeviceId));
+    OutboundMessages.SetRateLimit(0, 0);
+
+    TelemetrySample sample{};
+    sample.co = 1.25f;
+    sample.no2 = 0.125f;
+    sample.voc = 3.5f;
+    sample.temperature = 21.5f;
+    sample.humidity = 45.0f;
+    sample.light = 42;
+    TelemetryCountingWriter counter;
+    TelemetrySerializeJson(sample, counter);
+
+    static constexpr long Messages = 5000;
+    const NetworkStats::Latency publishBefore = NetworkStats::Publish;
+    const uint32_t droppedBefore = OutboundMessages.GetDroppedCount(MessagePriority::Telemetry);
+    const unsigned long startTime = micros();
+    long queued = 0;
+    while (queued < Messages && Mqtt.connected())
+    {
+        // Keep the queue from dropping the oldest messages, the way a steady sample rate would
+        if (OutboundMessages.GetQueuedCount(MessagePriority::Telemetry) >= 16)
+        {
+            OutboundMessages.DoWork(millis());
+            continue;
+        }
+        const uint64_t epochMillisecs = 1700000000000ULL + queued;
+        CHECK(OutboundMessages.Enqueue(MessagePriority::Telemetry, TelemetryTopicCache.Get(epochMillisecs), TelemetryJsonSource{ sample }));
+        ++queued;
+    }
+    while (OutboundMessages.DoWork(millis()) > 0) {}
+    const unsigned long elapsed = micros() - startTime;
+
+    const std::string stats = FetchStandInStats();
+    CHECK_EQUAL(Messages, HostTestJsonNumber(stats, "telemetry"));
+    CHECK_EQUAL(static_cast<long>(Messages * counter.GetSize()), HostTestJsonNumber(stats, "telemetry_bytes"));
+    CHECK_EQUAL(0L, HostTestJsonNumber(stats, "telemetry_bad_topic"));
+    CHECK_EQUAL(droppedBefore, OutboundMessages.GetDroppedCount(MessagePriority::Telemetry));
+    CHECK_EQUAL(publishBefore.Count + Messages, static_cast<long>(NetworkStats::Publish.Count));
+
+    printf("Telemetry: %ld messages of %zu bytes in %.3f s: %.0f msg/s, %.0f kB/s, %.1f us/message\n",
+        Messages, counter.GetSize(), elapsed / 1e6, Messages * 1e6 / elapsed, Messages * counter.GetSize() * 1e6 / elapsed / 1024, static_cast<double>(elapsed) / Messages);
+    NetworkStats::Print();
+    Mqtt.disconnect();
+}
+
+int main(int argc, char* argv[])
+{
+    static const HostTestCase cases[] =
+    {
+        { "provisioning_assigning", TestProvisioningAssigning },
+        { "provisioning_throttled", TestProvisioningThrottled },
+        { "provisioning_retry_after_capped", TestProvisioningRetryAfterCapped },
+        { "provisioning_resumes_after_reconnect", TestProvisioningResumesAfterReconnect },
+        { "provisioning_timeout", TestProvisioningTimeout },
+        { "provisioning_rejected_credentials", TestProvisioningRejectedCredentials },
+        { "hub_connection", TestHubConnection },
+        { "commands", TestCommands },
+        { "telemetry_throughput", TestTelemetryThroughput },
+    };
+
+    return HostTestMain(argc, argv, cases);
+}
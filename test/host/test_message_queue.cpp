@@ -0,0 +1,236 @@
+// MessageQueue record handling in a small ring, and the MessageScheduler rate limit
+// against iot_hub_standin.py. The scheduler gets explicit times, so the token bucket
+// is checked without waiting for the clock.
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <string>
+#include "MessageQueue.h"
+#include "MessageScheduler.h"
+#include "HostTest.h"
+
+static constexpr char Topic[] = "devices/wio-terminal/messages/events/";
+static constexpr char Username[] = "standin-hub.azure-devices.net/wio-terminal/?api-version=2020-09-30";
+static constexpr char Password[] = "SharedAccessSignature sr=standin-hub.azure-devices.net%2Fdevices%2Fwio-terminal&sig=c3RhbmRpbg%3D%3D&se=4102444800";
+
+// Collects what ReadFrontPayload() hands out
+struct StringWriter
+{
+    std::string Data;
+
+    bool Write(const uint8_t* data, size_t size)
+    {
+        Data.append(reinterpret_cast<const char*>(data), size);
+        return true;
+    }
+};
+
+static std::string Payload(int index)
+{
+    return String::format("payload-%03d", index);
+}
+
+static bool Push(MessageQueue& queue, const char* topic, const std::string& payload)
+{
+    if (!queue.Begin(topic, payload.size())) return false;
+    queue.Write(reinterpret_cast<const uint8_t*>(payload.data()), payload.size());
+
+    return queue.End();
+}
+
+static std::string FrontTopic(const MessageQueue& queue)
+{
+    char topic[MessageQueue::TopicMaxSize + 1];
+    queue.GetFrontTopic(topic);
+
+    return topic;
+}
+
+static std::string FrontPayload(const MessageQueue& queue)
+{
+    StringWriter writer;
+    CHECK(queue.ReadFrontPayload(writer));
+
+    return writer.Data;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MessageQueue
+
+static void TestQueueWrapAround()
+{
+    // 4 + 1 + 11 = 16 bytes per record, a 60 byte ring puts records across the end
+    uint8_t buffer[60];
+    MessageQueue queue(buffer, sizeof(buffer));
+
+    int next = 0;
+    int expected = 0;
+    for (int round = 0; round < 20; ++round)
+    {
+        while (queue.GetUsedBytes() + 16 <= sizeof(buffer))
+        {
+            CHECK(Push(queue, "t", Payload(next++)));
+        }
+        CHECK_EQUAL(3u, queue.GetCount());
+
+        CHECK_EQUAL(std::string("t"), FrontTopic(queue));
+        CHECK_EQUAL(11u, queue.GetFrontPayloadSize());
+        CHECK_EQUAL(Payload(expected++), FrontPayload(queue));
+        queue.Pop();
+    }
+
+    while (!queue.IsEmpty())
+    {
+        CHECK_EQUAL(Payload(expected++), FrontPayload(queue));
+        queue.Pop();
+    }
+    CHECK_EQUAL(next, expected);
+    CHECK_EQUAL(0u, queue.GetUsedBytes());
+    CHECK_EQUAL(0u, queue.GetDroppedCount());
+}
+
+static void TestQueueDropsOldestWhenFull()
+{
+    uint8_t buffer[64];
+    MessageQueue queue(buffer, sizeof(buffer));
+
+    CHECK(Push(queue, "a", "0123456789"));
+    CHECK(Push(queue, "b", "0123456789"));
+    CHECK(Push(queue, "c", "0123456789"));
+    CHECK(Push(queue, "d", "0123456789"));
+    CHECK_EQUAL(4u, queue.GetCount());
+    CHECK_EQUAL(0u, queue.GetDroppedCount());
+
+    // Needs the room of two records
+    CHECK(Push(queue, "e", "0123456789012345678901"));
+    CHECK_EQUAL(3u, queue.GetCount());
+    CHECK_EQUAL(2u, queue.GetDroppedCount());
+    CHECK_EQUAL(std::string("c"), FrontTopic(queue));
+
+    // A record larger than the ring is refused and counted, the queue is left alone
+    CHECK(!Push(queue, "f", std::string(sizeof(buffer), 'x')));
+    CHECK_EQUAL(3u, queue.GetCount());
+    CHECK_EQUAL(3u, queue.GetDroppedCount());
+
+    queue.Pop();
+    queue.Pop();
+    CHECK_EQUAL(std::string("e"), FrontTopic(queue));
+    CHECK_EQUAL(std::string("0123456789012345678901"), FrontPayload(queue));
+}
+
+static void TestQueueCommitsCompleteMessagesOnly()
+{
+    uint8_t buffer[64];
+    MessageQueue queue(buffer, sizeof(buffer));
+    CHECK(Push(queue, "a", "first"));
+
+    // Short of the announced size
+    CHECK(queue.Begin("b", 10));
+    CHECK(queue.Write(reinterpret_cast<const uint8_t*>("1234"), 4));
+    CHECK(!queue.End());
+    CHECK_EQUAL(1u, queue.GetCount());
+
+    // Past the announced size
+    CHECK(queue.Begin("c", 4));
+    CHECK(!queue.Write(reinterpret_cast<const uint8_t*>("123456"), 6));
+    CHECK(!queue.End());
+    CHECK_EQUAL(1u, queue.GetCount());
+
+    // The next message takes the place of the uncommitted bytes
+    CHECK(Push(queue, "d", "second"));
+    CHECK_EQUAL(2u, queue.GetCount());
+    CHECK_EQUAL(4u + 1 + 5 + 4 + 1 + 6, queue.GetUsedBytes());
+    queue.Pop();
+    CHECK_EQUAL(std::string("d"), FrontTopic(queue));
+    CHECK_EQUAL(std::string("second"), FrontPayload(queue));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MessageScheduler
+
+static PubSubClient Mqtt;
+static MessageScheduler OutboundMessages(Mqtt);
+
+static bool Connect(uint16_t port)
+{
+    Mqtt.setServer("127.0.0.1", port);
+
+    return Mqtt.connect("wio-terminal", Username, Password);
+}
+
+static void EnqueueTelemetry(int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        CHECK(OutboundMessages.Enqueue(MessagePriority::Telemetry, Topic, reinterpret_cast<const uint8_t*>("{}"), 2));
+    }
+}
+
+static void TestSchedulerBurstLimit()
+{
+    StandInProcess standIn("");
+    CHECK(Connect(standIn.GetPort()));
+
+    OutboundMessages.SetRateLimit(10, 3);
+    const unsigned long now = millis();
+    EnqueueTelemetry(8);
+
+    // A full bucket sends the burst, then nothing until it refills
+    CHECK_EQUAL(3, OutboundMessages.DoWork(now));
+    CHECK_EQUAL(0, OutboundMessages.DoWork(now));
+    CHECK_EQUAL(5u, OutboundMessages.GetQueuedCount(MessagePriority::Telemetry));
+
+    // Command responses are exempt and go out ahead of the waiting telemetry
+    CHECK(OutboundMessages.Enqueue(MessagePriority::CommandResponse, "$iothub/methods/res/200/?$rid=1", reinterpret_cast<const uint8_t*>("{}"), 2));
+    CHECK_EQUAL(1, OutboundMessages.DoWork(now));
+    CHECK_EQUAL(0u, OutboundMessages.GetQueuedCount(MessagePriority::CommandResponse));
+    CHECK_EQUAL(5u, OutboundMessages.GetQueuedCount(MessagePriority::Telemetry));
+
+    OutboundMessages.SetRateLimit(0, 0);
+    while (OutboundMessages.DoWork(millis()) > 0) {}
+    Mqtt.disconnect();
+}
+
+static void TestSchedulerRefill()
+{
+    StandInProcess standIn("");
+    CHECK(Connect(standIn.GetPort()));
+
+    OutboundMessages.SetRateLimit(10, 3);
+    const unsigned long now = millis();
+    EnqueueTelemetry(12);
+    CHECK_EQUAL(3, OutboundMessages.DoWork(now));
+
+    // 10 messages per second: one token per 100 ms, fractions carry over
+    CHECK_EQUAL(0, OutboundMessages.DoWork(now + 50));
+    CHECK_EQUAL(1, OutboundMessages.DoWork(now + 100));
+    CHECK_EQUAL(0, OutboundMessages.DoWork(now + 150));
+    CHECK_EQUAL(2, OutboundMessages.DoWork(now + 300));
+
+    // A long pause refills up to the burst only
+    CHECK_EQUAL(3, OutboundMessages.DoWork(now + 60000));
+    CHECK_EQUAL(0, OutboundMessages.DoWork(now + 60000));
+    CHECK_EQUAL(3u, OutboundMessages.GetQueuedCount(MessagePriority::Telemetry));
+
+    // Without a limit the rest goes out at once, up to MaxPublishesPerCall
+    OutboundMessages.SetRateLimit(0, 0);
+    CHECK_EQUAL(3, OutboundMessages.DoWork(millis()));
+    CHECK_EQUAL(0u, OutboundMessages.GetQueuedCount(MessagePriority::Telemetry));
+    CHECK_EQUAL(0u, OutboundMessages.GetDroppedCount(MessagePriority::Telemetry));
+
+    Mqtt.disconnect();
+}
+
+int main(int argc, char* argv[])
+{
+    static const HostTestCase cases[] =
+    {
+        { "queue_wrap_around", TestQueueWrapAround },
+        { "queue_drops_oldest_when_full", TestQueueDropsOldestWhenFull },
+        { "queue_commits_complete_messages_only", TestQueueCommitsCompleteMessagesOnly },
+        { "scheduler_burst_limit", TestSchedulerBurstLimit },
+        { "scheduler_refill", TestSchedulerRefill },
+    };
+
+    return HostTestMain(argc, argv, cases);
+}
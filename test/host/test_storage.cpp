@@ -0,0 +1,160 @@
+// Storage on the RAM-backed flash: records survive a reload and compaction, and a
+// full store refuses new records without losing the ones it holds.
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include "ExternalFlash.h"
+#include "Storage.h"
+#include "HostTest.h"
+
+extern uint32_t HostFlashEraseCount;
+
+static std::string GetString(const char* key)
+{
+    const uint8_t* value;
+    size_t valueSize;
+    if (!Storage::Get(key, &value, &valueSize)) return "<missing>";
+
+    return std::string(reinterpret_cast<const char*>(value), valueSize);
+}
+
+static std::string Value(char fill, size_t size, int serial)
+{
+    std::string value(size, fill);
+    const std::string tag = std::to_string(serial);
+    value.replace(0, tag.size(), tag);
+
+    return value;
+}
+
+static void TestSetGet()
+{
+    Storage::Erase();
+    CHECK(Storage::Set(Storage::KeyWiFiSSID, "ssid"));
+    CHECK(Storage::Set(Storage::KeyWiFiPassword, "password"));
+    CHECK(Storage::Set(Storage::KeyWiFiSSID, "another ssid"));
+    CHECK_EQUAL(std::string("another ssid"), GetString(Storage::KeyWiFiSSID));
+    CHECK(!Storage::Set("", "empty key"));
+    CHECK(!Storage::Set("gas.curve.too.long.a.key.for.the.store", "value"));
+
+    Storage::Load();
+    CHECK_EQUAL(std::string("another ssid"), GetString(Storage::KeyWiFiSSID));
+    CHECK_EQUAL(std::string("password"), GetString(Storage::KeyWiFiPassword));
+    CHECK_EQUAL(std::string("<missing>"), GetString(Storage::KeyIdScope));
+}
+
+static void TestOverwriteCompacts()
+{
+    Storage::Erase();
+    const uint32_t erasesBefore = HostFlashEraseCount;
+
+    // Far more than the store holds at once, the overwritten records have to be reclaimed
+    for (int i = 0; i < 2000; ++i)
+    {
+        CHECK(Storage::Set("key.a", Value('a', 100, i).c_str()));
+        CHECK(Storage::Set("key.b", Value('b', 300, i).c_str()));
+    }
+    CHECK(HostFlashEraseCount > erasesBefore);
+    CHECK_EQUAL(Value('a', 100, 1999), GetString("key.a"));
+    CHECK_EQUAL(Value('b', 300, 1999), GetString("key.b"));
+
+    Storage::Load();
+    CHECK_EQUAL(Value('a', 100, 1999), GetString("key.a"));
+    CHECK_EQUAL(Value('b', 300, 1999), GetString("key.b"));
+}
+
+static void TestLargeRecordsNeedSeveralAdvances()
+{
+    Storage::Erase();
+
+    // Only one of these fits in a sector. When the head comes round to the sector with
+    // the record that is never overwritten, that record moves into the new head and the
+    // next sector is needed.
+    CHECK(Storage::Set("big.0", Value('0', 2040, 49).c_str()));
+    for (int i = 0; i < 50; ++i) CHECK(Storage::Set("big.1", Value('1', 2040, i).c_str()));
+    CHECK_EQUAL(Value('0', 2040, 49), GetString("big.0"));
+    CHECK_EQUAL(Value('1', 2040, 49), GetString("big.1"));
+
+    Storage::Load();
+    CHECK_EQUAL(Value('0', 2040, 49), GetString("big.0"));
+    CHECK_EQUAL(Value('1', 2040, 49), GetString("big.1"));
+}
+
+static void TestFullStoreKeepsRecords()
+{
+    Storage::Erase();
+
+    std::vector<std::string> keys;
+    int serial = 0;
+    while (true)
+    {
+        const std::string key = "fill." + std::to_string(serial);
+        if (!Storage::Set(key.c_str(), Value('f', 1000, serial).c_str())) break;
+        keys.push_back(key);
+        ++serial;
+        if (serial > 100) break;
+    }
+    CHECK(serial <= 100);
+    CHECK(keys.size() >= 9);
+    printf("%zu records of 1000 bytes fit, %zu bytes free\n", keys.size(), Storage::GetFreeBytes());
+
+    // Refused again; the records already there are untouched
+    CHECK(!Storage::Set("fill.extra", Value('x', 1000, 0).c_str()));
+    CHECK_EQUAL(std::string("<missing>"), GetString("fill.extra"));
+    for (size_t i = 0; i < keys.size(); ++i) CHECK_EQUAL(Value('f', 1000, i), GetString(keys[i].c_str()));
+
+    Storage::Load();
+    for (size_t i = 0; i < keys.size(); ++i) CHECK_EQUAL(Value('f', 1000, i), GetString(keys[i].c_str()));
+
+    // A small record still fits in what is left
+    CHECK(Storage::Set(Storage::KeyWiFiSSID, "ssid"));
+    CHECK_EQUAL(std::string("ssid"), GetString(Storage::KeyWiFiSSID));
+}
+
+static std::string ViewString(az_span view)
+{
+    return std::string(reinterpret_cast<const char*>(az_span_ptr(view)));
+}
+
+static void TestSettingViewsFollowCompaction()
+{
+    Storage::Erase();
+    CHECK(Storage::Set(Storage::KeyHubHost, "standin-hub.azure-devices.net"));
+    const uint8_t* hubHost = az_span_ptr(Storage::HubHost);
+
+    // Compacts the store several times over, the view follows its record
+    for (int i = 0; i < 500; ++i) CHECK(Storage::Set("key.a", Value('a', 500, i).c_str()));
+    CHECK(az_span_ptr(Storage::HubHost) != hubHost);
+    const uint8_t* value;
+    size_t valueSize;
+    CHECK(Storage::Get(Storage::KeyHubHost, &value, &valueSize));
+    CHECK(az_span_ptr(Storage::HubHost) == value);
+    CHECK_EQUAL(std::string("standin-hub.azure-devices.net"), ViewString(Storage::HubHost));
+
+    CHECK(Storage::Set(Storage::KeyHubHost, "other-hub.azure-devices.net"));
+    CHECK_EQUAL(27, az_span_size(Storage::HubHost));
+    CHECK_EQUAL(std::string("other-hub.azure-devices.net"), ViewString(Storage::HubHost));
+
+    // A PEM sized value needs no buffer of its own
+    CHECK(Storage::Set(Storage::KeyX509Certificate, Value('c', 2000, 0).c_str()));
+    CHECK_EQUAL(Value('c', 2000, 0), ViewString(Storage::X509Certificate));
+
+    Storage::Load();
+    CHECK_EQUAL(std::string("other-hub.azure-devices.net"), ViewString(Storage::HubHost));
+    CHECK_EQUAL(0, az_span_size(Storage::DeviceId));
+}
+
+int main(int argc, char* argv[])
+{
+    static const HostTestCase cases[] =
+    {
+        { "set_get", TestSetGet },
+        { "overwrite_compacts", TestOverwriteCompacts },
+        { "large_records_need_several_advances", TestLargeRecordsNeedSeveralAdvances },
+        { "full_store_keeps_records", TestFullStoreKeepsRecords },
+        { "setting_views_follow_compaction", TestSettingViewsFollowCompaction },
+    };
+
+    return HostTestMain(argc, argv, cases);
+}
@@ -0,0 +1,141 @@
+// FormatIso8601 and the cached telemetry topic, checked against gmtime_r and against
+// the topic az_iot_hub_client builds per message, and timed against both.
+
+#include <time.h>
+#include <string>
+#include <az_iot_hub_client.h>
+#include "TelemetryTopic.h"
+#include "HostTest.h"
+
+static std::string FormatWithGmtime(uint64_t epochMillisecs)
+{
+    const time_t epochTime = static_cast<time_t>(epochMillisecs / 1000);
+    struct tm tm;
+    gmtime_r(&epochTime, &tm);
+
+    char buf[Iso8601Size + 1];
+    snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, static_cast<unsigned>(epochMillisecs % 1000));
+
+    return buf;
+}
+
+static std::string FormatWithFormatIso8601(uint64_t epochMillisecs)
+{
+    char buf[Iso8601Size];
+    FormatIso8601(buf, epochMillisecs);
+
+    return std::string(buf, sizeof(buf));
+}
+
+static constexpr uint64_t Epoch2100Millisecs = 4102444800000ULL;
+
+static void TestFormatIso8601()
+{
+    // Every hour boundary through 2100, with the milliseconds of the second before
+    long mismatches = 0;
+    for (uint64_t epochMillisecs = 0; epochMillisecs < Epoch2100Millisecs; epochMillisecs += 3600000)
+    {
+        const uint64_t checked[] = { epochMillisecs, epochMillisecs + 3599999 };
+        for (uint64_t t : checked)
+        {
+            if (FormatWithFormatIso8601(t) == FormatWithGmtime(t)) continue;
+            if (++mismatches <= 5) CHECK_EQUAL(FormatWithGmtime(t), FormatWithFormatIso8601(t));
+        }
+    }
+    CHECK_EQUAL(0L, mismatches);
+
+    CHECK_EQUAL(std::string("1970-01-01T00:00:00.000Z"), FormatWithFormatIso8601(0));
+    CHECK_EQUAL(std::string("2000-02-29T23:59:59.999Z"), FormatWithFormatIso8601(951868799999ULL));
+    CHECK_EQUAL(std::string("2100-03-01T00:00:00.001Z"), FormatWithFormatIso8601(4107542400001ULL));
+}
+
+static void BenchmarkFormatIso8601()
+{
+    static constexpr long Iterations = 5000000;
+    static constexpr uint64_t Start = 1700000000000ULL;
+
+    const double gmtime = HostTestBenchmark("gmtime_r + snprintf", Iterations, [](long i)
+    {
+        const time_t epochTime = static_cast<time_t>((Start + i * 997) / 1000);
+        struct tm tm;
+        gmtime_r(&epochTime, &tm);
+        char buf[Iso8601Size + 1];
+        snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, static_cast<unsigned>((Start + i * 997) % 1000));
+        return static_cast<uint64_t>(buf[18]);
+    });
+    const double direct = HostTestBenchmark("FormatIso8601", Iterations, [](long i)
+    {
+        char buf[Iso8601Size];
+        FormatIso8601(buf, Start + i * 997);
+        return static_cast<uint64_t>(buf[18]);
+    });
+
+    CHECK(direct < gmtime);
+}
+
+static az_iot_hub_client HubClient;
+
+static void InitHubClient()
+{
+    az_iot_hub_client_options options = az_iot_hub_client_options_default();
+    CHECK(az_result_succeeded(az_iot_hub_client_init(&HubClient, AZ_SPAN_FROM_STR("standin-hub.azure-devices.net"), AZ_SPAN_FROM_STR("wio-terminal"), &options)));
+}
+
+// The topic ConnectToHub built per message before the cache
+static std::string BuildTopic(uint64_t epochMillisecs)
+{
+    char creationTime[Iso8601Size];
+    FormatIso8601(creationTime, epochMillisecs);
+
+    az_iot_message_properties props;
+    uint8_t propsBuffer[64];
+    if (az_result_failed(az_iot_message_properties_init(&props, az_span_create(propsBuffer, sizeof(propsBuffer)), 0))) return std::string();
+    if (az_result_failed(az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR("iothub-creation-time-utc"), az_span_create(reinterpret_cast<uint8_t*>(creationTime), sizeof(creationTime))))) return std::string();
+
+    char topic[128];
+    if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&HubClient, &props, topic, sizeof(topic), nullptr))) return std::string();
+
+    return topic;
+}
+
+static void TestTelemetryTopic()
+{
+    InitHubClient();
+    TelemetryTopic topic;
+    CHECK(topic.Get(0) == nullptr);
+    CHECK_EQUAL(0, topic.Init(&HubClient));
+    CHECK(topic.IsValid());
+
+    for (uint64_t epochMillisecs = 1600000000000ULL; epochMillisecs < 1600000000000ULL + 86400000ULL * 400; epochMillisecs += 3600007)
+    {
+        CHECK_EQUAL(BuildTopic(epochMillisecs), std::string(topic.Get(epochMillisecs)));
+    }
+}
+
+static void BenchmarkTelemetryTopic()
+{
+    static constexpr long Iterations = 1000000;
+    static constexpr uint64_t Start = 1700000000000ULL;
+
+    InitHubClient();
+    static TelemetryTopic topic;
+    CHECK_EQUAL(0, topic.Init(&HubClient));
+
+    const double built = HostTestBenchmark("Topic built per message", Iterations, [](long i) { return static_cast<uint64_t>(BuildTopic(Start + i).size()); });
+    const double cached = HostTestBenchmark("TelemetryTopic::Get", Iterations, [](long i) { return static_cast<uint64_t>(topic.Get(Start + i)[0]); });
+
+    CHECK(cached < built);
+}
+
+int main(int argc, char* argv[])
+{
+    static const HostTestCase cases[] =
+    {
+        { "format_iso8601", TestFormatIso8601 },
+        { "format_iso8601_benchmark", BenchmarkFormatIso8601 },
+        { "telemetry_topic", TestTelemetryTopic },
+        { "telemetry_topic_benchmark", BenchmarkTelemetryTopic },
+    };
+
+    return HostTestMain(argc, argv, cases);
+}